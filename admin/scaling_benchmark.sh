@@ -0,0 +1,107 @@
+#!/bin/bash
+# Runs maracluster batch on synthetic datasets of increasing size with an
+# increasing number of threads, and collects the run reports and the cluster
+# purity with respect to the ground truth of the generator. With -s, each
+# run is repeated with the threads pinned to the given numbers of NUMA nodes
+# (sockets), e.g. -s "1 2" shows the scaling from one to two sockets.
+#
+# usage: scaling_benchmark.sh [-b <bin_dir>] [-w <work_dir>] [-n "<sizes>"] [-t "<threads>"] [-s "<numa_nodes>"] [-p <pval_threshold>]
+
+while getopts "b:w:n:t:s:p:" OPTION; do
+  case $OPTION in
+    b) bin_dir=${OPTARG};;
+    w) work_dir=${OPTARG};;
+    n) sizes=${OPTARG};;
+    t) threads=${OPTARG};;
+    s) numa_nodes=${OPTARG};;
+    p) cluster_threshold=${OPTARG};;
+    \?) echo "Invalid option: -${OPTARG}" >&2; exit 1;;
+  esac
+done
+
+if [[ -z ${bin_dir} ]]; then
+  if ! which maracluster > /dev/null 2>&1; then
+    echo "Error: maracluster not found on the PATH, specify its location with -b <bin_dir>" >&2
+    exit 1
+  fi
+  bin_dir=$(dirname $(which maracluster))
+fi
+for binary in maracluster maracluster-simulate; do
+  if [[ ! -x ${bin_dir}/${binary} ]]; then
+    echo "Error: ${bin_dir}/${binary} not found, specify the build or install directory with -b <bin_dir>" >&2
+    exit 1
+  fi
+done
+if [[ -z ${work_dir} ]]; then
+  work_dir=$(pwd)/scaling_benchmark
+fi
+if [[ -z ${sizes} ]]; then
+  sizes="1000000 10000000 50000000"
+fi
+if [[ -z ${threads} ]]; then
+  max_threads=$(nproc)
+  threads=""
+  for (( t=1; t<max_threads; t*=2 )); do
+    threads="${threads} ${t}"
+  done
+  threads="${threads} ${max_threads}"
+fi
+if [[ -z ${numa_nodes} ]]; then
+  # "-" runs without placement options, i.e. with the OpenMP defaults
+  numa_nodes="-"
+fi
+if [[ -z ${cluster_threshold} ]]; then
+  cluster_threshold=30
+fi
+
+mkdir -p ${work_dir}
+summary_file=${work_dir}/summary.tsv
+echo -e "num_spectra\tthreads\tnuma_nodes\twall_seconds\tcpu_seconds\tpeak_rss_mb\tpurity\tcompleteness\tclustered_fraction" > ${summary_file}
+
+# extracts a numeric field from the first line of a JSON file containing it
+get_json_field() {
+  grep -o "\"$2\": [0-9.e+-]*" $1 | head -n 1 | sed "s/\"$2\": //"
+}
+
+for num_spectra in ${sizes}; do
+  data_dir=${work_dir}/data_${num_spectra}
+  if [[ ! -f ${data_dir}/synthetic.files.txt ]]; then
+    echo "Generating ${num_spectra} synthetic spectra"
+    ${bin_dir}/maracluster-simulate generate -n ${num_spectra} -f ${data_dir} -v 1 || exit 1
+  fi
+
+  for num_threads in ${threads}; do
+  for num_nodes in ${numa_nodes}; do
+    echo "Clustering ${num_spectra} spectra with ${num_threads} threads on ${num_nodes} NUMA nodes"
+    run_dir=${work_dir}/run_${num_spectra}_t${num_threads}
+    placement_options=""
+    if [[ ${num_nodes} != "-" ]]; then
+      run_dir=${run_dir}_s${num_nodes}
+      placement_options="--numaNodes ${num_nodes} --pinThreads"
+    fi
+    report_file=${run_dir}/run_report.json
+    rm -rf ${run_dir}
+    mkdir -p ${run_dir}
+
+    ${bin_dir}/maracluster batch -b ${data_dir}/synthetic.files.txt -f ${run_dir} --threads ${num_threads} ${placement_options} --runReport ${report_file} -v 1 > ${run_dir}/output.txt 2>&1
+    if [[ $? -ne 0 ]]; then
+      echo "Clustering failed, see ${run_dir}/output.txt"
+      continue
+    fi
+
+    evaluation_file=${run_dir}/evaluation.json
+    ${bin_dir}/maracluster-simulate evaluate -f ${data_dir} -l ${run_dir}/MaRaCluster.clusters_p${cluster_threshold}.tsv -o ${evaluation_file}
+
+    # the "total" stage is the last stage of the report
+    wall_seconds=$(grep -o '"name": "total".*' ${report_file} | grep -o '"wall_seconds": [0-9.e+-]*' | sed 's/"wall_seconds": //')
+    cpu_seconds=$(grep -o '"name": "total".*' ${report_file} | grep -o '"cpu_seconds": [0-9.e+-]*' | sed 's/"cpu_seconds": //')
+    peak_rss_mb=$(get_json_field ${report_file} peak_rss_mb)
+    purity=$(get_json_field ${evaluation_file} purity)
+    completeness=$(get_json_field ${evaluation_file} completeness)
+    clustered_fraction=$(get_json_field ${evaluation_file} clustered_fraction)
+    echo -e "${num_spectra}\t${num_threads}\t${num_nodes}\t${wall_seconds}\t${cpu_seconds}\t${peak_rss_mb}\t${purity}\t${completeness}\t${clustered_fraction}" >> ${summary_file}
+  done
+  done
+done
+
+echo "Wrote summary to ${summary_file}"
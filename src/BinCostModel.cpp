@@ -0,0 +1,185 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "BinCostModel.h"
+#include "PvalueVectors.h"
+#include "SpectrumHandler.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+namespace maracluster {
+
+const unsigned int BinCostModel::kNumCalibrationPvecs = 200u;
+const unsigned int BinCostModel::kNumCalibrationPairs = 200000u;
+
+/* A p-value vector is held as a Spectrum while it is being computed and as 
+   a PvalueVectorsDbRow with its peak bins, peak scores and polynomial
+   coefficients while the p-values of its bin are calculated. */
+double BinCostModel::estimatePvecMemory() {
+  return static_cast<double>(sizeof(Spectrum) + sizeof(PvalueVectorsDbRow) +
+      2*PvalueCalculator::getMaxScoringPeaksConstant()*sizeof(unsigned int) + 
+      (PvalueCalculator::kPolyfitDegree + 1)*sizeof(double));
+}
+
+double BinCostModel::getWallSeconds() {
+  boost::posix_time::ptime now = 
+      boost::posix_time::microsec_clock::universal_time();
+  return (now - boost::posix_time::ptime(boost::gregorian::date(1970, 1, 1)))
+      .total_microseconds() / 1e6;
+}
+
+void BinCostModel::getRandomPeakBins(unsigned int numBins, 
+    unsigned int numPeaks, std::vector<unsigned int>& peakBins) {
+  peakBins.clear();
+  numPeaks = (std::min)(numPeaks, numBins);
+  std::vector<bool> hasPeak(numBins, false);
+  while (peakBins.size() < numPeaks) {
+    unsigned int bin = PvalueCalculator::lcg_rand() % numBins;
+    if (!hasPeak[bin]) {
+      peakBins.push_back(bin);
+      hasPeak[bin] = true;
+    }
+  }
+  std::sort(peakBins.begin(), peakBins.end());
+}
+
+/* Returns the charge at quantile (i + 0.5) / kNumCalibrationPvecs of the 
+   observed charge distribution, such that the calibration p-value vectors 
+   follow the charge mix of the dataset. */
+unsigned int BinCostModel::getCalibrationCharge(unsigned int i, 
+    const std::vector<size_t>& chargeCounts) {
+  size_t numPrecursors = std::accumulate(chargeCounts.begin(), 
+                                         chargeCounts.end(), size_t(0u));
+  if (numPrecursors == 0u) return 2u;
+  
+  double target = (i + 0.5) * numPrecursors / kNumCalibrationPvecs;
+  size_t cumCount = 0u;
+  for (size_t charge = 0; charge < chargeCounts.size(); ++charge) {
+    cumCount += chargeCounts[charge];
+    if (cumCount > target) return static_cast<unsigned int>(charge);
+  }
+  return static_cast<unsigned int>(chargeCounts.size() - 1);
+}
+
+/* Times the computation of p-value vectors for precursors spread over the
+   observed precursor m/z range and charge distribution, followed by the 
+   scoring of spectrum pairs against these p-value vectors. Both run on the 
+   configured number of threads, as the per core throughput drops when the 
+   cores share caches and memory bandwidth; the wall time multiplied by the
+   number of threads gives the per core costs used in isFull(). Precursors 
+   for which the peak counts give no distribution are left out. */
+void BinCostModel::calibrate(PeakCounts& peakCounts, 
+    const std::vector<double>& precMzs, 
+    const std::vector<size_t>& chargeCounts) {
+  if (precMzs.empty()) return;
+  
+  int numThreads = 1;
+#ifdef _OPENMP
+  numThreads = omp_get_max_threads();
+#endif
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Calibrating precursor bin costs on " << numThreads 
+              << " threads" << std::endl;
+  }
+  
+  PvalueCalculator::setSeed(1);
+  
+  // the peak distributions and random peak bins are generated single 
+  // threaded, as lcg_rand() is not thread safe
+  std::vector<PeakDistribution> distributions;
+  std::vector< std::vector<unsigned int> > queryPeakBins;
+  for (unsigned int i = 0; i < kNumCalibrationPvecs; ++i) {
+    double precMz = precMzs[(precMzs.size() - 1) * i / (kNumCalibrationPvecs - 1)];
+    unsigned int charge = getCalibrationCharge(i, chargeCounts);
+    unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(
+        SpectrumHandler::calcMass(precMz, charge));
+    
+    PeakDistribution distribution;
+    peakCounts.generatePeakDistribution(precMz, charge, distribution, 
+                                        numScoringPeaks);
+    if (distribution.getDistribution().empty()) continue;
+    
+    std::vector<unsigned int> peakBins;
+    getRandomPeakBins(distribution.getDistribution().size(), numScoringPeaks, 
+                      peakBins);
+    distributions.push_back(distribution);
+    queryPeakBins.push_back(peakBins);
+  }
+  
+  int numPvecs = static_cast<int>(queryPeakBins.size());
+  if (numPvecs < 2) {
+    if (Globals::VERB > 1) {
+      std::cerr << "Warning: too few precursors with a peak distribution for "
+                << "calibration, using the default bin costs." << std::endl;
+    }
+    return;
+  }
+  
+  std::vector<PvalueCalculator> pvalCalcs(numPvecs);
+  double startTime = getWallSeconds();
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < numPvecs; ++i) {
+    std::vector<unsigned int> peakBins(queryPeakBins[i]);
+    pvalCalcs[i].setPeakBins(peakBins);
+    pvalCalcs[i].computePvalVectorPolyfit(distributions[i].getDistribution());
+  }
+  double pvecTime = (getWallSeconds() - startTime) * 1000.0 * numThreads;
+  
+  startTime = getWallSeconds();
+  double sumPval = 0.0;
+  int numPairs = static_cast<int>(kNumCalibrationPairs);
+#pragma omp parallel for schedule(static) reduction(+:sumPval)
+  for (int k = 0; k < numPairs; ++k) {
+    int i = k % numPvecs;
+    int j = (k / numPvecs + i + 1) % numPvecs;
+    sumPval += pvalCalcs[i].computePvalPolyfit(queryPeakBins[j]);
+  }
+  double pvalTime = (getWallSeconds() - startTime) * 1000.0 * numThreads;
+  
+  // keep the defaults if the clock resolution was too coarse
+  if (pvecTime > 0.0) pvecCost_ = pvecTime / numPvecs;
+  if (pvalTime > 0.0) pvalCost_ = pvalTime / kNumCalibrationPairs;
+  isCalibrated_ = true;
+  
+  if (Globals::VERB > 4) {
+    std::cerr << "Sum of calibration p-values: " << sumPval << std::endl;
+  }
+}
+
+void BinCostModel::print() const {
+  std::cerr << "Precursor bin costs: " << pvecCost_ << " ms per p-value vector, " 
+            << pvalCost_ << " ms per p-value pair, " 
+            << maxCost_ / 60.0 / 1000.0 << " CPU minutes per bin";
+  if (maxMemory_ > 0.0) {
+    std::cerr << ", " << maxMemory_ / 1024.0 / 1024.0 << " MB per bin (" 
+              << pvecMemory_ << " bytes per p-value vector)";
+  }
+  std::cerr << (isCalibrated_ ? " (calibrated)" : " (default)") << std::endl;
+}
+
+void BinCostModel::addToManifest(JobManifest& manifest) const {
+  manifest.setParameter("bin_pvec_cost_ms", pvecCost_);
+  manifest.setParameter("bin_pval_cost_ms", pvalCost_);
+  manifest.setParameter("bin_max_cost_ms", maxCost_);
+  manifest.setParameter("bin_pvec_memory_bytes", pvecMemory_);
+  manifest.setParameter("bin_max_memory_bytes", maxMemory_);
+  manifest.setParameter("bin_costs_calibrated", isCalibrated_ ? 1 : 0);
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,93 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_BINCOSTMODEL_H_
+#define MARACLUSTER_BINCOSTMODEL_H_
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <ctime>
+#include <numeric>
+
+#include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "Globals.h"
+#include "PeakCounts.h"
+#include "PeakDistribution.h"
+#include "PvalueCalculator.h"
+#include "JobManifest.h"
+
+namespace maracluster {
+
+/* Estimates of the resources needed per p-value vector and per compared
+   spectrum pair, used to cut the precursor m/z range into bins of roughly
+   equal CPU time and memory footprint. The default costs were measured on 
+   a single core of an older machine; calibrate() replaces them by 
+   measurements on the current machine. */
+class BinCostModel {
+ public:
+  BinCostModel() : pvecCost_(0.7), pvalCost_(0.001), 
+    maxCost_(120.0*60.0*1000.0), pvecMemory_(estimatePvecMemory()), 
+    maxMemory_(0.0), calibrate_(false), isCalibrated_(false) {}
+  
+  inline double getPvecCost() const { return pvecCost_; }
+  inline double getPvalCost() const { return pvalCost_; }
+  inline double getMaxCost() const { return maxCost_; }
+  inline double getPvecMemory() const { return pvecMemory_; }
+  inline double getMaxMemory() const { return maxMemory_; }
+  
+  inline void setMaxCpuMinutes(double minutes) { maxCost_ = minutes*60.0*1000.0; }
+  inline void setMaxMemoryMB(double megaBytes) { maxMemory_ = megaBytes*1024.0*1024.0; }
+  inline void setCalibrate(bool calibrate) { calibrate_ = calibrate; }
+  inline bool doCalibrate() const { return calibrate_ && !isCalibrated_; }
+  
+  void calibrate(PeakCounts& peakCounts, const std::vector<double>& precMzs,
+                 const std::vector<size_t>& chargeCounts);
+  
+  /* returns true if the bin with the given content exceeds the CPU time or 
+     memory target */
+  inline bool isFull(double numPvecs, double numComparisons) const {
+    return (numPvecs*pvecCost_ + numComparisons*pvalCost_ > maxCost_) ||
+           (maxMemory_ > 0.0 && numPvecs*pvecMemory_ > maxMemory_);
+  }
+  
+  void print() const;
+  void addToManifest(JobManifest& manifest) const;
+  
+ protected:
+  double pvecCost_; // computation time for 1 p-value vector in ms on 1 core
+  double pvalCost_; // computation time for 1 p-value pair in ms on 1 core
+  double maxCost_; // max computation time per bin in ms on 1 core
+  double pvecMemory_; // memory for 1 p-value vector in bytes
+  double maxMemory_; // max memory for the p-value vectors of a bin in bytes, 0 = no limit
+  bool calibrate_, isCalibrated_;
+  
+  static const unsigned int kNumCalibrationPvecs;
+  static const unsigned int kNumCalibrationPairs;
+  
+  static double estimatePvecMemory();
+  static double getWallSeconds();
+  static unsigned int getCalibrationCharge(unsigned int i, 
+    const std::vector<size_t>& chargeCounts);
+  static void getRandomPeakBins(unsigned int numBins, unsigned int numPeaks,
+    std::vector<unsigned int>& peakBins);
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_BINCOSTMODEL_H_ */
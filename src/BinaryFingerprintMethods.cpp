@@ -25,6 +25,17 @@
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/random/mersenne_twister.hpp>
+
+#include <ctime>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+  #include <immintrin.h>
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+  #include <intrin.h>
+#endif
 
 namespace maracluster {
 
@@ -32,8 +43,73 @@ using namespace std;
 using namespace boost;
 using namespace BALL;
 
+// 16 x 16-bit = 256-bit AVX2 registers, also a multiple of the 8 SSE2 lanes
+const unsigned int BinaryFingerprintMethods::kCcTileLanes = 16u;
+
+namespace {
+
+// 16-bit counts added per vector instruction by addCommonCountRow
+#if defined(__AVX2__)
+const unsigned int kSimdLanes = 16u;
+#elif defined(__SSE2__)
+const unsigned int kSimdLanes = 8u;
+#else
+const unsigned int kSimdLanes = 1u;
+#endif
+
+inline unsigned int popcount64(const boost::uint64_t x) {
+#if defined(__GNUC__)
+  return static_cast<unsigned int>(__builtin_popcountll(x));
+#elif defined(_MSC_VER) && defined(_M_X64)
+  return static_cast<unsigned int>(__popcnt64(x));
+#else
+  boost::uint64_t y = x - ((x >> 1) & 0x5555555555555555ULL);
+  y = (y & 0x3333333333333333ULL) + ((y >> 2) & 0x3333333333333333ULL);
+  y = (y + (y >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return static_cast<unsigned int>((y * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// n_cols has to be a multiple of kCcTileLanes
+inline void addCommonCountRow(unsigned short* cc_row, 
+    const unsigned short* indicator, const unsigned int n_cols) {
+#if defined(__AVX2__)
+  for (unsigned int i = 0; i < n_cols; i += 16) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cc_row + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indicator + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(cc_row + i), _mm256_add_epi16(a, b));
+  }
+#elif defined(__SSE2__)
+  for (unsigned int i = 0; i < n_cols; i += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cc_row + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indicator + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(cc_row + i), _mm_add_epi16(a, b));
+  }
+#else
+  for (unsigned int i = 0; i < n_cols; ++i) {
+    cc_row[i] += indicator[i];
+  }
+#endif
+}
+
+void generateRandomFingerprints(const unsigned int n_molecules, 
+    const unsigned int n_features, const unsigned short vocabulary, 
+    boost::mt19937& rng, std::vector<std::vector<unsigned short> >& features) {
+  features.resize(n_molecules);
+  for (unsigned int i = 0; i < n_molecules; ++i) {
+    std::set<unsigned short> molecule;
+    while (molecule.size() < std::min<unsigned int>(n_features, vocabulary)) {
+      molecule.insert(static_cast<unsigned short>(rng() % vocabulary + 1));
+    }
+    features[i].assign(molecule.rbegin(), molecule.rend());
+  }
+}
+
+} /* namespace */
+
 BinaryFingerprintMethods::BinaryFingerprintMethods() : lib_features_(NULL),
-    query_features_(NULL), threads_(NULL), thread_data_(NULL), cutoff_(0.7),
+    query_features_(NULL), threads_(NULL), thread_data_(NULL), 
+    cc_kernel_(CC_KERNEL_AUTO), cutoff_(0.7),
     store_nns_(false), precision_(0.000001), n_threads_(1), verbosity_(0),
     ppm_search_thresh_(10.0) {
   setBlockSize(850);
@@ -68,6 +144,7 @@ void BinaryFingerprintMethods::assign(const BinaryFingerprintMethods& bfm)
     thread_data_ = NULL;
     blocksize_ = bfm.blocksize_;
     cc_matrix_size_ = bfm.cc_matrix_size_;
+    cc_kernel_ = bfm.cc_kernel_;
     cutoff_ = bfm.cutoff_;
     precision_ = bfm.precision_;
     store_nns_ = bfm.store_nns_;
@@ -161,11 +238,8 @@ void BinaryFingerprintMethods::createThreadData(const unsigned int blocksize, co
     thread_data_[i].active_iids_size = active_iids_size;
     
     thread_data_[i].cc_row = new unsigned short[thread_data_[i].blocksize];
-    thread_data_[i].cc_matrix = new unsigned short*[thread_data_[i].blocksize];
-    for (unsigned short j=0; j!=thread_data_[i].blocksize; ++j)
-    {
-      thread_data_[i].cc_matrix[j] = new unsigned short[thread_data_[i].blocksize];
-    }
+    createCommonCountTile(thread_data_[i].blocksize, thread_data_[i].blocksize, thread_data_[i].cc_tile);
+    thread_data_[i].cc_matrix = thread_data_[i].cc_tile.rows;
     
     if (dataset_size!=0)
     {
@@ -207,12 +281,7 @@ void BinaryFingerprintMethods::destroyThreadData()
     {
       if (thread_data_[i].cc_matrix != NULL)
       {
-        for (unsigned int j=0; j!=thread_data_[i].blocksize; ++j)
-        {
-          delete [] thread_data_[i].cc_matrix[j];
-        }
-        
-        delete [] thread_data_[i].cc_matrix;
+        destroyCommonCountTile(thread_data_[i].cc_tile);
         thread_data_[i].cc_matrix = NULL;
       }
       
@@ -498,6 +567,7 @@ BinaryFingerprintMethods::InvertedIndex* BinaryFingerprintMethods::createInverte
     if (block_pos_size)
     {
       f_list->feature_id = i;
+      f_list->n_positions = block_pos_size - 1;
       f_list->block_positions = new unsigned short[block_pos_size];
       
       memcpy(f_list->block_positions, &feature_list[i][0], sizeof(unsigned short)*block_pos_size);
@@ -571,7 +641,7 @@ void BinaryFingerprintMethods::createInvertedIndicesWithPrecMasses(const vector<
   for (i = 0; i < molecules.size(); ++i) {
     tmp.push_back(molecules[i]);
     if ((i+1) % blocksize_ == 0) {
-      prec_mass_starts_.push_back(prec_masses[i+1]);
+      if (i+1 < molecules.size()) prec_mass_starts_.push_back(prec_masses[i+1]);
       prec_mass_ends_.push_back(prec_masses[i]);
       target.push_back(createInvertedIndex(tmp));
       tmp.clear();
@@ -676,7 +746,232 @@ void BinaryFingerprintMethods::calculateCommonCounts_1_N(const FeatureList* ii1,
 }
 
 
+void BinaryFingerprintMethods::createCommonCountTile(const unsigned int n_rows, const unsigned int n_cols, CommonCountTile& tile)
+{
+  const size_t alignment = kCcTileLanes * sizeof(unsigned short);
+  
+  tile.n_rows = n_rows;
+  tile.stride = ((n_cols + kCcTileLanes - 1) / kCcTileLanes) * kCcTileLanes;
+  
+  size_t n_bytes = static_cast<size_t>(n_rows) * tile.stride * sizeof(unsigned short);
+  tile.buffer = new unsigned char[n_bytes + alignment];
+  memset(tile.buffer, '\0', n_bytes + alignment);
+  
+  size_t misalignment = reinterpret_cast<size_t>(tile.buffer) % alignment;
+  unsigned short* data = reinterpret_cast<unsigned short*>(tile.buffer + (alignment - misalignment) % alignment);
+  
+  tile.rows = new unsigned short*[n_rows];
+  for (unsigned int j=0; j!=n_rows; ++j)
+  {
+    tile.rows[j] = data + static_cast<size_t>(j) * tile.stride;
+  }
+}
+
+
+void BinaryFingerprintMethods::destroyCommonCountTile(CommonCountTile& tile)
+{
+  delete [] tile.rows;
+  delete [] tile.buffer;
+  tile.rows = NULL;
+  tile.buffer = NULL;
+}
+
+
 void BinaryFingerprintMethods::calculateCommonCounts_M_N(const InvertedIndex* ii1, const InvertedIndex* ii2, unsigned short** cc_matrix)
+{
+  // the diagonal blocks only need the upper triangle, which the scatter kernel 
+  // computes without touching the rest of the matrix
+  CommonCountKernel kernel = CC_KERNEL_SCATTER;
+  if (ii1 != ii2)
+  {
+    kernel = (cc_kernel_ == CC_KERNEL_AUTO) ? selectCommonCountKernel(ii1, ii2) : cc_kernel_;
+  }
+  
+  switch (kernel)
+  {
+    case CC_KERNEL_SIMD:
+      calculateCommonCountsSimd_M_N(ii1, ii2, cc_matrix);
+      break;
+    case CC_KERNEL_POPCOUNT:
+      calculateCommonCountsPopcount_M_N(ii1, ii2, cc_matrix);
+      break;
+    default:
+      calculateCommonCountsScatter_M_N(ii1, ii2, cc_matrix);
+      break;
+  }
+}
+
+
+/* Costs are counted in memory operations: a scatter increment is one, as is 
+   a vector add of kSimdLanes counts or a 64-bit AND + popcount. */
+BinaryFingerprintMethods::CommonCountKernel BinaryFingerprintMethods::selectCommonCountKernel(const InvertedIndex* ii1, const InvertedIndex* ii2) const
+{
+  const FeatureList *f1 = ii1->feature_skip_list;
+  const FeatureList *f2 = ii2->feature_skip_list;
+  
+  const LongSize n_vectors = ((ii2->n_molecules + kCcTileLanes) / kCcTileLanes) * (kCcTileLanes / kSimdLanes);
+  LongSize scatter_cost = 0, simd_cost = 0, n_shared = 0;
+  while (f1->feature_id && f2->feature_id)
+  {
+    if (f1->feature_id > f2->feature_id)
+    {
+      ++f1;
+    }
+    else if (f1->feature_id < f2->feature_id)
+    {
+      ++f2;
+    }
+    else
+    {
+      LongSize pairs = static_cast<LongSize>(f1->n_positions) * f2->n_positions;
+      scatter_cost += pairs;
+      simd_cost += std::min(pairs, f1->n_positions * n_vectors + 2 * f2->n_positions);
+      ++n_shared;
+      ++f1;
+      ++f2;
+    }
+  }
+  
+  LongSize popcount_cost = static_cast<LongSize>(ii1->n_molecules) * ii2->n_molecules * ((n_shared + 63) / 64);
+#if !defined(__POPCNT__) && !defined(_MSC_VER)
+  // software popcount takes about a dozen instructions
+  popcount_cost *= 4;
+#endif
+  
+  if (popcount_cost < simd_cost && popcount_cost < scatter_cost)
+  {
+    return CC_KERNEL_POPCOUNT;
+  }
+  else if (simd_cost < scatter_cost)
+  {
+    return CC_KERNEL_SIMD;
+  }
+  else
+  {
+    return CC_KERNEL_SCATTER;
+  }
+}
+
+
+void BinaryFingerprintMethods::calculateCommonCountsSimd_M_N(const InvertedIndex* ii1, const InvertedIndex* ii2, unsigned short** cc_matrix)
+{
+  const FeatureList *f1 = ii1->feature_skip_list;
+  const FeatureList *f2 = ii2->feature_skip_list;
+  
+  const unsigned int n_cols = ((ii2->n_molecules + kCcTileLanes) / kCcTileLanes) * kCcTileLanes;
+  std::vector<unsigned short> indicator(n_cols, 0);
+  
+  const unsigned short *ii1_position;
+  const unsigned short *ii2_position;
+  while (f1->feature_id && f2->feature_id)
+  {
+    if (f1->feature_id > f2->feature_id)
+    {
+      ++f1;
+    }
+    else if (f1->feature_id < f2->feature_id)
+    {
+      ++f2;
+    }
+    else
+    {
+      LongSize n_pairs = static_cast<LongSize>(f1->n_positions) * f2->n_positions;
+      LongSize n_vector_ops = static_cast<LongSize>(f1->n_positions) * (n_cols / kSimdLanes) + 2 * f2->n_positions;
+      if (n_vector_ops < n_pairs)
+      {
+        for (ii2_position = f2->block_positions; *ii2_position; ++ii2_position)
+        {
+          indicator[*ii2_position] = 1;
+        }
+        for (ii1_position = f1->block_positions; *ii1_position; ++ii1_position)
+        {
+          addCommonCountRow(cc_matrix[*ii1_position], &indicator[0], n_cols);
+        }
+        for (ii2_position = f2->block_positions; *ii2_position; ++ii2_position)
+        {
+          indicator[*ii2_position] = 0;
+        }
+      }
+      else
+      {
+        for (ii1_position = f1->block_positions; *ii1_position; ++ii1_position)
+        {
+          unsigned short* cc_matrix_f1 = cc_matrix[*ii1_position];
+          for (ii2_position = f2->block_positions; *ii2_position; ++ii2_position)
+          {
+            ++*(cc_matrix_f1 + *ii2_position);
+          }
+        }
+      }
+      ++f1;
+      ++f2;
+    }
+  }
+}
+
+
+void BinaryFingerprintMethods::calculateCommonCountsPopcount_M_N(const InvertedIndex* ii1, const InvertedIndex* ii2, unsigned short** cc_matrix)
+{
+  const FeatureList *f1 = ii1->feature_skip_list;
+  const FeatureList *f2 = ii2->feature_skip_list;
+  
+  std::vector<std::pair<const FeatureList*, const FeatureList*> > shared;
+  while (f1->feature_id && f2->feature_id)
+  {
+    if (f1->feature_id > f2->feature_id)
+    {
+      ++f1;
+    }
+    else if (f1->feature_id < f2->feature_id)
+    {
+      ++f2;
+    }
+    else
+    {
+      shared.push_back(std::make_pair(f1, f2));
+      ++f1;
+      ++f2;
+    }
+  }
+  if (shared.empty()) return;
+  
+  // bitmaps over the shared features, one row of n_words per molecule
+  const size_t n_words = (shared.size() + 63) / 64;
+  std::vector<boost::uint64_t> bits1(ii1->n_molecules * n_words, 0);
+  std::vector<boost::uint64_t> bits2(ii2->n_molecules * n_words, 0);
+  for (size_t k = 0; k < shared.size(); ++k)
+  {
+    const boost::uint64_t bit = static_cast<boost::uint64_t>(1) << (k % 64);
+    const size_t word = k / 64;
+    for (const unsigned short* p = shared[k].first->block_positions; *p; ++p)
+    {
+      bits1[(*p - 1) * n_words + word] |= bit;
+    }
+    for (const unsigned short* p = shared[k].second->block_positions; *p; ++p)
+    {
+      bits2[(*p - 1) * n_words + word] |= bit;
+    }
+  }
+  
+  for (unsigned int u=0; u!=ii1->n_molecules; ++u)
+  {
+    unsigned short* cc_matrix_row = cc_matrix[u+1];
+    const boost::uint64_t* a = &bits1[u * n_words];
+    for (unsigned int v=0; v!=ii2->n_molecules; ++v)
+    {
+      const boost::uint64_t* b = &bits2[v * n_words];
+      unsigned int c = 0;
+      for (size_t w = 0; w < n_words; ++w)
+      {
+        c += popcount64(a[w] & b[w]);
+      }
+      cc_matrix_row[v+1] += c;
+    }
+  }
+}
+
+
+void BinaryFingerprintMethods::calculateCommonCountsScatter_M_N(const InvertedIndex* ii1, const InvertedIndex* ii2, unsigned short** cc_matrix)
 {
   FeatureList *f1 = ii1->feature_skip_list;
   FeatureList *f2 = ii2->feature_skip_list;
@@ -1395,11 +1690,14 @@ bool BinaryFingerprintMethods::pairwiseSimilaritiesOMPThread(LongSize index, std
   // If the last molecule of the row block has a precursor mass more than 10ppm away from the first molecule of the column block, we can skip the comparison
   if (prec_mass_ends_.size() > 0 && prec_mass_ends_[row_index] < prec_mass_starts_[col_index] * (1 - ppm_search_thresh_*1e-6)) return false;
   
-  unsigned short** cc_matrix = new unsigned short*[blocksize_ + 1];
-  for (unsigned short j=0; j!=blocksize_ + 1; ++j) {
-    cc_matrix[j] = new unsigned short[blocksize_ + 1];
-    memset(cc_matrix[j], '\0', cc_matrix_size_);
-  }
+  pairwiseSimilaritiesBlocks(row_index, col_index, triplets);
+  return true;
+}
+
+void BinaryFingerprintMethods::pairwiseSimilaritiesBlocks(LongSize row_index, LongSize col_index, std::vector<PvalueTriplet>& triplets) {
+  CommonCountTile cc_tile;
+  createCommonCountTile(blocksize_ + 1, blocksize_ + 1, cc_tile);
+  unsigned short** cc_matrix = cc_tile.rows;
   
   // Calculate common counts
   calculateCommonCounts_M_N(lib_iindices_[row_index], lib_iindices_[col_index], cc_matrix);
@@ -1407,12 +1705,7 @@ bool BinaryFingerprintMethods::pairwiseSimilaritiesOMPThread(LongSize index, std
   // Calculate similarities
   pairwiseSimilaritiesCutoffOMP(row_index, col_index, cc_matrix, triplets);
   
-  for (unsigned short j=0; j!=blocksize_ + 1; ++j) {
-    delete [] cc_matrix[j];
-  }
-  delete [] cc_matrix;
-  cc_matrix = NULL;
-  return true;
+  destroyCommonCountTile(cc_tile);
 }
 
 bool BinaryFingerprintMethods::pairwiseSimilarities(const vector<unsigned int>& selection, vector<pair<unsigned int, float> >& nn_data)
@@ -3616,4 +3909,107 @@ BinaryFingerprintMethods::Cluster* BinaryFingerprintMethods::mergeClusters(Clust
   return 0;
 }
 
+bool BinaryFingerprintMethods::commonCountsUnitTest()
+{
+  BinaryFingerprintMethods bfm;
+  bfm.setBlockSize(100);
+  boost::mt19937 rng(1u);
+  
+  bool success = true;
+  const unsigned short vocabularies[] = { 5000u, 200u, 20u };
+  const CommonCountKernel kernels[] = { CC_KERNEL_SIMD, CC_KERNEL_POPCOUNT, CC_KERNEL_AUTO };
+  for (unsigned int i = 0; i < 3; ++i)
+  {
+    // the second block is not full
+    std::vector<std::vector<unsigned short> > features;
+    generateRandomFingerprints(183u, 30u, vocabularies[i], rng, features);
+    
+    vector<pair<const vector<unsigned short>*, unsigned int> > molecules;
+    for (unsigned int j = 0; j < features.size(); ++j)
+    {
+      molecules.push_back(make_pair(&features[j], j));
+    }
+    InvertedIndices iis;
+    bfm.createInvertedIndices(molecules, iis);
+    
+    CommonCountTile reference, tile;
+    createCommonCountTile(101, 101, reference);
+    bfm.calculateCommonCountsScatter_M_N(iis[0], iis[1], reference.rows);
+    for (unsigned int k = 0; k < 3; ++k)
+    {
+      createCommonCountTile(101, 101, tile);
+      bfm.setCommonCountKernel(kernels[k]);
+      bfm.calculateCommonCounts_M_N(iis[0], iis[1], tile.rows);
+      for (unsigned int u = 1; u <= iis[0]->n_molecules; ++u)
+      {
+        for (unsigned int v = 1; v <= iis[1]->n_molecules; ++v)
+        {
+          if (tile.rows[u][v] != reference.rows[u][v])
+          {
+            std::cerr << "Wrong common count for kernel " << kernels[k] 
+                      << " and vocabulary " << vocabularies[i] << " at (" 
+                      << u << "," << v << "): " << tile.rows[u][v] 
+                      << " != " << reference.rows[u][v] << std::endl;
+            success = false;
+            u = iis[0]->n_molecules;
+            break;
+          }
+        }
+      }
+      destroyCommonCountTile(tile);
+    }
+    destroyCommonCountTile(reference);
+    bfm.destroyInvertedIndices(iis);
+  }
+  return success;
+}
+
+
+void BinaryFingerprintMethods::benchmarkCommonCounts(const unsigned short blocksize)
+{
+  BinaryFingerprintMethods bfm;
+  bfm.setBlockSize(blocksize);
+  boost::mt19937 rng(1u);
+  
+  const unsigned int n_features = 40u, n_block_pairs = 20u;
+  const unsigned short vocabularies[] = { 20000u, 2000u, 400u, 100u };
+  const CommonCountKernel kernels[] = { CC_KERNEL_SCATTER, CC_KERNEL_SIMD, CC_KERNEL_POPCOUNT, CC_KERNEL_AUTO };
+  
+  std::cout << "blocksize\tvocabulary\tscatter_ms\tsimd_ms\tpopcount_ms\tauto_ms\tauto_kernel" << std::endl;
+  for (unsigned int i = 0; i < 4; ++i)
+  {
+    std::vector<std::vector<unsigned short> > features;
+    generateRandomFingerprints((n_block_pairs + 1) * blocksize, n_features, vocabularies[i], rng, features);
+    
+    vector<pair<const vector<unsigned short>*, unsigned int> > molecules;
+    for (unsigned int j = 0; j < features.size(); ++j)
+    {
+      molecules.push_back(make_pair(&features[j], j));
+    }
+    InvertedIndices iis;
+    bfm.createInvertedIndices(molecules, iis);
+    
+    CommonCountTile tile;
+    createCommonCountTile(blocksize + 1, blocksize + 1, tile);
+    size_t tile_size = sizeof(unsigned short) * tile.n_rows * tile.stride;
+    
+    std::cout << blocksize << "\t" << vocabularies[i];
+    for (unsigned int k = 0; k < 4; ++k)
+    {
+      bfm.setCommonCountKernel(kernels[k]);
+      clock_t startClock = clock();
+      for (unsigned int b = 1; b <= n_block_pairs; ++b)
+      {
+        memset(tile.rows[0], '\0', tile_size);
+        bfm.calculateCommonCounts_M_N(iis[0], iis[b], tile.rows);
+      }
+      std::cout << "\t" << (clock() - startClock) / (double)CLOCKS_PER_SEC * 1000.0;
+    }
+    std::cout << "\t" << bfm.selectCommonCountKernel(iis[0], iis[1]) << std::endl;
+    
+    destroyCommonCountTile(tile);
+    bfm.destroyInvertedIndices(iis);
+  }
+}
+
 } /* namespace maracluster */
@@ -30,6 +30,7 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/unordered_set.hpp>
+#include <boost/cstdint.hpp>
 
 #include <map>
 #include <set>
@@ -100,6 +101,17 @@ namespace BALL {
     //@}
     
     public:
+      /**
+       * MT: Kernels for the shared feature counts of two InvertedIndices, see calculateCommonCounts_M_N().
+       */
+      enum CommonCountKernel
+      {
+        CC_KERNEL_AUTO,
+        CC_KERNEL_SCATTER,
+        CC_KERNEL_SIMD,
+        CC_KERNEL_POPCOUNT
+      };
+      
       /**
       * @name Constructors and Destructors 
       */
@@ -211,6 +223,12 @@ namespace BALL {
        * @param ppm ppm threshold to use.
        */
       inline void setPpmThresh(const int ppmThresh) { ppm_search_thresh_ = ppmThresh; }
+      
+      /** 
+       * MT: Force a shared feature count kernel, CC_KERNEL_AUTO selects it per pair of InvertedIndices.
+       * @param kernel kernel to use.
+       */
+      inline void setCommonCountKernel(const CommonCountKernel kernel) { cc_kernel_ = kernel; }
       //@}
       
       
@@ -244,6 +262,14 @@ namespace BALL {
        */
       bool pairwiseSimilaritiesOMPThread(LongSize index, std::vector<PvalueTriplet>& triplets);
       
+      /**
+       * MT: Similarities of all molecule pairs of two blocks of the library, without precursor mass check.
+       * Triplets contain the library indices of the molecules and their Tanimoto similarity.
+       * @param row_index Index of the first block.
+       * @param col_index Index of the second block, col_index >= row_index.
+       */
+      void pairwiseSimilaritiesBlocks(LongSize row_index, LongSize col_index, std::vector<PvalueTriplet>& triplets);
+      
       /** 
        * Calculate similarity network of a set of molecules defined by selection and return the connected components.
        * @param selection Indices of molecules in lib_features_ array for which connected components analysis should be performed.
@@ -282,9 +308,32 @@ namespace BALL {
        */
       bool calculateSelectionMedoid(const std::vector<unsigned int>& selection, unsigned int& medoid_index, std::vector<float>& avg_sims);
       
+      /**
+       * MT: Check that all shared feature count kernels agree on random fingerprints.
+       */
+      static bool commonCountsUnitTest();
+      
+      /**
+       * MT: Time the shared feature count kernels on random fingerprints of increasing density.
+       * @param blocksize Number of molecules per InvertedIndex.
+       */
+      static void benchmarkCommonCounts(const unsigned short blocksize);
+      
       //@}
       
     private:
+      /**
+       * MT: Common counts matrix as a single aligned allocation. Rows are padded to a multiple 
+       * of kCcTileLanes, so that SIMD kernels can process full vectors without bounds checks.
+       */
+      struct CommonCountTile
+      {
+        unsigned char* buffer;
+        unsigned short** rows;
+        unsigned int n_rows;
+        unsigned int stride;
+      };
+      
       /**
        * Struct which stores information for a single BOOST thread.
        */
@@ -300,6 +349,7 @@ namespace BALL {
         
         unsigned short* cc_row;
         unsigned short** cc_matrix;
+        CommonCountTile cc_tile;
         
         float* float_array;
         double** dprec_matrix;
@@ -319,6 +369,9 @@ namespace BALL {
         // FeatureID which corresponds in principle to the index of a bit in a 2D fingerprint.
         unsigned short feature_id;
         
+        // MT: Number of molecules in block_positions, excluding the terminating 0.
+        unsigned short n_positions;
+        
         // Array which stores the sorted list of all molecules which all share the associated feature_id.
         // Molecules are only represented by their positions in the Block they belong to.
         unsigned short* block_positions;
@@ -486,6 +539,12 @@ namespace BALL {
       LongSize cc_matrix_size_;
       
       
+      /**
+       * MT: Kernel used by calculateCommonCounts_M_N().
+       */
+      CommonCountKernel cc_kernel_;
+      
+      
       /**
        * Similarity cutoff.
        */
@@ -755,12 +814,50 @@ namespace BALL {
       
       /**
        * Shared feature count calculation: InvertedIndices ii1 and ii2 have variable size.
+       * MT: Dispatches to one of the kernels below, the scatter kernel is always used if ii1 == ii2.
        * @param ii1 FeatureList of first InvertedIndex to be compared.
        * @param ii2 FeatureList of second InvertedIndex to be compared.
-       * @param cc_matrix 2D integer array which finally stores the number of shared features of (ii_1 X ii_2).
+       * @param cc_matrix Rows of a CommonCountTile which finally store the number of shared features of (ii_1 X ii_2).
        */
       void calculateCommonCounts_M_N(const InvertedIndex* ii_1, const InvertedIndex* ii_2, unsigned short** cc_matrix);
       
+      /**
+       * MT: Estimate the cheapest kernel from the lengths of the FeatureLists of the shared features.
+       */
+      CommonCountKernel selectCommonCountKernel(const InvertedIndex* ii1, const InvertedIndex* ii2) const;
+      
+      /**
+       * MT: Increment the common count of every molecule pair sharing a feature, one at a time.
+       */
+      void calculateCommonCountsScatter_M_N(const InvertedIndex* ii1, const InvertedIndex* ii2, unsigned short** cc_matrix);
+      
+      /**
+       * MT: As the scatter kernel, but features present in many molecules of ii2 are added as 
+       * 16-bit indicator rows with SIMD instructions. Requires ii1 != ii2.
+       */
+      void calculateCommonCountsSimd_M_N(const InvertedIndex* ii1, const InvertedIndex* ii2, unsigned short** cc_matrix);
+      
+      /**
+       * MT: Represent the molecules as bitmaps over the shared features and count the bits of 
+       * their intersections. Cheapest for dense blocks. Requires ii1 != ii2.
+       */
+      void calculateCommonCountsPopcount_M_N(const InvertedIndex* ii1, const InvertedIndex* ii2, unsigned short** cc_matrix);
+      
+      /**
+       * MT: Allocate a zero initialized CommonCountTile of n_rows x n_cols.
+       */
+      static void createCommonCountTile(const unsigned int n_rows, const unsigned int n_cols, CommonCountTile& tile);
+      
+      /**
+       * MT: Free a CommonCountTile created by createCommonCountTile.
+       */
+      static void destroyCommonCountTile(CommonCountTile& tile);
+      
+      /**
+       * MT: Number of 16-bit lanes the rows of a CommonCountTile are padded to.
+       */
+      static const unsigned int kCcTileLanes;
+      
       
       /**
        * Calculation of similarity coefficients and writing of similarities above cutoff to outfile.
@@ -22,6 +22,7 @@
 #include <fstream>
 
 #include "MyException.h"
+#include "StageProfiler.h"
 #include <boost/iostreams/device/mapped_file.hpp>
 
 namespace maracluster {
@@ -43,6 +44,7 @@ class BinaryInterface {
         const char* pointer = reinterpret_cast<const char*>(&vec[0]);
         size_t bytes = vec.size() * sizeof(vec[0]);
         outfile.write(pointer, bytes);
+        StageProfiler::addBytesWritten(bytes);
       }
     }
   }
@@ -55,6 +57,7 @@ class BinaryInterface {
       
       const char* f = mmap.const_data();
       const char* l = f + mmap.size();
+      StageProfiler::addBytesRead(mmap.size());
       
       errno = 0;
       Type tmp;
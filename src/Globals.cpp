@@ -17,6 +17,11 @@
 #include "Globals.h"
 #include "MyException.h"
 
+#ifndef _WIN32
+  #include <sys/resource.h>
+  #include <unistd.h>
+#endif
+
 namespace maracluster {
 
 unsigned int Globals::VERB = 3;
@@ -60,5 +65,33 @@ void Globals::reportProgress(time_t& startTime, clock_t& startClock,
                timeLeftSecMod << " sec wall time." << std::endl;
 }
 
+/* Returns the peak resident set size of this process, or 0 if not 
+   available on this platform */
+double Globals::getPeakMemoryMB() {
+#ifdef _WIN32
+  return 0.0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024.0 / 1024.0; // bytes
+#else
+  return usage.ru_maxrss / 1024.0; // kilobytes
+#endif
+#endif
+}
+
+/* Returns the current resident set size of this process, or 0 if not 
+   available on this platform */
+double Globals::getCurrentMemoryMB() {
+#if defined(__linux__)
+  std::ifstream statm("/proc/self/statm");
+  unsigned long long totalPages = 0ull, residentPages = 0ull;
+  if (!(statm >> totalPages >> residentPages)) return 0.0;
+  return residentPages * static_cast<double>(sysconf(_SC_PAGESIZE)) / 1024.0 / 1024.0;
+#else
+  return 0.0;
+#endif
+}
 
 } /* namespace maracluster */
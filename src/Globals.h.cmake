@@ -32,6 +32,8 @@ class Globals {
   static bool fileIsEmpty(const std::string& fileName);
   static void reportProgress(time_t& startTime, clock_t& startClock,
     size_t currentIt, size_t totalIt);
+  static double getPeakMemoryMB();
+  static double getCurrentMemoryMB();
 };
 
 } /* namespace maracluster */
@@ -0,0 +1,144 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "JobManifest.h"
+
+namespace maracluster {
+
+const unsigned int JobManifest::kPollIntervalSeconds = 10u;
+
+/* Format, one record per line with tab separated fields:
+     param <key> <value>
+     job <name> <type> <comma separated dependencies or -> <file1> <file2> ... */
+bool JobManifest::write() {
+  std::ofstream outfile(manifestFN_.c_str(), std::ios_base::out);
+  if (!outfile.is_open()) {
+    std::cerr << "Error: could not write job manifest to " << manifestFN_ << std::endl;
+    return false;
+  }
+
+  typedef std::pair<std::string, std::string> StringPair;
+  BOOST_FOREACH (const StringPair& param, parameters_) {
+    outfile << "param\t" << param.first << "\t" << param.second << "\n";
+  }
+
+  BOOST_FOREACH (const ManifestJob& job, jobs_) {
+    outfile << "job\t" << job.name << "\t" << job.type << "\t";
+    if (job.dependencies.empty()) {
+      outfile << "-";
+    } else {
+      for (size_t i = 0; i < job.dependencies.size(); ++i) {
+        if (i > 0) outfile << ",";
+        outfile << job.dependencies[i];
+      }
+    }
+    BOOST_FOREACH (const std::string& fn, job.files) {
+      outfile << "\t" << fn;
+    }
+    outfile << "\n";
+  }
+  outfile.close();
+
+  boost::system::error_code returnedError;
+  boost::filesystem::create_directories(jobFolder_, returnedError);
+  if (!boost::filesystem::exists(jobFolder_)) {
+    std::cerr << "Error: could not create job folder at " << jobFolder_ << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool JobManifest::read() {
+  std::ifstream infile(manifestFN_.c_str(), std::ios_base::in);
+  if (!infile.is_open()) {
+    std::cerr << "Error: could not read job manifest from " << manifestFN_ << std::endl;
+    return false;
+  }
+
+  parameters_.clear();
+  jobs_.clear();
+
+  std::string line;
+  while (getline(infile, line)) {
+    if (line.empty()) continue;
+
+    std::vector<std::string> fields;
+    std::istringstream lineStream(line);
+    std::string field;
+    while (getline(lineStream, field, '\t')) {
+      fields.push_back(field);
+    }
+
+    if (fields[0] == "param" && fields.size() == 3u) {
+      parameters_[fields[1]] = fields[2];
+    } else if (fields[0] == "job" && fields.size() >= 4u) {
+      ManifestJob job;
+      job.name = fields[1];
+      job.type = fields[2];
+      if (fields[3] != "-") {
+        std::istringstream depStream(fields[3]);
+        std::string dep;
+        while (getline(depStream, dep, ',')) {
+          job.dependencies.push_back(dep);
+        }
+      }
+      job.files.assign(fields.begin() + 4, fields.end());
+      jobs_.push_back(job);
+    } else {
+      std::cerr << "Error: could not parse line in job manifest: " << line << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool JobManifest::claimJob(const ManifestJob& job) {
+  if (isFinished(job)) return false;
+
+  // directory creation is atomic, also on most network file systems
+  boost::system::error_code returnedError;
+  return boost::filesystem::create_directory(getLockFN(job.name), returnedError);
+}
+
+void JobManifest::releaseJob(const ManifestJob& job) {
+  boost::system::error_code returnedError;
+  boost::filesystem::remove(getLockFN(job.name), returnedError);
+}
+
+void JobManifest::markFinished(const ManifestJob& job) {
+  std::ofstream outfile(getDoneFN(job.name).c_str(), std::ios_base::out);
+}
+
+bool JobManifest::isFinished(const ManifestJob& job) const {
+  return Globals::fileExists(getDoneFN(job.name));
+}
+
+bool JobManifest::isRunnable(const ManifestJob& job) const {
+  BOOST_FOREACH (const std::string& dep, job.dependencies) {
+    if (!Globals::fileExists(getDoneFN(dep))) return false;
+  }
+  return true;
+}
+
+size_t JobManifest::numFinished() const {
+  size_t finished = 0u;
+  BOOST_FOREACH (const ManifestJob& job, jobs_) {
+    if (isFinished(job)) ++finished;
+  }
+  return finished;
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,104 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_JOBMANIFEST_H_
+#define MARACLUSTER_JOBMANIFEST_H_
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <string>
+
+#include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "Globals.h"
+
+namespace maracluster {
+
+/* A job from the manifest. For "pvalue" jobs, files contains the dat-file
+   of the precursor bin; for "overlap" jobs it contains the tail and head
+   p-value vector files followed by the p-values output file. */
+struct ManifestJob {
+  std::string name;
+  std::string type;
+  std::vector<std::string> dependencies;
+  std::vector<std::string> files;
+};
+
+/* Flat tab-separated description of the jobs of a clustering run, together
+   with the parameters that all workers should share. Jobs are claimed by
+   atomically creating a lock directory in <manifestFN>.jobs, which only
+   requires a shared file system between the worker nodes. Removing the lock
+   directory of a crashed worker puts its job back in the queue. */
+class JobManifest {
+ public:
+  JobManifest(const std::string& manifestFN) : manifestFN_(manifestFN),
+    jobFolder_(manifestFN + ".jobs") {}
+
+  inline void setParameter(const std::string& key, const std::string& value) {
+    parameters_[key] = value;
+  }
+  template<typename T>
+  inline void setParameter(const std::string& key, const T& value) {
+    parameters_[key] = boost::lexical_cast<std::string>(value);
+  }
+  inline bool hasParameter(const std::string& key) const {
+    return parameters_.find(key) != parameters_.end();
+  }
+  inline std::string getParameter(const std::string& key) const {
+    std::map<std::string, std::string>::const_iterator it = parameters_.find(key);
+    return (it != parameters_.end()) ? it->second : "";
+  }
+
+  void addJob(const ManifestJob& job) { jobs_.push_back(job); }
+  inline std::vector<ManifestJob>& getJobs() { return jobs_; }
+
+  bool write();
+  bool read();
+
+  bool claimJob(const ManifestJob& job);
+  void releaseJob(const ManifestJob& job);
+  void markFinished(const ManifestJob& job);
+
+  bool isFinished(const ManifestJob& job) const;
+  bool isRunnable(const ManifestJob& job) const;
+  size_t numFinished() const;
+  inline bool allFinished() const { return numFinished() == jobs_.size(); }
+
+  inline std::string getManifestFN() const { return manifestFN_; }
+
+  static const unsigned int kPollIntervalSeconds;
+
+ protected:
+  std::string manifestFN_, jobFolder_;
+  std::map<std::string, std::string> parameters_;
+  std::vector<ManifestJob> jobs_;
+
+  inline std::string getLockFN(const std::string& jobName) const {
+    return jobFolder_ + "/" + jobName + ".lock";
+  }
+  inline std::string getDoneFN(const std::string& jobName) const {
+    return jobFolder_ + "/" + jobName + ".done";
+  }
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_JOBMANIFEST_H_ */
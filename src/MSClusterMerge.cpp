@@ -18,7 +18,61 @@
 
 namespace maracluster {
 
+namespace {
+
+const std::vector<BinnedMZIntensityPair> kNoPeaks;
+const std::vector<int> kNoPeakCounts;
+
+/* Creates a cluster of spectra that share a set of fragment peaks, with 
+   additional noise peaks and jitter on the m/z and intensity values. */
+void generateRandomCluster(const size_t clusterSize, boost::mt19937& rng,
+    std::vector< std::vector<BinnedMZIntensityPair> >& cluster) {
+  const size_t numSharedPeaks = 100u, numNoisePeaks = 100u;
+  boost::uniform_real<double> mzDist(100.0, 2000.0), unitDist(0.0, 1.0);
+  boost::variate_generator<boost::mt19937&, boost::uniform_real<double> > 
+      randomMz(rng, mzDist), randomUnit(rng, unitDist);
+  
+  std::vector<MZIntensityPair> sharedPeaks;
+  for (size_t j = 0; j < numSharedPeaks; ++j) {
+    sharedPeaks.push_back(MZIntensityPair(randomMz(), 100.0 * randomUnit()));
+  }
+  
+  cluster.resize(clusterSize);
+  for (size_t i = 0; i < clusterSize; ++i) {
+    std::vector<MZIntensityPair> mziPairs;
+    BOOST_FOREACH (const MZIntensityPair& peak, sharedPeaks) {
+      if (randomUnit() < 0.7) {
+        mziPairs.push_back(MZIntensityPair(peak.mz + 0.02 * (randomUnit() - 0.5),
+                                           peak.intensity * (0.5 + randomUnit())));
+      }
+    }
+    for (size_t j = 0; j < numNoisePeaks; ++j) {
+      mziPairs.push_back(MZIntensityPair(randomMz(), 10.0 * randomUnit()));
+    }
+    std::sort(mziPairs.begin(), mziPairs.end(), SpectrumHandler::lessMZ);
+    MSClusterMerge::binMZIntensityPairs(mziPairs, cluster[i]);
+  }
+}
+
+double maxPeakDifference(const std::vector<BinnedMZIntensityPair>& a,
+    const std::vector<BinnedMZIntensityPair>& b) {
+  if (a.size() != b.size()) return std::numeric_limits<double>::max();
+  double maxDiff = 0.0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    maxDiff = std::max(maxDiff, std::abs(a[i].mz - b[i].mz));
+    maxDiff = std::max(maxDiff, 
+        std::abs(a[i].intensity - b[i].intensity) / std::max(1.0, b[i].intensity));
+  }
+  return maxDiff;
+}
+
+} /* namespace */
+
 const float MSClusterMerge::MASS_TO_INT_RATIO = 10000.0f;
+const size_t MSClusterMerge::kPeakAreaSize = 160u;
+const size_t MSClusterMerge::kMaxMergeWays = 4096u;
+size_t ConsensusAccumulator::kMaxChunkPeaks = 1u << 18;
+boost::thread_specific_ptr<MSClusterMergeBuffers> MSClusterMerge::mergeBuffers_;
 float MSClusterMerge::fragmentTolerance_ = 0.34f; /* has to be > 0.1 */
 float MSClusterMerge::isoTolerance_ = 
     0.1f + (MSClusterMerge::fragmentTolerance_ - 0.1f) * 0.5f;
@@ -125,10 +179,203 @@ void MSClusterMerge::mergeMccs(std::vector<MassChargeCandidate>& allMccs,
 }
 
 /* Adapted from the MS-Cluster code base:
-   software/tools/ms-cluster/src/MsCluster/MsClusterDataStorage.cpp */
+   software/tools/ms-cluster/src/MsCluster/MsClusterDataStorage.cpp 
+   The peak lists of binMZIntensityPairs are sorted by m/z, so that the 
+   cluster members can be combined by a k-way merge instead of a sort. */
 void MSClusterMerge::merge(
     std::vector< std::vector<BinnedMZIntensityPair> >& cluster,
     std::vector<BinnedMZIntensityPair>& mergedSpectrum) {
+  MSClusterMergeBuffers& buffers = getMergeBuffers();
+  
+  mergeSortedPeaks(cluster, buffers.allPeaks, buffers.heap);
+  joinPeaks(kNoPeaks, kNoPeakCounts, buffers.allPeaks, 
+            buffers.mergedPeaks, buffers.peakCounts);
+  selectPeaks(buffers.mergedPeaks, buffers.peakCounts, cluster.size(), 
+              mergedSpectrum);
+}
+
+MSClusterMergeBuffers& MSClusterMerge::getMergeBuffers() {
+  if (mergeBuffers_.get() == NULL) {
+    mergeBuffers_.reset(new MSClusterMergeBuffers());
+  }
+  return *mergeBuffers_;
+}
+
+/* Combines the already joined peaks, with their peak counts, and the new 
+   peaks, both sorted by m/z, and joins peaks that are closer than the
+   isotope tolerance. */
+void MSClusterMerge::joinPeaks(
+    const std::vector<BinnedMZIntensityPair>& peaks,
+    const std::vector<int>& peakCounts,
+    const std::vector<BinnedMZIntensityPair>& newPeaks,
+    std::vector<BinnedMZIntensityPair>& joinedPeaks,
+    std::vector<int>& joinedCounts) {
+  joinedPeaks.clear();
+  joinedCounts.clear();
+  joinedPeaks.reserve(peaks.size() + newPeaks.size());
+  joinedCounts.reserve(peaks.size() + newPeaks.size());
+  
+  const int maxIntProximity = convertMassToInt(isoTolerance_);
+  size_t i = 0, j = 0;
+  while (i < peaks.size() || j < newPeaks.size()) {
+    const BinnedMZIntensityPair* peak;
+    int peakCount = 1;
+    if (j == newPeaks.size() || 
+        (i < peaks.size() && !SpectrumHandler::lessMZ(newPeaks[j], peaks[i]))) {
+      peak = &peaks[i];
+      peakCount = peakCounts[i++];
+    } else {
+      peak = &newPeaks[j++];
+    }
+    
+    if (!joinedPeaks.empty() && static_cast<int>(
+          peak->binIdx - joinedPeaks.back().binIdx) < maxIntProximity) {
+      // join peaks with proportion to their intensities
+      BinnedMZIntensityPair& prevPeak = joinedPeaks.back();
+      const double intensitySum = prevPeak.intensity + peak->intensity;
+      const double ratio = prevPeak.intensity/intensitySum;
+      const double newMass = ratio * prevPeak.mz + (1.0-ratio) * peak->mz;
+      
+      prevPeak.mz = newMass;
+      prevPeak.binIdx = convertMassToInt(newMass);
+      prevPeak.intensity = intensitySum;
+      joinedCounts.back() += peakCount;
+    } else {
+      joinedPeaks.push_back(*peak);
+      joinedCounts.push_back(peakCount);
+    }
+  }
+}
+
+/* Weights the joined peaks by their peak counts and keeps the most intense
+   ones. The intensities of peaks are modified in place. */
+void MSClusterMerge::selectPeaks(std::vector<BinnedMZIntensityPair>& peaks,
+    const std::vector<int>& peakCounts, size_t clusterSize,
+    std::vector<BinnedMZIntensityPair>& mergedSpectrum) {
+  // modify the intensity according to the peakWeightTable_
+  // that is discount the weight of peaks that have only a few copies
+  for (size_t i = 0; i < peaks.size(); i++) {
+    peaks[i].intensity *= peakWeightTable_.getWeight(peakCounts[i], 
+                                                     static_cast<int>(clusterSize));
+  }
+  
+  // select a number of peaks according to their intensity, the merged peaks
+  // are already sorted by m/z if no selection is needed
+  if (peaks.size() > kPeakAreaSize) {
+    std::nth_element(peaks.begin(), peaks.begin() + kPeakAreaSize, 
+                     peaks.end(), SpectrumHandler::greaterIntensity);
+    std::sort(peaks.begin(), peaks.begin() + kPeakAreaSize, 
+              SpectrumHandler::lessMZ);
+    mergedSpectrum.assign(peaks.begin(), peaks.begin() + kPeakAreaSize);
+  } else {
+    mergedSpectrum.assign(peaks.begin(), peaks.end());
+  }
+}
+
+/* Collects the peaks with positive intensity of all cluster members in 
+   allPeaks, sorted by m/z. Members that are not sorted, e.g. from unsorted
+   input spectra, fall back to a full sort, as do very large clusters for 
+   which the heap no longer fits in the cache. */
+void MSClusterMerge::mergeSortedPeaks(
+    const std::vector< std::vector<BinnedMZIntensityPair> >& cluster,
+    std::vector<BinnedMZIntensityPair>& allPeaks,
+    std::vector<MergeHead>& heap) {
+  allPeaks.clear();
+  heap.clear();
+  
+  bool isSorted = true;
+  size_t totalPeaks = 0u;
+  for (size_t i = 0; i < cluster.size(); ++i) {
+    const std::vector<BinnedMZIntensityPair>& member = cluster[i];
+    if (member.empty()) continue;
+    heap.push_back(MergeHead(member[0], static_cast<unsigned int>(i)));
+    totalPeaks += member.size();
+    for (size_t j = 1; j < member.size() && isSorted; ++j) {
+      if (SpectrumHandler::lessMZ(member[j], member[j-1])) isSorted = false;
+    }
+  }
+  allPeaks.reserve(totalPeaks);
+  
+  if (!isSorted || heap.size() > kMaxMergeWays) {
+    for (size_t i = 0; i < cluster.size(); ++i) {
+      BOOST_FOREACH (const BinnedMZIntensityPair& peak, cluster[i]) {
+        if (peak.intensity > 0) allPeaks.push_back(peak);
+      }
+    }
+    std::sort(allPeaks.begin(), allPeaks.end(), SpectrumHandler::lessMZ);
+    return;
+  }
+  
+  std::make_heap(heap.begin(), heap.end(), greaterHead);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), greaterHead);
+    MergeHead& top = heap.back();
+    const std::vector<BinnedMZIntensityPair>& member = cluster[top.member];
+    
+    // consume the member until another member has a lower m/z
+    const BinnedMZIntensityPair* peak = &member[top.peak];
+    const BinnedMZIntensityPair* end = &member[0] + member.size();
+    if (heap.size() == 1u) {
+      for (; peak != end; ++peak) {
+        if (peak->intensity > 0) allPeaks.push_back(*peak);
+      }
+      heap.pop_back();
+      continue;
+    }
+    const MergeHead& next = heap.front();
+    do {
+      if (peak->intensity > 0) allPeaks.push_back(*peak);
+      ++peak;
+    } while (peak != end && !greaterPeak(*peak, top.member, next));
+    
+    if (peak != end) {
+      top.mz = peak->mz;
+      top.intensity = peak->intensity;
+      top.peak = static_cast<unsigned int>(peak - &member[0]);
+      std::push_heap(heap.begin(), heap.end(), greaterHead);
+    } else {
+      heap.pop_back();
+    }
+  }
+}
+
+void ConsensusAccumulator::add(
+    std::vector<BinnedMZIntensityPair>& binnedSpectrum) {
+  ++numMembers_;
+  numChunkPeaks_ += binnedSpectrum.size();
+  chunk_.push_back(std::vector<BinnedMZIntensityPair>());
+  chunk_.back().swap(binnedSpectrum);
+  if (numChunkPeaks_ >= kMaxChunkPeaks) fold();
+}
+
+/* Folding the chunk into the joined peaks with their counts gives the same 
+   consensus as merging all members at once, apart from small shifts in m/z 
+   where a joined peak absorbs peaks from a later chunk. */
+void ConsensusAccumulator::fold() {
+  MSClusterMergeBuffers& buffers = MSClusterMerge::getMergeBuffers();
+  MSClusterMerge::mergeSortedPeaks(chunk_, buffers.allPeaks, buffers.heap);
+  MSClusterMerge::joinPeaks(peaks_, peakCounts_, buffers.allPeaks, 
+                            buffers.mergedPeaks, buffers.peakCounts);
+  peaks_.swap(buffers.mergedPeaks);
+  peakCounts_.swap(buffers.peakCounts);
+  
+  chunk_.clear();
+  numChunkPeaks_ = 0u;
+}
+
+void ConsensusAccumulator::finalize(
+    std::vector<BinnedMZIntensityPair>& mergedSpectrum) {
+  if (!chunk_.empty()) fold();
+  MSClusterMerge::selectPeaks(peaks_, peakCounts_, numMembers_, mergedSpectrum);
+  
+  peaks_.clear();
+  peakCounts_.clear();
+  numMembers_ = 0u;
+}
+
+void MSClusterMerge::mergeFullSort(
+    std::vector< std::vector<BinnedMZIntensityPair> >& cluster,
+    std::vector<BinnedMZIntensityPair>& mergedSpectrum) {
   const size_t peakAreaSize = 160;
   //const size_t peakAreaSize = 1000;
   std::vector<BinnedMZIntensityPair> allPeaks;
@@ -264,7 +511,80 @@ bool MSClusterMerge::mergeUnitTest() {
     return false;
   }
   
+  // the k-way merge should agree with the full sort reference
+  boost::mt19937 rng(1u);
+  const size_t clusterSizes[] = { 1u, 2u, 7u, 50u };
+  for (size_t k = 0; k < 4; ++k) {
+    generateRandomCluster(clusterSizes[k], rng, cluster);
+    std::vector<BinnedMZIntensityPair> referenceSpectrum;
+    merge(cluster, mergedSpectrum);
+    mergeFullSort(cluster, referenceSpectrum);
+    if (maxPeakDifference(mergedSpectrum, referenceSpectrum) > 1e-5) {
+      std::cerr << "Consensus spectrum of a cluster of size " << clusterSizes[k] 
+                << " differs from the reference implementation." << std::endl;
+      return false;
+    }
+    
+    // a single chunk of the accumulator should agree as well
+    ConsensusAccumulator accumulator;
+    BOOST_FOREACH (std::vector<BinnedMZIntensityPair>& member, cluster) {
+      accumulator.add(member);
+    }
+    accumulator.finalize(mergedSpectrum);
+    if (maxPeakDifference(mergedSpectrum, referenceSpectrum) > 1e-5) {
+      std::cerr << "Accumulated consensus spectrum of a cluster of size " 
+                << clusterSizes[k] << " differs from the reference implementation." 
+                << std::endl;
+      return false;
+    }
+  }
+  
   return true;
 }
 
+void MSClusterMerge::benchmarkMerge() {
+  init();
+  boost::mt19937 rng(1u);
+  
+  const size_t clusterSizes[] = { 2u, 10u, 100u, 1000u, 10000u };
+  const size_t totalSpectra = 20000u;
+  
+  std::cout << "cluster_size\tnum_clusters\tfull_sort_ms\tkway_ms\tmax_difference\taccumulator_ms" << std::endl;
+  for (size_t k = 0; k < 5; ++k) {
+    std::vector< std::vector<BinnedMZIntensityPair> > cluster;
+    generateRandomCluster(clusterSizes[k], rng, cluster);
+    const size_t numClusters = std::max<size_t>(1u, totalSpectra / clusterSizes[k]);
+    
+    std::vector<BinnedMZIntensityPair> referenceSpectrum, mergedSpectrum;
+    clock_t startClock = clock();
+    for (size_t i = 0; i < numClusters; ++i) {
+      mergeFullSort(cluster, referenceSpectrum);
+    }
+    double fullSortTime = (clock() - startClock) / (double)CLOCKS_PER_SEC * 1000.0;
+    
+    startClock = clock();
+    for (size_t i = 0; i < numClusters; ++i) {
+      merge(cluster, mergedSpectrum);
+    }
+    double kWayTime = (clock() - startClock) / (double)CLOCKS_PER_SEC * 1000.0;
+    double kWayDifference = maxPeakDifference(mergedSpectrum, referenceSpectrum);
+    
+    // the accumulator takes over the peaks, so the copies are part of the timing
+    startClock = clock();
+    for (size_t i = 0; i < numClusters; ++i) {
+      ConsensusAccumulator accumulator;
+      for (size_t j = 0; j < cluster.size(); ++j) {
+        std::vector<BinnedMZIntensityPair> member(cluster[j]);
+        accumulator.add(member);
+      }
+      accumulator.finalize(mergedSpectrum);
+    }
+    double accumulatorTime = (clock() - startClock) / (double)CLOCKS_PER_SEC * 1000.0;
+    
+    std::cout << clusterSizes[k] << "\t" << numClusters << "\t" << fullSortTime 
+              << "\t" << kWayTime << "\t" 
+              << kWayDifference << "\t" << accumulatorTime << std::endl;
+  }
+}
+
 } /* namespace maracluster */
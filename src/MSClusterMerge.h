@@ -19,8 +19,15 @@
 
 #include <vector>
 #include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <limits>
 
 #include <boost/foreach.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real.hpp>
+#include <boost/random/variate_generator.hpp>
 
 #include "SpectrumHandler.h"
 #include "BinSpectra.h"
@@ -87,7 +94,25 @@ class PeakWeightTable {
   }
 };
 
+/* Head of a cluster member in the k-way merge of MSClusterMerge::merge, the
+   m/z and intensity of the current peak are copied for cheap comparisons */
+struct MergeHead {
+  MergeHead(const BinnedMZIntensityPair& p, unsigned int member_) : 
+    mz(p.mz), intensity(p.intensity), member(member_), peak(0u) {}
+  double mz, intensity;
+  unsigned int member, peak;
+};
+
+/* Working memory of MSClusterMerge::merge, kept per thread so that merging
+   does not allocate once the buffers have grown to the largest cluster. */
+struct MSClusterMergeBuffers {
+  std::vector<BinnedMZIntensityPair> allPeaks, mergedPeaks;
+  std::vector<int> peakCounts;
+  std::vector<MergeHead> heap;
+};
+
 class MSClusterMerge {
+  friend class ConsensusAccumulator;
  public:
   static float fragmentTolerance_;
   static float isoTolerance_;
@@ -99,6 +124,7 @@ class MSClusterMerge {
   static void mergeMccs(std::vector<MassChargeCandidate>& allMccs,
       std::vector<MassChargeCandidate>& consensusMccs);
   static bool mergeUnitTest();
+  static void benchmarkMerge();
   
   static void binMZIntensityPairs(std::vector<MZIntensityPair>& spectrum,
       std::vector<BinnedMZIntensityPair>& binnedSpectrum);
@@ -109,6 +135,45 @@ class MSClusterMerge {
   static PeakWeightTable peakWeightTable_; // for creating consensuses
   
   static const float MASS_TO_INT_RATIO;
+  static const size_t kPeakAreaSize, kMaxMergeWays;
+  
+  static boost::thread_specific_ptr<MSClusterMergeBuffers> mergeBuffers_;
+  
+  /* orders the heap of the k-way merge by m/z and intensity as in 
+     SpectrumHandler::lessMZ, with the lowest peak on top. Ties are broken by 
+     the member index to reproduce the order of a stable sort. */
+  inline static bool greaterHead(const MergeHead& a, const MergeHead& b) {
+    if (a.mz != b.mz) return a.mz > b.mz;
+    else if (a.intensity != b.intensity) return a.intensity > b.intensity;
+    else return a.member > b.member;
+  }
+  inline static bool greaterPeak(const BinnedMZIntensityPair& a, 
+      unsigned int memberA, const MergeHead& b) {
+    if (a.mz != b.mz) return a.mz > b.mz;
+    else if (a.intensity != b.intensity) return a.intensity > b.intensity;
+    else return memberA > b.member;
+  }
+  
+  static MSClusterMergeBuffers& getMergeBuffers();
+  
+  static void mergeSortedPeaks(
+      const std::vector< std::vector<BinnedMZIntensityPair> >& cluster,
+      std::vector<BinnedMZIntensityPair>& allPeaks,
+      std::vector<MergeHead>& heap);
+  
+  static void joinPeaks(const std::vector<BinnedMZIntensityPair>& peaks,
+      const std::vector<int>& peakCounts,
+      const std::vector<BinnedMZIntensityPair>& newPeaks,
+      std::vector<BinnedMZIntensityPair>& joinedPeaks,
+      std::vector<int>& joinedCounts);
+  static void selectPeaks(std::vector<BinnedMZIntensityPair>& peaks,
+      const std::vector<int>& peakCounts, size_t clusterSize,
+      std::vector<BinnedMZIntensityPair>& mergedSpectrum);
+  
+  // original implementation with a full sort of all peaks, used as reference
+  static void mergeFullSort(
+      std::vector< std::vector<BinnedMZIntensityPair> >& cluster,
+      std::vector<BinnedMZIntensityPair>& mergedSpectrum);
 
   inline static int convertMassToInt(float mass) {
 	  return (static_cast<int>(MASS_TO_INT_RATIO * mass));
@@ -126,6 +191,33 @@ class MSClusterMerge {
   static inline bool isEqual(double a, double b) { return (std::abs(a - b) < 1e-5); }
 };
 
+/* Builds the consensus peak list of a cluster one member at a time. Members
+   are collected in chunks of at most kMaxChunkPeaks peaks, which are folded
+   into the joined peaks of the previous chunks together with their peak 
+   counts, so that the memory does not grow with the number of members. For
+   clusters that fit in a single chunk, the result is identical to 
+   MSClusterMerge::merge. */
+class ConsensusAccumulator {
+ public:
+  ConsensusAccumulator() : numMembers_(0u), numChunkPeaks_(0u) {}
+  
+  // takes over the peaks of binnedSpectrum, leaving it empty
+  void add(std::vector<BinnedMZIntensityPair>& binnedSpectrum);
+  void finalize(std::vector<BinnedMZIntensityPair>& mergedSpectrum);
+  
+  inline size_t getNumMembers() const { return numMembers_; }
+  
+  static size_t kMaxChunkPeaks;
+  
+ protected:
+  std::vector< std::vector<BinnedMZIntensityPair> > chunk_;
+  std::vector<BinnedMZIntensityPair> peaks_;
+  std::vector<int> peakCounts_;
+  size_t numMembers_, numChunkPeaks_;
+  
+  void fold();
+};
+
 } /* namespace maracluster */
 
 #endif /* MARACLUSTER_MSCLUSTERMERGE_H_ */
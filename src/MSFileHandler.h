@@ -66,6 +66,7 @@ class MSFileHandler {
       std::string resultFN = "", bool normalizeXCorr = false, 
       bool addPrecursorMass = true, bool truncatePeaks = true, 
       unsigned int chargeFilter = 0);
+  static void writeMSData(pwiz::msdata::MSData& msd, const std::string& outputFN);
  protected:
   SpectrumFileList fileList_;
   std::vector<ScanMergeInfoSet> combineSets_;
@@ -73,7 +74,6 @@ class MSFileHandler {
   
   static size_t getSpectrumIdxFromScannr(pwiz::msdata::SpectrumListPtr sl, 
                                          unsigned int scannr);
-  static void writeMSData(pwiz::msdata::MSData& msd, const std::string& outputFN);
   
   static std::string getPartFN(const std::string& outputFN,
                                const std::string& partString);
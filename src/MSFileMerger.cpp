@@ -15,6 +15,8 @@
  ******************************************************************************/
 
 #include "MSFileMerger.h"
+#include "MyException.h"
+#include "ThreadPlacement.h"
 #include "Version.h"
 
 namespace maracluster {
@@ -39,6 +41,8 @@ using pwiz::msdata::ProcessingMethod;
 int MSFileMerger::maxMSFilePtrs_ = 40; // memory constrained
 int MSFileMerger::maxSpectraPerFile_ = 200000; // memory constrained
 unsigned int MSFileMerger::maxConsensusSpectraPerFile_ = 200000u; // search engine memory constrained
+unsigned int MSFileMerger::maxSpectraInPipeline_ = 600000u; // memory constrained
+unsigned int MSFileMerger::minStreamingClusterSize_ = 1000u; // memory constrained
 
 int MSFileMerger::mergeMethod_ = 10;
 bool MSFileMerger::normalize_ = true;
@@ -88,18 +92,24 @@ void MSFileMerger::mergeAllSpectra(const std::string& spectrumInFN) {
   SpectrumListPtr sl = msd.run.spectrumListPtr;
 
   MSClusterMerge::init();
-
-  std::vector<SpectrumPtr> spectra;
+  
+  // spectra are folded in one at a time, the file can be arbitrarily large
+  ConsensusAccumulator accumulator;
+  std::vector<MassChargeCandidate> allMccs;
+  SpectrumPtr consensusSpec;
   for (unsigned int j = 0; j < sl->size(); ++j) {
     SpectrumPtr s = sl->spectrum(j, true);
-    spectra.push_back(s);
+    if (j == 0) consensusSpec = SpectrumPtr(new pwiz::msdata::Spectrum(*s));
+    addToConsensus(s, accumulator, allMccs);
   }
 
   SpectrumListSimplePtr mergedSpectra(new SpectrumListSimple);
   mergedSpectra->dp = DataProcessingPtr(new DataProcessing("MaRaCluster_consensus_builder"));
-
-  ScanId mergedScanId = fileList_.getScanId(spectrumOutFN_,1u);
-  mergeSpectraSetMSCluster(spectra, mergedScanId, mergedSpectra);
+  
+  if (consensusSpec.get()) {
+    ScanId mergedScanId = fileList_.getScanId(spectrumOutFN_,1u);
+    finalizeConsensus(consensusSpec, accumulator, allMccs, mergedScanId, mergedSpectra);
+  }
 
   std::cerr << "Creating merged MSData file" << std::endl;
   MSData msdMerged;
@@ -112,30 +122,72 @@ void MSFileMerger::mergeAllSpectra(const std::string& spectrumInFN) {
 void MSFileMerger::mergeSpectraSetMSCluster(
     std::vector<SpectrumPtr>& spectra,
     ScanId scanId, SpectrumListSimplePtr mergedSpectra) {
-  std::vector< std::vector<BinnedMZIntensityPair> > cluster;
+  ConsensusAccumulator accumulator;
   std::vector<MassChargeCandidate> allMccs;
-  bool first = true;
-  SpectrumPtr consensusSpec;
+  SpectrumPtr consensusSpec(new pwiz::msdata::Spectrum(*spectra.front()));
   BOOST_FOREACH(SpectrumPtr s, spectra) {
-    if (first) {
-      consensusSpec = SpectrumPtr(new pwiz::msdata::Spectrum(*s));
-      first = false;
-    }
+    addToConsensus(s, accumulator, allMccs);
+  }
+  finalizeConsensus(consensusSpec, accumulator, allMccs, scanId, mergedSpectra);
+}
+
+/* Only the first member is decoded to a full spectrum, as template for the 
+   meta data of the consensus spectrum. */
+void MSFileMerger::mergeSpooledSpectraSetMSCluster(
+    const std::vector<SpectrumSpoolEntry>& entries,
+    ScanId scanId, SpectrumListSimplePtr mergedSpectra) {
+  ConsensusAccumulator accumulator;
+  std::vector<MassChargeCandidate> allMccs;
+  SpectrumPtr consensusSpec = unspoolSpectrum(entries.front());
+  BOOST_FOREACH(const SpectrumSpoolEntry& entry, entries) {
+    addToConsensus(entry, accumulator, allMccs);
+  }
+  finalizeConsensus(consensusSpec, accumulator, allMccs, scanId, mergedSpectra);
+}
 
-    std::vector<MassChargeCandidate> mccs;
-    SpectrumHandler::getMassChargeCandidates(s, mccs);
-    allMccs.insert(allMccs.end(), mccs.begin(), mccs.end());
+void MSFileMerger::addToConsensus(std::vector<MZIntensityPair>& mziPairs,
+    ConsensusAccumulator& accumulator) {
+  if (normalize_) SpectrumHandler::normalizeIntensitiesMSCluster(mziPairs);
 
-    std::vector<MZIntensityPair> mziPairs;
-    SpectrumHandler::getMZIntensityPairs(s, mziPairs);
-    if (normalize_) SpectrumHandler::normalizeIntensitiesMSCluster(mziPairs);
+  std::vector<BinnedMZIntensityPair> binnedMziPairs;
+  MSClusterMerge::binMZIntensityPairs(mziPairs, binnedMziPairs);
+  accumulator.add(binnedMziPairs);
+}
 
-    std::vector<BinnedMZIntensityPair> binnedMziPairs;
-    MSClusterMerge::binMZIntensityPairs(mziPairs, binnedMziPairs);
-    cluster.push_back(binnedMziPairs);
+void MSFileMerger::addToConsensus(SpectrumPtr s,
+    ConsensusAccumulator& accumulator, 
+    std::vector<MassChargeCandidate>& allMccs) {
+  std::vector<MassChargeCandidate> mccs;
+  SpectrumHandler::getMassChargeCandidates(s, mccs);
+  allMccs.insert(allMccs.end(), mccs.begin(), mccs.end());
+
+  std::vector<MZIntensityPair> mziPairs;
+  SpectrumHandler::getMZIntensityPairs(s, mziPairs);
+  addToConsensus(mziPairs, accumulator);
+}
+
+void MSFileMerger::addToConsensus(const SpectrumSpoolEntry& entry,
+    ConsensusAccumulator& accumulator, 
+    std::vector<MassChargeCandidate>& allMccs) {
+  for (unsigned int i = 0; i < entry.header->numMccs; ++i) {
+    allMccs.push_back(MassChargeCandidate(entry.mccs[i].charge, 
+        entry.mccs[i].precMz, entry.mccs[i].mass));
   }
+  
+  std::vector<MZIntensityPair> mziPairs;
+  mziPairs.reserve(entry.header->numPeaks);
+  for (unsigned int i = 0; i < entry.header->numPeaks; ++i) {
+    mziPairs.push_back(MZIntensityPair(entry.mzs[i], entry.intensities[i]));
+  }
+  addToConsensus(mziPairs, accumulator);
+}
+
+void MSFileMerger::finalizeConsensus(SpectrumPtr consensusSpec,
+    ConsensusAccumulator& accumulator, 
+    std::vector<MassChargeCandidate>& allMccs,
+    ScanId scanId, SpectrumListSimplePtr mergedSpectra) {
   std::vector<BinnedMZIntensityPair> mergedMziPairs;
-  MSClusterMerge::merge(cluster, mergedMziPairs);
+  accumulator.finalize(mergedMziPairs);
 
   std::vector<MZIntensityPair> mziPairs;
   MSClusterMerge::unbinMZIntensityPairs(mergedMziPairs, mziPairs);
@@ -253,7 +305,15 @@ void MSFileMerger::mergeSpectraScalable() {
       combineSets_.size(), maxConsensusSpectraPerFile_);
   numClusterBins_ = std::max(numClusterBinsIn, numClusterBinsOut);
 
-  splitSpecFilesByConsensusSpec(scannrToMergedScannr);
+  {
+    ScopedStageTimer timer("consensus/split");
+    timer.addItems(scannrToMergedScannr.size());
+    splitSpecFilesByConsensusSpec(scannrToMergedScannr);
+  }
+  
+  // loading, merging and writing of the bins are pipelined
+  ScopedStageTimer timer("consensus/merge");
+  timer.addItems(combineSets_.size());
   mergeSplitSpecFiles();
 }
 
@@ -339,15 +399,182 @@ void MSFileMerger::splitSpecFilesByConsensusSpec(
     if (removeIdx >= 0) {
       msDataPtrs.erase(msDataPtrs.begin() + removeIdx);
     }
+    sourceMsDataPtrs_.insert(sourceMsDataPtrs_.end(), msDataPtrs.begin(), msDataPtrs.end());
     
-    writeClusterBins(batchNr, msDataPtrs, spectrumListsAcc);
+    writeClusterBins(batchNr, spectrumListsAcc);
   }
   std::cerr << "Finished splitting ms2 files" << std::endl;
 }
 
+/* Pipelined over cluster bins: while bin k is merged, bin k+1 is decoded by
+   the loader thread and bin k-1 is written by the writer thread. The number 
+   of input spectra in the pipeline is limited by maxSpectraInPipeline_. */
 void MSFileMerger::mergeSplitSpecFiles() {
   MSClusterMerge::init();
 
+  std::vector< std::vector<unsigned int> > binCombineSetIdxs(numClusterBins_);
+  for (unsigned int i = 0; i < combineSets_.size(); ++i) {
+    binCombineSetIdxs[getClusterBin(combineSets_[i].mergedScanId)].push_back(i);
+  }
+  
+  MergeBinQueue loadedBins, mergedBins;
+  SpectrumBudget budget(maxSpectraInPipeline_);
+  std::string writeError;
+  
+  boost::thread loaderThread(&MSFileMerger::loadSpectraBins, this, 
+      boost::cref(binCombineSetIdxs), boost::ref(loadedBins), boost::ref(budget));
+  boost::thread writerThread(&MSFileMerger::writeSpectraBins, this, 
+      boost::ref(mergedBins), boost::ref(budget), boost::ref(writeError));
+  
+  std::string loadError;
+  try {
+    for (size_t clusterBin = 0; clusterBin < numClusterBins_; ++clusterBin) {
+      MergeBinDataPtr bin = loadedBins.pop(clusterBin);
+      if (bin->error.empty()) {
+        std::cerr << "Merging spectra in bin " << clusterBin+1 << "/" << numClusterBins_ << std::endl;
+        mergeSpectraBin(*bin);
+        removeSpectraBinFiles(clusterBin);
+      } else {
+        loadError = bin->error;
+      }
+      mergedBins.push(bin);
+      if (!loadError.empty()) break;
+    }
+  } catch (...) {
+    // unblock the loader and writer threads, which otherwise wait forever 
+    // for budget or for bins that will not be merged
+    loadedBins.close();
+    mergedBins.close();
+    budget.close();
+    loaderThread.join();
+    writerThread.join();
+    throw;
+  }
+  
+  loaderThread.join();
+  writerThread.join();
+  
+  if (!loadError.empty()) {
+    throw MyException("Error: could not read split spectrum files: " + loadError);
+  } else if (!writeError.empty()) {
+    throw MyException("Error: could not write consensus spectra: " + writeError);
+  }
+}
+
+void MSFileMerger::loadSpectraBins(
+    const std::vector< std::vector<unsigned int> >& binCombineSetIdxs,
+    MergeBinQueue& loadedBins, SpectrumBudget& budget) {
+  ThreadPlacement::resetThreadAffinity();
+  for (size_t clusterBin = 0; clusterBin < numClusterBins_; ++clusterBin) {
+    // streamed clusters are not decoded and do not count towards the budget
+    size_t numSpectra = 0u;
+    BOOST_FOREACH (unsigned int i, binCombineSetIdxs[clusterBin]) {
+      if (combineSets_[i].scans.size() < minStreamingClusterSize_) {
+        numSpectra += combineSets_[i].scans.size();
+      }
+    }
+    if (!budget.reserve(numSpectra)) return;
+    
+    MergeBinDataPtr bin;
+    try {
+      bin = loadSpectraBin(clusterBin, binCombineSetIdxs[clusterBin]);
+      bin->numSpectra = numSpectra;
+    } catch (std::exception& e) {
+      bin = MergeBinDataPtr(new MergeBinData(clusterBin, numSpectra));
+      bin->error = e.what();
+    }
+    loadedBins.push(bin);
+    if (!bin->error.empty()) return;
+  }
+}
+
+/* Spectra are decoded in parallel from the memory mapped spool files. Large
+   clusters only keep references to their spool entries. */
+MergeBinDataPtr MSFileMerger::loadSpectraBin(size_t clusterBin,
+    const std::vector<unsigned int>& combineSetIdxs) {
+  MergeBinDataPtr bin(new MergeBinData(clusterBin, 0u));
+  std::vector<SpectrumSpoolReaderPtr>& spoolReaders = bin->spoolReaders;
+  for (unsigned int i = 0; i < numBatches_; ++i) {
+    spoolReaders.push_back(SpectrumSpoolReaderPtr(new SpectrumSpoolReader()));
+    if (!spoolReaders[i]->open(getSpectraBinFN(clusterBin, i))) {
+      throw MyException("could not open " + getSpectraBinFN(clusterBin, i));
+    }
+  }
+
+  /* (batchIdx, MergeScanIndex) */
+  std::vector< std::pair<unsigned int, MergeScanIndex> > scanIndices;
+  BOOST_FOREACH (unsigned int i, combineSetIdxs) {
+    const bool streaming = (combineSets_[i].scans.size() >= minStreamingClusterSize_);
+    if (streaming) {
+      bin->spooledSpectra.push_back(std::make_pair(
+          std::vector<SpectrumSpoolEntry>(), combineSets_[i].mergedScanId));
+    }
+    unsigned int posInCluster = 0;
+    BOOST_FOREACH (ScanId scannr, combineSets_[i].scans) {
+      unsigned int batchIdx = fileList_.getFileIdx(scannr) / numMSFilePtrsPerBatch_;
+      size_t result = spoolReaders[batchIdx]->find(hash_value(scannr));
+      if (result >= spoolReaders[batchIdx]->size()) {
+        std::cerr << "  Warning: index " << result << " out of bounds: "
+              << fileList_.getFilePath(scannr) << ": " << scannr << std::endl;
+      } else if (streaming) {
+        bin->spooledSpectra.back().first.push_back(
+            spoolReaders[batchIdx]->getEntry(result));
+      } else {
+        scanIndices.push_back(std::make_pair(batchIdx, MergeScanIndex(result, posInCluster, bin->spectra.size())));
+        ++posInCluster;
+      }
+    }
+    // initialize container for spectra to be merged for mergedScanId
+    if (!streaming) {
+      bin->spectra.push_back(std::make_pair(std::vector<SpectrumPtr>(posInCluster), combineSets_[i].mergedScanId));
+    }
+  }
+  
+#pragma omp parallel for schedule(dynamic, 1000)
+  for (int k = 0; k < static_cast<int>(scanIndices.size()); ++k) {
+    const MergeScanIndex& msi = scanIndices[k].second;
+    bin->spectra[msi.mergeIdx].first[msi.posInCluster] = unspoolSpectrum(
+        spoolReaders[scanIndices[k].first]->getEntry(msi.spectrumIndex));
+  }
+  return bin;
+}
+
+void MSFileMerger::mergeSpectraBin(MergeBinData& bin) {
+  bin.mergedSpectra = SpectrumListSimplePtr(new SpectrumListSimple);
+#pragma omp parallel for schedule(dynamic, 100)
+  for (int k = 0; k < static_cast<int>(bin.spectra.size()); ++k) {
+    if (bin.spectra[k].first.size() > 0) {
+      mergeSpectraSetMSCluster(bin.spectra[k].first, bin.spectra[k].second, bin.mergedSpectra);
+    }
+  }
+  bin.spectra.clear();
+  
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int k = 0; k < static_cast<int>(bin.spooledSpectra.size()); ++k) {
+    if (bin.spooledSpectra[k].first.size() > 0) {
+      mergeSpooledSpectraSetMSCluster(bin.spooledSpectra[k].first, 
+          bin.spooledSpectra[k].second, bin.mergedSpectra);
+    }
+  }
+  bin.spooledSpectra.clear();
+  bin.spoolReaders.clear();
+}
+
+void MSFileMerger::removeSpectraBinFiles(size_t clusterBin) {
+  for (unsigned int i = 0; i < numBatches_; ++i) {
+    std::string partSpecOutFN = getSpectraBinFN(clusterBin, i);
+    if (remove(partSpecOutFN.c_str()) != 0) {
+      std::cerr << "Warning: Can't remove " << partSpecOutFN << ": "
+                << strerror(errno) << std::endl;
+    }
+  }
+}
+
+/* Consensus spectra are written in order of their scan number, in part files
+   of maxConsensusSpectraPerFile_ spectra, independent of the pipelining. */
+void MSFileMerger::writeSpectraBins(MergeBinQueue& mergedBins, 
+    SpectrumBudget& budget, std::string& writeError) {
+  ThreadPlacement::resetThreadAffinity();
   SpectrumListSimplePtr mergedSpectra(new SpectrumListSimple);
 
   SoftwarePtr softwarePtr = SoftwarePtr(new Software("MaRaCluster"));
@@ -363,135 +590,134 @@ void MSFileMerger::mergeSplitSpecFiles() {
 
   unsigned int partIdx = 0u;
   
-  std::vector<MSDataPtr> msdVector;
-  
   for (size_t clusterBin = 0; clusterBin < numClusterBins_; ++clusterBin) {
-    std::cerr << "Merging spectra in bin " << clusterBin+1 << "/" << numClusterBins_ << std::endl;
+    MergeBinDataPtr bin = mergedBins.pop(clusterBin);
+    if (!bin) return; // the merging stopped on an exception
+    if (!bin->error.empty()) {
+      budget.release(bin->numSpectra);
+      return;
+    }
     
-    mergeSpectraBin(clusterBin, msdVector, mergedSpectra);
-
-    while (mergedSpectra->size() > maxConsensusSpectraPerFile_
-        || (mergedSpectra->size() > 0u && clusterBin == numClusterBins_ - 1)) {
-      std::cerr << "Creating merged MSData file" << std::endl;
-      MSDataMerger msdMerged(msdVector);
-      msdMerged.id = msdMerged.run.id = "consensus_spectra";
-      msdMerged.softwarePtrs.push_back(softwarePtr);
-
-      SpectrumListSimplePtr writeSpectra(new SpectrumListSimple);
-      writeSpectra->dp = dpPtr;
-      
-      std::sort(mergedSpectra->spectra.begin(), mergedSpectra->spectra.end(), SpectrumHandler::lessScannr);
-      
-      size_t idx = 0;
-      BOOST_FOREACH (SpectrumPtr& s, mergedSpectra->spectra) {
-        s->index = idx;
-        writeSpectra->spectra.push_back(s);
-        if (++idx >= maxConsensusSpectraPerFile_) break;
-      }
-
-      msdMerged.run.spectrumListPtr = writeSpectra;
+    if (writeError.empty()) {
+      try {
+        mergedSpectra->spectra.insert(mergedSpectra->spectra.end(),
+            bin->mergedSpectra->spectra.begin(), bin->mergedSpectra->spectra.end());
+        bin->mergedSpectra.reset();
+        
+        while (mergedSpectra->size() > maxConsensusSpectraPerFile_
+            || (mergedSpectra->size() > 0u && clusterBin == numClusterBins_ - 1)) {
+          std::cerr << "Creating merged MSData file" << std::endl;
+          MSDataMerger msdMerged(sourceMsDataPtrs_);
+          msdMerged.id = msdMerged.run.id = "consensus_spectra";
+          msdMerged.softwarePtrs.push_back(softwarePtr);
+
+          SpectrumListSimplePtr writeSpectra(new SpectrumListSimple);
+          writeSpectra->dp = dpPtr;
+          
+          std::sort(mergedSpectra->spectra.begin(), mergedSpectra->spectra.end(), SpectrumHandler::lessScannr);
+          
+          size_t idx = 0;
+          BOOST_FOREACH (SpectrumPtr& s, mergedSpectra->spectra) {
+            s->index = idx;
+            writeSpectra->spectra.push_back(s);
+            if (++idx >= maxConsensusSpectraPerFile_) break;
+          }
 
-      std::string partSpecOutFN = getPartFN(spectrumOutFN_, "part" +
-          boost::lexical_cast<std::string>(++partIdx));
-      writeMSData(msdMerged, partSpecOutFN);
+          msdMerged.run.spectrumListPtr = writeSpectra;
 
-      mergedSpectra->spectra.erase(mergedSpectra->spectra.begin(), mergedSpectra->spectra.begin() + idx);
-    }
-    msdVector.clear();
-  }
-}
+          std::string partSpecOutFN = getPartFN(spectrumOutFN_, "part" +
+              boost::lexical_cast<std::string>(++partIdx));
+          writeMSData(msdMerged, partSpecOutFN);
 
-void MSFileMerger::mergeSpectraBin(size_t clusterBin, std::vector<MSDataPtr>& msdVector,
-    SpectrumListSimplePtr mergedSpectra) {
-  {
-    for (unsigned int i = 0; i < numBatches_; ++i) {
-      std::string partSpecOutFN = getPartFN(spectrumOutFN_, "part" +
-            boost::lexical_cast<std::string>(clusterBin) + "_" +
-            boost::lexical_cast<std::string>(i) + "_tmpfile");
-      MSDataPtr msd(new MSDataFile(partSpecOutFN));
-      msdVector.push_back(msd);
-    }
-
-    std::vector< std::vector<MergeScanIndex> > scanIndices(numBatches_);
-    std::vector< std::pair< std::vector<SpectrumPtr>, ScanId> > spectra;
-
-    for (unsigned int i = 0; i < combineSets_.size(); ++i) {
-      if (getClusterBin(combineSets_[i].mergedScanId) == clusterBin) {
-        unsigned int posInCluster = 0;
-        BOOST_FOREACH (ScanId scannr, combineSets_[i].scans) {
-          unsigned int fileIdx = fileList_.getFileIdx(scannr);
-          //std::cerr << scannr << " " << i << " " << fileIdx << std::endl;
-          SpectrumListPtr sl = msdVector[fileIdx / numMSFilePtrsPerBatch_]->run.spectrumListPtr;
-          size_t result = getSpectrumIdxFromScannr(sl, hash_value(scannr));
-          if (result >= sl->size()) {
-            std::cerr << "  Warning: index " << result << " out of bounds: "
-                  << fileList_.getFilePath(scannr) << ": " << scannr << std::endl;
-          } else {
-            scanIndices[fileIdx / numMSFilePtrsPerBatch_].push_back( MergeScanIndex(result, posInCluster, spectra.size()) );
-            ++posInCluster;
-          }
+          mergedSpectra->spectra.erase(mergedSpectra->spectra.begin(), mergedSpectra->spectra.begin() + idx);
         }
-        // initialize container for spectra to be merged for mergedScanId
-        spectra.push_back(std::make_pair(std::vector<SpectrumPtr>(posInCluster), combineSets_[i].mergedScanId));
+      } catch (std::exception& e) {
+        writeError = e.what();
       }
     }
+    size_t numSpectra = bin->numSpectra;
+    bin.reset();
+    budget.release(numSpectra);
+  }
+}
 
-    std::cerr << "  Processing consensus spectra." << std::endl;
-    for (unsigned int j = 0; j < numBatches_; ++j) {
-      std::cerr << "  Batch " << j+1 << "/" << numBatches_ << std::endl;
-      SpectrumListPtr sl = msdVector[j]->run.spectrumListPtr;
-      std::sort(scanIndices[j].begin(), scanIndices[j].end(), lessIndex);
-      BOOST_FOREACH (MergeScanIndex msi, scanIndices[j]) {
-        SpectrumPtr s = sl->spectrum(msi.spectrumIndex, true);
-        spectra[msi.mergeIdx].first[msi.posInCluster] = s;
+void MSFileMerger::writeClusterBins(unsigned int batchIdx,
+    std::vector<SpectrumListSimplePtr>& spectrumLists) {
+  std::string writeError;
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < static_cast<int>(numClusterBins_); ++i) {
+    // bins without spectra still get an empty file, which the reader accepts
+    SpectrumSpoolWriter spoolWriter;
+    bool success = spoolWriter.open(getSpectraBinFN(i, batchIdx));
+    if (success) {
+      BOOST_FOREACH (SpectrumPtr& s, spectrumLists[i]->spectra) {
+        spoolSpectrum(s, spoolWriter);
       }
+      success = spoolWriter.close();
     }
-    std::cerr << "  Merging spectra" << std::endl;
-  #pragma omp parallel for schedule(dynamic, 100)
-    for (int k = 0; k < static_cast<int>(spectra.size()); ++k) {
-      if (spectra[k].first.size() > 0) {
-        mergeSpectraSetMSCluster(spectra[k].first, spectra[k].second, mergedSpectra);
+    spectrumLists[i]->spectra.clear();
+    if (!success) {
+    #pragma omp critical (write_error)
+      {
+        writeError = getSpectraBinFN(i, batchIdx);
       }
     }
   }
+  if (!writeError.empty()) {
+    throw MyException("Error: could not write split spectrum file " + writeError);
+  }
+}
 
-  for (unsigned int i = 0; i < numBatches_; ++i) {
-    std::string partSpecOutFN = getPartFN(spectrumOutFN_, "part" +
-          boost::lexical_cast<std::string>(clusterBin) + "_" +
-          boost::lexical_cast<std::string>(i) + "_tmpfile");
-    if (remove(partSpecOutFN.c_str()) != 0) {
-      std::cerr << "Warning: Can't remove " << partSpecOutFN << ": "
-                << strerror(errno) << std::endl;
-    }
+void MSFileMerger::spoolSpectrum(SpectrumPtr s, 
+    SpectrumSpoolWriter& spoolWriter) {
+  std::vector<MassChargeCandidate> mccs;
+  SpectrumHandler::getMassChargeCandidates(s, mccs);
+  
+  double retentionTime = -1.0;
+  if (s->scanList.scans.size() > 0 && 
+      s->scanList.scans.back().hasCVParam(pwiz::cv::MS_scan_start_time)) {
+    retentionTime = s->scanList.scans.back().cvParam(pwiz::cv::MS_scan_start_time).timeInSeconds();
+  }
+  
+  pwiz::msdata::BinaryDataArrayPtr mzArray = s->getMZArray();
+  pwiz::msdata::BinaryDataArrayPtr intensityArray = s->getIntensityArray();
+  if (mzArray.get() && intensityArray.get()) {
+    spoolWriter.write(SpectrumHandler::getScannr(s), retentionTime, mccs, 
+                      mzArray->data, intensityArray->data);
+  } else {
+    spoolWriter.write(SpectrumHandler::getScannr(s), retentionTime, mccs, 
+                      std::vector<double>(), std::vector<double>());
   }
 }
 
-void MSFileMerger::writeClusterBins(unsigned int batchIdx,
-    std::vector<MSDataPtr>& msDataPtrs, std::vector<SpectrumListSimplePtr>& spectrumLists) {
-#pragma omp parallel for schedule(dynamic, 1)
-  for (int i = 0; i < static_cast<int>(numClusterBins_); ++i) {
-    if (spectrumLists[i]->spectra.size() == 0) {
-      continue; // in case there are so few spectra that not all bins are filled
-    }
-    
-    size_t idx = 0;
-    BOOST_FOREACH (SpectrumPtr& s, spectrumLists[i]->spectra) {
-      s->index = idx++;
-    }
-    
-    MSDataMerger msdMerged(msDataPtrs);
-    //MSData msdMerged;
-    msdMerged.id = msdMerged.run.id = "merged_spectra";
-    msdMerged.run.spectrumListPtr = spectrumLists[i];
-    //msdMerged.dataProcessingPtrs = dataProcessingPtrs_;
-    //msdMerged.instrumentConfigurationPtrs = instrumentConfigurationPtrs_;
-
-    std::string partSpecOutFN = getPartFN(spectrumOutFN_, "part" +
-          boost::lexical_cast<std::string>(i) + "_" +
-          boost::lexical_cast<std::string>(batchIdx) + "_tmpfile");
-
-    writeMSData(msdMerged, partSpecOutFN);
+/* Only the meta data that is kept in the spool is restored, the consensus 
+   spectra are based on these spectra. */
+SpectrumPtr MSFileMerger::unspoolSpectrum(const SpectrumSpoolEntry& entry) {
+  SpectrumPtr s(new pwiz::msdata::Spectrum);
+  SpectrumHandler::setScannr(s, entry.header->scannr);
+  s->set(pwiz::cv::MS_ms_level, 2);
+  s->set(pwiz::cv::MS_MSn_spectrum);
+  s->set(pwiz::cv::MS_centroid_spectrum);
+  
+  s->scanList.scans.push_back(pwiz::msdata::Scan());
+  if (entry.header->retentionTime >= 0.0) {
+    s->scanList.scans.back().set(pwiz::cv::MS_scan_start_time, 
+        entry.header->retentionTime, pwiz::cv::UO_second);
+  }
+  
+  std::vector<MassChargeCandidate> mccs;
+  for (unsigned int i = 0; i < entry.header->numMccs; ++i) {
+    mccs.push_back(MassChargeCandidate(entry.mccs[i].charge, 
+        entry.mccs[i].precMz, entry.mccs[i].mass));
   }
+  s->precursors.push_back(pwiz::msdata::Precursor());
+  SpectrumHandler::setMassChargeCandidates(s, mccs);
+  
+  std::vector<double> mzs(entry.mzs, entry.mzs + entry.header->numPeaks);
+  std::vector<double> intensities(entry.intensities, 
+      entry.intensities + entry.header->numPeaks);
+  s->setMZIntensityArrays(mzs, intensities, pwiz::cv::MS_number_of_detector_counts);
+  return s;
 }
 
 } /* namespace maracluster */
@@ -28,11 +28,17 @@
 #include "pwiz/data/msdata/MSDataMerger.hpp"
 #include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include "Globals.h"
 #include "MSFileHandler.h"
 #include "MSClusterMerge.h"
 #include "ScanId.h"
+#include "SpectrumSpool.h"
+#include "StageProfiler.h"
 
 namespace maracluster {
 
@@ -42,12 +48,110 @@ struct MergeScanIndex {
   unsigned int spectrumIndex, posInCluster, mergeIdx;
 };
 
+typedef boost::shared_ptr<SpectrumSpoolReader> SpectrumSpoolReaderPtr;
+
+/* A cluster bin passing through the consensus pipeline: its spectra are 
+   decoded by the loader thread, merged by the calling thread and written by
+   the writer thread. Clusters of at least minStreamingClusterSize_ spectra
+   are not decoded, but are merged directly from the spool entries, which 
+   stay valid as long as spoolReaders are open. */
+struct MergeBinData {
+  MergeBinData(size_t _clusterBin, size_t _numSpectra) : 
+    clusterBin(_clusterBin), numSpectra(_numSpectra) {}
+  size_t clusterBin, numSpectra;
+  std::vector< std::pair< std::vector<pwiz::msdata::SpectrumPtr>, ScanId> > spectra;
+  std::vector< std::pair< std::vector<SpectrumSpoolEntry>, ScanId> > spooledSpectra;
+  std::vector<SpectrumSpoolReaderPtr> spoolReaders;
+  pwiz::msdata::SpectrumListSimplePtr mergedSpectra;
+  std::string error;
+};
+typedef boost::shared_ptr<MergeBinData> MergeBinDataPtr;
+
+/* Hands over cluster bins between two pipeline stages in order of their
+   cluster bin index. After close(), pop() returns an empty pointer instead
+   of waiting for bins that will never arrive. */
+class MergeBinQueue {
+ public:
+  MergeBinQueue() : closed_(false) {}
+  
+  void push(MergeBinDataPtr bin) {
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_[bin->clusterBin] = bin;
+    available_.notify_one();
+  }
+  
+  MergeBinDataPtr pop(size_t clusterBin) {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<size_t, MergeBinDataPtr>::iterator it;
+    while ((it = pending_.find(clusterBin)) == pending_.end()) {
+      if (closed_) return MergeBinDataPtr();
+      available_.wait(lock);
+    }
+    MergeBinDataPtr bin = it->second;
+    pending_.erase(it);
+    return bin;
+  }
+  
+  void close() {
+    boost::mutex::scoped_lock lock(mutex_);
+    closed_ = true;
+    available_.notify_all();
+  }
+  
+ protected:
+  bool closed_;
+  std::map<size_t, MergeBinDataPtr> pending_;
+  boost::mutex mutex_;
+  boost::condition_variable available_;
+};
+
+/* Limits the number of input spectra held by the pipeline. A bin is always
+   admitted if the pipeline is empty, so that bins larger than the budget 
+   are still processed, one at a time. reserve() returns false once the 
+   budget is closed. */
+class SpectrumBudget {
+ public:
+  SpectrumBudget(size_t maxSpectra) : maxSpectra_(maxSpectra), 
+    numSpectra_(0u), closed_(false) {}
+  
+  bool reserve(size_t numSpectra) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!closed_ && numSpectra_ > 0u && 
+           numSpectra_ + numSpectra > maxSpectra_) {
+      released_.wait(lock);
+    }
+    if (closed_) return false;
+    numSpectra_ += numSpectra;
+    return true;
+  }
+  
+  void release(size_t numSpectra) {
+    boost::mutex::scoped_lock lock(mutex_);
+    numSpectra_ -= numSpectra;
+    released_.notify_all();
+  }
+  
+  void close() {
+    boost::mutex::scoped_lock lock(mutex_);
+    closed_ = true;
+    released_.notify_all();
+  }
+  
+ protected:
+  size_t maxSpectra_, numSpectra_;
+  bool closed_;
+  boost::mutex mutex_;
+  boost::condition_variable released_;
+};
+
 class MSFileMerger : public MSFileHandler {
  public:
   static int mergeMethod_;
   static bool normalize_;
   static int maxMSFilePtrs_, maxSpectraPerFile_;
   static unsigned int maxConsensusSpectraPerFile_;
+  static unsigned int maxSpectraInPipeline_;
+  static unsigned int minStreamingClusterSize_;
 
   MSFileMerger(std::string& spectrumOutFN) :
     numClusterBins_(0), numBatches_(0),
@@ -71,6 +175,8 @@ class MSFileMerger : public MSFileHandler {
     const MergeScanIndex& b) { return (a.spectrumIndex < b.spectrumIndex); }
  protected:
   unsigned int numClusterBins_, numBatches_, numMSFilePtrsPerBatch_;
+  /* input files without spectra, to propagate meta data to the consensus files */
+  std::vector<pwiz::msdata::MSDataPtr> sourceMsDataPtrs_;
 
   void mergeTwoSpectra(
       std::vector<MZIntensityPair>& mziPairsIn,
@@ -82,13 +188,47 @@ class MSFileMerger : public MSFileHandler {
   void mergeSpectraSetMSCluster(
       std::vector<pwiz::msdata::SpectrumPtr>& spectra,
       ScanId scannr, pwiz::msdata::SpectrumListSimplePtr mergedSpectra);
+  void mergeSpooledSpectraSetMSCluster(
+      const std::vector<SpectrumSpoolEntry>& entries,
+      ScanId scannr, pwiz::msdata::SpectrumListSimplePtr mergedSpectra);
+  
+  void addToConsensus(std::vector<MZIntensityPair>& mziPairs,
+      ConsensusAccumulator& accumulator);
+  void addToConsensus(pwiz::msdata::SpectrumPtr s,
+      ConsensusAccumulator& accumulator, 
+      std::vector<MassChargeCandidate>& allMccs);
+  void addToConsensus(const SpectrumSpoolEntry& entry,
+      ConsensusAccumulator& accumulator, 
+      std::vector<MassChargeCandidate>& allMccs);
+  void finalizeConsensus(pwiz::msdata::SpectrumPtr consensusSpec,
+      ConsensusAccumulator& accumulator, 
+      std::vector<MassChargeCandidate>& allMccs,
+      ScanId scannr, pwiz::msdata::SpectrumListSimplePtr mergedSpectra);
+
+  MergeBinDataPtr loadSpectraBin(size_t clusterBin,
+    const std::vector<unsigned int>& combineSetIdxs);
+  void mergeSpectraBin(MergeBinData& bin);
+  void removeSpectraBinFiles(size_t clusterBin);
 
-  void mergeSpectraBin(size_t clusterBin, 
-    std::vector<pwiz::msdata::MSDataPtr>& msdVector,
-    pwiz::msdata::SpectrumListSimplePtr mergedSpectra);
+  void loadSpectraBins(
+    const std::vector< std::vector<unsigned int> >& binCombineSetIdxs,
+    MergeBinQueue& loadedBins, SpectrumBudget& budget);
+  void writeSpectraBins(MergeBinQueue& mergedBins, SpectrumBudget& budget,
+    std::string& writeError);
 
   void mergeSplitSpecFiles();
   
+  inline std::string getSpectraBinFN(size_t clusterBin, size_t batchIdx) {
+    return spectrumOutFN_ + ".part" + 
+        boost::lexical_cast<std::string>(clusterBin) + "_" +
+        boost::lexical_cast<std::string>(batchIdx) + ".spool";
+  }
+  
+  static void spoolSpectrum(pwiz::msdata::SpectrumPtr s, 
+    SpectrumSpoolWriter& spoolWriter);
+  static pwiz::msdata::SpectrumPtr unspoolSpectrum(
+    const SpectrumSpoolEntry& entry);
+  
   inline size_t calcNumBatches(size_t total, size_t batchSize) {
     return (total - 1u) / batchSize + 1u;
   }
@@ -101,7 +241,6 @@ class MSFileMerger : public MSFileHandler {
     std::map<ScanId, ScanId>& scannrToMergedScannr);
 
   void writeClusterBins(unsigned int batchIdx,
-    std::vector<pwiz::msdata::MSDataPtr>& msDataPtrs,
     std::vector<pwiz::msdata::SpectrumListSimplePtr>& spectrumListPtrMap);
 };
 
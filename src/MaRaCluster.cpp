@@ -23,11 +23,13 @@ MaRaCluster::MaRaCluster() :
     peakCountFN_(""), datFNFile_(""), 
     scanInfoFN_(""), pvaluesFN_(""), clusterFileFN_(""),
     pvalVecInFileFN_(""), pvalueVectorsBaseFN_(""), overlapBatchFileFN_(""), 
-    spectrumBatchFileFN_(""), spectrumInFN_(""), spectrumOutFN_(""),
-    spectrumLibraryFN_(""), matrixFN_(""), resultTreeFN_(""),
-    skipFilterAndSort_(false), writeAll_(false), precursorTolerance_(20),
+    spectrumBatchFileFN_(""), newSpectrumBatchFileFN_(""), spectrumInFN_(""), spectrumOutFN_(""),
+    spectrumLibraryFN_(""), libraryIndexFN_(""), socketFN_(""), manifestFN_(""), runReportFN_(""), matrixFN_(""), resultTreeFN_(""),
+    skipFilterAndSort_(false), writeAll_(false), freezePeakCounts_(false), precursorTolerance_(20),
     precursorToleranceDa_(false), dbPvalThreshold_(-5.0), 
-    chargeUncertainty_(0), minConsensusClusterSize_(1u)
+    chargeUncertainty_(0), minConsensusClusterSize_(1u), pvalMemoryMB_(0.0),
+    fingerprintFilterCutoff_(-1.0), topK_(10u), queryChunkSize_(100u), binaryOutput_(false), 
+    numServeWorkers_(4u)
 {
   boost::filesystem::path outputPath = boost::filesystem::current_path() / boost::filesystem::path("maracluster_output");
   outputFolder_ = outputPath.string();
@@ -72,6 +74,24 @@ bool MaRaCluster::parseOptions(int argc, char **argv) {
   intro << "    where msfile_list is a flat text file with absolute paths\n";
   intro << "    to the spectrum files to be clustered, one on each line.\n";
   intro << std::endl;
+  intro << "  Alternatively, to distribute the p-value calculations over multiple nodes:\n";
+  intro << "  maracluster plan -b <msfile_list> -f <shared_output_folder>\n";
+  intro << "  maracluster worker -f <shared_output_folder>    (on each node)\n";
+  intro << "  maracluster cluster -b <msfile_list> -f <shared_output_folder>\n";
+  intro << std::endl;
+  intro << "  To add new spectrum files to the clustering of a batch run that was\n";
+  intro << "  started with --keepPvalueVectors, without recomputing all pairs:\n";
+  intro << "  maracluster update -b <msfile_list> --newFiles <new_msfile_list> [-f <output_folder>]\n";
+  intro << std::endl;
+  intro << "  To search against a spectral library repeatedly, index it once:\n";
+  intro << "  maracluster build-library -z <library_file> --libraryIndex <index_file>\n";
+  intro << "  maracluster search -b <msfile_list> --libraryIndex <index_file>\n";
+  intro << "  or stream binary query spectrum records, e.g. from the index mode,\n";
+  intro << "  and report the best library hits of each query:\n";
+  intro << "  maracluster search-stream --libraryIndex <index_file> [-i <spectrum_records>]\n";
+  intro << "  or answer search requests on a Unix domain socket:\n";
+  intro << "  maracluster serve --libraryIndex <index_file> --socket <socket_file>\n";
+  intro << std::endl;
   
   // init
   CommandLineParser cmd(intro.str());
@@ -178,6 +198,95 @@ bool MaRaCluster::parseOptions(int argc, char **argv) {
       "lib",
       "File readable by ProteoWizard (e.g. ms2, mzML) with spectral library",
       "filename");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "libraryIndex",
+      "Library index written by the build-library mode. The search mode uses this index instead of the -z/--lib spectral library (default for build-library: <output_folder>/<prefix>.library_index.dat).",
+      "filename");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "topK",
+      "Number of best library hits reported per query spectrum by the search-stream mode (default: 10).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "queryChunkSize",
+      "Maximum number of query spectra read at a time by the search-stream mode, results are written after each chunk. Smaller chunks are scored when no further queries are available yet (default: 100).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "binaryOutput",
+      "Write the results of the search-stream mode as binary p-value records instead of tab separated text.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "socket",
+      "Unix domain socket on which the serve mode answers search requests (default: <output_folder>/<prefix>.sock).",
+      "filename");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "serveWorkers",
+      "Number of connections the serve mode handles concurrently (default: 4).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "calibrateBinCosts",
+      "Measure the computation time of p-value vectors and p-value pairs on this machine to decide the sizes of the precursor m/z bins, instead of using fixed estimates.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "binCpuMinutes",
+      "Target computation time for the p-values of a precursor m/z bin in CPU minutes (default: 120).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "binMemoryMB",
+      "Maximum memory for the p-value vectors of a precursor m/z bin in megabytes, 0 means no limit (default: 0).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "pvalMemoryMB",
+      "Memory budget in megabytes for the p-values of a precursor m/z bin during clustering. P-values exceeding the budget are temporarily written to disk, 0 means fixed job sizes (default: 0).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "fingerprintFilter",
+      "Only calculate p-values for spectrum pairs whose Tanimoto similarity of their top fragment peak bins is at least this value. Recall and the number of eliminated pairs are reported with -v 2 or higher, -1 means no filtering (default: -1).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "keepPvalueVectors",
+      "Keep the p-value vectors of all spectra in the output folder, which the update mode needs to add new spectrum files to the clustering later.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "newFiles",
+      "File with spectrum files to be added by the update mode to the clustering of the spectrum files in -b/--batch, one per line.",
+      "filename");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "freezePeakCounts",
+      "Calculate the p-value vectors of the new spectra in the update mode with the peak counts of the previous run, instead of adding the peak counts of the new spectrum files to them.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "runReport",
+      "Write a JSON report with the wall time, CPU time, bytes read and written, peak memory usage and number of processed items of each stage of the run to this file.",
+      "filename");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "threads",
+      "Number of threads (default: OpenMP default, i.e. OMP_NUM_THREADS or the number of cores).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "numaNodes",
+      "Distribute the threads and the p-value vectors over this many NUMA nodes (sockets), such that the p-values of a batch of p-value vectors are calculated on the node that holds them in memory, 0 means all nodes (default: 1).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "pinThreads",
+      "Pin each thread to a single CPU of its NUMA node, instead of letting it move between the CPUs of the node.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "progress",
+      "Write the progress of the run as newline-delimited JSON events, with the current stage, processed and total items, throughput, estimated time remaining and memory usage. Either a file descriptor number, unix:<path> for a Unix domain socket that is listening for the events, or a file name.",
+      "target");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "progressInterval",
+      "Minimum number of seconds between two progress events of --progress (default: 1).",
+      "int");
+  cmd.defineOption("J",
+      "jobManifest",
+      "Job manifest written by the plan mode and read by the worker and cluster modes (default: <output_folder>/<prefix>.job_manifest.tsv).",
+      "filename");
       
   // finally parse and handle return codes (display help etc...)
   cmd.parseArgs(argc, argv);
@@ -194,6 +303,14 @@ bool MaRaCluster::parseOptions(int argc, char **argv) {
     else if (mode == "search") mode_ = SEARCH;
     else if (mode == "profile-consensus") mode_ = PROFILE_CONSENSUS;
     else if (mode == "profile-search") mode_ = PROFILE_SEARCH;
+    else if (mode == "profile-fingerprint") mode_ = PROFILE_FINGERPRINT;
+    else if (mode == "profile-merge") mode_ = PROFILE_MERGE;
+    else if (mode == "plan") mode_ = PLAN;
+    else if (mode == "worker") mode_ = WORKER;
+    else if (mode == "build-library") mode_ = BUILD_LIBRARY;
+    else if (mode == "search-stream") mode_ = SEARCH_STREAM;
+    else if (mode == "serve") mode_ = SERVE;
+    else if (mode == "update") mode_ = UPDATE;
     else {
       std::cerr << "Error: Unknown mode: " << mode << std::endl;
       std::cerr << "Invoke with -h option for help" << std::endl;
@@ -239,6 +356,37 @@ bool MaRaCluster::parseOptions(int argc, char **argv) {
   
   // file input option for maracluster search
   if (cmd.optionSet("lib")) spectrumLibraryFN_ = cmd.options["lib"];
+  if (cmd.optionSet("libraryIndex")) libraryIndexFN_ = cmd.options["libraryIndex"];
+  if (cmd.optionSet("topK")) topK_ = cmd.getInt("topK", 1, 100000);
+  if (cmd.optionSet("queryChunkSize")) queryChunkSize_ = cmd.getInt("queryChunkSize", 1, 10000000);
+  if (cmd.optionSet("binaryOutput")) binaryOutput_ = true;
+  if (cmd.optionSet("socket")) socketFN_ = cmd.options["socket"];
+  if (cmd.optionSet("serveWorkers")) numServeWorkers_ = cmd.getInt("serveWorkers", 1, 1024);
+  
+  // precursor bin sizing for maracluster batch, index and plan
+  if (cmd.optionSet("calibrateBinCosts")) binCostModel_.setCalibrate(true);
+  if (cmd.optionSet("binCpuMinutes")) binCostModel_.setMaxCpuMinutes(cmd.getDouble("binCpuMinutes", 0.1, 1e6));
+  if (cmd.optionSet("binMemoryMB")) binCostModel_.setMaxMemoryMB(cmd.getDouble("binMemoryMB", 0.0, 1e9));
+  
+  if (cmd.optionSet("pvalMemoryMB")) pvalMemoryMB_ = cmd.getDouble("pvalMemoryMB", 0.0, 1e9);
+  if (cmd.optionSet("fingerprintFilter")) fingerprintFilterCutoff_ = cmd.getDouble("fingerprintFilter", -1.0, 1.0);
+  
+  // file input/output option for maracluster plan, worker and cluster
+  if (cmd.optionSet("jobManifest")) manifestFN_ = cmd.options["jobManifest"];
+  
+  // options for maracluster update, and for batch and plan runs to be updated later
+  if (cmd.optionSet("keepPvalueVectors")) writeAll_ = true;
+  if (cmd.optionSet("newFiles")) newSpectrumBatchFileFN_ = cmd.options["newFiles"];
+  if (cmd.optionSet("freezePeakCounts")) freezePeakCounts_ = true;
+  
+  if (cmd.optionSet("runReport")) runReportFN_ = cmd.options["runReport"];
+  if (cmd.optionSet("progressInterval")) ProgressReporter::setInterval(cmd.getInt("progressInterval", 1, 3600));
+  if (cmd.optionSet("progress") && !ProgressReporter::open(cmd.options["progress"])) return false;
+  
+  // thread count and placement
+  int numThreads = cmd.optionSet("threads") ? cmd.getInt("threads", 1, 65536) : 0;
+  int numNumaNodes = cmd.optionSet("numaNodes") ? cmd.getInt("numaNodes", 0, 1024) : 1;
+  if (!ThreadPlacement::init(numThreads, numNumaNodes, cmd.optionSet("pinThreads"))) return false;
   
   // general options
   if (cmd.optionSet("pvalThreshold")) dbPvalThreshold_ = cmd.getDouble("pvalThreshold", -1000.0, 0.0);
@@ -300,6 +448,7 @@ int MaRaCluster::mergeSpectra() {
     return EXIT_FAILURE;
   }
   
+  ScopedStageTimer timer("consensus");
   MSFileMerger msFileMerger(spectrumOutFN_);
   
   std::cerr << "Parsing cluster file" << std::endl;
@@ -330,9 +479,12 @@ int MaRaCluster::createIndex() {
   fileList.initFromFile(spectrumBatchFileFN_);
   
   if (!Globals::fileExists(datFNFile_) || !Globals::fileExists(scanInfoFN_)) {    
+    ScopedStageTimer timer("index");
     SpectrumFiles spectrumFiles(outputFolder_, chargeUncertainty_);
+    spectrumFiles.setBinCostModel(binCostModel_);
     spectrumFiles.splitByPrecursorMz(fileList, datFNFile_, peakCountFN_, 
         scanInfoFN_, precursorTolerance_, precursorToleranceDa_);
+    binCostModel_ = spectrumFiles.getBinCostModel();
   } else {
     std::cerr << "Read dat-files from " << datFNFile_ << 
         " and scan numbers from " << scanInfoFN_ <<
@@ -365,6 +517,7 @@ int MaRaCluster::doClustering(const std::vector<std::string> pvalFNs,
     std::cerr << "Starting p-value clustering." << std::endl;
     
     if (!Globals::fileExists(matrixFN_)) {
+      ScopedStageTimer timer("filter_and_sort");
       bool tsvInput = false;
       PvalueFilterAndSort::filterAndSort(pvalFNs, matrixFN_, tsvInput);
     } else {
@@ -372,6 +525,7 @@ int MaRaCluster::doClustering(const std::vector<std::string> pvalFNs,
           " . Remove this file to re-sort and filter the p-values." << std::endl;
     }
     
+    ScopedStageTimer timer("clustering");
     SparseClustering matrix;
     matrix.setMergeOffset(fileList.getMergeOffset());
     matrix.initMatrix(matrixFN_);
@@ -385,17 +539,667 @@ int MaRaCluster::doClustering(const std::vector<std::string> pvalFNs,
   pvalTreeFNs.push_back(resultTreeFN_);
   
   // write clusters
+  ScopedStageTimer timer("print_clusters");
   SpectrumClusters clustering;
   clustering.printClusters(pvalTreeFNs, clusterThresholds_, fileList, scanInfoFN_, clusterBaseFN);
   
   return EXIT_SUCCESS;
 }
 
+void MaRaCluster::processPrecursorBin(const std::string& datFN) {
+  std::string pvalueVectorsBaseFN = datFN + ".pvalue_vectors";
+  std::string pvaluesFN = datFN + ".pvalues.dat";
+  std::string pvalueTreeFN = datFN + ".pvalue_tree.tsv";
+  
+  if (!Globals::fileExists(pvalueTreeFN)) {
+    PvalueVectors pvecs(pvaluesFN, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+    {
+      ScopedStageTimer timer("pvalues/vectors");
+      Spectra spectra;
+      spectra.readBatchSpectra(datFN);
+      spectra.sortSpectraByPrecMz();
+      
+      PeakCounts peakCounts;
+      peakCounts.readFromFile(peakCountFN_);
+      pvecs.calculatePvalueVectors(spectra.getSpectra(), peakCounts);
+      pvecs.writePvalueVectors(pvalueVectorsBaseFN, writeAll_);
+      timer.addItems(pvecs.getPvalueVectors().size());
+    }
+    ScopedStageTimer timer("pvalues/scoring_and_clustering");
+    timer.addItems(pvecs.getPvalueVectors().size());
+    pvecs.setPvalMemoryBudget(pvalMemoryMB_);
+    pvecs.setFingerprintFilter(fingerprintFilterCutoff_);
+    pvecs.batchCalculateAndClusterPvalues(pvalueTreeFN, scanInfoFN_);
+  } else {
+    std::cerr << "Using p-value tree from " << pvalueTreeFN <<
+        ". Remove this file to generate a new p-value tree." << std::endl;
+  }
+}
+
+/* Creates one "pvalue" job per precursor bin and one "overlap" job per pair
+   of consecutive bins, the latter depending on the tail and head p-value 
+   vector files of the two former. */
+int MaRaCluster::writeJobManifest() {
+  if (Globals::fileExists(manifestFN_)) {
+    std::cerr << "Using job manifest from " << manifestFN_ << 
+        ". Remove this file to generate a new job manifest." << std::endl;
+    return EXIT_SUCCESS;
+  }
+  
+  int error = createIndex();
+  if (error != EXIT_SUCCESS) return EXIT_FAILURE;
+  
+  std::vector<std::string> datFNs;
+  {
+    SpectrumFiles spectrumFiles(outputFolder_, chargeUncertainty_);
+    spectrumFiles.readDatFNsFromFile(datFNFile_, datFNs);
+  }
+  
+  if (datFNs.empty()) {
+    std::cerr << "Error: could not find any ms2 spectra in the input files." << std::endl;
+    return EXIT_FAILURE;
+  }
+  
+  JobManifest manifest(manifestFN_);
+  manifest.setParameter("peak_counts", peakCountFN_);
+  manifest.setParameter("scan_info", scanInfoFN_);
+  manifest.setParameter("precursor_tolerance", precursorTolerance_);
+  manifest.setParameter("precursor_tolerance_da", precursorToleranceDa_ ? 1 : 0);
+  manifest.setParameter("pval_threshold", dbPvalThreshold_);
+  manifest.setParameter("keep_pvalue_vectors", writeAll_ ? 1 : 0);
+  binCostModel_.addToManifest(manifest);
+  
+  addPrecursorBinJobs(datFNs, manifest);
+  
+  if (!manifest.write()) return EXIT_FAILURE;
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Wrote " << manifest.getJobs().size() << 
+        " jobs to job manifest " << manifestFN_ << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* Precursor bins without spectra have no dat-file and get no jobs, the 
+   overlap jobs pair each remaining bin with the next remaining bin. */
+void MaRaCluster::addPrecursorBinJobs(const std::vector<std::string>& datFNs,
+    JobManifest& manifest) {
+  size_t prevBinIdx = 0u;
+  bool hasPrevBin = false;
+  for (size_t i = 0; i < datFNs.size(); ++i) {
+    if (!Globals::fileExists(datFNs[i])) {
+      std::cerr << "Ignoring missing data file " << datFNs[i] << std::endl;
+      continue;
+    }
+    
+    ManifestJob job;
+    job.name = "pvalue_" + boost::lexical_cast<std::string>(i);
+    job.type = "pvalue";
+    job.files.push_back(datFNs[i]);
+    manifest.addJob(job);
+    
+    if (hasPrevBin) {
+      ManifestJob overlapJob;
+      overlapJob.name = "overlap_" + boost::lexical_cast<std::string>(prevBinIdx);
+      overlapJob.type = "overlap";
+      overlapJob.dependencies.push_back("pvalue_" + boost::lexical_cast<std::string>(prevBinIdx));
+      overlapJob.dependencies.push_back(job.name);
+      overlapJob.files.push_back(datFNs[prevBinIdx] + ".pvalue_vectors.tail.dat");
+      overlapJob.files.push_back(datFNs[i] + ".pvalue_vectors.head.dat");
+      overlapJob.files.push_back(outputFolder_ + "/overlap_" + 
+                          boost::lexical_cast<std::string>(prevBinIdx) + ".pvalues.dat");
+      manifest.addJob(overlapJob);
+    }
+    prevBinIdx = i;
+    hasPrevBin = true;
+  }
+}
+
+bool MaRaCluster::readJobManifest(JobManifest& manifest) {
+  if (!manifest.read()) return false;
+  
+  if (peakCountFN_.empty()) peakCountFN_ = manifest.getParameter("peak_counts");
+  if (scanInfoFN_.empty()) scanInfoFN_ = manifest.getParameter("scan_info");
+  
+  // all workers should use the same settings as the planner
+  if (manifest.hasParameter("precursor_tolerance")) {
+    precursorTolerance_ = atof(manifest.getParameter("precursor_tolerance").c_str());
+    precursorToleranceDa_ = (manifest.getParameter("precursor_tolerance_da") == "1");
+  }
+  if (manifest.hasParameter("pval_threshold")) {
+    dbPvalThreshold_ = atof(manifest.getParameter("pval_threshold").c_str());
+  }
+  if (manifest.getParameter("keep_pvalue_vectors") == "1") writeAll_ = true;
+  return true;
+}
+
+bool MaRaCluster::runJob(const ManifestJob& job) {
+  if (job.type == "pvalue" && job.files.size() == 1u) {
+    // the planner only adds jobs for existing dat-files, so this worker 
+    // probably cannot see the shared file system
+    if (!Globals::fileExists(job.files[0])) {
+      std::cerr << "Error: could not find data file " << job.files[0] << 
+          " of job " << job.name << std::endl;
+      return false;
+    }
+    processPrecursorBin(job.files[0]);
+    return true;
+  } else if (job.type == "overlap" && job.files.size() == 3u) {
+    const std::string& pvaluesFN = job.files[2];
+    if (!Globals::fileExists(pvaluesFN)) {
+      std::vector< std::pair<std::string, std::string> > overlapFNs;
+      overlapFNs.push_back(std::make_pair(job.files[0], job.files[1]));
+      
+      PvalueVectors pvecs(pvaluesFN, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+      pvecs.processOverlapFiles(overlapFNs);
+    } else {
+      std::cerr << "Using p-values from " << pvaluesFN << 
+          ". Remove this file to generate new p-values." << std::endl;
+    }
+    return true;
+  } else {
+    std::cerr << "Error: unknown job type " << job.type << " for job " << 
+        job.name << std::endl;
+    return false;
+  }
+}
+
+/* Keeps claiming runnable jobs until all jobs in the manifest are finished.
+   Several workers, possibly on different nodes, can run simultaneously on
+   the same manifest. */
+int MaRaCluster::runWorker() {
+  JobManifest manifest(manifestFN_);
+  if (!readJobManifest(manifest)) return EXIT_FAILURE;
+  
+  size_t numJobsRun = 0u;
+  while (!manifest.allFinished()) {
+    bool claimedJob = false;
+    BOOST_FOREACH (const ManifestJob& job, manifest.getJobs()) {
+      if (manifest.isRunnable(job) && manifest.claimJob(job)) {
+        if (Globals::VERB > 1) {
+          std::cerr << "Running job " << job.name << std::endl;
+        }
+        if (!runClaimedJob(manifest, job)) return EXIT_FAILURE;
+        claimedJob = true;
+        ++numJobsRun;
+        break;
+      }
+    }
+    
+    if (!claimedJob) {
+      if (Globals::VERB > 2) {
+        std::cerr << "Waiting for jobs of other workers to finish (" << 
+            manifest.numFinished() << "/" << manifest.getJobs().size() << 
+            " finished)" << std::endl;
+      }
+      boost::this_thread::sleep(
+          boost::posix_time::seconds(JobManifest::kPollIntervalSeconds));
+    }
+  }
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "All jobs finished, this worker ran " << numJobsRun << 
+        " jobs." << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* A failed job is put back in the queue, such that another worker, e.g. 
+   one that can see the input files, can retry it. */
+bool MaRaCluster::runClaimedJob(JobManifest& manifest, const ManifestJob& job) {
+  if (!runJob(job)) {
+    std::cerr << "Error: job " << job.name << " failed, releasing it for "
+              << "other workers." << std::endl;
+    manifest.releaseJob(job);
+    return false;
+  }
+  manifest.markFinished(job);
+  return true;
+}
+
+bool MaRaCluster::jobRunnerUnitTest() {
+  boost::filesystem::path testFolder = 
+      boost::filesystem::temp_directory_path() / 
+      boost::filesystem::unique_path("maracluster_jobs_%%%%%%%%");
+  boost::filesystem::create_directories(testFolder);
+  
+  JobManifest manifest((testFolder / "manifest.tsv").string());
+  ManifestJob missingJob;
+  missingJob.name = "pvalue_0";
+  missingJob.type = "pvalue";
+  missingJob.files.push_back((testFolder / "missing.dat").string());
+  manifest.addJob(missingJob);
+  
+  ManifestJob unknownJob;
+  unknownJob.name = "unknown_0";
+  unknownJob.type = "unknown";
+  manifest.addJob(unknownJob);
+  
+  bool success = manifest.write();
+  
+  // a job with a missing input file should fail and return to the queue
+  MaRaCluster maracluster;
+  success = success && manifest.claimJob(missingJob);
+  if (success && maracluster.runClaimedJob(manifest, missingJob)) {
+    std::cout << "Job with a missing data file succeeded." << std::endl;
+    success = false;
+  }
+  if (success && (manifest.isFinished(missingJob) || 
+                  !manifest.claimJob(missingJob))) {
+    std::cout << "Failed job was not released." << std::endl;
+    success = false;
+  }
+  
+  if (success && (!manifest.claimJob(unknownJob) || 
+                  maracluster.runClaimedJob(manifest, unknownJob))) {
+    std::cout << "Job of unknown type succeeded." << std::endl;
+    success = false;
+  }
+  
+  success = success && (manifest.numFinished() == 0u);
+  
+  // an empty precursor bin has no dat-file, the overlap job should skip it
+  std::vector<std::string> datFNs;
+  for (size_t i = 0; i < 3u; ++i) {
+    datFNs.push_back((testFolder / (boost::lexical_cast<std::string>(i) + ".dat")).string());
+    if (i != 1u) {
+      std::ofstream datStream(datFNs.back().c_str());
+      datStream << "spectra";
+    }
+  }
+  JobManifest binManifest((testFolder / "bin_manifest.tsv").string());
+  maracluster.outputFolder_ = testFolder.string();
+  maracluster.addPrecursorBinJobs(datFNs, binManifest);
+  std::vector<ManifestJob>& binJobs = binManifest.getJobs();
+  if (success && (binJobs.size() != 3u || binJobs[0].name != "pvalue_0" || 
+                  binJobs[1].name != "pvalue_2" || binJobs[2].type != "overlap")) {
+    std::cout << "Unexpected jobs for a run with an empty bin." << std::endl;
+    success = false;
+  }
+  if (success && (binJobs[2].dependencies.size() != 2u || 
+                  binJobs[2].dependencies[1] != "pvalue_2" ||
+                  binJobs[2].files[1] != datFNs[2] + ".pvalue_vectors.head.dat")) {
+    std::cout << "Overlap job does not skip the empty bin." << std::endl;
+    success = false;
+  }
+  
+  boost::system::error_code returnedError;
+  boost::filesystem::remove_all(testFolder, returnedError);
+  return success;
+}
+
+int MaRaCluster::gatherJobResults(std::vector<std::string>& pvalFNs, 
+    std::vector<std::string>& pvalTreeFNs) {
+  JobManifest manifest(manifestFN_);
+  if (!readJobManifest(manifest)) return EXIT_FAILURE;
+  
+  if (!manifest.allFinished()) {
+    std::cerr << "Error: only " << manifest.numFinished() << " out of " << 
+        manifest.getJobs().size() << " jobs in " << manifestFN_ << 
+        " have finished." << std::endl;
+    return EXIT_FAILURE;
+  }
+  
+  BOOST_FOREACH (const ManifestJob& job, manifest.getJobs()) {
+    std::string pvaluesFN;
+    if (job.type == "pvalue") {
+      pvaluesFN = job.files[0] + ".pvalues.dat";
+      pvalTreeFNs.push_back(job.files[0] + ".pvalue_tree.tsv");
+    } else if (job.type == "overlap") {
+      pvaluesFN = job.files[2];
+    }
+    if (Globals::fileExists(pvaluesFN)) {
+      pvalFNs.push_back(pvaluesFN);
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/* Trees of the precursor bins of datFNs, the tree of their overlaps and the
+   trees of previous updates, which are stored next to the dat-files of the
+   update. */
+void MaRaCluster::getPvalueTreeFNs(const std::vector<std::string>& datFNs, 
+    std::vector<std::string>& pvalTreeFNs) {
+  std::set<std::string> updateTreeFNs;
+  BOOST_FOREACH (const std::string& datFN, datFNs) {
+    std::string pvalueTreeFN = datFN + ".pvalue_tree.tsv";
+    if (Globals::fileExists(pvalueTreeFN)) {
+      pvalTreeFNs.push_back(pvalueTreeFN);
+    } else {
+      boost::filesystem::path datFolder = boost::filesystem::path(datFN).parent_path();
+      std::string updateTreeFN = (datFolder / "update.pvalue_tree.tsv").string();
+      if (Globals::fileExists(updateTreeFN) && 
+          updateTreeFNs.insert(updateTreeFN).second) {
+        pvalTreeFNs.push_back(updateTreeFN);
+      }
+    }
+  }
+  
+  if (resultTreeFN_.empty()) {
+    resultTreeFN_ = outputFolder_ + "/overlap.pvalue_tree.tsv";
+  }
+  if (Globals::fileExists(resultTreeFN_)) {
+    pvalTreeFNs.push_back(resultTreeFN_);
+  }
+}
+
+/* Adds the spectrum files in newSpectrumBatchFileFN_ to the clustering of 
+   a previous batch run in the same output folder. Only pairs with at least 
+   one new spectrum are scored, the pairs with a previous spectrum against the
+   p-value vectors kept by the previous run. The merges of the previous run 
+   are replayed in p-value order together with the new pairs, but are never 
+   undone. With --freezePeakCounts, this gives the same clusters as a full 
+   rerun, unless the new spectra would have delayed one of the previous 
+   merges. */
+int MaRaCluster::runUpdate() {
+  if (spectrumBatchFileFN_.empty()) {
+    std::cerr << "Error: no batch file specified with -b/--batch flag" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (newSpectrumBatchFileFN_.empty()) {
+    std::cerr << "Error: no new spectrum files specified with --newFiles flag" << std::endl;
+    return EXIT_FAILURE;
+  }
+  
+  if (peakCountFN_.empty())
+    peakCountFN_ = outputFolder_ + "/" + fnPrefix_ + ".peak_counts.dat";
+  if (scanInfoFN_.empty())
+    scanInfoFN_ = outputFolder_ + "/" + fnPrefix_ + ".scan_info.dat";
+  if (datFNFile_.empty())
+    datFNFile_ = outputFolder_ + "/" + fnPrefix_ + ".dat_file_list.txt";
+  
+  if (!Globals::fileExists(datFNFile_) || !Globals::fileExists(scanInfoFN_) ||
+      !Globals::fileExists(peakCountFN_)) {
+    std::cerr << "Error: could not find the results of a previous batch run in " 
+              << outputFolder_ << std::endl;
+    return EXIT_FAILURE;
+  }
+  
+  // new files get the file indices following the previous files
+  SpectrumFileList fileList;
+  fileList.initFromFile(spectrumBatchFileFN_);
+  size_t firstNewFileIdx = fileList.size();
+  {
+    SpectrumFileList newFileList;
+    newFileList.initFromFile(newSpectrumBatchFileFN_);
+    BOOST_FOREACH (const std::string& filePath, newFileList.getFilePaths()) {
+      fileList.addFile(filePath);
+    }
+  }
+  if (fileList.size() == firstNewFileIdx) {
+    std::cerr << "Error: all files in " << newSpectrumBatchFileFN_ << 
+        " are already part of the clustering." << std::endl;
+    return EXIT_FAILURE;
+  }
+  
+  std::string updateFolder = outputFolder_ + "/" + fnPrefix_ + ".update_" + 
+      boost::lexical_cast<std::string>(firstNewFileIdx);
+  std::string updatePeakCountFN = updateFolder + "/peak_counts.dat";
+  std::string mergedPeakCountFN = updateFolder + "/merged_peak_counts.dat";
+  std::string updateScanInfoFN = updateFolder + "/scan_info.dat";
+  std::string updateDatFNFile = updateFolder + "/dat_file_list.txt";
+  std::string updatePvaluesFN = updateFolder + "/update.pvalues.dat";
+  std::string updateTreeFN = updateFolder + "/update.pvalue_tree.tsv";
+  std::string updateDoneFN = updateFolder + "/update.done";
+  
+  // finish the installation of an update that was interrupted after its 
+  // done marker was written
+  if (Globals::fileExists(updateDoneFN) && 
+      !installStagedUpdateFiles(updateFolder)) {
+    return EXIT_FAILURE;
+  }
+  
+  std::vector<std::string> datFNs, newDatFNs;
+  SpectrumFiles spectrumFiles(updateFolder, chargeUncertainty_);
+  spectrumFiles.readDatFNsFromFile(datFNFile_, datFNs);
+  
+  if (!Globals::fileExists(updateDoneFN)) {
+    size_t numStoredPvecFiles = 0u;
+    BOOST_FOREACH (const std::string& datFN, datFNs) {
+      if (!Globals::fileIsEmpty(datFN + ".pvalue_vectors.dat")) ++numStoredPvecFiles;
+    }
+    if (numStoredPvecFiles == 0u) {
+      std::cerr << "Error: could not find the p-value vectors of the previous run." 
+                << " Run maracluster batch with --keepPvalueVectors to allow"
+                << " updates of its clustering." << std::endl;
+      return EXIT_FAILURE;
+    }
+    
+    boost::system::error_code returnedError;
+    boost::filesystem::create_directories(updateFolder, returnedError);
+    if (!boost::filesystem::exists(updateFolder)) {
+      std::cerr << "Error: could not create update directory at " << updateFolder << std::endl;
+      return EXIT_FAILURE;
+    }
+    
+    if (!Globals::fileExists(updateDatFNFile) || !Globals::fileExists(updateScanInfoFN)) {
+      ScopedStageTimer timer("index");
+      spectrumFiles.setBinCostModel(binCostModel_);
+      spectrumFiles.setFirstFileIdx(firstNewFileIdx);
+      spectrumFiles.splitByPrecursorMz(fileList, updateDatFNFile, updatePeakCountFN, 
+          updateScanInfoFN, precursorTolerance_, precursorToleranceDa_);
+    }
+    spectrumFiles.readDatFNsFromFile(updateDatFNFile, newDatFNs);
+    
+    std::string scoringPeakCountFN = peakCountFN_;
+    if (!freezePeakCounts_) {
+      spectrumFiles.mergePeakCounts(peakCountFN_, updatePeakCountFN, mergedPeakCountFN);
+      scoringPeakCountFN = mergedPeakCountFN;
+    }
+    
+    if (!Globals::fileExists(updatePvaluesFN)) {
+      // the scores are appended bin by bin, so an interrupted run must not 
+      // leave them under the name that a rerun takes as complete
+      std::string tmpPvaluesFN = updateFolder + "/update.pvalues.partial.dat";
+      remove(tmpPvaluesFN.c_str());
+      
+      PeakCounts peakCounts;
+      peakCounts.readFromFile(scoringPeakCountFN);
+      
+      std::vector< std::pair<std::string, std::string> > overlapFNs;
+      for (size_t i = 0; i < newDatFNs.size(); ++i) {
+        if (!Globals::fileExists(newDatFNs[i])) continue;
+        
+        std::string pvalueVectorsBaseFN = newDatFNs[i] + ".pvalue_vectors";
+        if (i > 0) {
+          overlapFNs.push_back(std::make_pair(
+              newDatFNs[i-1] + ".pvalue_vectors.tail.dat", 
+              pvalueVectorsBaseFN + ".head.dat"));
+        }
+        
+        PvalueVectors pvecs(tmpPvaluesFN, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+        {
+          ScopedStageTimer timer("pvalues/vectors");
+          Spectra spectra;
+          spectra.readBatchSpectra(newDatFNs[i]);
+          spectra.sortSpectraByPrecMz();
+          pvecs.calculatePvalueVectors(spectra.getSpectra(), peakCounts);
+          if (pvecs.getPvalueVectors().empty()) continue;
+          
+          // kept for the next update
+          bool writeAll = true;
+          pvecs.writePvalueVectors(pvalueVectorsBaseFN, writeAll);
+          timer.addItems(pvecs.getPvalueVectors().size());
+        }
+        
+        ScopedStageTimer timer("pvalues/update_scoring");
+        timer.addItems(pvecs.getPvalueVectors().size());
+        BOOST_FOREACH (const std::string& datFN, datFNs) {
+          pvecs.batchCalculatePvaluesUpdate(datFN + ".pvalue_vectors.dat");
+        }
+        pvecs.batchCalculatePvalues();
+      }
+      
+      {
+        ScopedStageTimer timer("pvalues/overlap");
+        PvalueVectors pvecs(tmpPvaluesFN, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+        pvecs.processOverlapFiles(overlapFNs);
+      }
+      
+      if (!Globals::fileExists(tmpPvaluesFN)) {
+        // none of the new spectra were similar enough to any other spectrum
+        std::ofstream emptyPvaluesStream(tmpPvaluesFN.c_str());
+      }
+      if (!moveFile(tmpPvaluesFN, updatePvaluesFN)) {
+        return EXIT_FAILURE;
+      }
+    } else {
+      std::cerr << "Using p-values from " << updatePvaluesFN << 
+          ". Remove this file to generate new p-values." << std::endl;
+    }
+    
+    if (!Globals::fileExists(updateTreeFN)) {
+      double cutoff = std::min(dbPvalThreshold_, clusterThresholds_.back());
+      ScopedStageTimer timer("clustering");
+      
+      std::vector<std::string> pvalTreeFNs;
+      getPvalueTreeFNs(datFNs, pvalTreeFNs);
+      std::vector<PvalueTriplet> pvalTree;
+      BOOST_FOREACH (const std::string& pvalTreeFN, pvalTreeFNs) {
+        SpectrumClusters::readPvalTree(pvalTreeFN, pvalTree);
+      }
+      
+      SparseClustering matrix;
+      matrix.setMergeOffset(fileList.getMergeOffset());
+      matrix.setPreviousMerges(pvalTree);
+      
+      if (!Globals::fileIsEmpty(updatePvaluesFN)) {
+        std::string matrixFN = updateFolder + "/sorted.pvalues.dat";
+        std::vector<std::string> pvalFNs(1, updatePvaluesFN);
+        {
+          ScopedStageTimer filterTimer("filter_and_sort");
+          bool tsvInput = false;
+          PvalueFilterAndSort::filterAndSort(pvalFNs, matrixFN, tsvInput);
+        }
+        
+        matrix.initMatrix(matrixFN);
+        matrix.setClusterPairFN(updateTreeFN);
+        matrix.doClustering(cutoff);
+        remove(matrixFN.c_str());
+      } else {
+        // none of the new spectra were similar enough to any other spectrum
+        std::ofstream emptyTreeStream(updateTreeFN.c_str());
+      }
+    } else {
+      std::cerr << "Using update clustering tree from " << updateTreeFN << 
+          ". Remove this file to redo the clustering." << std::endl;
+    }
+    
+    // add the new spectra to the results of the previous run. The new 
+    // versions of its files are staged in the update folder and only 
+    // replace the old ones after the done marker was written, such that an
+    // interrupted update either has not touched them or is completed on the
+    // next call.
+    datFNs.insert(datFNs.end(), newDatFNs.begin(), newDatFNs.end());
+    spectrumFiles.writeDatFNsToFile(datFNs, updateFolder + "/staged_dat_file_list.txt");
+    {
+      std::string stagedScanInfoFN = updateFolder + "/staged_scan_info.dat";
+      boost::system::error_code returnedError;
+      boost::filesystem::remove(stagedScanInfoFN, returnedError);
+      boost::filesystem::copy_file(scanInfoFN_, stagedScanInfoFN, returnedError);
+      if (returnedError) {
+        std::cerr << "Error: could not copy " << scanInfoFN_ << " to " 
+                  << stagedScanInfoFN << std::endl;
+        return EXIT_FAILURE;
+      }
+      std::vector<ScanInfo> scanInfos;
+      BinaryInterface::read<ScanInfo>(updateScanInfoFN, scanInfos);
+      bool append = true;
+      BinaryInterface::write<ScanInfo>(scanInfos, stagedScanInfoFN, append);
+    }
+    std::string stagedPeakCountFN = updateFolder + "/staged_peak_counts.dat";
+    if (freezePeakCounts_) {
+      // left by an interrupted update without --freezePeakCounts
+      boost::system::error_code returnedError;
+      boost::filesystem::remove(stagedPeakCountFN, returnedError);
+    } else if (!moveFile(mergedPeakCountFN, stagedPeakCountFN)) {
+      return EXIT_FAILURE;
+    }
+    
+    {
+      std::ofstream doneStream(updateDoneFN.c_str());
+      if (!doneStream.is_open()) {
+        std::cerr << "Error: could not write " << updateDoneFN << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    if (!installStagedUpdateFiles(updateFolder)) return EXIT_FAILURE;
+  } else {
+    std::cerr << "Update with " << newSpectrumBatchFileFN_ << " was already"
+        " added to " << outputFolder_ << ". Remove " << updateFolder << 
+        " to redo the update from a fresh batch run." << std::endl;
+  }
+  
+  std::vector<std::string> pvalTreeFNs;
+  getPvalueTreeFNs(datFNs, pvalTreeFNs);
+  
+  std::string clusterBaseFN = outputFolder_ + "/" + fnPrefix_ + ".clusters_";
+  {
+    ScopedStageTimer timer("print_clusters");
+    SpectrumClusters clustering;
+    clustering.printClusters(pvalTreeFNs, clusterThresholds_, fileList, scanInfoFN_, clusterBaseFN);
+  }
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Append the files of " << newSpectrumBatchFileFN_ << " to " 
+        << spectrumBatchFileFN_ << " before running the next update." << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* Moves the files staged by runUpdate() over the files of the previous run.
+   Files that are no longer in the update folder were already moved, so this
+   can be repeated until it succeeds. */
+bool MaRaCluster::installStagedUpdateFiles(const std::string& updateFolder) {
+  std::vector< std::pair<std::string, std::string> > stagedFNs;
+  stagedFNs.push_back(std::make_pair(
+      updateFolder + "/staged_dat_file_list.txt", datFNFile_));
+  stagedFNs.push_back(std::make_pair(
+      updateFolder + "/staged_scan_info.dat", scanInfoFN_));
+  stagedFNs.push_back(std::make_pair(
+      updateFolder + "/staged_peak_counts.dat", peakCountFN_));
+  
+  typedef std::pair<std::string, std::string> FNPair;
+  BOOST_FOREACH (const FNPair& stagedFN, stagedFNs) {
+    if (Globals::fileExists(stagedFN.first) && 
+        !moveFile(stagedFN.first, stagedFN.second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Falls back to a copy if the files are on different file systems */
+bool MaRaCluster::moveFile(const std::string& fromFN, const std::string& toFN) {
+  boost::system::error_code returnedError;
+  boost::filesystem::rename(fromFN, toFN, returnedError);
+  if (returnedError) {
+    returnedError.clear();
+    std::string tmpFN = toFN + ".tmp";
+    boost::filesystem::remove(tmpFN, returnedError);
+    boost::filesystem::copy_file(fromFN, tmpFN, returnedError);
+    if (!returnedError) boost::filesystem::rename(tmpFN, toFN, returnedError);
+    if (!returnedError) boost::filesystem::remove(fromFN, returnedError);
+  }
+  if (returnedError) {
+    std::cerr << "Error: could not move " << fromFN << " to " << toFN 
+              << ": " << returnedError.message() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void MaRaCluster::writeRunReport(int exitCode) {
+  if (runReportFN_.empty()) return;
+  StageProfiler::writeReport(runReportFN_, VERSION, call_, exitCode);
+}
+
 int MaRaCluster::run() {
   time_t startTime;
   clock_t startClock;
   time(&startTime);
   startClock = clock();
+  ScopedStageTimer runTimer("total");
   
   if (Globals::VERB > 0) {
     std::cerr << extendedGreeter(startTime);
@@ -452,7 +1256,7 @@ int MaRaCluster::run() {
         return EXIT_FAILURE;
       }
       
-      std::vector<std::string> pvalFNs;
+      std::vector<std::string> binPvalFNs(datFNs.size());
       std::vector<std::string> pvalTreeFNs;
       std::vector< std::pair<std::string, std::string> > overlapFNs(datFNs.size() - 1);
       
@@ -475,26 +1279,8 @@ int MaRaCluster::run() {
           std::string pvaluesFN = datFN + ".pvalues.dat";
           std::string pvalueTreeFN = datFN + ".pvalue_tree.tsv";
           
-          if (!Globals::fileExists(pvalueTreeFN)) {
-            PvalueVectors pvecs(pvaluesFN, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
-            {
-              Spectra spectra;
-              spectra.readBatchSpectra(datFN);
-              spectra.sortSpectraByPrecMz();
-              
-              PeakCounts peakCounts;
-              peakCounts.readFromFile(peakCountFN_);
-              pvecs.calculatePvalueVectors(spectra.getSpectra(), peakCounts);
-            }
-            pvecs.writePvalueVectors(pvalueVectorsBaseFN, writeAll_);
-            pvecs.batchCalculateAndClusterPvalues(pvalueTreeFN, scanInfoFN_);
-          } else {
-            std::cerr << "Using p-value tree from " << pvalueTreeFN <<
-                ". Remove this file to generate a new p-value tree." << std::endl;
-          }
-          if (Globals::fileExists(pvaluesFN)) {
-            pvalFNs.push_back(pvaluesFN);
-          }
+          processPrecursorBin(datFN);
+          binPvalFNs[i] = pvaluesFN;
           pvalTreeFNs.push_back(pvalueTreeFN);
         }
       }
@@ -503,31 +1289,30 @@ int MaRaCluster::run() {
         resultTreeFN_ = outputFolder_ + "/overlap.pvalue_tree.tsv";
       }
       
+      // the p-values of the overlaps are clustered as they are calculated,
+      // together with the p-values left by the precursor bins
       if (!Globals::fileExists(resultTreeFN_)) {
+        std::cerr << "Starting p-value clustering." << std::endl;
+        
+        ScopedStageTimer timer("pvalues/overlap_and_clustering");
         std::string pvaluesFN = outputFolder_ + "/overlap.pvalues.dat";
-        if (overlapFNs.size() > 0) {
-          if (!Globals::fileExists(pvaluesFN)) {
-            PvalueVectors pvecs(pvaluesFN, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
-            pvecs.processOverlapFiles(overlapFNs);
-          } else {
-            std::cerr << "Using p-values from " << pvaluesFN << 
-                ". Remove this file to generate new p-values." << std::endl;
-          }
-          
-          if (Globals::fileExists(pvaluesFN)) {
-            pvalFNs.push_back(pvaluesFN);
-          }
-        }
-      }
-      
-      if (matrixFN_.empty()) {
-        matrixFN_ = outputFolder_ + "/poisoned.pvalues.dat";
+        PvalueVectors pvecs(pvaluesFN, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+        pvecs.setPvalMemoryBudget(pvalMemoryMB_);
+        pvecs.processAndClusterOverlapFiles(overlapFNs, binPvalFNs, 
+                                            resultTreeFN_, scanInfoFN_);
+      } else {
+        std::cerr << "Using p-value tree from " << resultTreeFN_ << std::endl;
       }
+      pvalTreeFNs.push_back(resultTreeFN_);
       
       SpectrumFileList fileList;
       fileList.initFromFile(spectrumBatchFileFN_);
-      error = doClustering(pvalFNs, pvalTreeFNs, fileList); 
-      if (error != EXIT_SUCCESS) return EXIT_FAILURE;
+      {
+        ScopedStageTimer timer("print_clusters");
+        std::string clusterBaseFN = outputFolder_ + "/" + fnPrefix_ + ".clusters_";
+        SpectrumClusters clustering;
+        clustering.printClusters(pvalTreeFNs, clusterThresholds_, fileList, scanInfoFN_, clusterBaseFN);
+      }
       
       if (!spectrumOutFN_.empty()) {
         if (clusterFileFN_.empty()) {
@@ -570,6 +1355,8 @@ int MaRaCluster::run() {
         PvalueVectors pvecs(pvaluesFN_, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
         pvecs.parsePvalueVectorFile(pvalVecInFileFN_);
         if (resultTreeFN_.size() > 0) {
+          pvecs.setPvalMemoryBudget(pvalMemoryMB_);
+          pvecs.setFingerprintFilter(fingerprintFilterCutoff_);
           pvecs.batchCalculateAndClusterPvalues(resultTreeFN_, scanInfoFN_);
         } else {
           pvecs.batchCalculatePvalues();
@@ -652,6 +1439,8 @@ int MaRaCluster::run() {
         
         //pvecs.parsePvalueVectorFile(pvalueVectorsBaseFN + ".dat");
         if (resultTreeFN_.size() > 0) {
+          pvecs.setPvalMemoryBudget(pvalMemoryMB_);
+          pvecs.setFingerprintFilter(fingerprintFilterCutoff_);
           pvecs.batchCalculateAndClusterPvalues(resultTreeFN_, scanInfoFN_);
         } else {
           pvecs.batchCalculatePvalues();
@@ -659,10 +1448,23 @@ int MaRaCluster::run() {
       }
       return EXIT_SUCCESS;
     }
+    case PLAN:
+    {
+      // maracluster plan -b /media/storage/mergespec/data/batchcluster/Linfeng/all.txt -f /shared/output
+      if (manifestFN_.empty())
+        manifestFN_ = outputFolder_ + "/" + fnPrefix_ + ".job_manifest.tsv";
+      return writeJobManifest();
+    }
+    case WORKER:
+    {
+      // maracluster worker -f /shared/output
+      if (manifestFN_.empty())
+        manifestFN_ = outputFolder_ + "/" + fnPrefix_ + ".job_manifest.tsv";
+      return runWorker();
+    }
     case CLUSTER:
     {
       std::vector<std::string> pvalFNs, pvalTreeFNs;
-      pvalFNs.push_back(matrixFN_);
       
       if (spectrumBatchFileFN_.empty()) {
         std::cerr << "Error: no batch file specified with -b/--batch flag" << std::endl;
@@ -671,6 +1473,18 @@ int MaRaCluster::run() {
       SpectrumFileList fileList;
       fileList.initFromFile(spectrumBatchFileFN_);
       
+      // gather the results of the workers if no p-value matrix was given
+      if (matrixFN_.empty()) {
+        if (manifestFN_.empty())
+          manifestFN_ = outputFolder_ + "/" + fnPrefix_ + ".job_manifest.tsv";
+        int error = gatherJobResults(pvalFNs, pvalTreeFNs);
+        if (error != EXIT_SUCCESS) return EXIT_FAILURE;
+        
+        matrixFN_ = outputFolder_ + "/poisoned.pvalues.dat";
+        return doClustering(pvalFNs, pvalTreeFNs, fileList);
+      }
+      
+      pvalFNs.push_back(matrixFN_);
       if (!skipFilterAndSort_) {
         bool tsvInput = false;
         PvalueFilterAndSort::filterAndSort(pvalFNs, matrixFN_, tsvInput);
@@ -678,15 +1492,129 @@ int MaRaCluster::run() {
       
       return doClustering(pvalFNs, pvalTreeFNs, fileList);
     }
+    case UPDATE:
+    {
+      // maracluster update -b /media/storage/mergespec/data/batchcluster/Linfeng/all.txt --newFiles new.txt
+      return runUpdate();
+    }
     case CONSENSUS:
     {
       return mergeSpectra();
     }
-    case SEARCH:
+    case BUILD_LIBRARY:
     {
       if (spectrumLibraryFN_.empty()) {
         std::cerr << "Error: no spectrum library file specified with -z/--lib flag" << std::endl;
         return EXIT_FAILURE;
+      }
+      
+      if (libraryIndexFN_.empty())
+        libraryIndexFN_ = outputFolder_ + "/" + fnPrefix_ + ".library_index.dat";
+      
+      SpectrumFileList fileList;
+      fileList.addFile(spectrumLibraryFN_);
+      if (peakCountFN_.empty()) {
+        peakCountFN_ = outputFolder_ + "/" + fnPrefix_ + ".peak_counts.dat";
+        
+        SpectrumFiles spectrumFiles(outputFolder_);
+        std::vector<double> precMzsAccumulated;
+        spectrumFiles.getPeakCountsAndPrecursorMzs(fileList, precMzsAccumulated, peakCountFN_);
+      }
+      std::cerr << "Reading peak counts" << std::endl;
+      PeakCounts peakCounts;
+      peakCounts.readFromFile(peakCountFN_);
+      std::cerr << "Finished reading peak counts" << std::endl;
+      
+      PvalueCalculator::kMinScoringPeaks = 5u;
+      Spectra librarySpectra;
+      librarySpectra.convertToBatchSpectra(spectrumLibraryFN_, fileList);
+      librarySpectra.sortSpectraByPrecMz();
+      
+      PvalueVectors pvecs(pvaluesFN_, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+      pvecs.calculatePvalueVectors(librarySpectra.getSpectra(), peakCounts);
+      if (!pvecs.writePvalueVectorIndex(libraryIndexFN_)) {
+        return EXIT_FAILURE;
+      }
+      
+      return EXIT_SUCCESS;
+    }
+    case SEARCH_STREAM:
+    {
+      if (libraryIndexFN_.empty()) {
+        std::cerr << "Error: no library index specified with --libraryIndex flag" << std::endl;
+        return EXIT_FAILURE;
+      }
+      
+      PvalueVectorIndex libraryIndex;
+      if (!libraryIndex.open(libraryIndexFN_)) {
+        return EXIT_FAILURE;
+      }
+      
+      // "-" or no file name means stdin/stdout
+      std::ifstream queryFile;
+      if (!spectrumInFN_.empty() && spectrumInFN_ != "-") {
+        queryFile.open(spectrumInFN_.c_str(), std::ios_base::in | std::ios_base::binary);
+        if (!queryFile.is_open()) {
+          std::cerr << "Error: could not open query spectra " << spectrumInFN_ << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+      std::ofstream resultFile;
+      if (!pvaluesFN_.empty() && pvaluesFN_ != "-") {
+        resultFile.open(pvaluesFN_.c_str(), std::ios_base::out | std::ios_base::binary);
+        if (!resultFile.is_open()) {
+          std::cerr << "Error: could not write results to " << pvaluesFN_ << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+      // std::cin does not buffer while it is synchronized with stdio, a 
+      // dedicated stream on stdin lets the available queries be read in chunks
+      boost::iostreams::stream<boost::iostreams::file_descriptor_source> stdinStream;
+      if (!queryFile.is_open()) {
+        stdinStream.open(boost::iostreams::file_descriptor_source(
+            fileno(stdin), boost::iostreams::never_close_handle),
+            queryChunkSize_ * sizeof(Spectrum));
+      }
+      std::istream& queryStream = queryFile.is_open() ? 
+          static_cast<std::istream&>(queryFile) : stdinStream;
+      std::ostream& resultStream = resultFile.is_open() ? resultFile : std::cout;
+      
+      PvalueVectors pvecs(pvaluesFN_, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+      size_t numQueries = pvecs.streamPvaluesLibrarySearch(libraryIndex, 
+          queryStream, resultStream, topK_, queryChunkSize_, binaryOutput_);
+      
+      if (Globals::VERB > 1) {
+        std::cerr << "Searched " << numQueries << " query spectra against the library index" << std::endl;
+      }
+      return EXIT_SUCCESS;
+    }
+    case SERVE:
+    {
+      if (libraryIndexFN_.empty()) {
+        std::cerr << "Error: no library index specified with --libraryIndex flag" << std::endl;
+        return EXIT_FAILURE;
+      }
+      
+      if (socketFN_.empty())
+        socketFN_ = outputFolder_ + "/" + fnPrefix_ + ".sock";
+      
+      PvalueVectorIndex libraryIndex;
+      if (!libraryIndex.open(libraryIndexFN_)) {
+        return EXIT_FAILURE;
+      }
+      
+      PvalueVectors pvecs(pvaluesFN_, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+      SearchServer server(pvecs, libraryIndex);
+      if (!server.run(socketFN_, numServeWorkers_)) {
+        return EXIT_FAILURE;
+      }
+      return EXIT_SUCCESS;
+    }
+    case SEARCH:
+    {
+      if (spectrumLibraryFN_.empty() && libraryIndexFN_.empty()) {
+        std::cerr << "Error: no spectrum library file specified with -z/--lib or --libraryIndex flag" << std::endl;
+        return EXIT_FAILURE;
       } else if (spectrumBatchFileFN_.empty() && spectrumInFN_.empty()) {
         std::cerr << "Error: no query spectrum file(s) specified with -i/--specIn or -b/--batch flag" << std::endl;
         return EXIT_FAILURE;
@@ -710,6 +1638,20 @@ int MaRaCluster::run() {
         }
         querySpectra.sortSpectraByPrecMz();
         
+        if (!libraryIndexFN_.empty()) {
+          PvalueVectorIndex libraryIndex;
+          if (!libraryIndex.open(libraryIndexFN_)) {
+            return EXIT_FAILURE;
+          }
+          
+          // the library is placed after the query files, as for -z/--lib
+          unsigned int libraryFileIdxOffset = fileList.size();
+          PvalueVectors pvecs(pvaluesFN_, precursorTolerance_, precursorToleranceDa_, dbPvalThreshold_);
+          pvecs.batchCalculatePvaluesLibrarySearch(libraryIndex, 
+              querySpectra.getSpectra(), libraryFileIdxOffset);
+          return EXIT_SUCCESS;
+        }
+        
         if (peakCountFN_.empty()) {
           peakCountFN_ = outputFolder_ + "/" + fnPrefix_ + ".peak_counts.dat";
           
@@ -812,6 +1754,16 @@ int MaRaCluster::run() {
       
       return EXIT_SUCCESS;
     }
+    case PROFILE_FINGERPRINT:
+    {
+      BALL::BinaryFingerprintMethods::benchmarkCommonCounts(850);
+      return EXIT_SUCCESS;
+    }
+    case PROFILE_MERGE:
+    {
+      MSClusterMerge::benchmarkMerge();
+      return EXIT_SUCCESS;
+    }
     case UNIT_TEST:
     {
       unsigned int failures = 0u;
@@ -829,6 +1781,13 @@ int MaRaCluster::run() {
         ++failures;
       }
       
+      if (SparseClustering::updateClusteringUnitTest()) {
+        std::cerr << "Update clustering unit tests succeeded" << std::endl;
+      } else {
+        std::cerr << "Update clustering unit tests failed" << std::endl;
+        ++failures;
+      }
+      
       if (PeakCounts::peakCountsSerializationUnitTest()) {
         std::cerr << "PeakCounts serialization unit tests succeeded" << std::endl;
       } else {
@@ -836,6 +1795,13 @@ int MaRaCluster::run() {
         ++failures;
       }
       
+      if (jobRunnerUnitTest()) {
+        std::cerr << "Job runner unit tests succeeded" << std::endl;
+      } else {
+        std::cerr << "Job runner unit tests failed" << std::endl;
+        ++failures;
+      }
+      
       if (PvalueCalculator::binaryPeakMatchUnitTest()) {
         std::cerr << "PvalueCalculator peak matching unit tests succeeded" << std::endl;
       } else {
@@ -856,6 +1822,34 @@ int MaRaCluster::run() {
         std::cerr << "PvalueCalculator polyfit unit tests failed" << std::endl;
         ++failures;
       }
+      
+      if (PvalueCalculator::pvalPolyfitBatchUnitTest()) {
+        std::cerr << "PvalueCalculator batch polyfit unit tests succeeded" << std::endl;
+      } else {
+        std::cerr << "PvalueCalculator batch polyfit unit tests failed" << std::endl;
+        ++failures;
+      }
+      
+      if (PvalueCalculator::pvalPolyfitPairUnitTest()) {
+        std::cerr << "PvalueCalculator polyfit pair unit tests succeeded" << std::endl;
+      } else {
+        std::cerr << "PvalueCalculator polyfit pair unit tests failed" << std::endl;
+        ++failures;
+      }
+      
+      if (PvalueVectorFile::pvalueVectorFileUnitTest()) {
+        std::cerr << "PvalueVectorFile unit tests succeeded" << std::endl;
+      } else {
+        std::cerr << "PvalueVectorFile unit tests failed" << std::endl;
+        ++failures;
+      }
+      
+      if (BALL::BinaryFingerprintMethods::commonCountsUnitTest()) {
+        std::cerr << "BinaryFingerprintMethods common counts unit tests succeeded" << std::endl;
+      } else {
+        std::cerr << "BinaryFingerprintMethods common counts unit tests failed" << std::endl;
+        ++failures;
+      }
       /*
       if (PvalueFilterAndSort::unitTest()) {
         std::cerr << "PvalueFilterAndSort unit tests succeeded" << std::endl;
@@ -887,6 +1881,13 @@ int MaRaCluster::run() {
         ++failures;
       }
       
+      if (SearchServer::searchServerUnitTest()) {
+        std::cerr << "Search server unit tests succeeded" << std::endl;
+      } else {
+        std::cerr << "Search server unit tests failed" << std::endl;
+        ++failures;
+      }
+      
       if (failures > 0) {
         std::cerr << std::endl << "UNIT TESTS FAILED: " << failures << std::endl;
         return EXIT_FAILURE;
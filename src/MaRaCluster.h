@@ -29,6 +29,9 @@
 #include <sstream>
 
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/file_descriptor.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "Option.h"
 #include "PvalueCalculator.h"
@@ -48,10 +51,16 @@
 
 #include "PvalueFilterAndSort.h"
 #include "SparseClustering.h"
+#include "JobManifest.h"
+#include "PvalueVectorIndex.h"
+#include "BinaryFingerprintMethods.h"
+#include "SearchServer.h"
+#include "StageProfiler.h"
+#include "ThreadPlacement.h"
 
 namespace maracluster {
 
-enum Mode { NONE, BATCH, PVALUE, UNIT_TEST, INDEX, CLUSTER, CONSENSUS, SEARCH, PROFILE_CONSENSUS, PROFILE_SEARCH };
+enum Mode { NONE, BATCH, PVALUE, UNIT_TEST, INDEX, CLUSTER, CONSENSUS, SEARCH, PROFILE_CONSENSUS, PROFILE_SEARCH, PROFILE_FINGERPRINT, PROFILE_MERGE, PLAN, WORKER, BUILD_LIBRARY, SEARCH_STREAM, SERVE, UPDATE };
 
 class MaRaCluster {  
  public:
@@ -61,9 +70,12 @@ class MaRaCluster {
   bool parseOptions(int argc, char **argv);
   
   int run();
+  void writeRunReport(int exitCode);
   
   virtual int mergeSpectra();
   
+  static bool jobRunnerUnitTest();
+  
  protected:
   std::string greeter();
   std::string extendedGreeter(time_t& startTime);
@@ -72,6 +84,22 @@ class MaRaCluster {
   int doClustering(const std::vector<std::string> pvalFNs, 
     std::vector<std::string> pvalTreeFNs, SpectrumFileList& fileList);
   
+  void processPrecursorBin(const std::string& datFN);
+  int writeJobManifest();
+  void addPrecursorBinJobs(const std::vector<std::string>& datFNs, 
+    JobManifest& manifest);
+  bool readJobManifest(JobManifest& manifest);
+  int runWorker();
+  bool runJob(const ManifestJob& job);
+  bool runClaimedJob(JobManifest& manifest, const ManifestJob& job);
+  int gatherJobResults(std::vector<std::string>& pvalFNs, 
+    std::vector<std::string>& pvalTreeFNs);
+  void getPvalueTreeFNs(const std::vector<std::string>& datFNs, 
+    std::vector<std::string>& pvalTreeFNs);
+  int runUpdate();
+  bool installStagedUpdateFiles(const std::string& updateFolder);
+  static bool moveFile(const std::string& fromFN, const std::string& toFN);
+  
   Mode mode_;
   std::string call_;
   std::string percOutFN_;
@@ -87,20 +115,33 @@ class MaRaCluster {
   boost::filesystem::path outputPath;
   std::string outputFolder_;
   std::string spectrumBatchFileFN_;
+  std::string newSpectrumBatchFileFN_;
   std::string spectrumInFN_;
   std::string spectrumOutFN_;
   std::string spectrumLibraryFN_;
+  std::string libraryIndexFN_;
+  std::string socketFN_;
+  std::string manifestFN_;
+  std::string runReportFN_;
 
   std::string matrixFN_;
   std::string resultTreeFN_;
   bool skipFilterAndSort_;
   bool writeAll_;
+  bool freezePeakCounts_;
   std::vector<double> clusterThresholds_;
   double precursorTolerance_;
   bool precursorToleranceDa_;
   double dbPvalThreshold_; // logPval
   int chargeUncertainty_;
   size_t minConsensusClusterSize_;
+  double pvalMemoryMB_;
+  double fingerprintFilterCutoff_;
+  BinCostModel binCostModel_;
+  size_t topK_;
+  size_t queryChunkSize_;
+  bool binaryOutput_;
+  unsigned int numServeWorkers_;
 };
 
 } /* namespace maracluster */
@@ -101,6 +101,7 @@ bool MatrixLoader::initStream(const std::string& matrixFN) {
             boost::iostreams::mapped_file::readonly);
   f_ = mmap_.const_data();
   l_ = f_ + mmap_.size();
+  StageProfiler::addBytesRead(mmap_.size());
   
   if (!f_) {
     std::cerr << "Could not open matrix file " << matrixFN << std::endl;
@@ -26,6 +26,7 @@
 
 #include "SpectrumFileList.h"
 #include "PvalueTriplet.h"
+#include "StageProfiler.h"
 
 #include <cerrno>
 #include <boost/iostreams/device/mapped_file.hpp>
@@ -0,0 +1,646 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "MicroBenchmarks.h"
+
+#include <set>
+#include <iterator>
+#include <queue>
+#include <iomanip>
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+#include "PeakDistribution.h"
+#include "PvalueCalculator.h"
+#include "BinSpectra.h"
+#include "MSClusterMerge.h"
+#include "SparseMatrix.h"
+#include "PvalueFilterAndSort.h"
+
+namespace maracluster {
+
+namespace {
+
+const unsigned int kNumPeakBins = 2000u; // fragment bins of a 2000 Da precursor
+const unsigned int kNumPeaks = 150u; // peaks of a raw spectrum
+
+/* Fragment peak distribution with a higher peak density at low m/z,
+   normalized to sum to 1 such that generateRandSpec can sample from it. */
+void initPeakDistribution(PeakDistribution& distribution) {
+  distribution.init(kNumPeakBins);
+  double sumWeights = 0.0;
+  for (unsigned int bin = 0; bin < kNumPeakBins; ++bin) {
+    sumWeights += 1.0 / (1.0 + 4.0 * bin / kNumPeakBins);
+  }
+  for (unsigned int bin = 0; bin < kNumPeakBins; ++bin) {
+    distribution.insert(bin, 1.0 / (1.0 + 4.0 * bin / kNumPeakBins) / sumWeights);
+  }
+}
+
+void generateSpectrum(const std::vector<unsigned int>& peakBins,
+    std::vector<MZIntensityPair>& mziPairs) {
+  BOOST_FOREACH (const unsigned int bin, peakBins) {
+    mziPairs.push_back(MZIntensityPair(
+        BinSpectra::getMZ(bin) + 0.02 * (PeakDistribution::lcg_rand_unif() - 0.5),
+        100.0 * PeakDistribution::lcg_rand_unif() + 1.0));
+  }
+}
+
+/* Query spectrum sharing on average matchProb of the peaks of the target
+   spectrum, padded with random peaks up to numPeaks. */
+void generateQueryPeakBins(PeakDistribution& distribution,
+    PeakDistribution& matchDistribution, const unsigned int numPeaks,
+    std::vector<unsigned int>& targetPeakBins,
+    std::vector<unsigned int>& queryPeakBins) {
+  std::vector<unsigned int> matchedPeakBins, randomPeakBins;
+  matchDistribution.generateRandSpecBernoulli(matchedPeakBins, numPeaks,
+                                              targetPeakBins);
+  distribution.generateRandSpec(randomPeakBins, numPeaks - matchedPeakBins.size());
+
+  queryPeakBins.clear();
+  std::set_union(matchedPeakBins.begin(), matchedPeakBins.end(),
+                 randomPeakBins.begin(), randomPeakBins.end(),
+                 std::back_inserter(queryPeakBins));
+}
+
+/* Links every scan to numNeighbors random scans with a nearby precursor,
+   i.e. among the next kScanWindow scans, as in a precursor m/z sorted run.
+   With bothDirections, each pair is added in both directions with
+   different p-values, as in the output of PvalueVectors. */
+void generatePvalueTriplets(const unsigned int numScans,
+    const unsigned int numNeighbors, bool bothDirections,
+    std::vector<PvalueTriplet>& pvalBuffer) {
+  const unsigned int kScanWindow = 50u;
+  pvalBuffer.clear();
+  for (unsigned int i = 0; i + 1 < numScans; ++i) {
+    std::set<unsigned int> neighbors;
+    unsigned int maxNeighbors = (std::min)(numNeighbors,
+        (std::min)(kScanWindow, numScans - i - 1));
+    while (neighbors.size() < maxNeighbors) {
+      unsigned int j = i + 1 + PeakDistribution::lcg_rand() %
+          (std::min)(kScanWindow, numScans - i - 1);
+      if (neighbors.insert(j).second) {
+        pvalBuffer.push_back(PvalueTriplet(ScanId(0, i), ScanId(0, j),
+            static_cast<float>(-30.0 * PeakDistribution::lcg_rand_unif())));
+        if (bothDirections) {
+          pvalBuffer.push_back(PvalueTriplet(ScanId(0, j), ScanId(0, i),
+              static_cast<float>(-30.0 * PeakDistribution::lcg_rand_unif())));
+        }
+      }
+    }
+  }
+}
+
+class PvalVectorPolyfitBenchmark : public MicroBenchmark {
+ public:
+  PvalVectorPolyfitBenchmark() :
+    MicroBenchmark("computePvalVectorPolyfit", "p-value vectors") {}
+
+  void init() {
+    PeakDistribution::setSeed(1);
+    initPeakDistribution(distribution_);
+
+    peakBins_.resize(kNumPvecs);
+    for (unsigned int i = 0; i < kNumPvecs; ++i) {
+      distribution_.generateRandSpec(peakBins_[i],
+          PvalueCalculator::getMaxScoringPeaksConstant());
+    }
+    // the p-value vectors need the probability of a peak in each bin
+    distribution_.rescale(PvalueCalculator::getMaxScoringPeaksConstant());
+  }
+
+  size_t getNumItems() const { return kNumPvecs; }
+
+  double run(double& checksum) {
+    std::vector< std::vector<unsigned int> > peakBins(peakBins_);
+    double startTime = getWallSeconds();
+    for (unsigned int i = 0; i < kNumPvecs; ++i) {
+      PvalueCalculator pvalCalc;
+      pvalCalc.setPeakBins(peakBins[i]);
+      pvalCalc.computePvalVectorPolyfit(distribution_.getDistribution());
+      checksum += pvalCalc.getNumScoringPeaks();
+    }
+    return getWallSeconds() - startTime;
+  }
+
+ protected:
+  static const unsigned int kNumPvecs = 200u;
+  PeakDistribution distribution_;
+  std::vector< std::vector<unsigned int> > peakBins_;
+};
+
+class PvalPolyfitBenchmark : public MicroBenchmark {
+ public:
+  PvalPolyfitBenchmark() :
+    MicroBenchmark("computePvalPolyfit", "spectrum pairs") {}
+  explicit PvalPolyfitBenchmark(const std::string& name) :
+    MicroBenchmark(name, "spectrum pairs") {}
+
+  void init() {
+    PeakDistribution::setSeed(1);
+    PeakDistribution distribution, matchDistribution;
+    initPeakDistribution(distribution);
+    matchDistribution.init(kNumPeakBins);
+    matchDistribution.setUniform(kMatchProb);
+
+    unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaksConstant();
+    std::vector< std::vector<unsigned int> > targetPeakBins(kNumPvecs);
+    for (unsigned int i = 0; i < kNumPvecs; ++i) {
+      distribution.generateRandSpec(targetPeakBins[i], numScoringPeaks);
+    }
+
+    queryPeakBins_.resize(kNumQueries);
+    for (unsigned int j = 0; j < kNumQueries; ++j) {
+      generateQueryPeakBins(distribution, matchDistribution, numScoringPeaks,
+          targetPeakBins[j % kNumPvecs], queryPeakBins_[j]);
+    }
+
+    distribution.rescale(numScoringPeaks);
+    pvalCalcs_.resize(kNumPvecs);
+    for (unsigned int i = 0; i < kNumPvecs; ++i) {
+      pvalCalcs_[i].setPeakBins(targetPeakBins[i]);
+      pvalCalcs_[i].computePvalVectorPolyfit(distribution.getDistribution());
+    }
+  }
+
+  size_t getNumItems() const { return kNumPvecs * kNumQueries; }
+
+  double run(double& checksum) {
+    double startTime = getWallSeconds();
+    for (unsigned int i = 0; i < kNumPvecs; ++i) {
+      for (unsigned int j = 0; j < kNumQueries; ++j) {
+        checksum += pvalCalcs_[i].computePvalPolyfit(queryPeakBins_[j]);
+      }
+    }
+    return getWallSeconds() - startTime;
+  }
+
+ protected:
+  static const unsigned int kNumPvecs = 100u, kNumQueries = 1000u;
+  static const double kMatchProb;
+  std::vector<PvalueCalculator> pvalCalcs_;
+  std::vector< std::vector<unsigned int> > queryPeakBins_;
+};
+
+const double PvalPolyfitBenchmark::kMatchProb = 0.3;
+
+// same inputs as PvalPolyfitBenchmark, each query scored against all
+// p-value vectors in one batch
+class PvalPolyfitBatchBenchmark : public PvalPolyfitBenchmark {
+ public:
+  PvalPolyfitBatchBenchmark() :
+    PvalPolyfitBenchmark("computePvalPolyfitBatch") {}
+
+  void init() {
+    PvalPolyfitBenchmark::init();
+    candidates_.clear();
+    for (unsigned int i = 0; i < kNumPvecs; ++i) {
+      candidates_.push_back(&pvalCalcs_[i]);
+    }
+  }
+
+  double run(double& checksum) {
+    std::vector<double> logPvals;
+    std::vector<unsigned char> queryBinMask;
+    double startTime = getWallSeconds();
+    for (unsigned int j = 0; j < kNumQueries; ++j) {
+      PvalueCalculator::computePvalPolyfitBatch(queryPeakBins_[j], 
+          candidates_, logPvals, queryBinMask);
+      checksum += std::accumulate(logPvals.begin(), logPvals.end(), 0.0);
+    }
+    return getWallSeconds() - startTime;
+  }
+
+ protected:
+  std::vector<const PvalueCalculator*> candidates_;
+};
+
+class BinBinaryTruncatedBenchmark : public MicroBenchmark {
+ public:
+  BinBinaryTruncatedBenchmark() :
+    MicroBenchmark("binBinaryTruncated", "spectra") {}
+
+  void init() {
+    PeakDistribution::setSeed(1);
+    PeakDistribution distribution;
+    initPeakDistribution(distribution);
+
+    spectra_.resize(kNumSpectra);
+    for (unsigned int i = 0; i < kNumSpectra; ++i) {
+      std::vector<unsigned int> peakBins;
+      bool withDuplicates = true;
+      distribution.generateRandSpec(peakBins, kNumPeaks, withDuplicates);
+      generateSpectrum(peakBins, spectra_[i]);
+    }
+  }
+
+  size_t getNumItems() const { return kNumSpectra; }
+
+  double run(double& checksum) {
+    // binBinaryTruncated sorts the peaks by intensity
+    std::vector< std::vector<MZIntensityPair> > spectra(spectra_);
+    double precMass = BinSpectra::getMZ(kNumPeakBins);
+    double startTime = getWallSeconds();
+    std::vector<unsigned int> peakBins;
+    for (unsigned int i = 0; i < kNumSpectra; ++i) {
+      BinSpectra::binBinaryTruncated(spectra[i], peakBins,
+          PvalueCalculator::getMaxScoringPeaksConstant(), precMass);
+      checksum += peakBins.size();
+    }
+    return getWallSeconds() - startTime;
+  }
+
+ protected:
+  static const unsigned int kNumSpectra = 1000u;
+  std::vector< std::vector<MZIntensityPair> > spectra_;
+};
+
+class SparseMatrixMergeBenchmark : public MicroBenchmark {
+ public:
+  SparseMatrixMergeBenchmark() :
+    MicroBenchmark("SparseMatrix::merge", "merges") {}
+
+  void init() {
+    PeakDistribution::setSeed(1);
+    bool bothDirections = false;
+    generatePvalueTriplets(kNumScans, kNumNeighbors, bothDirections, pvalBuffer_);
+  }
+
+  size_t getNumItems() const { return kNumScans / 2; }
+
+  /* merges pairs of neighboring scans, which share most of their links */
+  double run(double& checksum) {
+    SparseMatrix matrix;
+    matrix.reserve(kNumScans + kNumScans / 2);
+    BOOST_FOREACH (const PvalueTriplet& pvalTriplet, pvalBuffer_) {
+      matrix.insert(pvalTriplet.scannr1, pvalTriplet.scannr2, pvalTriplet.pval);
+    }
+    matrix.sortRows();
+
+    std::priority_queue<SparseEdge> edgeList;
+    double startTime = getWallSeconds();
+    for (unsigned int i = 0; i < kNumScans / 2; ++i) {
+      matrix.merge(ScanId(0, 2*i), ScanId(0, 2*i + 1), ScanId(1, i), edgeList);
+    }
+    double seconds = getWallSeconds() - startTime;
+    checksum += edgeList.size();
+    return seconds;
+  }
+
+ protected:
+  static const unsigned int kNumScans = 20000u, kNumNeighbors = 10u;
+  std::vector<PvalueTriplet> pvalBuffer_;
+};
+
+class ClusterMergeBenchmark : public MicroBenchmark {
+ public:
+  ClusterMergeBenchmark() :
+    MicroBenchmark("MSClusterMerge::merge", "clusters") {}
+
+  void init() {
+    MSClusterMerge::init();
+    PeakDistribution::setSeed(1);
+    PeakDistribution distribution, retainDistribution;
+    initPeakDistribution(distribution);
+    retainDistribution.init(kNumPeakBins);
+    retainDistribution.setUniform(kRetainProb);
+
+    clusters_.resize(kNumClusters);
+    for (unsigned int i = 0; i < kNumClusters; ++i) {
+      std::vector<unsigned int> sharedPeakBins;
+      distribution.generateRandSpec(sharedPeakBins, kNumPeaks / 2);
+
+      clusters_[i].resize(kClusterSize);
+      for (unsigned int j = 0; j < kClusterSize; ++j) {
+        std::vector<unsigned int> retainedPeakBins, noisePeakBins;
+        retainDistribution.generateRandSpecBernoulli(retainedPeakBins,
+            kNumPeaks / 2, sharedPeakBins);
+        distribution.generateRandSpec(noisePeakBins, kNumPeaks / 2);
+
+        std::vector<MZIntensityPair> mziPairs;
+        generateSpectrum(retainedPeakBins, mziPairs);
+        generateSpectrum(noisePeakBins, mziPairs);
+        std::sort(mziPairs.begin(), mziPairs.end(), SpectrumHandler::lessMZ);
+        MSClusterMerge::binMZIntensityPairs(mziPairs, clusters_[i][j]);
+      }
+    }
+  }
+
+  size_t getNumItems() const { return kNumClusters; }
+
+  double run(double& checksum) {
+    std::vector< std::vector< std::vector<BinnedMZIntensityPair> > > clusters(clusters_);
+    std::vector<BinnedMZIntensityPair> mergedSpectrum;
+    double startTime = getWallSeconds();
+    for (unsigned int i = 0; i < kNumClusters; ++i) {
+      MSClusterMerge::merge(clusters[i], mergedSpectrum);
+      checksum += mergedSpectrum.size();
+    }
+    return getWallSeconds() - startTime;
+  }
+
+ protected:
+  static const unsigned int kNumClusters = 200u, kClusterSize = 10u;
+  static const double kRetainProb;
+  std::vector< std::vector< std::vector<BinnedMZIntensityPair> > > clusters_;
+};
+
+const double ClusterMergeBenchmark::kRetainProb = 0.7;
+
+class FilterAndSortBenchmark : public MicroBenchmark {
+ public:
+  FilterAndSortBenchmark() :
+    MicroBenchmark("PvalueFilterAndSort::filterAndSort", "p-values") {}
+
+  void init() {
+    PeakDistribution::setSeed(1);
+    bool bothDirections = true;
+    generatePvalueTriplets(kNumScans, kNumNeighbors, bothDirections, pvalBuffer_);
+  }
+
+  size_t getNumItems() const { return pvalBuffer_.size(); }
+
+  double run(double& checksum) {
+    std::vector<PvalueTriplet> pvalBuffer(pvalBuffer_);
+    double startTime = getWallSeconds();
+    PvalueFilterAndSort::filterAndSort(pvalBuffer);
+    double seconds = getWallSeconds() - startTime;
+    checksum += pvalBuffer.size();
+    return seconds;
+  }
+
+ protected:
+  static const unsigned int kNumScans = 50000u, kNumNeighbors = 10u;
+  std::vector<PvalueTriplet> pvalBuffer_;
+};
+
+} /* anonymous namespace */
+
+double MicroBenchmark::getWallSeconds() {
+  static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+  return (boost::posix_time::microsec_clock::universal_time() - epoch)
+             .total_microseconds() / 1e6;
+}
+
+MicroBenchmarks::MicroBenchmarks() : numThreads_(1), numRepetitions_(5),
+    tolerance_(0.1), listOnly_(false) {
+  benchmarks_.push_back(new PvalVectorPolyfitBenchmark());
+  benchmarks_.push_back(new PvalPolyfitBenchmark());
+  benchmarks_.push_back(new PvalPolyfitBatchBenchmark());
+  benchmarks_.push_back(new BinBinaryTruncatedBenchmark());
+  benchmarks_.push_back(new SparseMatrixMergeBenchmark());
+  benchmarks_.push_back(new ClusterMergeBenchmark());
+  benchmarks_.push_back(new FilterAndSortBenchmark());
+}
+
+MicroBenchmarks::~MicroBenchmarks() {
+  BOOST_FOREACH (MicroBenchmark* benchmark, benchmarks_) {
+    delete benchmark;
+  }
+}
+
+bool MicroBenchmarks::parseOptions(int argc, char **argv) {
+  std::ostringstream intro;
+  intro << "MaRaCluster micro-benchmarks version " << VERSION << "\n";
+  intro << "Usage:" << std::endl;
+  intro << "  maracluster-bench [-t <threads>] [-o <results_json>] [--baseline <baseline_json>]\n";
+  intro << std::endl;
+  intro << "  Times the scoring, clustering and merging kernels on reproducible\n";
+  intro << "  synthetic spectra and reports the number of processed items per second\n";
+  intro << "  of a single thread. Store the output of a run with -o and pass it as\n";
+  intro << "  --baseline to a later run to compare the throughput of the kernels.\n";
+  intro << std::endl;
+
+  CommandLineParser cmd(intro.str());
+  cmd.defineOption("t",
+      "threads",
+      "Number of threads that run each benchmark simultaneously. The threads share the generated inputs, benchmarks that modify their inputs work on a per run copy (default: 1).",
+      "int");
+  cmd.defineOption("r",
+      "repetitions",
+      "Number of timed runs of each benchmark, the median is reported (default: 5).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "filter",
+      "Only run the benchmarks whose name contains this string.",
+      "string");
+  cmd.defineOption("o",
+      "output",
+      "Write the results as JSON to this file.",
+      "filename");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "baseline",
+      "Compare the throughput per core to the results in this file, as written by -o.",
+      "filename");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "tolerance",
+      "Relative decrease of the throughput per core compared to the baseline that is reported as a regression (default: 0.1).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "list",
+      "List the benchmarks and exit.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption("v",
+      "verbatim",
+      "Set the verbatim level (lowest: 0, highest: 5, default: 3).",
+      "int");
+
+  cmd.parseArgs(argc, argv);
+
+  if (cmd.optionSet("threads")) numThreads_ = cmd.getInt("threads", 1, 1024);
+  if (cmd.optionSet("repetitions")) numRepetitions_ = cmd.getInt("repetitions", 1, 1000);
+  if (cmd.optionSet("filter")) filter_ = cmd.options["filter"];
+  if (cmd.optionSet("output")) outputFN_ = cmd.options["output"];
+  if (cmd.optionSet("baseline")) baselineFN_ = cmd.options["baseline"];
+  if (cmd.optionSet("tolerance")) tolerance_ = cmd.getDouble("tolerance", 0.0, 1.0);
+  if (cmd.optionSet("list")) listOnly_ = true;
+  if (cmd.optionSet("verbatim")) Globals::VERB = cmd.getInt("verbatim", 0, 5);
+
+  return true;
+}
+
+int MicroBenchmarks::run() {
+  if (listOnly_) {
+    BOOST_FOREACH (MicroBenchmark* benchmark, benchmarks_) {
+      std::cout << benchmark->getName() << std::endl;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  std::map<std::string, double> baseline;
+  if (!baselineFN_.empty() && !readBaseline(baseline)) {
+    return EXIT_FAILURE;
+  }
+
+  std::cout << std::left << std::setw(38) << "Benchmark" << std::right
+            << std::setw(12) << "Time/run" << std::setw(10) << "Items"
+            << std::setw(16) << "Items/s/core" << std::setw(16) << "Baseline"
+            << std::setw(10) << "Change" << std::endl;
+
+  std::vector<MicroBenchmarkResult> results;
+  bool hasRegression = false;
+  BOOST_FOREACH (MicroBenchmark* benchmark, benchmarks_) {
+    if (benchmark->getName().find(filter_) == std::string::npos) continue;
+
+    MicroBenchmarkResult result;
+    runBenchmark(*benchmark, result);
+
+    std::map<std::string, double>::const_iterator it = baseline.find(result.name);
+    if (it != baseline.end()) {
+      result.baselineItemsPerSecondPerCore = it->second;
+      if (result.itemsPerSecondPerCore < (1.0 - tolerance_) * it->second) {
+        hasRegression = true;
+      }
+    }
+    printResult(result);
+    results.push_back(result);
+  }
+
+  if (!outputFN_.empty() && !writeResults(results)) {
+    return EXIT_FAILURE;
+  }
+
+  if (hasRegression) {
+    std::cerr << "Error: the throughput per core of at least one benchmark "
+              << "decreased by more than " << tolerance_ * 100
+              << "% compared to the baseline" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* Every thread runs the kernel on the full inputs, such that the throughput
+   per core also reflects the contention for memory bandwidth and caches when
+   all cores are busy. The first run is a warm-up and is not reported. */
+void MicroBenchmarks::runBenchmark(MicroBenchmark& benchmark,
+    MicroBenchmarkResult& result) {
+  if (Globals::VERB > 2) {
+    std::cerr << "Generating inputs for " << benchmark.getName() << std::endl;
+  }
+  benchmark.init();
+
+  result.name = benchmark.getName();
+  result.itemName = benchmark.getItemName();
+  result.numItems = benchmark.getNumItems();
+
+  std::vector<double> secondsPerRun;
+  for (int rep = 0; rep <= numRepetitions_; ++rep) {
+    std::vector<double> threadSeconds(numThreads_, 0.0);
+    double checksum = 0.0;
+  #pragma omp parallel for schedule(static, 1) num_threads(numThreads_) reduction(+:checksum)
+    for (int t = 0; t < numThreads_; ++t) {
+      threadSeconds[t] = benchmark.run(checksum);
+    }
+
+    if (Globals::VERB > 4) {
+      std::cerr << result.name << " checksum: " << checksum << std::endl;
+    }
+    if (rep == 0) continue;
+
+    double sumSeconds = 0.0;
+    BOOST_FOREACH (const double seconds, threadSeconds) {
+      sumSeconds += seconds;
+    }
+    secondsPerRun.push_back(sumSeconds / numThreads_);
+  }
+
+  std::nth_element(secondsPerRun.begin(),
+      secondsPerRun.begin() + secondsPerRun.size() / 2, secondsPerRun.end());
+  result.secondsPerRun = secondsPerRun[secondsPerRun.size() / 2];
+  if (result.secondsPerRun > 0.0) {
+    result.itemsPerSecondPerCore = result.numItems / result.secondsPerRun;
+    result.itemsPerSecond = result.itemsPerSecondPerCore * numThreads_;
+  }
+}
+
+void MicroBenchmarks::printResult(const MicroBenchmarkResult& result) {
+  std::cout << std::left << std::setw(38) << result.name << std::right
+            << std::fixed << std::setprecision(2)
+            << std::setw(10) << result.secondsPerRun * 1000.0 << "ms"
+            << std::setw(10) << result.numItems
+            << std::setprecision(0) << std::setw(16) << result.itemsPerSecondPerCore;
+  if (result.baselineItemsPerSecondPerCore > 0.0) {
+    double change = result.itemsPerSecondPerCore / result.baselineItemsPerSecondPerCore - 1.0;
+    std::cout << std::setw(16) << result.baselineItemsPerSecondPerCore
+              << std::setprecision(1) << std::showpos
+              << std::setw(9) << change * 100.0 << "%" << std::noshowpos;
+    if (change < -tolerance_) std::cout << "  REGRESSION";
+  }
+  std::cout << std::endl;
+  std::cout.unsetf(std::ios_base::floatfield);
+  std::cout << std::setprecision(6);
+}
+
+/* Reads the results written by writeResults, which has one benchmark per
+   line, such that no general JSON parser is needed. */
+bool MicroBenchmarks::readBaseline(std::map<std::string, double>& baseline) {
+  std::ifstream baselineStream(baselineFN_.c_str(), std::ios_base::in);
+  if (!baselineStream.is_open()) {
+    std::cerr << "Error: could not read baseline from " << baselineFN_ << std::endl;
+    return false;
+  }
+
+  const std::string nameKey = "\"name\": \"";
+  const std::string throughputKey = "\"items_per_second_per_core\": ";
+  std::string line;
+  while (getline(baselineStream, line)) {
+    size_t namePos = line.find(nameKey);
+    size_t throughputPos = line.find(throughputKey);
+    if (namePos == std::string::npos || throughputPos == std::string::npos) {
+      continue;
+    }
+    namePos += nameKey.size();
+    std::string name = line.substr(namePos, line.find('"', namePos) - namePos);
+    baseline[name] = atof(line.c_str() + throughputPos + throughputKey.size());
+  }
+
+  if (baseline.empty()) {
+    std::cerr << "Error: no benchmark results found in baseline " << baselineFN_ << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool MicroBenchmarks::writeResults(const std::vector<MicroBenchmarkResult>& results) {
+  std::ofstream outputStream(outputFN_.c_str(), std::ios_base::out);
+  if (!outputStream.is_open()) {
+    std::cerr << "Error: could not write results to " << outputFN_ << std::endl;
+    return false;
+  }
+
+  outputStream << std::setprecision(10) << "{\n"
+      << "  \"version\": \"" << VERSION << "\",\n"
+      << "  \"threads\": " << numThreads_ << ",\n"
+      << "  \"repetitions\": " << numRepetitions_ << ",\n"
+      << "  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const MicroBenchmarkResult& result = results[i];
+    outputStream << "    {\"name\": \"" << result.name << "\""
+        << ", \"items\": " << result.numItems
+        << ", \"item_name\": \"" << result.itemName << "\""
+        << ", \"seconds_per_run\": " << result.secondsPerRun
+        << ", \"items_per_second\": " << result.itemsPerSecond
+        << ", \"items_per_second_per_core\": " << result.itemsPerSecondPerCore
+        << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  outputStream << "  ]\n}\n";
+  return true;
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,101 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_MICROBENCHMARKS_H_
+#define MARACLUSTER_MICROBENCHMARKS_H_
+
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "Option.h"
+#include "Globals.h"
+#include "Version.h"
+
+namespace maracluster {
+
+/* A kernel with reproducible synthetic inputs. init() generates the inputs
+   single threaded, as the random number generator of PeakDistribution is not
+   thread safe; run() has to be thread safe, as every thread of a benchmark
+   runs the kernel on the same inputs. run() returns the number of seconds
+   spent in the kernel, copying of the inputs is not included. */
+class MicroBenchmark {
+ public:
+  MicroBenchmark(const std::string& name, const std::string& itemName) :
+    name_(name), itemName_(itemName) {}
+  virtual ~MicroBenchmark() {}
+
+  virtual void init() = 0;
+  virtual size_t getNumItems() const = 0;
+  virtual double run(double& checksum) = 0;
+
+  inline const std::string& getName() const { return name_; }
+  inline const std::string& getItemName() const { return itemName_; }
+
+  static double getWallSeconds();
+ protected:
+  std::string name_, itemName_;
+};
+
+struct MicroBenchmarkResult {
+  std::string name, itemName;
+  size_t numItems;
+  double secondsPerRun; // median over the repetitions
+  double itemsPerSecond, itemsPerSecondPerCore;
+  double baselineItemsPerSecondPerCore; // 0.0 if not in the baseline
+
+  MicroBenchmarkResult() : numItems(0u), secondsPerRun(0.0),
+    itemsPerSecond(0.0), itemsPerSecondPerCore(0.0),
+    baselineItemsPerSecondPerCore(0.0) {}
+};
+
+/* Driver of the maracluster-bench executable. Runs each benchmark on
+   numThreads threads, reports the throughput per core, i.e. the number of
+   processed items per second of a single thread, and compares it to a
+   baseline written by an earlier run with --output. */
+class MicroBenchmarks {
+ public:
+  MicroBenchmarks();
+  ~MicroBenchmarks();
+
+  bool parseOptions(int argc, char **argv);
+  int run();
+
+ protected:
+  std::vector<MicroBenchmark*> benchmarks_;
+  int numThreads_, numRepetitions_;
+  double tolerance_;
+  std::string filter_, outputFN_, baselineFN_;
+  bool listOnly_;
+
+  void runBenchmark(MicroBenchmark& benchmark, MicroBenchmarkResult& result);
+  void printResult(const MicroBenchmarkResult& result);
+  bool readBaseline(std::map<std::string, double>& baseline);
+  bool writeResults(const std::vector<MicroBenchmarkResult>& results);
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_MICROBENCHMARKS_H_ */
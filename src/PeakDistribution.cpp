@@ -27,10 +27,12 @@ unsigned long PeakDistribution::seed = 1;
 void PeakDistribution::init(unsigned int numBins) {
   peakDist_.clear();
   peakDist_.resize(numBins);
+  cumPeakDist_.clear();
 }
 
 void PeakDistribution::insert(unsigned int bin, double value) {
   peakDist_.at(bin) = value;
+  cumPeakDist_.clear();
 }
 
 void PeakDistribution::print() {
@@ -44,12 +46,14 @@ void PeakDistribution::rescale(double scalingFactor) {
   BOOST_FOREACH(double & value, peakDist_) {
     value *= scalingFactor;
   }
+  cumPeakDist_.clear();
 }
 
 void PeakDistribution::setUniform(double prob) {
   BOOST_FOREACH(double & value, peakDist_) {
     value = prob;
   }
+  cumPeakDist_.clear();
 }
 
 // Calculate Bhattacharyya distance
@@ -86,24 +90,26 @@ double PeakDistribution::lcg_rand_unif() {
 
 void PeakDistribution::generateRandSpec(std::vector<unsigned int>& peakBins, const unsigned int numQueryPeaks, bool withDuplicates) {
   peakBins.clear();
-  std::vector<double> cumPeakDist(peakDist_.size() + 1);
-  cumPeakDist[0] = 0.0;
-  
-  std::partial_sum(peakDist_.begin(), peakDist_.end(), cumPeakDist.begin() + 1);
+  if (cumPeakDist_.size() != peakDist_.size() + 1) {
+    cumPeakDist_.resize(peakDist_.size() + 1);
+    cumPeakDist_[0] = 0.0;
+    std::partial_sum(peakDist_.begin(), peakDist_.end(), cumPeakDist_.begin() + 1);
+  }
   
   std::map<unsigned int, bool> hasPeak;
   for (unsigned int i = 0; i < numQueryPeaks; ++i) {
     bool peakAdded = false;
     while (!peakAdded) {
       double uniRand = lcg_rand_unif();
-      for (unsigned int j = 0; j < cumPeakDist.size() - 1; ++j) {
-        if (uniRand < cumPeakDist[j+1] && uniRand > cumPeakDist[j]) {
-          if (!hasPeak[j] || withDuplicates) {
-            peakBins.push_back(j);
-            hasPeak[j] = true;
-            peakAdded = true;
-          }
-          break;
+      // first bin j with uniRand < cumPeakDist_[j+1], draws on a bin 
+      // boundary are rejected
+      unsigned int j = std::upper_bound(cumPeakDist_.begin() + 1, 
+          cumPeakDist_.end(), uniRand) - (cumPeakDist_.begin() + 1);
+      if (j < peakDist_.size() && uniRand > cumPeakDist_[j]) {
+        if (!hasPeak[j] || withDuplicates) {
+          peakBins.push_back(j);
+          hasPeak[j] = true;
+          peakAdded = true;
         }
       }
     }
@@ -134,6 +140,7 @@ NB: can only parse files with constant step size starting from 0.0 for now
 void PeakDistribution::readPeakProbabilities(std::string peakProbFN) {
   std::ifstream peakProbStream(peakProbFN.c_str());
   peakDist_.clear();
+  cumPeakDist_.clear();
   if (peakProbStream.is_open()) {
     bool foundStepSize = false;
     std::string line;
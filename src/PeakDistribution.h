@@ -69,6 +69,7 @@ class PeakDistribution {
   static bool peakProbUnitTest(std::string peakProbFN);
  private:
   std::vector<double> peakDist_;
+  std::vector<double> cumPeakDist_; // cache for generateRandSpec
   double stepSize_;
   
   inline unsigned int getFracBin(unsigned int mzBin, double precMz) {
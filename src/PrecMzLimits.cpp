@@ -0,0 +1,54 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "PrecMzLimits.h"
+
+namespace maracluster {
+
+void PrecMzLimits::finalize() {
+  bool isSorted = true;
+  for (size_t i = 1u; i < limits_.size() && isSorted; ++i) {
+    isSorted = !(limits_[i] < limits_[i-1]);
+  }
+  if (!isSorted) std::sort(limits_.begin(), limits_.end());
+  
+  // merge duplicate entries, e.g. multiple charge states of the same scan
+  size_t numUnique = 0u;
+  for (size_t i = 0u; i < limits_.size(); ++i) {
+    if (numUnique > 0u && limits_[numUnique-1].scanId == limits_[i].scanId) {
+      PrecMzLimit& pl = limits_[numUnique-1];
+      pl.minPrecMz = (std::min)(pl.minPrecMz, limits_[i].minPrecMz);
+      pl.maxPrecMz = (std::max)(pl.maxPrecMz, limits_[i].maxPrecMz);
+    } else {
+      limits_[numUnique++] = limits_[i];
+    }
+  }
+  limits_.resize(numUnique);
+  
+  fileOffsets_.clear();
+  if (limits_.empty()) return;
+  
+  size_t numFiles = static_cast<size_t>(limits_.back().scanId.fileIdx) + 1u;
+  fileOffsets_.resize(numFiles + 1u, 0u);
+  for (size_t i = 0u; i < limits_.size(); ++i) {
+    ++fileOffsets_[limits_[i].scanId.fileIdx + 1u];
+  }
+  for (size_t f = 0u; f < numFiles; ++f) {
+    fileOffsets_[f + 1u] += fileOffsets_[f];
+  }
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,87 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_PRECMZLIMITS_H_
+#define MARACLUSTER_PRECMZLIMITS_H_
+
+#include <vector>
+#include <algorithm>
+
+#include "ScanId.h"
+
+namespace maracluster {
+
+struct PrecMzLimit {
+  PrecMzLimit() : scanId(), minPrecMz(0.0f), maxPrecMz(0.0f) {}
+  PrecMzLimit(const ScanId& si, float minMz, float maxMz) :
+    scanId(si), minPrecMz(minMz), maxPrecMz(maxMz) {}
+  
+  ScanId scanId;
+  float minPrecMz, maxPrecMz;
+  
+  bool operator<(const PrecMzLimit& pl) const {
+    return (scanId < pl.scanId);
+  }
+};
+
+/* Minimum and maximum precursor m/z over the charge states of each scan, 
+   stored as a flat array sorted by ScanId with an offset per file. Lookups
+   do a branch-free binary search over the scans of a single file. Call 
+   finalize() after the last add() and before the first lookup. Scans that 
+   were never added have limits (0.0, 0.0), as before with std::map. */
+class PrecMzLimits {
+ public:
+  PrecMzLimits() {}
+  
+  inline void add(const ScanId& si, float minPrecMz, float maxPrecMz) {
+    limits_.push_back(PrecMzLimit(si, minPrecMz, maxPrecMz));
+  }
+  void finalize();
+  
+  inline float getMinPrecMz(const ScanId& si) const { 
+    return find(si).minPrecMz;
+  }
+  inline float getMaxPrecMz(const ScanId& si) const { 
+    return find(si).maxPrecMz;
+  }
+  inline size_t size() const { return limits_.size(); }
+  
+ protected:
+  std::vector<PrecMzLimit> limits_;
+  // limits_[fileOffsets_[f]] to limits_[fileOffsets_[f+1]] belong to file f
+  std::vector<size_t> fileOffsets_;
+  PrecMzLimit missingLimit_;
+  
+  inline const PrecMzLimit& find(const ScanId& si) const {
+    if (static_cast<size_t>(si.fileIdx) + 1u >= fileOffsets_.size()) {
+      return missingLimit_;
+    }
+    size_t n = fileOffsets_[si.fileIdx + 1u] - fileOffsets_[si.fileIdx];
+    if (n == 0u) return missingLimit_;
+    
+    const PrecMzLimit* base = &limits_[fileOffsets_[si.fileIdx]];
+    while (n > 1u) {
+      size_t half = n / 2u;
+      base = (base[half].scanId.scannr <= si.scannr) ? base + half : base;
+      n -= half;
+    }
+    return (base->scanId.scannr == si.scannr) ? *base : missingLimit_;
+  }
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_PRECMZLIMITS_H_ */
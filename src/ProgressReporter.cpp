@@ -0,0 +1,312 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "ProgressReporter.h"
+#include "StageProfiler.h"
+
+#ifndef _WIN32
+  #include <cerrno>
+  #include <csignal>
+  #include <cstring>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+#endif
+
+namespace maracluster {
+
+boost::mutex ProgressReporter::mutex_;
+int ProgressReporter::fd_ = -1;
+bool ProgressReporter::closeFd_ = false;
+unsigned int ProgressReporter::streamIntervalSeconds_ = 1u;
+const unsigned int ProgressReporter::kTextIntervalSeconds = 10u;
+
+boost::posix_time::ptime ProgressReporter::runStartTime_ = 
+    boost::posix_time::microsec_clock::universal_time();
+boost::posix_time::ptime ProgressReporter::taskStartTime_ = 
+    ProgressReporter::runStartTime_;
+std::vector<std::string> ProgressReporter::stages_;
+std::string ProgressReporter::task_;
+unsigned long long ProgressReporter::itemsDone_ = 0ull;
+unsigned long long ProgressReporter::totalItems_ = 0ull;
+time_t ProgressReporter::nextReportTime_ = 0;
+time_t ProgressReporter::nextStreamTime_ = 0;
+time_t ProgressReporter::nextTextTime_ = 0;
+time_t ProgressReporter::textStartTime_ = 0;
+clock_t ProgressReporter::textStartClock_ = 0;
+
+#ifdef _WIN32
+
+bool ProgressReporter::open(const std::string& target) {
+  std::cerr << "Error: progress streams are not available on Windows" << std::endl;
+  return false;
+}
+
+void ProgressReporter::close(int exitCode) {}
+
+void ProgressReporter::writeEvent(std::ostringstream& oss) {}
+
+#else
+
+bool ProgressReporter::open(const std::string& target) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (target.empty()) {
+    std::cerr << "Error: no target given for the progress stream" << std::endl;
+    return false;
+  }
+  
+  // a consumer closing its end of a pipe or socket should not terminate the run
+  signal(SIGPIPE, SIG_IGN);
+  
+  if (target.find_first_not_of("0123456789") == std::string::npos) {
+    fd_ = atoi(target.c_str());
+    closeFd_ = false;
+    if (fcntl(fd_, F_GETFD) < 0) {
+      std::cerr << "Error: " << target << " is not an open file descriptor" 
+                << std::endl;
+      fd_ = -1;
+      return false;
+    }
+  } else if (target.substr(0, 5) == "unix:") {
+    std::string socketFN = target.substr(5);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketFN.empty() || socketFN.size() >= sizeof(address.sun_path)) {
+      std::cerr << "Error: invalid socket path " << socketFN << ", use at most "
+                << sizeof(address.sun_path) - 1 << " characters" << std::endl;
+      return false;
+    }
+    strncpy(address.sun_path, socketFN.c_str(), sizeof(address.sun_path) - 1);
+    
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    closeFd_ = true;
+    if (fd_ < 0 || connect(fd_, reinterpret_cast<struct sockaddr*>(&address), 
+                           sizeof(address)) < 0) {
+      std::cerr << "Error: could not connect to socket " << socketFN << ": " 
+                << strerror(errno) << std::endl;
+      if (fd_ >= 0) ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+  } else {
+    fd_ = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    closeFd_ = true;
+    if (fd_ < 0) {
+      std::cerr << "Error: could not open progress stream " << target << ": " 
+                << strerror(errno) << std::endl;
+      return false;
+    }
+  }
+  
+  runStartTime_ = boost::posix_time::microsec_clock::universal_time();
+  std::ostringstream oss;
+  startEvent(oss, "started");
+  oss << ", \"pid\": " << getpid();
+  writeEvent(oss);
+  updateNextReportTime();
+  return true;
+}
+
+void ProgressReporter::close(int exitCode) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (fd_ < 0) return;
+  
+  std::ostringstream oss;
+  startEvent(oss, "finished");
+  oss << ", \"exit_code\": " << exitCode
+      << ", \"peak_rss_mb\": " << Globals::getPeakMemoryMB();
+  writeEvent(oss);
+  
+  if (fd_ >= 0 && closeFd_) ::close(fd_);
+  fd_ = -1;
+  updateNextReportTime();
+}
+
+/* A failed write, e.g. because the consumer went away, closes the stream 
+   instead of failing the run */
+void ProgressReporter::writeEvent(std::ostringstream& oss) {
+  if (fd_ < 0) return;
+  oss << "}\n";
+  std::string event = oss.str();
+  const char* buffer = event.c_str();
+  size_t numBytes = event.size();
+  while (numBytes > 0) {
+    ssize_t numWritten = ::write(fd_, buffer, numBytes);
+    if (numWritten < 0 && errno == EINTR) continue;
+    if (numWritten <= 0) {
+      if (Globals::VERB > 1) {
+        std::cerr << "Warning: could not write to the progress stream, "
+                  << "no further progress events will be written" << std::endl;
+      }
+      if (closeFd_) ::close(fd_);
+      fd_ = -1;
+      updateNextReportTime();
+      return;
+    }
+    buffer += numWritten;
+    numBytes -= numWritten;
+  }
+}
+
+#endif /* _WIN32 */
+
+void ProgressReporter::beginStage(const std::string& stage) {
+  boost::mutex::scoped_lock lock(mutex_);
+  stages_.push_back(stage);
+  task_.clear();
+  totalItems_ = 0ull;
+  itemsDone_ = 0ull;
+  
+  std::ostringstream oss;
+  startEvent(oss, "stage_start");
+  oss << ", \"stage\": \"" << StageProfiler::escapeJson(stage) << "\"";
+  writeEvent(oss);
+}
+
+void ProgressReporter::endStage(const std::string& stage, double wallSeconds) {
+  boost::mutex::scoped_lock lock(mutex_);
+  std::ostringstream oss;
+  startEvent(oss, "stage_end");
+  oss << ", \"stage\": \"" << StageProfiler::escapeJson(stage) << "\""
+      << ", \"wall_seconds\": " << wallSeconds
+      << ", \"rss_mb\": " << Globals::getCurrentMemoryMB()
+      << ", \"peak_rss_mb\": " << Globals::getPeakMemoryMB();
+  writeEvent(oss);
+  
+  std::vector<std::string>::reverse_iterator it = 
+      std::find(stages_.rbegin(), stages_.rend(), stage);
+  if (it != stages_.rend()) stages_.erase(--(it.base()), stages_.end());
+  task_.clear();
+  totalItems_ = 0ull;
+  itemsDone_ = 0ull;
+}
+
+void ProgressReporter::startTask(const std::string& task, 
+    unsigned long long totalItems) {
+  boost::mutex::scoped_lock lock(mutex_);
+  task_ = task;
+  totalItems_ = totalItems;
+  itemsDone_ = 0ull;
+  taskStartTime_ = boost::posix_time::microsec_clock::universal_time();
+  
+  time(&textStartTime_);
+  textStartClock_ = clock();
+  nextStreamTime_ = textStartTime_ + streamIntervalSeconds_;
+  nextTextTime_ = textStartTime_ + kTextIntervalSeconds;
+  
+  std::ostringstream oss;
+  startEvent(oss, "task_start");
+  oss << ", \"stage\": \"" << StageProfiler::escapeJson(getStage()) << "\""
+      << ", \"task\": \"" << StageProfiler::escapeJson(task_) << "\"";
+  if (totalItems_ > 0ull) oss << ", \"items_total\": " << totalItems_;
+  writeEvent(oss);
+  updateNextReportTime();
+}
+
+/* Called by addProgress() if the next report is due. Threads that do not 
+   get the lock return immediately, the report is written by another 
+   thread. */
+void ProgressReporter::report() {
+  boost::mutex::scoped_try_lock lock(mutex_);
+  if (!lock.owns_lock()) return;
+  
+  time_t now = time(NULL);
+  if (now < nextReportTime_) return;
+  
+  unsigned long long itemsDone = itemsDone_;
+  if (fd_ >= 0 && now >= nextStreamTime_) {
+    writeProgressEvent(itemsDone);
+    nextStreamTime_ = now + streamIntervalSeconds_;
+  }
+  if (Globals::VERB > 2 && now >= nextTextTime_) {
+    writeTextProgress(itemsDone);
+    nextTextTime_ = now + kTextIntervalSeconds;
+  }
+  updateNextReportTime();
+}
+
+void ProgressReporter::writeProgressEvent(unsigned long long itemsDone) {
+  double taskSeconds = getSecondsSince(taskStartTime_);
+  double itemsPerSecond = (taskSeconds > 0.0) ? itemsDone / taskSeconds : 0.0;
+  
+  std::ostringstream oss;
+  startEvent(oss, "progress");
+  oss << ", \"stage\": \"" << StageProfiler::escapeJson(getStage()) << "\""
+      << ", \"task\": \"" << StageProfiler::escapeJson(task_) << "\""
+      << ", \"items_done\": " << itemsDone;
+  if (totalItems_ > 0ull) {
+    oss << ", \"items_total\": " << totalItems_
+        << ", \"fraction\": " << static_cast<double>(itemsDone) / totalItems_;
+  }
+  oss << ", \"task_seconds\": " << taskSeconds
+      << ", \"items_per_second\": " << itemsPerSecond;
+  if (totalItems_ > 0ull && itemsPerSecond > 0.0) {
+    double itemsLeft = (itemsDone < totalItems_) ? 
+        static_cast<double>(totalItems_ - itemsDone) : 0.0;
+    oss << ", \"eta_seconds\": " << itemsLeft / itemsPerSecond;
+  }
+  oss << ", \"rss_mb\": " << Globals::getCurrentMemoryMB()
+      << ", \"peak_rss_mb\": " << Globals::getPeakMemoryMB();
+  writeEvent(oss);
+}
+
+void ProgressReporter::writeTextProgress(unsigned long long itemsDone) {
+  if (totalItems_ > 0ull) {
+    std::cerr << task_ << " " << itemsDone << "/" << totalItems_ << " (" 
+              << itemsDone * 100 / totalItems_ << "%)." << std::endl;
+    if (itemsDone > 0ull) {
+      Globals::reportProgress(textStartTime_, textStartClock_, 
+          static_cast<size_t>(itemsDone - 1), static_cast<size_t>(totalItems_));
+    }
+  } else {
+    std::cerr << task_ << " " << itemsDone << "." << std::endl;
+  }
+}
+
+void ProgressReporter::updateNextReportTime() {
+  if (fd_ >= 0 && Globals::VERB > 2) {
+    nextReportTime_ = (std::min)(nextStreamTime_, nextTextTime_);
+  } else if (fd_ >= 0) {
+    nextReportTime_ = nextStreamTime_;
+  } else if (Globals::VERB > 2) {
+    nextReportTime_ = nextTextTime_;
+  } else {
+    nextReportTime_ = (std::numeric_limits<time_t>::max)();
+  }
+}
+
+void ProgressReporter::startEvent(std::ostringstream& oss, 
+    const std::string& event) {
+  static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+  oss << std::fixed << std::setprecision(3)
+      << "{\"event\": \"" << event << "\""
+      << ", \"time\": " << getSecondsSince(epoch)
+      << ", \"elapsed_seconds\": " << getSecondsSince(runStartTime_);
+}
+
+std::string ProgressReporter::getStage() {
+  return stages_.empty() ? "" : stages_.back();
+}
+
+double ProgressReporter::getSecondsSince(
+    const boost::posix_time::ptime& startTime) {
+  return (boost::posix_time::microsec_clock::universal_time() - 
+      startTime).total_milliseconds() / 1e3;
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,94 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_PROGRESSREPORTER_H_
+#define MARACLUSTER_PROGRESSREPORTER_H_
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <ctime>
+#include <limits>
+#include <algorithm>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "Globals.h"
+
+namespace maracluster {
+
+/* Reports the progress of a run as newline-delimited JSON events, to be 
+   consumed by the GUI or a job scheduler, and as text on stderr for -v 3 and 
+   higher. Stages are started and ended by ScopedStageTimer, within a stage 
+   the hot loops announce a task with startTask() and count the processed 
+   items with addProgress(). 
+   
+   addProgress() can be called from many threads at the same time; only a 
+   counter is updated, at most once per interval the thread that gets the 
+   lock writes a progress event, the other threads do not wait for it. */
+class ProgressReporter {
+ public:
+  /* target is a file descriptor number, "unix:<path>" for a Unix domain 
+     socket a consumer is listening on, or a file name */
+  static bool open(const std::string& target);
+  static void close(int exitCode);
+  static inline bool isOpen() { return fd_ >= 0; }
+  static inline void setInterval(unsigned int seconds) { 
+    streamIntervalSeconds_ = seconds; 
+  }
+  
+  static void beginStage(const std::string& stage);
+  static void endStage(const std::string& stage, double wallSeconds);
+  
+  /* totalItems = 0 means that the total is not known in advance */
+  static void startTask(const std::string& task, unsigned long long totalItems);
+  static inline void addProgress(unsigned long long items) {
+#pragma omp atomic
+    itemsDone_ += items;
+    if (time(NULL) >= nextReportTime_) report();
+  }
+  
+ protected:
+  static boost::mutex mutex_;
+  static int fd_;
+  static bool closeFd_;
+  static unsigned int streamIntervalSeconds_;
+  static const unsigned int kTextIntervalSeconds;
+  
+  static boost::posix_time::ptime runStartTime_, taskStartTime_;
+  static std::vector<std::string> stages_;
+  static std::string task_;
+  static unsigned long long itemsDone_, totalItems_;
+  static time_t nextReportTime_, nextStreamTime_, nextTextTime_, textStartTime_;
+  static clock_t textStartClock_;
+  
+  static void report();
+  static void writeProgressEvent(unsigned long long itemsDone);
+  static void writeTextProgress(unsigned long long itemsDone);
+  static void updateNextReportTime();
+  
+  static void startEvent(std::ostringstream& oss, const std::string& event);
+  static void writeEvent(std::ostringstream& oss);
+  static std::string getStage();
+  static double getSecondsSince(const boost::posix_time::ptime& startTime);
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_PROGRESSREPORTER_H_ */
@@ -20,6 +20,12 @@ Adapted from https://code.google.com/p/in-silico-mass-fingerprinting/
 */
 #include "PvalueCalculator.h"
 
+// MSVC does not define __FMA__, but /arch:AVX2 implies FMA support
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+  #define POLYVAL_FMA_LANES
+  #include <immintrin.h>
+#endif
+
 namespace maracluster {
 
 // to avoid 0 scoring peaks we have to ensure that: 
@@ -41,6 +47,7 @@ void PvalueCalculator::initPolyfit(std::vector<unsigned int>& peakBins,
   peakScores_.swap(peakScores);
   maxScore_ = std::accumulate(peakScores_.begin(), peakScores_.end(), 0u);
   polyfit_.swap(polyfit);
+  earlyExitScore_ = UINT_MAX;
 }
 
 void PvalueCalculator::initFromPeakBins(
@@ -127,6 +134,7 @@ void PvalueCalculator::computePvalVector(
     //std::cout << sumL << " " << l.size() << std::endl;
   }
   maxScore_ = sumL;
+  earlyExitScore_ = UINT_MAX;
   
   // dynamic programming, the easy way
   std::vector<double> f(sumL + 1);
@@ -270,21 +278,154 @@ smooth_pvalue - True if the pvalues should be smoothed
 Output: estimated p value
 */
 double PvalueCalculator::computePvalPolyfit(const std::vector<unsigned int>& queryPeakBins) {
-  std::vector<bool> d(peakBins_.size());
-  binaryMatchPeakBins(queryPeakBins, d);
-                            
-  // express P(D|R = 0) in terms of li (D = obs config)
+  double relScore = static_cast<double>(getUnmatchedScore(queryPeakBins))/maxScore_;
+  return polyval(relScore);
+}
+
+/* Same matching as binaryMatchPeakBins(), without storing the matches.
+   Expresses P(D|R = 0) in terms of li (D = obs config) */
+unsigned int PvalueCalculator::getUnmatchedScore(
+    const std::vector<unsigned int>& queryPeakBins) const {
   unsigned int score = 0u;
-  for (unsigned int i = 0; i < d.size(); ++i) {
-    if (!d[i]) {
+  size_t candIdx = 0;
+  for (size_t i = 0; i < peakBins_.size(); ++i) {
+    while (candIdx < queryPeakBins.size() && peakBins_[i] > queryPeakBins[candIdx]) {
+      ++candIdx;
+    }
+    if (candIdx < queryPeakBins.size() && peakBins_[i] == queryPeakBins[candIdx]) {
+      ++candIdx;
+    } else {
       score += peakScores_[i];
     }
   }
-  double relScore = static_cast<double>(score)/maxScore_;
-  return polyval(relScore);
+  return score;
+}
+
+/* Peak bins are unique, so a candidate peak is matched if and only if its 
+   bin is set in the mask of the query bins, which replaces the merge of
+   getUnmatchedScore(queryPeakBins) and its hard to predict branches */
+unsigned int PvalueCalculator::getUnmatchedScore(
+    const std::vector<unsigned char>& queryBinMask) const {
+  unsigned int score = 0u;
+  size_t maskSize = queryBinMask.size();
+  for (size_t i = 0; i < peakBins_.size(); ++i) {
+    unsigned int peakBin = peakBins_[i];
+    bool matched = peakBin < maskSize && queryBinMask[peakBin];
+    score += matched ? 0u : peakScores_[i];
+  }
+  return score;
+}
+
+void PvalueCalculator::computePvalPolyfitBatch(
+    const std::vector<unsigned int>& queryPeakBins,
+    const std::vector<const PvalueCalculator*>& candidates, 
+    std::vector<double>& logPvals) {
+  std::vector<unsigned char> queryBinMask;
+  computePvalPolyfitBatch(queryPeakBins, candidates, logPvals, queryBinMask);
+}
+
+/* The unmatched scores are summed per candidate, after which the 
+   coefficients of kPolyvalLanes candidates are transposed, such that 
+   polyvalLanes() can run Horner's method on all of them at once. */
+void PvalueCalculator::computePvalPolyfitBatch(
+    const std::vector<unsigned int>& queryPeakBins,
+    const std::vector<const PvalueCalculator*>& candidates, 
+    std::vector<double>& logPvals, std::vector<unsigned char>& queryBinMask) {
+  size_t numCandidates = candidates.size();
+  logPvals.resize(numCandidates);
+  if (numCandidates == 0) return;
+  
+  // the mask is sized per bin, as queryPeakBins is not necessarily sorted
+  BOOST_FOREACH (const unsigned int queryPeakBin, queryPeakBins) {
+    if (queryPeakBin >= queryBinMask.size()) {
+      queryBinMask.resize(queryPeakBin + 1, 0u);
+    }
+    queryBinMask[queryPeakBin] = 1u;
+  }
+  
+  double coeffs[kPolyfitDegree + 1][kPolyvalLanes];
+  double relScores[kPolyvalLanes], y[kPolyvalLanes];
+  for (size_t k = 0; k < numCandidates; k += kPolyvalLanes) {
+    size_t numLanes = (std::min)(static_cast<size_t>(kPolyvalLanes), numCandidates - k);
+    for (size_t l = 0; l < kPolyvalLanes; ++l) {
+      const PvalueCalculator* pvalCalc = (l < numLanes) ? candidates[k + l] : NULL;
+      bool hasPolyfit = pvalCalc && pvalCalc->polyfit_.size() == kPolyfitDegree + 1;
+      relScores[l] = pvalCalc ? static_cast<double>(
+          pvalCalc->getUnmatchedScore(queryBinMask))/pvalCalc->maxScore_ : 0.0;
+      for (unsigned int d = 0; d <= kPolyfitDegree; ++d) {
+        coeffs[d][l] = hasPolyfit ? pvalCalc->polyfit_[d] : 0.0;
+      }
+    }
+    
+    polyvalLanes(coeffs, relScores, y);
+    
+    for (size_t l = 0; l < numLanes; ++l) {
+      const PvalueCalculator* pvalCalc = candidates[k + l];
+      if (pvalCalc->polyfit_.size() == kPolyfitDegree + 1) {
+        logPvals[k + l] = y[l];
+      } else {
+        logPvals[k + l] = pvalCalc->polyval(relScores[l]);
+      }
+    }
+  }
+  
+  BOOST_FOREACH (const unsigned int queryPeakBin, queryPeakBins) {
+    queryBinMask[queryPeakBin] = 0u;
+  }
+}
+
+/* Horner's method for kPolyvalLanes polynomials of degree kPolyfitDegree, 
+   coeffs[d][l] is the coefficient of x^d of the l-th polynomial. Results are
+   equal to those of polyval() up to the rounding of the fused multiply-adds, 
+   which the compiler may also use for polyval(). */
+void PvalueCalculator::polyvalLanes(const double coeffs[][kPolyvalLanes],
+    const double* x, double* y) {
+#ifdef POLYVAL_FMA_LANES
+  __m256d xs = _mm256_loadu_pd(x);
+  __m256d ys = _mm256_loadu_pd(coeffs[kPolyfitDegree]);
+  for (int d = kPolyfitDegree - 1; d >= 0; --d) {
+    ys = _mm256_fmadd_pd(ys, xs, _mm256_loadu_pd(coeffs[d]));
+  }
+  // the second operand is returned for NaNs, like std::min(0.0, y)
+  _mm256_storeu_pd(y, _mm256_min_pd(ys, _mm256_setzero_pd()));
+#else
+  for (unsigned int l = 0; l < kPolyvalLanes; ++l) {
+    double yl = coeffs[kPolyfitDegree][l];
+    for (int d = kPolyfitDegree - 1; d >= 0; --d) {
+      yl = coeffs[d][l] + yl*x[l];
+    }
+    y[l] = (std::min)(0.0, yl);
+  }
+#endif
+}
+
+double PvalueCalculator::computePvalPolyfit(const short* peakBins, 
+    const short* peakScores, const double* polyfit,
+    const std::vector<unsigned int>& queryPeakBins) {
+  unsigned int score = 0u, maxScore = 0u;
+  size_t candIdx = 0;
+  for (unsigned int i = 0; i < kMaxScoringPeaks && peakBins[i] != 0; ++i) {
+    unsigned int peakBin = peakBins[i];
+    while (candIdx < queryPeakBins.size() && peakBin > queryPeakBins[candIdx]) {
+      ++candIdx;
+    }
+    if (candIdx < queryPeakBins.size() && peakBin == queryPeakBins[candIdx]) {
+      ++candIdx;
+    } else {
+      score += peakScores[i];
+    }
+    maxScore += peakScores[i];
+  }
+  
+  double relScore = static_cast<double>(score)/maxScore;
+  double y = polyfit[kPolyfitDegree];
+  for (int i = kPolyfitDegree - 1; i >= 0; --i) {
+    y = polyfit[i] + y*relScore;
+  }
+  return (std::min)(0.0,y);
 }
 
-double PvalueCalculator::polyval(double x) {
+double PvalueCalculator::polyval(double x) const {
   if (polyfit_.size() > 0) {
     // Horner's method
     double y = polyfit_.back();
@@ -297,12 +438,192 @@ double PvalueCalculator::polyval(double x) {
   }
 }
 
-void PvalueCalculator::copyPolyfit(short* peakBins, short* peakScores, double* polyfit) {
-  peakBins_.resize(kMaxScoringPeaks, 0u);
-  peakScores_.resize(kMaxScoringPeaks, 0u);
-  std::copy(peakBins_.begin(), peakBins_.begin() + kMaxScoringPeaks, peakBins);
-  std::copy(peakScores_.begin(), peakScores_.begin() + kMaxScoringPeaks, peakScores);
-  std::copy(polyfit_.begin(), polyfit_.begin() + kPolyfitDegree + 1, polyfit);
+/* The polynomial is not guaranteed to be monotone, so the bound is the 
+   smallest score s for which all scores in [s, maxScore_] fail the 
+   threshold, evaluated exactly as in computePvalPolyfit() */
+void PvalueCalculator::initEarlyExit(double logPvalThreshold) {
+  earlyExitScore_ = UINT_MAX;
+  if (maxScore_ == 0u || polyfit_.empty()) return;
+  
+  earlyExitScore_ = maxScore_ + 1u;
+  while (earlyExitScore_ > 0u && polyval(
+      static_cast<double>(earlyExitScore_ - 1u)/maxScore_) > logPvalThreshold) {
+    --earlyExitScore_;
+  }
+}
+
+/* The unmatched scores only increase during the merge, so as soon as one 
+   of them reaches the early exit score of its calculator, the pair cannot
+   pass the threshold anymore. */
+bool PvalueCalculator::computePvalPolyfitPair(const PvalueCalculator& target,
+    const PvalueCalculator& query, double logPvalThreshold,
+    double& targetPval, double& queryPval) {
+  const std::vector<unsigned int>& targetBins = target.peakBins_;
+  const std::vector<unsigned int>& queryBins = query.peakBins_;
+  size_t numTargetPeaks = targetBins.size(), numQueryPeaks = queryBins.size();
+  unsigned int targetScore = 0u, queryScore = 0u;
+  size_t i = 0, j = 0;
+  while (i < numTargetPeaks && j < numQueryPeaks) {
+    if (targetBins[i] < queryBins[j]) {
+      targetScore += target.peakScores_[i++];
+      if (targetScore >= target.earlyExitScore_) return false;
+    } else if (targetBins[i] > queryBins[j]) {
+      queryScore += query.peakScores_[j++];
+      if (queryScore >= query.earlyExitScore_) return false;
+    } else {
+      ++i;
+      ++j;
+    }
+  }
+  for (; i < numTargetPeaks; ++i) targetScore += target.peakScores_[i];
+  for (; j < numQueryPeaks; ++j) queryScore += query.peakScores_[j];
+  
+  queryPval = query.polyval(static_cast<double>(queryScore)/query.maxScore_);
+  if (queryPval > logPvalThreshold) return false;
+  targetPval = target.polyval(static_cast<double>(targetScore)/target.maxScore_);
+  return (targetPval <= logPvalThreshold);
+}
+
+/* The mask holds the index + 1 of the target peak in each of its bins, so 
+   that a single pass over the peaks of a candidate gives both unmatched 
+   scores: the candidate's directly and the target's as its total score 
+   minus the scores of the matched target peaks. The candidate's score is 
+   checked against its early exit score during the pass, the target's only
+   at the end, as it decreases during the pass. The polynomials of the 
+   surviving candidates are evaluated kPolyvalLanes candidates at a time. */
+void PvalueCalculator::computePvalPolyfitPairBatch(
+    const PvalueCalculator& target,
+    const std::vector<const PvalueCalculator*>& candidates, 
+    double logPvalThreshold, std::vector<size_t>& passedIdxs,
+    std::vector<double>& logPvals, std::vector<unsigned char>& targetBinMask) {
+  passedIdxs.clear();
+  logPvals.clear();
+  
+  const std::vector<unsigned int>& targetBins = target.peakBins_;
+  size_t numTargetPeaks = targetBins.size();
+  if (numTargetPeaks > UCHAR_MAX) {
+    // too many peaks to index with the mask
+    double targetPval, queryPval;
+    for (size_t k = 0; k < candidates.size(); ++k) {
+      if (computePvalPolyfitPair(target, *candidates[k], logPvalThreshold, 
+                                 targetPval, queryPval)) {
+        passedIdxs.push_back(k);
+        logPvals.push_back((std::max)(targetPval, queryPval));
+      }
+    }
+    return;
+  }
+  
+  unsigned int targetTotalScore = 0u;
+  for (size_t i = 0; i < numTargetPeaks; ++i) {
+    if (targetBins[i] >= targetBinMask.size()) {
+      targetBinMask.resize(targetBins[i] + 1, 0u);
+    }
+    targetBinMask[targetBins[i]] = static_cast<unsigned char>(i + 1);
+    targetTotalScore += target.peakScores_[i];
+  }
+  
+  bool hasTargetPolyfit = (target.polyfit_.size() == kPolyfitDegree + 1);
+  double targetCoeffs[kPolyfitDegree + 1][kPolyvalLanes];
+  for (unsigned int d = 0; d <= kPolyfitDegree; ++d) {
+    for (unsigned int l = 0; l < kPolyvalLanes; ++l) {
+      targetCoeffs[d][l] = hasTargetPolyfit ? target.polyfit_[d] : 0.0;
+    }
+  }
+  
+  PolyfitPairLanes lanes;
+  lanes.numLanes = 0u;
+  size_t maskSize = targetBinMask.size();
+  for (size_t k = 0; k < candidates.size(); ++k) {
+    const PvalueCalculator& query = *candidates[k];
+    const std::vector<unsigned int>& queryBins = query.peakBins_;
+    unsigned int queryScore = 0u, targetMatchedScore = 0u;
+    bool isExit = false;
+    for (size_t j = 0; j < queryBins.size(); ++j) {
+      unsigned int targetIdx = (queryBins[j] < maskSize) ? 
+                                   targetBinMask[queryBins[j]] : 0u;
+      if (targetIdx > 0u) {
+        targetMatchedScore += target.peakScores_[targetIdx - 1u];
+      } else {
+        queryScore += query.peakScores_[j];
+        if (queryScore >= query.earlyExitScore_) {
+          isExit = true;
+          break;
+        }
+      }
+    }
+    unsigned int targetScore = targetTotalScore - targetMatchedScore;
+    if (isExit || targetScore >= target.earlyExitScore_) continue;
+    
+    size_t l = lanes.numLanes++;
+    bool hasPolyfit = (query.polyfit_.size() == kPolyfitDegree + 1);
+    lanes.idxs[l] = k;
+    lanes.queries[l] = &query;
+    lanes.queryScores[l] = static_cast<double>(queryScore)/query.maxScore_;
+    lanes.targetScores[l] = static_cast<double>(targetScore)/target.maxScore_;
+    for (unsigned int d = 0; d <= kPolyfitDegree; ++d) {
+      lanes.queryCoeffs[d][l] = hasPolyfit ? query.polyfit_[d] : 0.0;
+    }
+    
+    if (lanes.numLanes == kPolyvalLanes) {
+      evaluatePolyfitPairLanes(target, targetCoeffs, lanes, logPvalThreshold,
+                               passedIdxs, logPvals);
+    }
+  }
+  if (lanes.numLanes > 0u) {
+    evaluatePolyfitPairLanes(target, targetCoeffs, lanes, logPvalThreshold,
+                             passedIdxs, logPvals);
+  }
+  
+  BOOST_FOREACH (const unsigned int targetBin, targetBins) {
+    targetBinMask[targetBin] = 0u;
+  }
+}
+
+/* Calculators without a complete polynomial fall back to polyval(), like in
+   computePvalPolyfitBatch(). Empties the lanes. */
+void PvalueCalculator::evaluatePolyfitPairLanes(const PvalueCalculator& target,
+    const double targetCoeffs[][kPolyvalLanes], PolyfitPairLanes& lanes,
+    double logPvalThreshold, std::vector<size_t>& passedIdxs,
+    std::vector<double>& logPvals) {
+  for (size_t l = lanes.numLanes; l < kPolyvalLanes; ++l) {
+    lanes.queryScores[l] = 0.0;
+    lanes.targetScores[l] = 0.0;
+    for (unsigned int d = 0; d <= kPolyfitDegree; ++d) {
+      lanes.queryCoeffs[d][l] = 0.0;
+    }
+  }
+  
+  double queryPvals[kPolyvalLanes], targetPvals[kPolyvalLanes];
+  polyvalLanes(lanes.queryCoeffs, lanes.queryScores, queryPvals);
+  polyvalLanes(targetCoeffs, lanes.targetScores, targetPvals);
+  
+  bool hasTargetPolyfit = (target.polyfit_.size() == kPolyfitDegree + 1);
+  for (size_t l = 0; l < lanes.numLanes; ++l) {
+    const PvalueCalculator& query = *lanes.queries[l];
+    double queryPval = (query.polyfit_.size() == kPolyfitDegree + 1) ? 
+        queryPvals[l] : query.polyval(lanes.queryScores[l]);
+    double targetPval = hasTargetPolyfit ? 
+        targetPvals[l] : target.polyval(lanes.targetScores[l]);
+    if (queryPval > logPvalThreshold || targetPval > logPvalThreshold) continue;
+    
+    passedIdxs.push_back(lanes.idxs[l]);
+    logPvals.push_back((std::max)(targetPval, queryPval));
+  }
+  lanes.numLanes = 0u;
+}
+
+/* The arrays are padded with zeros, without padding peakBins_ itself, as 
+   the scoring functions rely on its peak bins being sorted */
+void PvalueCalculator::copyPolyfit(short* peakBins, short* peakScores, double* polyfit) const {
+  size_t numPeaks = std::min<size_t>(peakBins_.size(), kMaxScoringPeaks);
+  std::fill(peakBins, peakBins + kMaxScoringPeaks, 0);
+  std::fill(peakScores, peakScores + kMaxScoringPeaks, 0);
+  std::copy(peakBins_.begin(), peakBins_.begin() + numPeaks, peakBins);
+  std::copy(peakScores_.begin(), peakScores_.begin() + numPeaks, peakScores);
+  std::fill(polyfit, polyfit + kPolyfitDegree + 1, 0.0);
+  std::copy(polyfit_.begin(), polyfit_.begin() + 
+      std::min<size_t>(polyfit_.size(), kPolyfitDegree + 1), polyfit);
 }
 
 void PvalueCalculator::serialize(std::string& polyfitString, std::string& peakScorePairsString) {
@@ -338,6 +659,7 @@ void PvalueCalculator::deserialize(std::string& polyfitString, std::string& peak
   peakBins_.clear();
   peakScores_.clear();
   maxScore_ = 0u;
+  earlyExitScore_ = UINT_MAX;
   
   std::istringstream iss2(peakScorePairsString);
   unsigned int peakBin, score;
@@ -573,4 +895,218 @@ bool PvalueCalculator::pvalPolyfitUnitTest() {
   }
 }
 
+bool PvalueCalculator::pvalPolyfitBatchUnitTest() {
+  setSeed(10);
+  unsigned int numBins = 1000u, numPeaks = 40u;
+  
+  std::set<unsigned int> queryPeakSet;
+  while (queryPeakSet.size() < numPeaks) {
+    queryPeakSet.insert(lcg_rand() % numBins);
+  }
+  std::vector<unsigned int> queryPeakBins(queryPeakSet.begin(), queryPeakSet.end());
+  
+  // not a multiple of kPolyvalLanes, the last candidate has no polyfit. The
+  // candidates share an increasing number of peaks with the query.
+  std::vector<PvalueCalculator> pvalCalcs(11);
+  std::vector<const PvalueCalculator*> candidates;
+  for (size_t k = 0; k < pvalCalcs.size(); ++k) {
+    PvalueCalculator& pvalCalc = pvalCalcs[k];
+    std::set<unsigned int> peakBins(queryPeakBins.begin(), 
+                                    queryPeakBins.begin() + k * 3);
+    while (peakBins.size() < numPeaks) {
+      peakBins.insert(lcg_rand() % numBins);
+    }
+    pvalCalc.peakBins_.assign(peakBins.begin(), peakBins.end());
+    for (unsigned int i = 0; i < numPeaks; ++i) {
+      pvalCalc.peakScores_.push_back(lcg_rand() % 100 + 1);
+      pvalCalc.maxScore_ += pvalCalc.peakScores_.back();
+    }
+    if (k + 1 < pvalCalcs.size()) {
+      double scale = 0.5 + lcg_rand_unif();
+      pvalCalc.polyfit_.push_back(-40.236851088905013*scale);
+      pvalCalc.polyfit_.push_back(90.270774017803348*scale);
+      pvalCalc.polyfit_.push_back(-117.64110105643428*scale);
+      pvalCalc.polyfit_.push_back(154.88646213751957*scale);
+      pvalCalc.polyfit_.push_back(-118.82877111418108*scale);
+      pvalCalc.polyfit_.push_back(31.617289887393586*scale);
+    }
+    candidates.push_back(&pvalCalc);
+  }
+  
+  std::vector<double> logPvals;
+  computePvalPolyfitBatch(queryPeakBins, candidates, logPvals);
+  
+  bool success = (logPvals.size() == pvalCalcs.size());
+  for (size_t k = 0; success && k < pvalCalcs.size(); ++k) {
+    double logPval = pvalCalcs[k].computePvalPolyfit(queryPeakBins);
+    if (!isEqual(logPvals[k], logPval)) {
+      std::cout << "log(pval) of candidate " << k << " was " << logPvals[k] 
+                << ", should be " << logPval << "." << std::endl;
+      success = false;
+    }
+  }
+  
+  // a query with fewer than kMaxScoringPeaks peaks, padded with zeros at the
+  // end as the arrays of copyPolyfit(), i.e. the bins are not sorted. The 
+  // last query bin is 0, so the mask has to be sized by the largest bin.
+  size_t numShortPeaks = 25u;
+  std::vector<unsigned int> shortQueryPeakBins(queryPeakBins.begin(), 
+      queryPeakBins.begin() + numShortPeaks);
+  std::vector<unsigned int> paddedQueryPeakBins(shortQueryPeakBins);
+  paddedQueryPeakBins.resize(kMaxScoringPeaks, 0u);
+  
+  std::vector<unsigned char> queryBinMask;
+  computePvalPolyfitBatch(paddedQueryPeakBins, candidates, logPvals, queryBinMask);
+  
+  success = success && (logPvals.size() == pvalCalcs.size());
+  for (size_t k = 0; success && k < pvalCalcs.size(); ++k) {
+    double logPval = pvalCalcs[k].computePvalPolyfit(shortQueryPeakBins);
+    if (!isEqual(logPvals[k], logPval)) {
+      std::cout << "log(pval) of candidate " << k << " for the padded query was " 
+                << logPvals[k] << ", should be " << logPval << "." << std::endl;
+      success = false;
+    }
+  }
+  if (queryBinMask.size() <= shortQueryPeakBins.back() ||
+      std::count(queryBinMask.begin(), queryBinMask.end(), 1u) != 0) {
+    std::cout << "Query bin mask of size " << queryBinMask.size() 
+              << " was not cleared or too small." << std::endl;
+    success = false;
+  }
+  
+  // copyPolyfit() should not pad the peak bins of the calculator itself
+  PvalueCalculator shortPvalCalc;
+  shortPvalCalc.peakBins_ = shortQueryPeakBins;
+  shortPvalCalc.peakScores_.assign(numShortPeaks, 1u);
+  shortPvalCalc.maxScore_ = numShortPeaks;
+  shortPvalCalc.polyfit_ = pvalCalcs.front().polyfit_;
+  short peakBins[kMaxScoringPeaks], peakScores[kMaxScoringPeaks];
+  double polyfit[kPolyfitDegree + 1];
+  shortPvalCalc.copyPolyfit(peakBins, peakScores, polyfit);
+  if (shortPvalCalc.getNumScoringPeaks() != numShortPeaks || 
+      peakBins[numShortPeaks] != 0 || 
+      peakBins[numShortPeaks - 1] != static_cast<short>(shortQueryPeakBins.back())) {
+    std::cout << "copyPolyfit changed the number of peaks to " 
+              << shortPvalCalc.getNumScoringPeaks() << "." << std::endl;
+    success = false;
+  }
+  return success;
+}
+
+bool PvalueCalculator::pvalPolyfitPairUnitTest() {
+  setSeed(11);
+  unsigned int numBins = 1000u, numPeaks = 40u;
+  double logPvalThreshold = -5.0;
+  
+  std::set<unsigned int> sharedPeakSet;
+  while (sharedPeakSet.size() < numPeaks) {
+    sharedPeakSet.insert(lcg_rand() % numBins);
+  }
+  std::vector<unsigned int> sharedPeakBins(sharedPeakSet.begin(), 
+                                           sharedPeakSet.end());
+  
+  // the spectra share an increasing number of peaks, such that some of the 
+  // pairs pass the threshold, some only in one direction and some in neither
+  std::vector<PvalueCalculator> pvalCalcs(14);
+  for (size_t k = 0; k < pvalCalcs.size(); ++k) {
+    PvalueCalculator& pvalCalc = pvalCalcs[k];
+    std::set<unsigned int> peakBins(sharedPeakBins.begin(), 
+        sharedPeakBins.begin() + std::min<size_t>(k * 3, numPeaks));
+    while (peakBins.size() < numPeaks) {
+      peakBins.insert(lcg_rand() % numBins);
+    }
+    pvalCalc.peakBins_.assign(peakBins.begin(), peakBins.end());
+    for (unsigned int i = 0; i < numPeaks; ++i) {
+      pvalCalc.peakScores_.push_back(lcg_rand() % 100 + 1);
+      pvalCalc.maxScore_ += pvalCalc.peakScores_.back();
+    }
+    double scale = 0.5 + lcg_rand_unif();
+    pvalCalc.polyfit_.push_back(-40.236851088905013*scale);
+    pvalCalc.polyfit_.push_back(90.270774017803348*scale);
+    pvalCalc.polyfit_.push_back(-117.64110105643428*scale);
+    pvalCalc.polyfit_.push_back(154.88646213751957*scale);
+    pvalCalc.polyfit_.push_back(-118.82877111418108*scale);
+    pvalCalc.polyfit_.push_back(31.617289887393586*scale);
+    pvalCalc.initEarlyExit(logPvalThreshold);
+  }
+  
+  bool success = true;
+  size_t numPassed = 0u;
+  for (size_t k = 0; k < pvalCalcs.size(); ++k) {
+    for (size_t l = 0; l < pvalCalcs.size(); ++l) {
+      if (k == l) continue;
+      double targetPval = pvalCalcs[k].computePvalPolyfit(pvalCalcs[l].peakBins_);
+      double queryPval = pvalCalcs[l].computePvalPolyfit(pvalCalcs[k].peakBins_);
+      bool shouldPass = (targetPval <= logPvalThreshold && 
+                         queryPval <= logPvalThreshold);
+      
+      double pairTargetPval = 0.0, pairQueryPval = 0.0;
+      bool passed = computePvalPolyfitPair(pvalCalcs[k], pvalCalcs[l], 
+          logPvalThreshold, pairTargetPval, pairQueryPval);
+      if (passed != shouldPass || (passed && (
+            !isEqual(pairTargetPval, targetPval) || 
+            !isEqual(pairQueryPval, queryPval)))) {
+        std::cout << "log(pval) pair " << k << "," << l << " was " 
+                  << pairTargetPval << "," << pairQueryPval << " (" << passed 
+                  << "), should be " << targetPval << "," << queryPval 
+                  << " (" << shouldPass << ")." << std::endl;
+        success = false;
+      }
+      if (passed) ++numPassed;
+    }
+  }
+  
+  // the batch version should pass the same pairs with the same p-values
+  std::vector<unsigned char> targetBinMask;
+  for (size_t k = 0; k < pvalCalcs.size(); ++k) {
+    std::vector<const PvalueCalculator*> candidates;
+    std::vector<size_t> candidateIdxs;
+    for (size_t l = 0; l < pvalCalcs.size(); ++l) {
+      if (k == l) continue;
+      candidates.push_back(&pvalCalcs[l]);
+      candidateIdxs.push_back(l);
+    }
+    
+    std::vector<size_t> passedIdxs;
+    std::vector<double> logPvals;
+    computePvalPolyfitPairBatch(pvalCalcs[k], candidates, logPvalThreshold,
+        passedIdxs, logPvals, targetBinMask);
+    
+    std::vector<size_t> expectedIdxs;
+    std::vector<double> expectedPvals;
+    for (size_t c = 0; c < candidates.size(); ++c) {
+      double targetPval = 0.0, queryPval = 0.0;
+      if (computePvalPolyfitPair(pvalCalcs[k], *candidates[c], 
+              logPvalThreshold, targetPval, queryPval)) {
+        expectedIdxs.push_back(c);
+        expectedPvals.push_back(std::max(targetPval, queryPval));
+      }
+    }
+    
+    bool isEqualPvals = (logPvals.size() == expectedPvals.size());
+    for (size_t c = 0; isEqualPvals && c < logPvals.size(); ++c) {
+      isEqualPvals = isEqual(logPvals[c], expectedPvals[c]);
+    }
+    if (passedIdxs != expectedIdxs || !isEqualPvals) {
+      std::cout << "Batch pair scoring of " << k << " passed " 
+                << passedIdxs.size() << " candidates, should be " 
+                << expectedIdxs.size() << "." << std::endl;
+      success = false;
+    }
+  }
+  
+  if (std::count(targetBinMask.begin(), targetBinMask.end(), 0u) != 
+        static_cast<long>(targetBinMask.size())) {
+    std::cout << "Target bin mask was not cleared." << std::endl;
+    success = false;
+  }
+  
+  // make sure that the test covers both outcomes
+  if (numPassed == 0u || numPassed == pvalCalcs.size() * (pvalCalcs.size() - 1)) {
+    std::cout << "Pairs passing the threshold: " << numPassed << std::endl;
+    success = false;
+  }
+  return success;
+}
+
 } /* namespace maracluster */
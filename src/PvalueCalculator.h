@@ -23,6 +23,7 @@ Adapted from https://code.google.com/p/in-silico-mass-fingerprinting/
 */
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
 
 #include <cmath>
@@ -33,6 +34,7 @@ Adapted from https://code.google.com/p/in-silico-mass-fingerprinting/
 #include <sstream>
 
 #include <cassert>
+#include <climits>
 #include <cstdlib>
 #include <stdexcept>
 
@@ -53,7 +55,7 @@ class PvalueCalculator {
   static unsigned int kMinScoringPeaks;
   static const bool kVariableScoringPeaks;
   
-  PvalueCalculator() : maxScore_(0u) {}
+  PvalueCalculator() : maxScore_(0u), earlyExitScore_(UINT_MAX) {}
   inline unsigned int getNumScoringPeaks() const { return peakBins_.size(); }
   
   // prevents ODR usage of kMaxScoringPeaks: http://en.cppreference.com/w/cpp/language/definition#ODR-use
@@ -93,7 +95,44 @@ class PvalueCalculator {
   void computePvalVectorPolyfit(const std::vector<double>& peakDist);
   double computePvalPolyfit(const std::vector<unsigned int>& queryPeakBins);
   
-  void copyPolyfit(short* peakBins, short* peakScores, double* polyfit);
+  // same as computePvalPolyfit, for the arrays of a stored PvalueVector
+  static double computePvalPolyfit(const short* peakBins, 
+      const short* peakScores, const double* polyfit, 
+      const std::vector<unsigned int>& queryPeakBins);
+  
+  // logPvals[k] = candidates[k]->computePvalPolyfit(queryPeakBins), the 
+  // polynomials are evaluated for kPolyvalLanes candidates at a time. 
+  // queryBinMask is scratch space that is all zeros before and after the call.
+  static void computePvalPolyfitBatch(
+      const std::vector<unsigned int>& queryPeakBins,
+      const std::vector<const PvalueCalculator*>& candidates, 
+      std::vector<double>& logPvals, std::vector<unsigned char>& queryBinMask);
+  static void computePvalPolyfitBatch(
+      const std::vector<unsigned int>& queryPeakBins,
+      const std::vector<const PvalueCalculator*>& candidates, 
+      std::vector<double>& logPvals);
+  
+  // precomputes the bound used by computePvalPolyfitPair() to stop early
+  void initEarlyExit(double logPvalThreshold);
+  
+  // targetPval = target.computePvalPolyfit(query.getPeakBinsRef()) and vice
+  // versa for queryPval, with a single merge of the peak bins. Returns false, 
+  // possibly without computing the p-values, if either p-value is above 
+  // logPvalThreshold, which should not exceed the threshold of initEarlyExit().
+  static bool computePvalPolyfitPair(const PvalueCalculator& target, 
+      const PvalueCalculator& query, double logPvalThreshold,
+      double& targetPval, double& queryPval);
+  
+  // for each candidate k for which computePvalPolyfitPair(target, 
+  // *candidates[k], ...) returns true, appends k to passedIdxs and the 
+  // larger of the two p-values to logPvals. targetBinMask is scratch space 
+  // that is all zeros before and after the call.
+  static void computePvalPolyfitPairBatch(const PvalueCalculator& target,
+      const std::vector<const PvalueCalculator*>& candidates, 
+      double logPvalThreshold, std::vector<size_t>& passedIdxs,
+      std::vector<double>& logPvals, std::vector<unsigned char>& targetBinMask);
+  
+  void copyPolyfit(short* peakBins, short* peakScores, double* polyfit) const;
   void serialize(std::string& polyfitString, std::string& peakScorePairsString);
   void deserialize(std::string& polyfitString, std::string& peakScorePairsString);
   
@@ -106,6 +145,8 @@ class PvalueCalculator {
   static bool pvalPolyfitUnitTest();
   static bool pvalUniformUnitTest();
   static bool binaryPeakMatchUnitTest();
+  static bool pvalPolyfitBatchUnitTest();
+  static bool pvalPolyfitPairUnitTest();
   
   // needed for smoothing and unit tests
   inline static void setSeed(unsigned long s) { seed_ = s; }
@@ -114,6 +155,8 @@ class PvalueCalculator {
   
  private:
   unsigned int maxScore_;
+  // unmatched score from which on polyval() stays above the threshold
+  unsigned int earlyExitScore_;
   std::vector<unsigned int> peakBins_;
   std::vector<unsigned int> peakScores_;
   std::vector<double> polyfit_;
@@ -121,7 +164,27 @@ class PvalueCalculator {
   void initFromPeakBins(const std::vector<double>& peakDist,
                         std::vector<double>& peakProbs);
   void binaryMatchPeakBins(const std::vector<unsigned int>& queryPeakBins, std::vector<bool>& d);
-  double polyval(double x);
+  unsigned int getUnmatchedScore(const std::vector<unsigned int>& queryPeakBins) const;
+  unsigned int getUnmatchedScore(const std::vector<unsigned char>& queryBinMask) const;
+  double polyval(double x) const;
+  
+  // doubles per 256-bit AVX register
+  static const unsigned int kPolyvalLanes = 4u;
+  static void polyvalLanes(const double coeffs[][kPolyvalLanes], 
+      const double* x, double* y);
+  
+  // candidates of computePvalPolyfitPairBatch() that survived the early exit
+  struct PolyfitPairLanes {
+    size_t numLanes;
+    size_t idxs[kPolyvalLanes];
+    const PvalueCalculator* queries[kPolyvalLanes];
+    double queryCoeffs[kPolyfitDegree + 1][kPolyvalLanes];
+    double queryScores[kPolyvalLanes], targetScores[kPolyvalLanes];
+  };
+  static void evaluatePolyfitPairLanes(const PvalueCalculator& target,
+      const double targetCoeffs[][kPolyvalLanes], PolyfitPairLanes& lanes,
+      double logPvalThreshold, std::vector<size_t>& passedIdxs,
+      std::vector<double>& logPvals);
   
   // used for unit tests
   static inline bool isEqual(double a, double b) { return (std::abs(a - b) < 1e-5); }
@@ -49,14 +49,13 @@ void PvalueFilterAndSort::filterAndSort(const std::vector<std::string>& pvalFNs,
   
   reportProgress(startTime, startClock);
   
+  ProgressReporter::startTask("Sorting and filtering bin", numFiles);
 #pragma omp parallel for schedule(static, 1)  
   for (int bin = 0; bin < numFiles; ++bin) {
-    if (bin % 10 == 0) {
-      std::cerr << "Sorting and filtering bin " << bin+1 << "/" << numFiles << " (" << (bin+1)*100/numFiles << "%)" << std::endl;
-    }
     std::string partFileFN = resultFN + "." + boost::lexical_cast<std::string>(bin);
     
     filterAndSortSingleFile(partFileFN);
+    ProgressReporter::addProgress(1u);
   }
   
   reportProgress(startTime, startClock);
@@ -107,6 +106,7 @@ int PvalueFilterAndSort::splitByHash(const std::vector<std::string>& pvalFNs,
             boost::iostreams::mapped_file::readonly);
     const char* f = mmap.const_data();
     const char* l = f + mmap.size();
+    StageProfiler::addBytesRead(mmap.size());
     
     {
       errno = 0;
@@ -177,6 +177,7 @@ void PvalueFilterAndSort::externalMergeSort(const std::string& resultFN, int num
         errno = 0;
         PvalueTriplet tmp;
         int numPvalsAdded = 0;
+        long long startOffset = offsets[bin];
         while (errno == 0 && f && f<=(l-sizeof(tmp)) && 
                ++numPvalsAdded <= maxPvalSort/numFiles) {
           memcpy(&tmp, f, sizeof(tmp));
@@ -184,6 +185,7 @@ void PvalueFilterAndSort::externalMergeSort(const std::string& resultFN, int num
           offsets[bin] += sizeof(tmp);
           pvecBuffer.push_back(tmp);
         }
+        StageProfiler::addBytesRead(offsets[bin] - startOffset);
         
         if (pvecBuffer.back().pval < maxMinPval) {
           maxMinPval = pvecBuffer.back().pval;
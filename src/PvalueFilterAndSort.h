@@ -35,6 +35,7 @@
 
 #include <boost/filesystem.hpp>
 
+#include "ProgressReporter.h"
 #include "PvalueTriplet.h"
 #include "BinaryInterface.h"
 
@@ -0,0 +1,316 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "PvalueVectorFile.h"
+
+#include <set>
+
+#include <boost/filesystem.hpp>
+
+namespace maracluster {
+
+const char PvalueVectorFile::kMagic[8] = { 'M', 'R', 'C', 'L', 'P', 'V', 'E', 'C' };
+const unsigned int PvalueVectorFile::kVersion = 1u;
+
+/* The header is only written at the start of the file, appended records 
+   follow the records already in the file. */
+void PvalueVectorFile::write(const std::vector<PvalueVectorRecord>& records,
+    const std::string& pvalueVectorsFN, bool append) {
+  if (records.empty()) return;
+  
+  bool writeHeader = !append || Globals::fileIsEmpty(pvalueVectorsFN);
+  std::ofstream outfile;
+  if (append) {
+    outfile.open(pvalueVectorsFN.c_str(), std::ios_base::app | std::ios_base::binary);
+  } else {
+    outfile.open(pvalueVectorsFN.c_str(), std::ios_base::out | std::ios_base::binary);
+  }
+  if (!outfile.is_open()) {
+    std::cerr << "Error: could not write p-value vectors to " << pvalueVectorsFN << std::endl;
+    return;
+  }
+  
+  size_t bytes = records.size() * sizeof(PvalueVectorRecord);
+  if (writeHeader) {
+    PvalueVectorFileHeader header;
+    memset(&header, 0, sizeof(header));
+    std::copy(kMagic, kMagic + sizeof(kMagic), header.magic);
+    header.version = kVersion;
+    header.recordSize = sizeof(PvalueVectorRecord);
+    header.polyfitDegree = PvalueCalculator::kPolyfitDegree;
+    header.maxScoringPeaks = PvalueCalculator::getMaxScoringPeaksConstant();
+    outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    bytes += sizeof(header);
+  }
+  outfile.write(reinterpret_cast<const char*>(&records[0]), 
+                records.size() * sizeof(PvalueVectorRecord));
+  StageProfiler::addBytesWritten(bytes);
+}
+
+bool PvalueVectorFile::open(const std::string& pvalueVectorsFN) {
+  close();
+  if (Globals::fileIsEmpty(pvalueVectorsFN)) {
+    return true;
+  }
+  
+  mmap_.open(pvalueVectorsFN);
+  if (!mmap_.is_open()) {
+    std::cerr << "Error: could not read p-value vectors from " << pvalueVectorsFN << std::endl;
+    return false;
+  }
+  
+  PvalueVectorFileHeader header;
+  if (mmap_.size() >= sizeof(header)) {
+    memcpy(&header, mmap_.data(), sizeof(header));
+  } else {
+    memset(&header, 0, sizeof(header));
+  }
+  
+  if (std::equal(kMagic, kMagic + sizeof(kMagic), header.magic)) {
+    if (!isValidHeader(header)) {
+      std::cerr << "Error: p-value vectors file " << pvalueVectorsFN 
+                << " has version " << header.version << " and record size " 
+                << header.recordSize << ", expected version " << kVersion 
+                << " and record size " << sizeof(PvalueVectorRecord) 
+                << ". Please rerun the p-value vector calculation." << std::endl;
+      close();
+      return false;
+    } else if ((mmap_.size() - sizeof(header)) % sizeof(PvalueVectorRecord) != 0) {
+      std::cerr << "Error: p-value vectors file " << pvalueVectorsFN << " is truncated" << std::endl;
+      close();
+      return false;
+    }
+    records_ = reinterpret_cast<const PvalueVectorRecord*>(mmap_.data() + sizeof(header));
+    numRecords_ = (mmap_.size() - sizeof(header)) / sizeof(PvalueVectorRecord);
+  } else if (mmap_.size() % sizeof(PvalueVector) == 0) {
+    if (Globals::VERB > 2) {
+      std::cerr << "Converting p-value vectors of " << pvalueVectorsFN 
+                << " from the previous file format" << std::endl;
+    }
+    size_t numLegacy = mmap_.size() / sizeof(PvalueVector);
+    legacyRecords_.resize(numLegacy);
+    PvalueVector pvec;
+    for (size_t i = 0; i < numLegacy; ++i) {
+      memcpy(&pvec, mmap_.data() + i * sizeof(PvalueVector), sizeof(pvec));
+      encode(pvec, legacyRecords_[i]);
+    }
+    mmap_.close();
+    records_ = legacyRecords_.empty() ? NULL : &legacyRecords_[0];
+    numRecords_ = legacyRecords_.size();
+  } else {
+    std::cerr << "Error: " << pvalueVectorsFN << " is not a p-value vectors file" << std::endl;
+    close();
+    return false;
+  }
+  return true;
+}
+
+void PvalueVectorFile::close() {
+  if (mmap_.is_open()) mmap_.close();
+  std::vector<PvalueVectorRecord>().swap(legacyRecords_);
+  records_ = NULL;
+  numRecords_ = 0u;
+}
+
+void PvalueVectorFile::encode(const PvalueVector& pvec, 
+    PvalueVectorRecord& record) {
+  // also clears the padding, such that the files are reproducible
+  memset(static_cast<void*>(&record), 0, sizeof(record));
+  record.precMz = static_cast<float>(pvec.precMz);
+  record.retentionTime = static_cast<float>(pvec.retentionTime);
+  for (unsigned int j = 0; j < PvalueCalculator::kPolyfitDegree + 1; ++j) {
+    record.polyfit[j] = static_cast<float>(pvec.polyfit[j]);
+  }
+  record.scannr = pvec.scannr;
+  for (unsigned int j = 0; j < PvalueCalculator::kMaxScoringPeaks && 
+                           pvec.peakBins[j] != 0; ++j) {
+    record.peakBins[j] = static_cast<unsigned short>(pvec.peakBins[j]);
+    record.peakScores[j] = static_cast<unsigned char>(
+        std::min(static_cast<int>(pvec.peakScores[j]), 255));
+  }
+  record.charge = static_cast<unsigned char>(pvec.charge);
+  record.queryCharge = static_cast<unsigned char>(pvec.queryCharge);
+}
+
+bool PvalueVectorFile::isValidHeader(const PvalueVectorFileHeader& header) {
+  return header.version == kVersion && 
+         header.recordSize == sizeof(PvalueVectorRecord) &&
+         header.polyfitDegree == PvalueCalculator::kPolyfitDegree &&
+         header.maxScoringPeaks == PvalueCalculator::getMaxScoringPeaksConstant();
+}
+
+static bool isEqualRecord(const PvalueVectorRecord& a, 
+                          const PvalueVectorRecord& b) {
+  return memcmp(&a, &b, sizeof(PvalueVectorRecord)) == 0;
+}
+
+bool PvalueVectorFile::pvalueVectorFileUnitTest() {
+  boost::filesystem::path testFolder = 
+      boost::filesystem::temp_directory_path() / 
+      boost::filesystem::unique_path("maracluster_pvecfile_%%%%%%%%");
+  boost::filesystem::create_directories(testFolder);
+  std::string pvecFN = (testFolder / "pvecs.dat").string();
+  std::string legacyFN = (testFolder / "legacy.dat").string();
+  std::string truncatedFN = (testFolder / "truncated.dat").string();
+  std::string versionFN = (testFolder / "version.dat").string();
+  
+  PvalueCalculator::setSeed(1);
+  size_t numPvecs = 10u;
+  std::vector<PvalueVector> pvecs(numPvecs);
+  std::vector<PvalueVectorRecord> records(numPvecs);
+  for (size_t i = 0; i < numPvecs; ++i) {
+    PvalueVector& pvec = pvecs[i];
+    memset(static_cast<void*>(&pvec), 0, sizeof(pvec));
+    pvec.precMass = 1000.0 + 100.0*PvalueCalculator::lcg_rand_unif();
+    pvec.precMz = pvec.precMass / 2.0;
+    pvec.retentionTime = 60.0*PvalueCalculator::lcg_rand_unif();
+    pvec.charge = 2;
+    pvec.queryCharge = 2;
+    pvec.scannr = ScanId(0, static_cast<unsigned int>(i + 1));
+    
+    std::set<short> peakBins;
+    size_t numPeaks = 20u + PvalueCalculator::lcg_rand() % 21u;
+    while (peakBins.size() < numPeaks) {
+      peakBins.insert(static_cast<short>(PvalueCalculator::lcg_rand() % 200u + 1u));
+    }
+    std::copy(peakBins.begin(), peakBins.end(), pvec.peakBins);
+    for (size_t j = 0; j < numPeaks; ++j) {
+      pvec.peakScores[j] = static_cast<short>(PvalueCalculator::lcg_rand() % 100u + 1u);
+    }
+    
+    double scale = 0.5 + PvalueCalculator::lcg_rand_unif();
+    pvec.polyfit[0] = -40.236851088905013*scale;
+    pvec.polyfit[1] = 90.270774017803348*scale;
+    pvec.polyfit[2] = -117.64110105643428*scale;
+    pvec.polyfit[3] = 154.88646213751957*scale;
+    pvec.polyfit[4] = -118.82877111418108*scale;
+    pvec.polyfit[5] = 31.617289887393586*scale;
+    
+    encode(pvec, records[i]);
+  }
+  
+  bool success = true;
+  
+  // appended records follow the first ones, without a second header
+  std::vector<PvalueVectorRecord> firstRecords(records.begin(), records.begin() + 4);
+  std::vector<PvalueVectorRecord> lastRecords(records.begin() + 4, records.end());
+  write(firstRecords, pvecFN, false);
+  write(lastRecords, pvecFN, true);
+  PvalueVectorFile pvecFile;
+  if (!pvecFile.open(pvecFN) || pvecFile.size() != numPvecs) {
+    std::cout << "Appended file has " << pvecFile.size() << " records instead of " 
+              << numPvecs << "." << std::endl;
+    success = false;
+  }
+  for (size_t i = 0; success && i < numPvecs; ++i) {
+    if (!isEqualRecord(pvecFile[i], records[i])) {
+      std::cout << "Record " << i << " of the appended file differs." << std::endl;
+      success = false;
+    }
+  }
+  pvecFile.close();
+  
+  // writing without append replaces the records
+  write(lastRecords, pvecFN, false);
+  if (!pvecFile.open(pvecFN) || pvecFile.size() != lastRecords.size() || 
+      !isEqualRecord(pvecFile[0], lastRecords[0])) {
+    std::cout << "Rewritten file has " << pvecFile.size() << " records instead of " 
+              << lastRecords.size() << "." << std::endl;
+    success = false;
+  }
+  pvecFile.close();
+  
+  // files of plain PvalueVectors are converted on opening
+  {
+    std::ofstream legacyStream(legacyFN.c_str(), std::ios_base::out | std::ios_base::binary);
+    legacyStream.write(reinterpret_cast<const char*>(&pvecs[0]), 
+                       pvecs.size() * sizeof(PvalueVector));
+  }
+  if (!pvecFile.open(legacyFN) || pvecFile.size() != numPvecs) {
+    std::cout << "Legacy file has " << pvecFile.size() << " records instead of " 
+              << numPvecs << "." << std::endl;
+    success = false;
+  }
+  for (size_t i = 0; success && i < numPvecs; ++i) {
+    if (!isEqualRecord(pvecFile[i], records[i])) {
+      std::cout << "Record " << i << " of the legacy file differs." << std::endl;
+      success = false;
+    }
+  }
+  
+  // decoded records give the p-values of the double precision vectors
+  for (size_t i = 0; success && i < numPvecs; ++i) {
+    const PvalueVectorRecord& record = pvecFile[i];
+    std::vector<unsigned int> peakBins, peakScores;
+    for (unsigned int j = 0; j < PvalueCalculator::kMaxScoringPeaks && 
+                             record.peakBins[j] != 0; ++j) {
+      peakBins.push_back(record.peakBins[j]);
+      peakScores.push_back(record.peakScores[j]);
+    }
+    std::vector<double> polyfit(record.polyfit, 
+        record.polyfit + PvalueCalculator::kPolyfitDegree + 1);
+    PvalueCalculator pvalCalc;
+    pvalCalc.initPolyfit(peakBins, peakScores, polyfit);
+    
+    for (size_t k = 0; k < numPvecs; ++k) {
+      std::vector<unsigned int> queryPeakBins;
+      for (unsigned int j = 0; j < PvalueCalculator::kMaxScoringPeaks && 
+                               pvecs[k].peakBins[j] != 0; ++j) {
+        queryPeakBins.push_back(pvecs[k].peakBins[j]);
+      }
+      double logPval = PvalueCalculator::computePvalPolyfit(pvecs[i].peakBins, 
+          pvecs[i].peakScores, pvecs[i].polyfit, queryPeakBins);
+      double decodedLogPval = pvalCalc.computePvalPolyfit(queryPeakBins);
+      if (std::abs(logPval - decodedLogPval) > 1e-4) {
+        std::cout << "log(pval) of decoded record " << i << " against " << k 
+                  << " was " << decodedLogPval << ", should be " << logPval 
+                  << "." << std::endl;
+        success = false;
+      }
+    }
+  }
+  pvecFile.close();
+  
+  // truncated files and files of other versions are rejected
+  write(records, truncatedFN, false);
+  boost::filesystem::resize_file(truncatedFN, 
+      boost::filesystem::file_size(truncatedFN) - sizeof(PvalueVectorRecord)/2);
+  if (pvecFile.open(truncatedFN)) {
+    std::cout << "Truncated file was accepted." << std::endl;
+    success = false;
+  }
+  
+  write(records, versionFN, false);
+  {
+    std::fstream versionStream(versionFN.c_str(), 
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    PvalueVectorFileHeader header;
+    versionStream.read(reinterpret_cast<char*>(&header), sizeof(header));
+    header.version = kVersion + 1u;
+    versionStream.seekp(0);
+    versionStream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+  if (pvecFile.open(versionFN)) {
+    std::cout << "File with version " << kVersion + 1u << " was accepted." << std::endl;
+    success = false;
+  }
+  pvecFile.close();
+  
+  boost::filesystem::remove_all(testFolder);
+  return success;
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,94 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_PVALUEVECTORFILE_H_
+#define MARACLUSTER_PVALUEVECTORFILE_H_
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "Globals.h"
+#include "StageProfiler.h"
+#include "PvalueVector.h"
+
+namespace maracluster {
+
+struct PvalueVectorFileHeader {
+  char magic[8];
+  unsigned int version, recordSize;
+  unsigned int polyfitDegree, maxScoringPeaks;
+};
+
+/* Compact form of a PvalueVector for the intermediate p-value vector files,
+   164 instead of 248 bytes. The polyfit coefficients are stored in single 
+   precision, which changes the log10 p-values by less than 1e-4. Peak scores
+   are bounded by PvalueCalculator::probDiscretizationLevels_ and fit in 8 
+   bits. The peak bins are zero terminated, as in PvalueVector. */
+struct PvalueVectorRecord {
+  float precMz, retentionTime;
+  float polyfit[PvalueCalculator::kPolyfitDegree + 1];
+  ScanId scannr;
+  unsigned short peakBins[PvalueCalculator::kMaxScoringPeaks];
+  unsigned char peakScores[PvalueCalculator::kMaxScoringPeaks];
+  unsigned char charge, queryCharge;
+};
+
+/* File of PvalueVectorRecords, as written by 
+   PvalueVectors::writePvalueVectors(), preceded by a PvalueVectorFileHeader.
+   open() memory maps the file, such that the records can be read without 
+   copying. Files without a header, written by earlier versions as plain
+   PvalueVector arrays, are converted to records in memory. */
+class PvalueVectorFile {
+ public:
+  PvalueVectorFile() : records_(NULL), numRecords_(0u) {}
+  
+  static void write(const std::vector<PvalueVectorRecord>& records,
+                    const std::string& pvalueVectorsFN, bool append);
+  bool open(const std::string& pvalueVectorsFN);
+  void close();
+  
+  inline size_t size() const { return numRecords_; }
+  inline const PvalueVectorRecord* begin() const { return records_; }
+  inline const PvalueVectorRecord* end() const { return records_ + numRecords_; }
+  inline const PvalueVectorRecord& operator[](size_t idx) const { 
+    return records_[idx];
+  }
+  
+  static void encode(const PvalueVector& pvec, PvalueVectorRecord& record);
+  
+  static bool pvalueVectorFileUnitTest();
+  
+  static const char kMagic[8];
+  static const unsigned int kVersion;
+  
+ protected:
+  boost::iostreams::mapped_file_source mmap_;
+  std::vector<PvalueVectorRecord> legacyRecords_;
+  const PvalueVectorRecord* records_;
+  size_t numRecords_;
+  
+  static bool isValidHeader(const PvalueVectorFileHeader& header);
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_PVALUEVECTORFILE_H_ */
@@ -0,0 +1,130 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "PvalueVectorIndex.h"
+
+namespace maracluster {
+
+const char PvalueVectorIndex::kMagic[8] = { 'M', 'R', 'C', 'L', 'P', 'V', 'I', 'X' };
+const unsigned int PvalueVectorIndex::kVersion = 1u;
+
+/* The index is written to a temporary file first and then renamed, so that 
+   processes that still have the old index mapped are not affected. */
+bool PvalueVectorIndex::write(const std::string& indexFN, 
+    std::vector<PvalueVector>& pvecs) {
+  std::sort(pvecs.begin(), pvecs.end(), lessPrecMz);
+  
+  PvalueVectorIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  std::copy(kMagic, kMagic + sizeof(kMagic), header.magic);
+  header.version = kVersion;
+  header.recordSize = sizeof(PvalueVector);
+  header.polyfitDegree = PvalueCalculator::kPolyfitDegree;
+  header.maxScoringPeaks = PvalueCalculator::getMaxScoringPeaksConstant();
+  header.numVectors = pvecs.size();
+  if (!pvecs.empty()) {
+    header.minPrecMz = pvecs.front().precMz;
+    header.maxPrecMz = pvecs.back().precMz;
+  }
+  
+  std::string tmpIndexFN = indexFN + ".tmp";
+  std::ofstream outfile(tmpIndexFN.c_str(), 
+                        std::ios_base::out | std::ios_base::binary);
+  if (!outfile.is_open()) {
+    std::cerr << "Error: could not write library index to " << tmpIndexFN << std::endl;
+    return false;
+  }
+  outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (!pvecs.empty()) {
+    outfile.write(reinterpret_cast<const char*>(&pvecs[0]), 
+                  pvecs.size() * sizeof(PvalueVector));
+  }
+  outfile.close();
+  if (outfile.fail()) {
+    std::cerr << "Error: failed writing library index to " << tmpIndexFN << std::endl;
+    return false;
+  }
+  
+  boost::system::error_code returnedError;
+  boost::filesystem::rename(tmpIndexFN, indexFN, returnedError);
+  if (returnedError) {
+    std::cerr << "Error: could not move library index to " << indexFN << std::endl;
+    return false;
+  }
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Wrote " << pvecs.size() << " p-value vectors to library index " 
+              << indexFN << std::endl;
+  }
+  return true;
+}
+
+bool PvalueVectorIndex::open(const std::string& indexFN) {
+  close();
+  if (Globals::fileIsEmpty(indexFN)) {
+    std::cerr << "Error: missing or empty library index " << indexFN << std::endl;
+    return false;
+  }
+  
+  mmap_.open(indexFN);
+  if (!mmap_.is_open() || mmap_.size() < sizeof(PvalueVectorIndexHeader)) {
+    std::cerr << "Error: could not read library index " << indexFN << std::endl;
+    close();
+    return false;
+  }
+  
+  PvalueVectorIndexHeader header;
+  memcpy(&header, mmap_.data(), sizeof(header));
+  if (!std::equal(kMagic, kMagic + sizeof(kMagic), header.magic)) {
+    std::cerr << "Error: " << indexFN << " is not a library index" << std::endl;
+    close();
+    return false;
+  } else if (header.version != kVersion || 
+             header.recordSize != sizeof(PvalueVector) ||
+             header.polyfitDegree != PvalueCalculator::kPolyfitDegree ||
+             header.maxScoringPeaks != PvalueCalculator::getMaxScoringPeaksConstant()) {
+    std::cerr << "Error: library index " << indexFN << " has version " 
+              << header.version << " and record size " << header.recordSize
+              << ", expected version " << kVersion << " and record size " 
+              << sizeof(PvalueVector) << ". Please rebuild the library index." 
+              << std::endl;
+    close();
+    return false;
+  } else if (mmap_.size() != sizeof(header) + 
+                 header.numVectors * sizeof(PvalueVector)) {
+    std::cerr << "Error: library index " << indexFN << " is truncated" << std::endl;
+    close();
+    return false;
+  }
+  
+  pvecs_ = reinterpret_cast<const PvalueVector*>(mmap_.data() + sizeof(header));
+  numVectors_ = header.numVectors;
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Opened library index " << indexFN << " with " << numVectors_
+              << " p-value vectors between precursor m/z " << header.minPrecMz 
+              << " and " << header.maxPrecMz << std::endl;
+  }
+  return true;
+}
+
+void PvalueVectorIndex::close() {
+  if (mmap_.is_open()) mmap_.close();
+  pvecs_ = NULL;
+  numVectors_ = 0u;
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,88 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_PVALUEVECTORINDEX_H_
+#define MARACLUSTER_PVALUEVECTORINDEX_H_
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "Globals.h"
+#include "PvalueVector.h"
+
+namespace maracluster {
+
+struct PvalueVectorIndexHeader {
+  char magic[8];
+  unsigned int version, recordSize;
+  unsigned int polyfitDegree, maxScoringPeaks;
+  unsigned long long numVectors;
+  double minPrecMz, maxPrecMz;
+};
+
+/* Read-only spectral library of p-value vectors, sorted by precursor m/z. 
+   The file consists of a PvalueVectorIndexHeader followed by the PvalueVector
+   records in native byte order, so that the index can be memory mapped as
+   is. Processes that map the same index share its pages in the page cache. */
+class PvalueVectorIndex {
+ public:
+  PvalueVectorIndex() : pvecs_(NULL), numVectors_(0u) {}
+  
+  static bool write(const std::string& indexFN, 
+                    std::vector<PvalueVector>& pvecs);
+  bool open(const std::string& indexFN);
+  void close();
+  
+  inline bool isOpen() const { return mmap_.is_open(); }
+  inline size_t size() const { return numVectors_; }
+  inline const PvalueVector* begin() const { return pvecs_; }
+  inline const PvalueVector* end() const { return pvecs_ + numVectors_; }
+  inline const PvalueVector& operator[](size_t idx) const { 
+    return pvecs_[idx]; 
+  }
+  
+  // index of the first p-value vector with precursor m/z >= precMz
+  inline size_t lowerBound(double precMz) const {
+    return std::lower_bound(begin(), end(), precMz, comparePrecMz) - begin();
+  }
+  
+  inline static bool comparePrecMz(const PvalueVector& pvec, double precMz) {
+    return pvec.precMz < precMz;
+  }
+  
+  static const char kMagic[8];
+  static const unsigned int kVersion;
+  
+ protected:
+  boost::iostreams::mapped_file_source mmap_;
+  const PvalueVector* pvecs_;
+  size_t numVectors_;
+  
+  inline static bool lessPrecMz(const PvalueVector& a, const PvalueVector& b) {
+    return a.precMz < b.precMz || (a.precMz == b.precMz && a.scannr < b.scannr);
+  }
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_PVALUEVECTORINDEX_H_ */
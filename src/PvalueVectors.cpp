@@ -16,8 +16,18 @@
  
 #include "PvalueVectors.h"
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
 namespace maracluster {
 
+const size_t PvalueVectors::kPvecBatchSize = 10000u;
+const size_t PvalueVectors::kMinPvalsForClustering = 20000000u; /* = 20M */
+// blocks of the fingerprint filter must not cross p-value vector batches
+const unsigned short PvalueVectors::kFingerprintBlockSize = 1000u;
+const size_t PvalueVectors::kFingerprintRecallSampling = 50u;
+
 void PvalueVectors::calculatePvalueVectors(
     std::vector<Spectrum>& spectra, 
     PeakCounts& peakCounts) {
@@ -28,10 +38,7 @@ void PvalueVectors::calculatePvalueVectors(
   size_t numSpectra = spectra.size();
   //size_t numSpectra = 500000;
   
-  time_t startTime;
-  time(&startTime);
-  clock_t startClock = clock();
-  
+  ProgressReporter::startTask("Inserting spectrum", numSpectra);
   for (size_t i = 0; i < numSpectra; ++i) {    
     if (Globals::VERB > 4) {
       std::cerr << "Global scannr " << spectra[i].scannr << std::endl;
@@ -45,11 +52,7 @@ void PvalueVectors::calculatePvalueVectors(
     bool forceInsert = false;
     batchInsert(peakCounts, forceInsert);
     
-    if ((i % 50000 == 0 && Globals::VERB > 2) || Globals::VERB > 3) {
-      std::cerr << "Successfully inserted spectrum " << i + 1 << "/" << 
-          numSpectra << " (" << (i+1)*100/numSpectra << "%)" << std::endl;
-      Globals::reportProgress(startTime, startClock, i, numSpectra);
-    }
+    ProgressReporter::addProgress(1u);
   }
   
   bool forceInsert = true;
@@ -159,6 +162,7 @@ void PvalueVectors::calculatePvalueVector(PvalueVectorsDbRow& pvecRow,
   float precMass = SpectrumHandler::calcMass(pvecRow.precMz, pvecRow.charge);
   unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(precMass);
   initPvalCalc(pvecRow.pvalCalc, pvecRow, peakCounts, numScoringPeaks);
+  pvecRow.pvalCalc.initEarlyExit(dbPvalThreshold_);
   
   if (pvecRow.pvalCalc.getNumScoringPeaks() >= PvalueCalculator::getMinScoringPeaks(precMass)) {    
   #pragma omp critical (store_pvec)
@@ -191,43 +195,68 @@ void PvalueVectors::writePvalueVectors(
     std::cerr << "Writing pvalue vectors" << std::endl;
   }
 
-  std::vector<PvalueVector> headList, tailList, allList;
+  std::vector<PvalueVectorRecord> headList, tailList, allList;
   double headOverlapLimit = getUpperBound(pvalVecCollection_.front().precMz);
   double tailOverlapLimit = getLowerBound(pvalVecCollection_.back().precMz);
   size_t n = pvalVecCollection_.size();
   
+  ProgressReporter::startTask("Writing pvalue vector", n);
+  PvalueVector pvec;
+  PvalueVectorRecord record;
   for (size_t i = 0; i < n; ++i) {
-    if (i % 100000 == 0 && Globals::VERB > 2) {
-      std::cerr << "Writing pvalue vector " << i << "/" << n << std::endl;
-    }
-
-    if (writeAll) insert(pvalVecCollection_[i], allList);
+    ProgressReporter::addProgress(1u);
     
-    if (pvalVecCollection_[i].precMz < headOverlapLimit) {
-      insert(pvalVecCollection_[i], headList);
-    }
-    if (pvalVecCollection_[i].precMz > tailOverlapLimit) {
-      insert(pvalVecCollection_[i], tailList);
-    }
+    bool isHead = pvalVecCollection_[i].precMz < headOverlapLimit;
+    bool isTail = pvalVecCollection_[i].precMz > tailOverlapLimit;
+    if (!writeAll && !isHead && !isTail) continue;
+    
+    initPvec(pvalVecCollection_[i], pvec);
+    PvalueVectorFile::encode(pvec, record);
+    if (writeAll) allList.push_back(record);
+    if (isHead) headList.push_back(record);
+    if (isTail) tailList.push_back(record);
   }
 
   bool append = false;
-  BinaryInterface::write<PvalueVector>(allList, pvalueVectorsFN, append);
-  BinaryInterface::write<PvalueVector>(headList, pvalueVectorsHeadFN, append);
-  BinaryInterface::write<PvalueVector>(tailList, pvalueVectorsTailFN, append);
+  PvalueVectorFile::write(allList, pvalueVectorsFN, append);
+  PvalueVectorFile::write(headList, pvalueVectorsHeadFN, append);
+  PvalueVectorFile::write(tailList, pvalueVectorsTailFN, append);
   
   if (Globals::VERB > 1) {
     std::cerr << "Finished writing pvalue vectors" << std::endl;
   }
 }
 
+bool PvalueVectors::writePvalueVectorIndex(const std::string& indexFN) {
+  if (Globals::VERB > 1) {
+    std::cerr << "Writing library index" << std::endl;
+  }
+  
+  std::vector<PvalueVector> pvecs;
+  pvecs.reserve(pvalVecCollection_.size());
+  BOOST_FOREACH (PvalueVectorsDbRow& pvecRow, pvalVecCollection_) {
+    insert(pvecRow, pvecs);
+  }
+  return PvalueVectorIndex::write(indexFN, pvecs);
+}
+
 void PvalueVectors::insert(PvalueVectorsDbRow& pvecRow, std::vector<PvalueVector>& pvecList) {
   if (Globals::VERB > 4) {
     std::cerr << "Inserting pvalue vector into pvalue vectors " <<
                  "table asynchronously" << std::endl;
   }  
   PvalueVector pvec;
+  initPvec(pvecRow, pvec);
+  pvecList.push_back(pvec);
   
+  if (Globals::VERB > 4) {
+    std::cerr << "Put pvalue vector insertion into queue" << std::endl;
+  }
+}
+
+void PvalueVectors::initPvec(const PvalueVectorsDbRow& pvecRow, 
+                             PvalueVector& pvec) {
+  pvec.precMass = 0.0;
   pvec.precMz = pvecRow.precMz;
   pvec.charge = pvecRow.charge;
   pvec.scannr = pvecRow.scannr;
@@ -236,18 +265,32 @@ void PvalueVectors::insert(PvalueVectorsDbRow& pvecRow, std::vector<PvalueVector
   pvec.queryCharge = pvecRow.queryCharge;
   
   pvecRow.pvalCalc.copyPolyfit(pvec.peakBins, pvec.peakScores, pvec.polyfit);
-  
-  pvecList.push_back(pvec);
-  
-  if (Globals::VERB > 4) {
-    std::cerr << "Put pvalue vector insertion into queue" << std::endl;
-  }
 }
 
+/* With multiple NUMA nodes, the p-value vectors of batch b are copied by a 
+   thread of node b % numNodes, such that their memory is allocated on the 
+   node that calculates the p-values of this batch. */
 void PvalueVectors::reloadPvalueVectors() {
   std::vector<PvalueVectorsDbRow> pvalVecCollection;
-  BOOST_FOREACH (PvalueVectorsDbRow& tmp, pvalVecCollection_) {
-    pvalVecCollection.push_back(tmp);
+  if (ThreadPlacement::getNumNodes() > 1) {
+    size_t n = pvalVecCollection_.size();
+    pvalVecCollection.resize(n);
+    NodeBatchScheduler batchScheduler((n + kPvecBatchSize - 1) / kPvecBatchSize);
+  #pragma omp parallel
+    {
+      int node = ThreadPlacement::getThreadNode();
+      size_t batchIdx;
+      while (batchScheduler.next(node, batchIdx)) {
+        size_t upperBoundIdx = (std::min)((batchIdx + 1) * kPvecBatchSize, n);
+        for (size_t i = batchIdx * kPvecBatchSize; i < upperBoundIdx; ++i) {
+          pvalVecCollection[i] = pvalVecCollection_[i];
+        }
+      }
+    }
+  } else {
+    BOOST_FOREACH (PvalueVectorsDbRow& tmp, pvalVecCollection_) {
+      pvalVecCollection.push_back(tmp);
+    }
   }
   pvalVecCollection_.swap(pvalVecCollection);
   
@@ -275,43 +318,19 @@ void PvalueVectors::readPvalueVectorsFile(const std::string& pvalueVectorsFN,
     return;
   }
 
-  boost::iostreams::mapped_file mmap(pvalueVectorsFN,
-            boost::iostreams::mapped_file::readonly);
-  
-  const char* f = mmap.const_data();
-  const char* l = f + mmap.size();
+  PvalueVectorFile pvecFile;
+  if (!pvecFile.open(pvalueVectorsFN)) {
+    std::stringstream ss;
+    ss << "(PvalueVectors.cpp) error in reading p-value vectors file " 
+       << pvalueVectorsFN << std::endl;
+    throw MyException(ss);
+  }
+  StageProfiler::addBytesRead(pvecFile.size() * sizeof(PvalueVectorRecord));
   
-  errno = 0;
-  PvalueVector tmp;
-  while (errno == 0 && f && f<=(l-sizeof(tmp)) ) {
-    memcpy(&tmp, f, sizeof(tmp));
-    f += sizeof(tmp);
+  pvalVecCollection.reserve(pvalVecCollection.size() + pvecFile.size());
+  for (size_t i = 0; i < pvecFile.size(); ++i) {
     PvalueVectorsDbRow pvecRow;
-    
-    pvecRow.precMz = tmp.precMz;
-    pvecRow.charge = tmp.charge;
-    pvecRow.scannr = tmp.scannr;
-    
-    pvecRow.retentionTime = tmp.retentionTime;
-    pvecRow.queryCharge = tmp.queryCharge;
-    
-    std::vector<unsigned int> peakBins, peakScores;
-    for (unsigned int j = 0; j < PvalueCalculator::kMaxScoringPeaks; ++j) {
-      if (tmp.peakBins[j] != 0) {
-        peakBins.push_back(tmp.peakBins[j]);
-        peakScores.push_back(tmp.peakScores[j]);
-      } else {
-        break;
-      }
-    }
-    
-    std::vector<double> polyfit;
-    for (unsigned int j = 0; j < PvalueCalculator::kPolyfitDegree + 1; ++j) {
-      polyfit.push_back(tmp.polyfit[j]);
-    }
-    
-    pvecRow.pvalCalc.initPolyfit(peakBins, peakScores, polyfit);
-    
+    initPvecRow(pvecFile[i], pvecRow);
     pvalVecCollection.push_back(pvecRow);
   }
   
@@ -320,6 +339,55 @@ void PvalueVectors::readPvalueVectorsFile(const std::string& pvalueVectorsFN,
   }
 }
 
+void PvalueVectors::initPvecRow(const PvalueVector& pvec, 
+                                PvalueVectorsDbRow& pvecRow) {
+  pvecRow.precMz = pvec.precMz;
+  pvecRow.charge = pvec.charge;
+  pvecRow.scannr = pvec.scannr;
+  
+  pvecRow.retentionTime = pvec.retentionTime;
+  pvecRow.queryCharge = pvec.queryCharge;
+  
+  std::vector<unsigned int> peakBins, peakScores;
+  for (unsigned int j = 0; j < PvalueCalculator::kMaxScoringPeaks; ++j) {
+    if (pvec.peakBins[j] != 0) {
+      peakBins.push_back(pvec.peakBins[j]);
+      peakScores.push_back(pvec.peakScores[j]);
+    } else {
+      break;
+    }
+  }
+  
+  std::vector<double> polyfit;
+  for (unsigned int j = 0; j < PvalueCalculator::kPolyfitDegree + 1; ++j) {
+    polyfit.push_back(pvec.polyfit[j]);
+  }
+  
+  pvecRow.pvalCalc.initPolyfit(peakBins, peakScores, polyfit);
+}
+
+void PvalueVectors::initPvecRow(const PvalueVectorRecord& record, 
+                                PvalueVectorsDbRow& pvecRow) {
+  pvecRow.precMz = record.precMz;
+  pvecRow.charge = record.charge;
+  pvecRow.scannr = record.scannr;
+  
+  pvecRow.retentionTime = record.retentionTime;
+  pvecRow.queryCharge = record.queryCharge;
+  
+  std::vector<unsigned int> peakBins, peakScores;
+  for (unsigned int j = 0; j < PvalueCalculator::kMaxScoringPeaks && 
+                           record.peakBins[j] != 0; ++j) {
+    peakBins.push_back(record.peakBins[j]);
+    peakScores.push_back(record.peakScores[j]);
+  }
+  
+  std::vector<double> polyfit(record.polyfit, 
+      record.polyfit + PvalueCalculator::kPolyfitDegree + 1);
+  
+  pvecRow.pvalCalc.initPolyfit(peakBins, peakScores, polyfit);
+}
+
 void PvalueVectors::parseBatchOverlapFile(
     const std::string& overlapBatchFileFN,
     std::vector< std::pair<std::string, std::string> >& overlapFNs) {
@@ -337,33 +405,194 @@ void PvalueVectors::parseBatchOverlapFile(
   }
 }
 
+/* The overlap pairs are independent and are processed concurrently. With a 
+   single pair, e.g. for an overlap job of a manifest, the outer loop runs 
+   single threaded and batchCalculatePvaluesOverlap() uses all threads. */
 void PvalueVectors::processOverlapFiles(
     std::vector< std::pair<std::string, std::string> >& overlapFNs) {
-  typedef std::pair<std::string, std::string> OverlapPair;
-  BOOST_FOREACH(OverlapPair& p, overlapFNs) {
+  int numOverlaps = static_cast<int>(overlapFNs.size());
+  std::string readError;
+  ProgressReporter::startTask("Processing overlap", numOverlaps);
+#pragma omp parallel for schedule(dynamic, 1) if (numOverlaps > 1)
+  for (int i = 0; i < numOverlaps; ++i) {
+    std::pair<std::string, std::string>& p = overlapFNs[i];
     std::vector<PvalueVectorsDbRow> pvalVecCollectionTail;
     std::vector<PvalueVectorsDbRow> pvalVecCollectionHead;
     
-    readPvalueVectorsFile(p.first, pvalVecCollectionTail);
-    readPvalueVectorsFile(p.second, pvalVecCollectionHead);
+    try {
+      readPvalueVectorsFile(p.first, pvalVecCollectionTail);
+      readPvalueVectorsFile(p.second, pvalVecCollectionHead);
+    } catch (std::exception& e) {
+    #pragma omp critical (overlap_read_error)
+      {
+        readError = e.what();
+      }
+      continue;
+    }
+    initEarlyExits(pvalVecCollectionTail);
+    initEarlyExits(pvalVecCollectionHead);
     
     batchCalculatePvaluesOverlap(pvalVecCollectionTail, pvalVecCollectionHead);
     
     remove(p.first.c_str());
     remove(p.second.c_str());
+    ProgressReporter::addProgress(1u);
+  }
+  if (!readError.empty()) {
+    throw MyException(readError);
   }
   clearPvalueVectors();
 }
 
+/* Clusters the p-values of the overlaps together with the p-values left by
+   the precursor bins for the final clustering, one file per bin in 
+   binPvalFNs, in the same way as batchCalculateAndClusterPvalues() clusters
+   the p-values of a single bin. Batch k holds the p-values of bin k and of 
+   the overlap of bins k and k+1, which are scored as soon as a thread is 
+   free. The tail and head files are only removed once the tree is complete,
+   such that an interrupted run can be restarted. */
+void PvalueVectors::processAndClusterOverlapFiles(
+    const std::vector< std::pair<std::string, std::string> >& overlapFNs,
+    const std::vector<std::string>& binPvalFNs,
+    const std::string& resultTreeFN, const std::string& scanInfoFN) {
+  if (binPvalFNs.empty()) return;
+  if (binPvalFNs.size() != overlapFNs.size() + 1u) {
+    std::stringstream ss;
+    ss << "(PvalueVectors.cpp) expected " << overlapFNs.size() + 1u 
+       << " p-value files of precursor bins, received " << binPvalFNs.size() 
+       << std::endl;
+    throw MyException(ss);
+  }
+  
+  time_t startTime;
+  time(&startTime);
+  clock_t startClock = clock();
+  
+  PrecMzLimits precMzLimits;
+  SpectrumFiles reader;
+  reader.readPrecMzLimits(scanInfoFN, precMzLimits);
+  
+  size_t minPvalsForClustering, maxBufferedPvals;
+  getPvalBufferLimits(minPvalsForClustering, maxBufferedPvals);
+  
+  size_t newStartBatch = 0u;
+  size_t numPvecBatches = binPvalFNs.size();
+  
+  PvalBatchBuffers pvalBuffers(numPvecBatches, maxBufferedPvals, 
+                               pvalues_.getPvaluesFN());
+  // batch k ends where bin k+1 starts, i.e. at the first p-value vector of 
+  // its head, as the later batches only contain spectra from there on
+  for (size_t k = 0; k + 1 < numPvecBatches; ++k) {
+    double binStartPrecMz = pvalBuffers.lowerPrecMzs[k];
+    PvalueVectorFile headFile;
+    if (!Globals::fileIsEmpty(overlapFNs[k].second) && 
+        headFile.open(overlapFNs[k].second) && headFile.size() > 0u) {
+      binStartPrecMz = headFile[0].precMz;
+    }
+    pvalBuffers.upperPrecMzs[k] = binStartPrecMz;
+    pvalBuffers.lowerPrecMzs[k+1] = binStartPrecMz;
+  }
+  // nothing follows the last batch, so none of its spectra are poisoned
+  pvalBuffers.upperPrecMzs.back() = std::numeric_limits<float>::max();
+  std::vector<bool> finishedPvalCalc(numPvecBatches);
+  // MT: deque (opposed to vector) does not invalidate references!
+  std::deque<ClusterJob> clusterJobs;
+  
+  // nothing precedes the first batch and no clustering follows this one
+  PoisonedEdgeQueue poisonedEdgeQueue;
+  const float lowerPrecMz = 0.0f;
+  const bool isFinalClustering = true;
+  boost::thread poisonedClusteringThread(
+      boost::bind(&PvalueVectors::runPoisonedClusteringChain, this, 
+                  boost::ref(poisonedEdgeQueue), boost::cref(precMzLimits), 
+                  lowerPrecMz, isFinalClustering, boost::cref(resultTreeFN), 
+                  minPvalsForClustering));
+  
+  int numBatches = static_cast<int>(numPvecBatches);
+  std::string readError;
+  ProgressReporter::startTask("Processing overlap", numBatches);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int k = 0; k < numBatches; ++k) {
+    std::vector<PvalueTriplet>& pvalBuffer = pvalBuffers.pvals[k];
+    try {
+      BinaryInterface::read<PvalueTriplet>(binPvalFNs[k], pvalBuffer);
+      if (k + 1 < numBatches) {
+        std::vector<PvalueVectorsDbRow> pvalVecCollectionTail;
+        std::vector<PvalueVectorsDbRow> pvalVecCollectionHead;
+        readPvalueVectorsFile(overlapFNs[k].first, pvalVecCollectionTail);
+        readPvalueVectorsFile(overlapFNs[k].second, pvalVecCollectionHead);
+        initEarlyExits(pvalVecCollectionTail);
+        initEarlyExits(pvalVecCollectionHead);
+        
+        for (size_t i = 0; i < pvalVecCollectionTail.size(); ++i) {
+          calculatePvaluesOverlap(pvalVecCollectionTail[i], 
+                                  pvalVecCollectionHead, pvalBuffer);
+        }
+      }
+    } catch (std::exception& e) {
+    #pragma omp critical (overlap_read_error)
+      {
+        readError = e.what();
+      }
+    }
+    // failed batches are finished as well, otherwise the clustering of the
+    // following batches would wait for them forever
+    finishPvalBatch(k, pvalBuffers, finishedPvalCalc);
+    ProgressReporter::addProgress(1u);
+    
+    attemptClustering(newStartBatch, numPvecBatches, minPvalsForClustering,
+                      finishedPvalCalc, pvalBuffers, clusterJobs, poisonedEdgeQueue,
+                      precMzLimits, resultTreeFN, startTime, startClock);
+  }
+  
+  while (newStartBatch < numPvecBatches) {
+    attemptClustering(newStartBatch, numPvecBatches, minPvalsForClustering,
+                      finishedPvalCalc, pvalBuffers, clusterJobs, poisonedEdgeQueue,
+                      precMzLimits, resultTreeFN, startTime, startClock);
+  }
+  
+  poisonedClusteringThread.join();
+  
+  if (!readError.empty()) {
+    throw MyException(readError);
+  }
+  
+  typedef std::pair<std::string, std::string> OverlapFilePair;
+  BOOST_FOREACH (const OverlapFilePair& p, overlapFNs) {
+    remove(p.first.c_str());
+    remove(p.second.c_str());
+  }
+  
+  if (Globals::VERB > 2) {
+    std::cerr << "Peak buffered p-values: " << pvalBuffers.peakBufferedPvals 
+              << " (" << pvalBuffers.peakBufferedPvals*sizeof(PvalueTriplet)/1024/1024 
+              << " MB), spilled " << pvalBuffers.numSpilledBatches << "/" 
+              << numPvecBatches << " batches to disk" << std::endl;
+  }
+}
+
+void PvalueVectors::initEarlyExits(
+    std::vector<PvalueVectorsDbRow>& pvalVecCollection) {
+#ifndef DOT_PRODUCT
+  int n = static_cast<int>(pvalVecCollection.size());
+#pragma omp parallel for schedule(dynamic, 10000)
+  for (int i = 0; i < n; ++i) {
+    pvalVecCollection[i].pvalCalc.initEarlyExit(dbPvalThreshold_);
+  }
+#endif
+}
+
 void PvalueVectors::parsePvalueVectorFile(const std::string& pvalVecInFileFN) {
   if (Globals::VERB > 2) {
     std::cerr << "Reading p-value vectors file" << std::endl;
   }
   readPvalueVectorsFile(pvalVecInFileFN, pvalVecCollection_);
+  initEarlyExits(pvalVecCollection_);
   if (Globals::VERB > 2) {
     std::cerr << "Read in " << pvalVecCollection_.size() 
               << " p-value vectors from file" << std::endl;
   }
+  if (ThreadPlacement::getNumNodes() > 1) reloadPvalueVectors();
 }
 
 /* This function presumes that the pvalue vectors are sorted by precursor
@@ -375,27 +604,23 @@ void PvalueVectors::batchCalculatePvalues() {
   
   size_t n = pvalVecCollection_.size();
   
-  time_t startTime;
-  time(&startTime);
-  clock_t startClock = clock();
-  
-#pragma omp parallel for schedule(dynamic, 1000)
-  for (int i = 0; i < n; ++i) {
-    if (i % 10000 == 0 && Globals::VERB > 2) {
-      std::cerr << "Processing pvalue vector " << i+1 << "/" << n << " (" <<
-                   i*100/n << "%)." << std::endl;
-      Globals::reportProgress(startTime, startClock, i, n);
-    }
-    double precLimit = getUpperBound(pvalVecCollection_[i].precMz);
-    std::vector<PvalueTriplet> pvalBuffer;                       
-    for (size_t j = i+1; j < n; ++j) {
-      if (pvalVecCollection_[j].precMz < precLimit) { 
-        calculatePvalues(pvalVecCollection_[i], pvalVecCollection_[j], pvalBuffer);
-      } else {
-        break;
+  ProgressReporter::startTask("Processing pvalue vector", n);
+#pragma omp parallel
+  {
+    CandidateScoreBuffers scoreBuffers;
+  #pragma omp for schedule(dynamic, 1000)
+    for (int i = 0; i < n; ++i) {
+      ProgressReporter::addProgress(1u);
+      double precLimit = getUpperBound(pvalVecCollection_[i].precMz);
+      size_t windowEnd = i+1;
+      while (windowEnd < n && pvalVecCollection_[windowEnd].precMz < precLimit) {
+        ++windowEnd;
       }
+      std::vector<PvalueTriplet> pvalBuffer;
+      calculatePvaluesBatch(pvalVecCollection_[i], i+1, windowEnd, 
+                            scoreBuffers, pvalBuffer);
+      pvalues_.batchWrite(pvalBuffer);
     }
-    pvalues_.batchWrite(pvalBuffer);
   }
   clearPvalueVectors();
   
@@ -404,19 +629,12 @@ void PvalueVectors::batchCalculatePvalues() {
   }
 }
 
-void PvalueVectors::getPrecMzLimits(
-    std::map<ScanId, std::pair<float, float> >& precMzLimits) {
-  for (int i = 0; i < pvalVecCollection_.size(); ++i) {
-    ScanId si = pvalVecCollection_[i].scannr;
-    if (precMzLimits[si].first == 0.0) {
-      precMzLimits[si] = std::make_pair(pvalVecCollection_[i].precMz, 
-                                        pvalVecCollection_[i].precMz);
-    } else if (pvalVecCollection_[i].precMz < precMzLimits[si].first) {
-      precMzLimits[si].first = pvalVecCollection_[i].precMz;
-    } else if (pvalVecCollection_[i].precMz > precMzLimits[si].second) {
-      precMzLimits[si].second = pvalVecCollection_[i].precMz;
-    }
+void PvalueVectors::getPrecMzLimits(PrecMzLimits& precMzLimits) {
+  for (size_t i = 0; i < pvalVecCollection_.size(); ++i) {
+    precMzLimits.add(pvalVecCollection_[i].scannr, 
+        pvalVecCollection_[i].precMz, pvalVecCollection_[i].precMz);
   }
+  precMzLimits.finalize();
 }
 
 /* This function presumes that the pvalue vectors are sorted by precursor
@@ -429,12 +647,13 @@ void PvalueVectors::batchCalculateAndClusterPvalues(
   }
   
   size_t numTotalPvecs = pvalVecCollection_.size();
+  if (numTotalPvecs == 0) return;
   
   time_t startTime;
   time(&startTime);
   clock_t startClock = clock();
   
-  std::map<ScanId, std::pair<float, float> > precMzLimits;
+  PrecMzLimits precMzLimits;
   if (scanInfoFN.size() > 0) {
     SpectrumFiles reader;
     reader.readPrecMzLimits(scanInfoFN, precMzLimits);
@@ -442,108 +661,321 @@ void PvalueVectors::batchCalculateAndClusterPvalues(
     getPrecMzLimits(precMzLimits);
   }
   
-  const size_t pvecBatchSize = 10000;
-  const size_t minPvalsForClustering = 20000000; /* = 20M */
+  const size_t pvecBatchSize = kPvecBatchSize;
+  size_t minPvalsForClustering, maxBufferedPvals;
+  getPvalBufferLimits(minPvalsForClustering, maxBufferedPvals);
   
-  size_t newStartBatch = 0u, newPoisonedStartBatch = 0u;
+  size_t newStartBatch = 0u;
   size_t numPvecBatches = (numTotalPvecs - 1) / pvecBatchSize + 1;
   
-  std::vector< std::vector<PvalueTriplet> > pvalBuffers(numPvecBatches);
+  PvalBatchBuffers pvalBuffers(numPvecBatches, maxBufferedPvals, 
+                               pvalues_.getPvaluesFN());
+  for (size_t i = 0; i < numPvecBatches; ++i) {
+    size_t endIdx = (std::min)((i+1) * pvecBatchSize, numTotalPvecs) - 1;
+    pvalBuffers.lowerPrecMzs[i] = pvalVecCollection_[i * pvecBatchSize].precMz;
+    pvalBuffers.upperPrecMzs[i] = pvalVecCollection_[endIdx].precMz;
+  }
   std::vector<bool> finishedPvalCalc(numPvecBatches);
   // MT: deque (opposed to vector) does not invalidate references!
   std::deque<ClusterJob> clusterJobs;
   
-  // MT: there is only 1 poisoned cluster job, because each job depends on the previous
-  ClusterJob poisonedClusterJob;
-  poisonedClusterJob.finished = true;
-  
-#pragma omp parallel for schedule(dynamic)
-  for (int b = 0; b < numTotalPvecs; b += pvecBatchSize) {
-    if (Globals::VERB > 2) {
-      std::cerr << "Processing pvalue vector " << b+1 << "/" << numTotalPvecs << " (" 
-                << b*100/numTotalPvecs << "%)." << std::endl;
-    }
-    int upperBoundIdx = (std::min)(b + pvecBatchSize, numTotalPvecs);
+  BALL::BinaryFingerprintMethods bfm;
+  std::vector<std::vector<unsigned short> > fingerprintFeatures;
+  FingerprintFilterStats fingerprintStats;
+  bool useFingerprintFilter = fingerprintFilterCutoff_ >= 0.0 &&
+      initFingerprintFilter(bfm, fingerprintFeatures);
+  
+  // MT: the poisoned clustering jobs depend on each other and are therefore 
+  // run in order by a dedicated thread, while the p-value calculations continue
+  PoisonedEdgeQueue poisonedEdgeQueue;
+  boost::thread poisonedClusteringThread(
+      boost::bind(&PvalueVectors::runPoisonedClusteringChain, this, 
+                  boost::ref(poisonedEdgeQueue), boost::cref(precMzLimits), 
+                  pvalVecCollection_.front().precMz, false, 
+                  boost::cref(resultTreeFN), minPvalsForClustering));
+  
+  ProgressReporter::startTask("Processing pvalue vector", numTotalPvecs);
+  // the batches are interleaved over the NUMA nodes, like their p-value 
+  // vectors by reloadPvalueVectors()
+  NodeBatchScheduler batchScheduler(numPvecBatches);
+#pragma omp parallel
+  {
+    int node = ThreadPlacement::getThreadNode();
+    size_t batchIdx;
+    while (batchScheduler.next(node, batchIdx)) {
+      int b = static_cast<int>(batchIdx * pvecBatchSize);
+      int upperBoundIdx = (std::min)(b + pvecBatchSize, numTotalPvecs);
     
-    for (int i = b; i < upperBoundIdx; ++i) {
-      double precLimit = getUpperBound(pvalVecCollection_[i].precMz);
-      for (size_t j = i+1; j < numTotalPvecs; ++j) {
-        if (pvalVecCollection_[j].precMz < precLimit) { 
-          calculatePvalues(pvalVecCollection_[i], pvalVecCollection_[j], 
-                           pvalBuffers[b / pvecBatchSize]);
-        } else {
-          break;
+      if (useFingerprintFilter) {
+        FingerprintFilterStats batchStats;
+        calculatePvaluesFingerprintFiltered(bfm, b, upperBoundIdx,
+            pvalBuffers.pvals[b / pvecBatchSize], batchStats);
+      #pragma omp critical (fingerprint_stats)
+        {
+          fingerprintStats.windowPairs += batchStats.windowPairs;
+          fingerprintStats.candidatePairs += batchStats.candidatePairs;
+          fingerprintStats.sampledBlocks += batchStats.sampledBlocks;
+          fingerprintStats.sampledExhaustivePvals += batchStats.sampledExhaustivePvals;
+          fingerprintStats.sampledFilteredPvals += batchStats.sampledFilteredPvals;
         }
+      } else {
+        calculatePvaluesExhaustive(b, upperBoundIdx, 
+            pvalBuffers.pvals[b / pvecBatchSize]);
       }
-    }
-    finishedPvalCalc[b / pvecBatchSize] = true;
+      finishPvalBatch(b / pvecBatchSize, pvalBuffers, finishedPvalCalc);
+      ProgressReporter::addProgress(upperBoundIdx - b);
     
-    attemptClustering(newStartBatch, newPoisonedStartBatch, pvecBatchSize, numPvecBatches, minPvalsForClustering,
-                      finishedPvalCalc, pvalBuffers, clusterJobs, poisonedClusterJob,
-                      precMzLimits, resultTreeFN, startTime, startClock);
+      attemptClustering(newStartBatch, numPvecBatches, minPvalsForClustering,
+                        finishedPvalCalc, pvalBuffers, clusterJobs, poisonedEdgeQueue,
+                        precMzLimits, resultTreeFN, startTime, startClock);
+    }
   }
   
-  while (newStartBatch < numPvecBatches || newPoisonedStartBatch + 1 < clusterJobs.size()) {
-    attemptClustering(newStartBatch, newPoisonedStartBatch, pvecBatchSize, numPvecBatches, minPvalsForClustering,
-                      finishedPvalCalc, pvalBuffers, clusterJobs, poisonedClusterJob,
+  while (newStartBatch < numPvecBatches) {
+    attemptClustering(newStartBatch, numPvecBatches, minPvalsForClustering,
+                      finishedPvalCalc, pvalBuffers, clusterJobs, poisonedEdgeQueue,
                       precMzLimits, resultTreeFN, startTime, startClock);
   }
   
+  poisonedClusteringThread.join();
+  
   clearPvalueVectors();
   
+  if (useFingerprintFilter) reportFingerprintFilterStats(fingerprintStats);
+  
   if (Globals::VERB > 1) {
     std::cerr << "Finished calculating pvalues." << std::endl;
     Globals::reportProgress(startTime, startClock, numTotalPvecs - 1, numTotalPvecs);
   }
+  if (Globals::VERB > 2) {
+    std::cerr << "Peak buffered p-values: " << pvalBuffers.peakBufferedPvals 
+              << " (" << pvalBuffers.peakBufferedPvals*sizeof(PvalueTriplet)/1024/1024 
+              << " MB), spilled " << pvalBuffers.numSpilledBatches << "/" 
+              << numPvecBatches << " batches to disk, peak resident memory: " 
+              << Globals::getPeakMemoryMB() << " MB" << std::endl;
+  }
+}
+
+void PvalueVectors::calculatePvaluesExhaustive(size_t startIdx, 
+    size_t endIdx, std::vector<PvalueTriplet>& pvalBuffer) {
+  size_t numTotalPvecs = pvalVecCollection_.size();
+  CandidateScoreBuffers scoreBuffers;
+  size_t windowEnd = startIdx;
+  for (size_t i = startIdx; i < endIdx; ++i) {
+    double precLimit = getUpperBound(pvalVecCollection_[i].precMz);
+    windowEnd = (std::max)(windowEnd, i+1);
+    while (windowEnd < numTotalPvecs && 
+           pvalVecCollection_[windowEnd].precMz < precLimit) {
+      ++windowEnd;
+    }
+    calculatePvaluesBatch(pvalVecCollection_[i], i+1, windowEnd, 
+                          scoreBuffers, pvalBuffer);
+  }
+}
+
+/* The fingerprint of a p-value vector consists of its peak bins. Blocks of
+   kFingerprintBlockSize consecutive p-value vectors are indexed, so block b
+   contains the p-value vectors [b*kFingerprintBlockSize, (b+1)*kFingerprintBlockSize). */
+bool PvalueVectors::initFingerprintFilter(BALL::BinaryFingerprintMethods& bfm,
+    std::vector<std::vector<unsigned short> >& features) {
+  std::vector<ScanId> identifiers;
+  std::vector<float> precMasses;
+  readFingerprints(features, identifiers, precMasses);
+  if (features.empty()) {
+    return false;
+  } else if (features.size() != pvalVecCollection_.size()) {
+    std::cerr << "Warning: p-value vectors without peaks, disabling the "
+              << "fingerprint filter" << std::endl;
+    return false;
+  }
+  
+  bfm.setCutoff(static_cast<float>(fingerprintFilterCutoff_));
+  bfm.setBlockSize(kFingerprintBlockSize);
+  bfm.setVerbosityLevel(0);
+  bfm.setLibraryFeatures(features);
+  
+  std::vector<float> precMzs;
+  precMzs.reserve(pvalVecCollection_.size());
+  BOOST_FOREACH (const PvalueVectorsDbRow& pvecRow, pvalVecCollection_) {
+    precMzs.push_back(pvecRow.precMz);
+  }
+  return bfm.initInvertedIndicesWithPrecMasses(precMzs);
+}
+
+/* Candidate pairs come from the fingerprint block comparisons that overlap 
+   the precursor windows of the p-value vectors in [startIdx, endIdx), and 
+   then get the same precursor window check as calculatePvaluesExhaustive. */
+void PvalueVectors::calculatePvaluesFingerprintFiltered(
+    BALL::BinaryFingerprintMethods& bfm, size_t startIdx, size_t endIdx, 
+    std::vector<PvalueTriplet>& pvalBuffer, FingerprintFilterStats& stats) {
+  size_t numTotalPvecs = pvalVecCollection_.size();
+  size_t numBlocks = (numTotalPvecs - 1) / kFingerprintBlockSize + 1;
+  for (size_t rowBlock = startIdx / kFingerprintBlockSize; 
+       rowBlock * kFingerprintBlockSize < endIdx; ++rowBlock) {
+    size_t rowStart = rowBlock * kFingerprintBlockSize;
+    size_t rowEnd = (std::min)(rowStart + kFingerprintBlockSize, numTotalPvecs);
+    
+    size_t windowEnd = rowStart;
+    for (size_t i = rowStart; i < rowEnd; ++i) {
+      double precLimit = getUpperBound(pvalVecCollection_[i].precMz);
+      windowEnd = (std::max)(windowEnd, i + 1);
+      while (windowEnd < numTotalPvecs && 
+             pvalVecCollection_[windowEnd].precMz < precLimit) {
+        ++windowEnd;
+      }
+      stats.windowPairs += windowEnd - i - 1;
+    }
+    
+    size_t numPvalsBefore = pvalBuffer.size();
+    std::vector<PvalueTriplet> candidates;
+    for (size_t colBlock = rowBlock; colBlock < numBlocks && 
+           colBlock * kFingerprintBlockSize < windowEnd; ++colBlock) {
+      candidates.clear();
+      bfm.pairwiseSimilaritiesBlocks(rowBlock, colBlock, candidates);
+      BOOST_FOREACH (const PvalueTriplet& t, candidates) {
+        size_t i = t.scannr1.scannr, j = t.scannr2.scannr;
+        if (pvalVecCollection_[j].precMz < getUpperBound(pvalVecCollection_[i].precMz)) {
+          calculatePvalues(pvalVecCollection_[i], pvalVecCollection_[j], 
+                           pvalBuffer);
+          ++stats.candidatePairs;
+        }
+      }
+    }
+    
+    if (rowBlock % kFingerprintRecallSampling == 0) {
+      std::vector<PvalueTriplet> exhaustivePvals;
+      calculatePvaluesExhaustive(rowStart, rowEnd, exhaustivePvals);
+      ++stats.sampledBlocks;
+      stats.sampledExhaustivePvals += exhaustivePvals.size();
+      stats.sampledFilteredPvals += pvalBuffer.size() - numPvalsBefore;
+    }
+  }
+}
+
+void PvalueVectors::reportFingerprintFilterStats(
+    const FingerprintFilterStats& stats) {
+  if (Globals::VERB > 1) {
+    unsigned long long eliminatedPairs = stats.windowPairs - stats.candidatePairs;
+    std::cerr << "Fingerprint filter eliminated " << eliminatedPairs << "/" 
+              << stats.windowPairs << " pairs within the precursor tolerance";
+    if (stats.windowPairs > 0) {
+      std::cerr << " (" << eliminatedPairs*100.0/stats.windowPairs << "%)";
+    }
+    std::cerr << std::endl;
+    if (stats.sampledExhaustivePvals > 0) {
+      double recall = static_cast<double>(stats.sampledFilteredPvals) / 
+                      stats.sampledExhaustivePvals;
+      std::cerr << "Fingerprint filter recall of significant pairs: " 
+                << recall*100.0 << "% (" << stats.sampledFilteredPvals << "/" 
+                << stats.sampledExhaustivePvals << " in " << stats.sampledBlocks
+                << " sampled blocks of " << kFingerprintBlockSize 
+                << " p-value vectors)" << std::endl;
+    }
+  }
+}
+
+/* Half of the memory budget is reserved for p-values waiting for a cluster 
+   job, the other half for the running cluster jobs, which hold their 
+   p-values about twice during merging and clustering. */
+void PvalueVectors::getPvalBufferLimits(size_t& minPvalsForClustering, 
+    size_t& maxBufferedPvals) {
+  minPvalsForClustering = kMinPvalsForClustering;
+  maxBufferedPvals = std::numeric_limits<size_t>::max();
+  if (pvalMemoryBudget_ > 0.0) {
+    int numThreads = 1;
+#ifdef _OPENMP
+    numThreads = omp_get_max_threads();
+#endif
+    size_t budgetPvals = static_cast<size_t>(pvalMemoryBudget_ / sizeof(PvalueTriplet));
+    maxBufferedPvals = budgetPvals / 2;
+    minPvalsForClustering = (std::max)(budgetPvals / (4 * numThreads), static_cast<size_t>(1u));
+    if (Globals::VERB > 2) {
+      std::cerr << "P-value memory budget: " << pvalMemoryBudget_ / 1024.0 / 1024.0 
+                << " MB, " << minPvalsForClustering << " p-values per cluster job, "
+                << maxBufferedPvals << " buffered p-values before spilling to disk" 
+                << std::endl;
+    }
+  }
 }
 
-void PvalueVectors::attemptClustering(size_t& newStartBatch, size_t& newPoisonedStartBatch,
-    size_t pvecBatchSize, size_t numPvecBatches, size_t minPvalsForClustering,
+/* Registers the p-values of a finished batch, writing them to disk instead
+   if they do not fit in the memory budget. They are read back when the 
+   batch is assigned to a cluster job. */
+void PvalueVectors::finishPvalBatch(size_t batchIdx, 
+    PvalBatchBuffers& pvalBuffers, std::vector<bool>& finishedPvalCalc) {
+  std::vector<PvalueTriplet>& pvalBuffer = pvalBuffers.pvals[batchIdx];
+  bool spill = false;
+#pragma omp critical (dist_cluster)
+  {
+    pvalBuffers.numPvals[batchIdx] = pvalBuffer.size();
+    if (pvalBuffers.numBufferedPvals + pvalBuffer.size() > pvalBuffers.maxBufferedPvals) {
+      spill = true;
+      ++pvalBuffers.numSpilledBatches;
+    } else {
+      pvalBuffers.numBufferedPvals += pvalBuffer.size();
+      pvalBuffers.peakBufferedPvals = (std::max)(pvalBuffers.peakBufferedPvals, 
+                                                 pvalBuffers.numBufferedPvals);
+    }
+  }
+  
+  if (spill) {
+    bool append = false;
+    BinaryInterface::write<PvalueTriplet>(pvalBuffer, 
+        pvalBuffers.getSpillFN(batchIdx), append);
+    std::vector<PvalueTriplet> empty;
+    pvalBuffer.swap(empty);
+    
+    if (Globals::VERB > 3) {
+      std::cerr << "Spilled " << pvalBuffers.numPvals[batchIdx] 
+                << " p-values of batch " << batchIdx << " to disk" << std::endl;
+    }
+  }
+  
+#pragma omp critical (dist_cluster)
+  {
+    pvalBuffers.isSpilled[batchIdx] = spill;
+    finishedPvalCalc[batchIdx] = true;
+  }
+}
+
+void PvalueVectors::attemptClustering(size_t& newStartBatch,
+    size_t numPvecBatches, size_t minPvalsForClustering,
     const std::vector<bool>& finishedPvalCalc,
-    std::vector< std::vector<PvalueTriplet> >& pvalBuffers, 
-    std::deque<ClusterJob>& clusterJobs, ClusterJob& poisonedClusterJob,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits,
+    PvalBatchBuffers& pvalBuffers, 
+    std::deque<ClusterJob>& clusterJobs, PoisonedEdgeQueue& poisonedEdgeQueue,
+    const PrecMzLimits& precMzLimits,
     const std::string& resultTreeFN, time_t& startTime, clock_t& startClock) {
   bool doClustering = false;
   size_t clusterJobIdx = 0u;
 #pragma omp critical (dist_cluster)
   {
-    doClustering = createClusterJob(newStartBatch, pvecBatchSize, numPvecBatches,
+    doClustering = createClusterJob(newStartBatch, numPvecBatches,
                      minPvalsForClustering, finishedPvalCalc, pvalBuffers, clusterJobs,
                      clusterJobIdx);
   }
   
   if (doClustering) {
     runClusterJob(clusterJobs[clusterJobIdx], pvalBuffers, precMzLimits, resultTreeFN, startTime, startClock);
-  }
-  
-  bool doPoisonedClustering = false;
-#pragma omp critical (dist_cluster)
-  {
-    doPoisonedClustering = createPoisonedClusterJob(newPoisonedStartBatch, numPvecBatches,
-                    minPvalsForClustering, clusterJobs, poisonedClusterJob);
-  }
     
-  if (doPoisonedClustering) {
-    runPoisonedClusterJob(poisonedClusterJob, clusterJobs, precMzLimits, resultTreeFN, numPvecBatches);
+    bool isLastJob = (clusterJobs[clusterJobIdx].endBatch + 1 == numPvecBatches);
+    poisonedEdgeQueue.push(clusterJobIdx, clusterJobs[clusterJobIdx].poisonedPvals, 
+                           clusterJobs[clusterJobIdx].upperPrecMz, isLastJob);
   }
 }
 
 bool PvalueVectors::createClusterJob(size_t& newStartBatch, 
-    size_t pvecBatchSize, size_t numPvecBatches, size_t minPvalsForClustering,
+    size_t numPvecBatches, size_t minPvalsForClustering,
     const std::vector<bool>& finishedPvalCalc,
-    const std::vector< std::vector<PvalueTriplet> >& pvalBuffers, 
+    const PvalBatchBuffers& pvalBuffers, 
     std::deque<ClusterJob>& clusterJobs, size_t& clusterJobIdx) {
   bool doClustering = false;
   size_t numPvals = 0u;
-  size_t startIdx = newStartBatch * pvecBatchSize;
-  double lowerPrecMz = pvalVecCollection_[startIdx].precMz;
+  double lowerPrecMz = pvalBuffers.lowerPrecMzs[newStartBatch];
   for (size_t i = newStartBatch; i < numPvecBatches; ++i) {
     if (finishedPvalCalc[i]) {
-      numPvals += pvalBuffers[i].size();
+      numPvals += pvalBuffers.numPvals[i];
       
-      size_t endIdx = (std::min)((i+1) * pvecBatchSize, pvalVecCollection_.size()) - 1;
-      double upperPrecMz = pvalVecCollection_[endIdx].precMz;
+      double upperPrecMz = pvalBuffers.upperPrecMzs[i];
       
       double threeWindows = getUpperBound(getUpperBound(getUpperBound(lowerPrecMz)));
       if ((threeWindows < upperPrecMz && numPvals > minPvalsForClustering) || i+1 == numPvecBatches) {
@@ -553,7 +985,6 @@ bool PvalueVectors::createClusterJob(size_t& newStartBatch,
         ClusterJob clusterJob;
         clusterJob.startBatch = newStartBatch;
         clusterJob.endBatch = i;
-        clusterJob.endIdx = endIdx;
         clusterJob.lowerPrecMz = lowerPrecMz;
         clusterJob.upperPrecMz = upperPrecMz;
         clusterJob.finished = false;
@@ -569,46 +1000,30 @@ bool PvalueVectors::createClusterJob(size_t& newStartBatch,
   return doClustering;
 }
 
-bool PvalueVectors::createPoisonedClusterJob(size_t& newPoisonedStartBatch, 
-    const size_t numPvecBatches, const size_t minPvalsForClustering, 
-    std::deque<ClusterJob>& clusterJobs, ClusterJob& poisonedClusterJob) {
-  bool doPoisonedClustering = false;
-  if (poisonedClusterJob.finished) {
-    size_t numPvals = 0u;
-    for (size_t i = newPoisonedStartBatch; i < clusterJobs.size(); ++i) {
-      if (clusterJobs[i].finished) {
-        numPvals += clusterJobs[i].poisonedPvals.size();
-        if ((numPvals > minPvalsForClustering && i > newPoisonedStartBatch) || clusterJobs[i].endBatch + 1 == numPvecBatches) {
-          doPoisonedClustering = true;
-          
-          poisonedClusterJob.startBatch = newPoisonedStartBatch;
-          poisonedClusterJob.lowerPrecMz = pvalVecCollection_.front().precMz;
-          poisonedClusterJob.endBatch = i;
-          poisonedClusterJob.upperPrecMz = clusterJobs[i].upperPrecMz;
-          poisonedClusterJob.finished = false;
-          
-          newPoisonedStartBatch = i;
-          break;
-        }
-      } else {
-        break;
-      }
-    }
-  }
-  return doPoisonedClustering;
-}
-
 void PvalueVectors::runClusterJob(ClusterJob& clusterJob,
-    std::vector< std::vector<PvalueTriplet> >& pvalBuffers,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits,
+    PvalBatchBuffers& pvalBuffers,
+    const PrecMzLimits& precMzLimits,
     const std::string& resultTreeFN,
     time_t& startTime, clock_t& startClock) {
   std::vector<PvalueTriplet> pvalBuffer;
+  size_t numReleasedPvals = 0u;
   for (size_t i = clusterJob.startBatch; i <= clusterJob.endBatch; ++i) {
-    pvalBuffer.insert(pvalBuffer.end(), pvalBuffers[i].begin(), pvalBuffers[i].end());
-    std::vector<PvalueTriplet> empty;
-    pvalBuffers[i].swap(empty);
+    if (pvalBuffers.isSpilled[i]) {
+      std::string spillFN = pvalBuffers.getSpillFN(i);
+      BinaryInterface::read<PvalueTriplet>(spillFN, pvalBuffer);
+      remove(spillFN.c_str());
+    } else {
+      pvalBuffer.insert(pvalBuffer.end(), pvalBuffers.pvals[i].begin(), pvalBuffers.pvals[i].end());
+      std::vector<PvalueTriplet> empty;
+      pvalBuffers.pvals[i].swap(empty);
+      numReleasedPvals += pvalBuffers.numPvals[i];
+    }
+  }
+#pragma omp critical (dist_cluster)
+  {
+    pvalBuffers.numBufferedPvals -= numReleasedPvals;
   }
+  size_t numJobPvals = pvalBuffer.size();
   
   if (Globals::VERB > 2) {
     std::cerr << "Starting clustering job: batches " << clusterJob.startBatch << "-" << clusterJob.endBatch << std::endl;
@@ -620,57 +1035,98 @@ void PvalueVectors::runClusterJob(ClusterJob& clusterJob,
   
   if (Globals::VERB > 2) {
     std::cerr << "Retained " << clusterJob.poisonedPvals.size() << " pvalues" << std::endl;
-    size_t numTotalPvecs = pvalVecCollection_.size();
-    Globals::reportProgress(startTime, startClock, clusterJob.endIdx, numTotalPvecs);
+    std::cerr << "Clustering job batches " << clusterJob.startBatch << "-" 
+              << clusterJob.endBatch << " used " << numJobPvals << " pvalues (" 
+              << numJobPvals*sizeof(PvalueTriplet)/1024/1024 
+              << " MB), peak resident memory: " << Globals::getPeakMemoryMB() 
+              << " MB" << std::endl;
+    Globals::reportProgress(startTime, startClock, clusterJob.endBatch, 
+                            pvalBuffers.pvals.size());
   }
 }
 
-void PvalueVectors::runPoisonedClusterJob(ClusterJob& poisonedClusterJob,
-    std::deque<ClusterJob>& clusterJobs,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits,
-    const std::string& resultTreeFN, const size_t numPvecBatches) {
-  std::vector<PvalueTriplet> pvalBuffer;
-  for (size_t i = poisonedClusterJob.startBatch; i <= poisonedClusterJob.endBatch; ++i) {
-    pvalBuffer.insert(pvalBuffer.end(), clusterJobs[i].poisonedPvals.begin(), clusterJobs[i].poisonedPvals.end());
-    std::vector<PvalueTriplet> empty;
-    clusterJobs[i].poisonedPvals.swap(empty);
-  }
-  
-  if (Globals::VERB > 2) {
-    std::cerr << "Starting poisoned clustering job: batches " << poisonedClusterJob.startBatch << "-" << poisonedClusterJob.endBatch << std::endl;
-  }
-  
-  clusterPvals(pvalBuffer, clusterJobs[poisonedClusterJob.endBatch].poisonedPvals, precMzLimits, 
-      poisonedClusterJob.lowerPrecMz, poisonedClusterJob.upperPrecMz, resultTreeFN);
-  
-  if (poisonedClusterJob.startBatch == 0) {
-    std::vector<PvalueTriplet> pvalBufferWrite, pvalBufferKeep;
-    BOOST_FOREACH (const PvalueTriplet& pt, clusterJobs[poisonedClusterJob.endBatch].poisonedPvals) {
-      if (isSafeToWrite(pt.scannr1, precMzLimits, poisonedClusterJob.upperPrecMz)
-           && isSafeToWrite(pt.scannr2, precMzLimits, poisonedClusterJob.upperPrecMz)) {
-        pvalBufferWrite.push_back(pt);
+/* Clusters the poisoned edges of the cluster jobs in order, each time 
+   together with the edges retained by the previous poisoned clustering job.
+   Runs in its own thread and waits for the cluster jobs to finish. Edges 
+   that can only be resolved by a later clustering are written to the 
+   p-values file, unless this is the final clustering, which keeps them 
+   until the last job. */
+void PvalueVectors::runPoisonedClusteringChain(
+    PoisonedEdgeQueue& poisonedEdgeQueue,
+    const PrecMzLimits& precMzLimits, const float lowerPrecMz,
+    const bool isFinalClustering, const std::string& resultTreeFN, 
+    const size_t minPvalsForClustering) {
+  ThreadPlacement::resetThreadAffinity();
+  
+  std::vector<PvalueTriplet> retainedPvals;
+  size_t clusterJobIdx = 0u, numPoisonedJobs = 0u;
+  double waitTime = 0.0;
+  bool isLastJob = false;
+  while (!isLastJob) {
+    size_t startClusterJobIdx = clusterJobIdx, lag = 0u;
+    float upperPrecMz = 0.0f;
+    std::vector<PvalueTriplet> pvalBuffer;
+    pvalBuffer.swap(retainedPvals);
+    do {
+      std::vector<PvalueTriplet> poisonedPvals;
+      double upperPrecMzJob = 0.0;
+      
+      boost::posix_time::ptime waitStart = boost::posix_time::microsec_clock::universal_time();
+      poisonedEdgeQueue.pop(clusterJobIdx++, poisonedPvals, upperPrecMzJob, 
+                            isLastJob, lag);
+      waitTime += (boost::posix_time::microsec_clock::universal_time() - 
+                   waitStart).total_milliseconds() / 1000.0;
+      
+      upperPrecMz = upperPrecMzJob;
+      if (pvalBuffer.empty()) {
+        pvalBuffer.swap(poisonedPvals);
       } else {
-        pvalBufferKeep.push_back(pt);
+        pvalBuffer.insert(pvalBuffer.end(), poisonedPvals.begin(), poisonedPvals.end());
       }
+    } while (!isLastJob && pvalBuffer.size() <= minPvalsForClustering);
+    
+    if (Globals::VERB > 2) {
+      std::cerr << "Starting poisoned clustering job: cluster jobs " 
+                << startClusterJobIdx << "-" << clusterJobIdx - 1 << std::endl;
+    }
+    
+    clusterPvals(pvalBuffer, retainedPvals, precMzLimits, 
+        lowerPrecMz, upperPrecMz, resultTreeFN);
+    
+    if (numPoisonedJobs++ == 0 && !isFinalClustering) {
+      std::vector<PvalueTriplet> pvalBufferWrite, pvalBufferKeep;
+      BOOST_FOREACH (const PvalueTriplet& pt, retainedPvals) {
+        if (isSafeToWrite(pt.scannr1, precMzLimits, upperPrecMz)
+             && isSafeToWrite(pt.scannr2, precMzLimits, upperPrecMz)) {
+          pvalBufferWrite.push_back(pt);
+        } else {
+          pvalBufferKeep.push_back(pt);
+        }
+      }
+      retainedPvals.swap(pvalBufferKeep);
+      pvalues_.batchWrite(pvalBufferWrite);
+    }
+    
+    if (isLastJob) {
+      pvalues_.batchWrite(retainedPvals);
+    }
+    
+    if (Globals::VERB > 2) {
+      std::cerr << "Retained " << retainedPvals.size() << " pvalues in poisoned "
+                << "clustering, " << lag << " finished cluster jobs waiting" 
+                << std::endl;
     }
-    clusterJobs[poisonedClusterJob.endBatch].poisonedPvals.swap(pvalBufferKeep);
-    pvalues_.batchWrite(pvalBufferWrite);
-  }
-  
-  if (poisonedClusterJob.endBatch + 1 == clusterJobs.size()) {
-    pvalues_.batchWrite(clusterJobs[poisonedClusterJob.endBatch].poisonedPvals);
   }
   
-  poisonedClusterJob.finished = true;
-  
   if (Globals::VERB > 2) {
-    std::cerr << "Retained " << clusterJobs[poisonedClusterJob.endBatch].poisonedPvals.size() << " pvalues" << std::endl;
+    std::cerr << "Poisoned clustering ran " << numPoisonedJobs << " jobs and "
+              << "waited " << waitTime << " seconds for cluster jobs" << std::endl;
   }
 }
 
 void PvalueVectors::clusterPvals(std::vector<PvalueTriplet>& pvalBuffer,
     std::vector<PvalueTriplet>& pvalPoisonedBuffer,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits, 
+    const PrecMzLimits& precMzLimits, 
     float lowerPrecMz, float upperPrecMz, const std::string& resultTreeFN) {
   PvalueFilterAndSort::filter(pvalBuffer);
       
@@ -690,35 +1146,34 @@ void PvalueVectors::clusterPvals(std::vector<PvalueTriplet>& pvalBuffer,
 
 void PvalueVectors::markPoisoned(SparsePoisonedClustering& matrix, 
     std::vector<PvalueTriplet>& pvalBuffer, 
-    std::map<ScanId, std::pair<float, float> >& precMzLimits, 
+    const PrecMzLimits& precMzLimits, 
     float lowerPrecMz, float upperPrecMz) {
-  std::set<ScanId> scanIds;
   BOOST_FOREACH (const PvalueTriplet& pt, pvalBuffer) {
-    scanIds.insert(pt.scannr1);
-    scanIds.insert(pt.scannr2);
-  }
-  
-  BOOST_FOREACH (const ScanId& si, scanIds) {
-    if (isPoisoned(si, precMzLimits, lowerPrecMz, upperPrecMz)) {
-      matrix.markPoisoned(si);
+    if (!matrix.isPoisoned(pt.scannr1) && 
+        isPoisoned(pt.scannr1, precMzLimits, lowerPrecMz, upperPrecMz)) {
+      matrix.markPoisoned(pt.scannr1);
+    }
+    if (!matrix.isPoisoned(pt.scannr2) && 
+        isPoisoned(pt.scannr2, precMzLimits, lowerPrecMz, upperPrecMz)) {
+      matrix.markPoisoned(pt.scannr2);
     }
   }
 }
 
 bool PvalueVectors::isPoisoned(const ScanId& si,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits, 
+    const PrecMzLimits& precMzLimits, 
     float lowerPrecMz, float upperPrecMz) {
-  float minPrecMz = precMzLimits[si].first;
-  float maxPrecMz = precMzLimits[si].second;
+  float minPrecMz = precMzLimits.getMinPrecMz(si);
+  float maxPrecMz = precMzLimits.getMaxPrecMz(si);
   
   return (minPrecMz < getUpperBound(lowerPrecMz)
           || upperPrecMz < getUpperBound(maxPrecMz));
 }
 
 bool PvalueVectors::isSafeToWrite(const ScanId& si,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits, 
+    const PrecMzLimits& precMzLimits, 
     float upperPrecMz) {
-  float maxPrecMz = precMzLimits[si].second;
+  float maxPrecMz = precMzLimits.getMaxPrecMz(si);
   
   return (upperPrecMz > getUpperBound(maxPrecMz));
 }
@@ -727,49 +1182,225 @@ bool PvalueVectors::isSafeToWrite(const ScanId& si,
 /* This function presumes that the pvalue vectors are sorted by precursor
    mass by writePvalueVectors() */
 void PvalueVectors::batchCalculatePvaluesLibrarySearch(
-    std::vector<Spectrum>& querySpectra) {    
+    std::vector<Spectrum>& querySpectra) {
+  std::vector<PvalueVector> libraryPvecs;
+  libraryPvecs.reserve(pvalVecCollection_.size());
+  BOOST_FOREACH (PvalueVectorsDbRow& pvecRow, pvalVecCollection_) {
+    insert(pvecRow, libraryPvecs);
+  }
+  pvalVecCollection_.clear();
+  
+  unsigned int libraryFileIdxOffset = 0u;
+  if (!libraryPvecs.empty()) {
+    batchCalculatePvaluesLibrarySearch(&libraryPvecs[0], libraryPvecs.size(), 
+        querySpectra, libraryFileIdxOffset);
+  }
+}
+
+/* The library index was built with its own SpectrumFileList, the file 
+   indices of its p-value vectors are therefore shifted by 
+   libraryFileIdxOffset to place them after the query files. */
+void PvalueVectors::batchCalculatePvaluesLibrarySearch(
+    const PvalueVectorIndex& library, std::vector<Spectrum>& querySpectra,
+    unsigned int libraryFileIdxOffset) {
+  if (library.size() > 0) {
+    batchCalculatePvaluesLibrarySearch(library.begin(), library.size(), 
+        querySpectra, libraryFileIdxOffset);
+  }
+}
+
+/* Both the library and the query spectra are sorted by precursor m/z, so 
+   each query only visits the library p-value vectors in its precursor window.
+   Queries are processed in blocks in parallel, so that the p-values of a 
+   query are written consecutively. */
+void PvalueVectors::batchCalculatePvaluesLibrarySearch(
+    const PvalueVector* library, size_t numLibraryPvecs,
+    std::vector<Spectrum>& querySpectra, unsigned int libraryFileIdxOffset) {
   if (Globals::VERB > 1) {
     std::cerr << "Calculating pvalues" << std::endl;
   }
   
-  size_t n = pvalVecCollection_.size();
+  int n = static_cast<int>(querySpectra.size());
+  const int queryBlockSize = 1000;
   
-  time_t startTime;
-  time(&startTime);
-  clock_t startClock = clock();
-  
-  //long long numPvalsNoThresh = 0;
-  int k = 0;
-#pragma omp parallel for schedule(dynamic, 1000)
-  for (int i = 0; i < n; ++i) {
-    if (i % 10000 == 0 && Globals::VERB > 2) {
-      std::cerr << "Processing pvalue vector " << i+1 << "/" << n << " (" <<
-                   i*100/n << "%)." << std::endl;
-      Globals::reportProgress(startTime, startClock, i, n);
-    }
+  ProgressReporter::startTask("Processing query spectrum", n);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int blockStart = 0; blockStart < n; blockStart += queryBlockSize) {
     std::vector<PvalueTriplet> pvalBuffer;
-    double precLimitLower = getLowerBound(pvalVecCollection_[i].precMz);
-    double precLimitUpper = getUpperBound(pvalVecCollection_[i].precMz);
-    for (size_t j = 0; j < querySpectra.size(); ++j) {
-      if (querySpectra[j].precMz < precLimitLower) {
-        continue;
-      }
-      if (querySpectra[j].precMz < precLimitUpper) {
-        calculatePvalue(pvalVecCollection_[i], querySpectra[j], pvalBuffer);
-      } else {
-        break;
-      }
+    std::vector<unsigned int> queryPeakBins;
+    int blockEnd = (std::min)(blockStart + queryBlockSize, n);
+    for (int j = blockStart; j < blockEnd; ++j) {
+      getQueryPeakBins(querySpectra[j], queryPeakBins);
+      calculatePvaluesLibraryWindow(library, numLibraryPvecs, 
+          libraryFileIdxOffset, querySpectra[j], queryPeakBins, pvalBuffer);
     }
     pvalues_.batchWrite(pvalBuffer);
+    ProgressReporter::addProgress(blockEnd - blockStart);
   }
   clearPvalueVectors();
   
   if (Globals::VERB > 1) {
-    //std::cerr << "Finished calculating pvalues (" << numPvalsNoThresh << " total)." << std::endl;
     std::cerr << "Finished calculating pvalues." << std::endl;
   }
-  
-  //PvalueFilterAndSort::filterAndSort(pvalues_.getPvaluesFN());
+}
+
+/* Reads query spectra as binary Spectrum records, e.g. the output of the 
+   index mode, in chunks of at most queryChunkSize and writes the topK best 
+   library hits of each query after each chunk. A chunk is cut short when no 
+   further complete record can be read without blocking, such that queries 
+   arriving slowly are not held back until the chunk fills up. Memory use 
+   does not depend on the number of queries. Queries do not have to be 
+   sorted by precursor m/z. */
+size_t PvalueVectors::streamPvaluesLibrarySearch(
+    const PvalueVectorIndex& library, std::istream& queryStream, 
+    std::ostream& resultStream, size_t topK, size_t queryChunkSize, 
+    bool binaryOutput) {
+  if (!binaryOutput) {
+    resultStream << "query_file_idx\tquery_scannr\trank\t"
+                 << "library_file_idx\tlibrary_scannr\tlog_pvalue\n";
+  }
+  
+  std::vector<Spectrum> querySpectra(queryChunkSize);
+  std::vector< std::vector<PvalueTriplet> > topHits(queryChunkSize);
+  size_t numQueries = 0u;
+  while (queryStream.good()) {
+    int numRead = static_cast<int>(readQueryChunk(queryStream, querySpectra));
+    
+  #pragma omp parallel for schedule(dynamic, 10)
+    for (int j = 0; j < numRead; ++j) {
+      searchLibrary(library, querySpectra[j], topK, topHits[j]);
+    }
+    
+    for (int j = 0; j < numRead; ++j) {
+      writeTopHits(querySpectra[j], topHits[j], resultStream, binaryOutput);
+    }
+    resultStream.flush();
+    
+    numQueries += numRead;
+    if (Globals::VERB > 2) {
+      std::cerr << "Searched " << numQueries << " query spectra" << std::endl;
+    }
+  }
+  return numQueries;
+}
+
+/* Blocks until the first record of the chunk has been read, after which 
+   records are only read as long as they are completely available in the 
+   stream buffer. Returns the number of records read. */
+size_t PvalueVectors::readQueryChunk(std::istream& queryStream,
+    std::vector<Spectrum>& querySpectra) {
+  const std::streamsize recordSize = sizeof(Spectrum);
+  size_t numRead = 0u;
+  while (numRead < querySpectra.size()) {
+    if (numRead > 0u && queryStream.rdbuf()->in_avail() < recordSize) break;
+    
+    queryStream.read(reinterpret_cast<char*>(&querySpectra[numRead]), 
+                     recordSize);
+    std::streamsize bytesRead = queryStream.gcount();
+    if (bytesRead == recordSize) {
+      ++numRead;
+    } else {
+      if (bytesRead > 0) {
+        std::cerr << "Warning: ignoring incomplete query spectrum record at "
+                  << "the end of the input" << std::endl;
+      }
+      break;
+    }
+  }
+  return numRead;
+}
+
+/* Scores a single query against the library index. Only reads member 
+   variables, so it can be called from multiple threads at the same time. */
+void PvalueVectors::searchLibrary(const PvalueVectorIndex& library,
+    const Spectrum& querySpectrum, size_t topK, 
+    std::vector<PvalueTriplet>& topHits) {
+  std::vector<unsigned int> queryPeakBins;
+  std::vector<PvalueTriplet> windowPvals;
+  unsigned int libraryFileIdxOffset = 0u;
+  getQueryPeakBins(querySpectrum, queryPeakBins);
+  calculatePvaluesLibraryWindow(library.begin(), library.size(), 
+      libraryFileIdxOffset, querySpectrum, queryPeakBins, windowPvals);
+  keepTopHits(windowPvals, topK, topHits);
+}
+
+/* Bounded max-heap on the p-value: the worst of the current top hits is at
+   the front and is replaced by better hits. */
+void PvalueVectors::keepTopHits(const std::vector<PvalueTriplet>& pvals, 
+    size_t topK, std::vector<PvalueTriplet>& topHits) {
+  topHits.clear();
+  if (topK == 0u) return;
+  
+  BOOST_FOREACH (const PvalueTriplet& pt, pvals) {
+    if (topHits.size() < topK) {
+      topHits.push_back(pt);
+      std::push_heap(topHits.begin(), topHits.end());
+    } else if (pt < topHits.front()) {
+      std::pop_heap(topHits.begin(), topHits.end());
+      topHits.back() = pt;
+      std::push_heap(topHits.begin(), topHits.end());
+    }
+  }
+  std::sort_heap(topHits.begin(), topHits.end());
+}
+
+/* Binary output consists of PvalueTriplet records (library scan, query scan,
+   log p-value), as in the .pvalues.dat files of the search mode. */
+void PvalueVectors::writeTopHits(const Spectrum& querySpectrum,
+    std::vector<PvalueTriplet>& topHits, std::ostream& resultStream, 
+    bool binaryOutput) {
+  if (binaryOutput) {
+    if (!topHits.empty()) {
+      resultStream.write(reinterpret_cast<const char*>(&topHits[0]), 
+                         topHits.size() * sizeof(PvalueTriplet));
+    }
+  } else {
+    for (size_t rank = 0; rank < topHits.size(); ++rank) {
+      resultStream << querySpectrum.scannr.fileIdx << '\t' 
+                   << querySpectrum.scannr.scannr << '\t' << rank + 1 << '\t'
+                   << topHits[rank].scannr1.fileIdx << '\t' 
+                   << topHits[rank].scannr1.scannr << '\t' 
+                   << topHits[rank].pval << '\n';
+    }
+  }
+}
+
+/* A library p-value vector is scored against the query if the query's 
+   precursor m/z lies in [getLowerBound(pvec.precMz), getUpperBound(pvec.precMz)).
+   getLowerBound(querySpectrum.precMz) is a lower limit for the precursor m/z 
+   of such library vectors for both ppm and Da tolerances. */
+void PvalueVectors::calculatePvaluesLibraryWindow(
+    const PvalueVector* library, size_t numLibraryPvecs,
+    unsigned int libraryFileIdxOffset, const Spectrum& querySpectrum,
+    const std::vector<unsigned int>& queryPeakBins,
+    std::vector<PvalueTriplet>& pvalBuffer) {
+  const PvalueVector* libraryEnd = library + numLibraryPvecs;
+  const PvalueVector* pvecIt = std::lower_bound(library, libraryEnd, 
+      getLowerBound(querySpectrum.precMz), PvalueVectorIndex::comparePrecMz);
+  for (; pvecIt != libraryEnd; ++pvecIt) {
+    if (querySpectrum.precMz < getLowerBound(pvecIt->precMz)) break;
+    if (querySpectrum.precMz < getUpperBound(pvecIt->precMz)) {
+      ScanId libraryScanId(pvecIt->scannr.fileIdx + libraryFileIdxOffset,
+                           pvecIt->scannr.scannr);
+      calculatePvalue(*pvecIt, libraryScanId, querySpectrum, queryPeakBins, 
+                      pvalBuffer);
+    }
+  }
+}
+
+void PvalueVectors::getQueryPeakBins(const Spectrum& querySpectrum,
+    std::vector<unsigned int>& peakBins) {
+  float precMass = SpectrumHandler::calcMass(querySpectrum.precMz, 
+                                             querySpectrum.charge);
+  unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(precMass);
+  peakBins.clear();
+  for (unsigned int j = 0; j < numScoringPeaks; ++j) {
+    if (querySpectrum.fragBins[j] != 0) {
+      peakBins.push_back(querySpectrum.fragBins[j]);
+    } else {
+      break;
+    }
+  }
 }
 
 void PvalueVectors::readFingerprints(
@@ -807,123 +1438,136 @@ void PvalueVectors::readFingerprints(
   }
 }
 
-#ifdef FINGERPRINT_FILTER
-void PvalueVectors::batchCalculatePvaluesJaccardFilter() {    
-  std::vector<ScanId> lib_identifiers;
-  std::vector<std::vector<unsigned short> > lib_features;
-  std::vector<float> lib_prec_masses;
-  
-  readFingerprints(lib_features, lib_identifiers, lib_prec_masses);
-  
-  BALL::BinaryFingerprintMethods bfm;
-  float simCutoff = 0.0;
-  size_t blockSize = 850;
-  bfm.setCutoff(simCutoff);
-  bfm.setBlockSize(blockSize);
-  bfm.setVerbosityLevel(6);
-  bfm.setPpmThresh(precursorTolerance_);
-  bfm.setLibraryFeatures(lib_features);
-  bfm.initInvertedIndicesWithPrecMasses(lib_prec_masses);
-  
+void PvalueVectors::batchCalculatePvaluesOverlap(
+    std::vector<PvalueVectorsDbRow>& pvalVecCollectionTail,
+    std::vector<PvalueVectorsDbRow>& pvalVecCollectionHead) {
   if (Globals::VERB > 1) {
-    std::cerr << "Calculating pvalues" << std::endl;
+    std::cerr << "Calculating pvalues of overlap" << std::endl;
   }
   
-  size_t n = pvalVecCollection_.size();
-  size_t numBlocks = (n-1) / blockSize + 1;
-  size_t numBlockPairs = numBlocks * (numBlocks+1) / 2;
-  
-  time_t startTime;
-  time(&startTime);
-  clock_t startClock = clock();
-  
-  //long long numPvalsNoThresh = 0;
-  long long fingerPrintPairs = 0, fingerPrintComparisons = 0, pvaluePairsPassed = 0, fingerPrintPairCandidates = 0;
-#pragma omp parallel for schedule(dynamic, 100)
-  for (int i = 0; i < numBlockPairs; ++i) {
-    int col = std::floor(std::sqrt(2 * i + 0.25) - 0.5);
-    int row = i - ((col * col + col) / 2);
-    if (col % 100 == 0 && row == 0 && Globals::VERB > 2) {
-      std::cerr << "Processing column " << col+1 << "/" << numBlocks << " (" <<
-                   col*100/numBlocks << "%)." << std::endl;
-      Globals::reportProgress(startTime, startClock, col, numBlocks);
-    }
-    std::vector<PvalueTriplet> pvalBuffer, tmpPvalBuffer;
-    bool blocksInRange = bfm.pairwiseSimilaritiesOMPThread(i, tmpPvalBuffer);
-    
-    int fingerPrintPairCandidatesLocal = 0;
-    if (tmpPvalBuffer.size() > 0) {
-      //std::cerr << i << " cand " << tmpPvalBuffer.size() << std::endl;
-      
-      double lowerBound = getLowerBound(pvalVecCollection_[t.scannr2.scannr].precMz);
-      BOOST_FOREACH(const PvalueTriplet& t, tmpPvalBuffer) {
-        if (pvalVecCollection_[t.scannr1.scannr].precMz > lowerBound) {
-          calculatePvalues(pvalVecCollection_[t.scannr1.scannr], 
-                           pvalVecCollection_[t.scannr2.scannr], pvalBuffer);
-          ++fingerPrintPairCandidatesLocal;
-        }
-      }
-      
-      //std::cerr << i << " real " << pvalBuffer.size() << std::endl;
-      pvalues_.batchWrite(pvalBuffer);
-    }
-    
-    if (blocksInRange) {
-    #pragma omp critical(count_fingerprint_pairs)
-      {
-        pvaluePairsPassed += pvalBuffer.size() / 2;
-        fingerPrintPairs += tmpPvalBuffer.size();
-        fingerPrintPairCandidates += fingerPrintPairCandidatesLocal;
-        if (col != row) {
-          fingerPrintComparisons += blockSize * blockSize;
-        } else {
-          fingerPrintComparisons += ((blockSize - 1) * blockSize) / 2;
-        }
+  /* Both collections are sorted by precursor m/z, so the head vectors 
+     within the upper bound of tail vector i form a prefix of the head 
+     vectors, which only grows with i. The end of the prefix is found by a 
+     binary search, such that the tail vectors can be processed in any 
+     order. The p-values are collected per chunk of tail vectors, to reduce 
+     the contention on the p-value file. */
+  int n1 = static_cast<int>(pvalVecCollectionTail.size());
+  const size_t minPvalsPerWrite = 100u;
+#pragma omp parallel
+  {
+    std::vector<PvalueTriplet> pvalBuffer;
+#pragma omp for schedule(dynamic, 100)
+    for (int i = 0; i < n1; ++i) {
+      calculatePvaluesOverlap(pvalVecCollectionTail[i], pvalVecCollectionHead, 
+                              pvalBuffer);
+      if (pvalBuffer.size() >= minPvalsPerWrite) {
+        pvalues_.batchWrite(pvalBuffer);
+        pvalBuffer.clear();
       }
     }
+    pvalues_.batchWrite(pvalBuffer);
   }
-  clearPvalueVectors();
   
   if (Globals::VERB > 1) {
-    //std::cerr << "Finished calculating pvalues (" << numPvalsNoThresh << " total)." << std::endl;
-    std::cerr << "Finished calculating pvalues." << std::endl;
-    std::cerr << "Significant pairs found: " << pvaluePairsPassed << "/" 
-              << fingerPrintPairCandidates << "/" << fingerPrintPairs 
-              << "/" << fingerPrintComparisons << std::endl;
+    std::cerr << "Finished calculating pvalues of overlap" << std::endl;
   }
-  
-  //PvalueFilterAndSort::filterAndSort(pvalues_.getPvaluesFN());
 }
-#endif
 
-void PvalueVectors::batchCalculatePvaluesOverlap(
-    std::vector<PvalueVectorsDbRow>& pvalVecCollectionTail,
-    std::vector<PvalueVectorsDbRow>& pvalVecCollectionHead) {
-  if (Globals::VERB > 1) {
-    std::cerr << "Calculating pvalues of overlap" << std::endl;
+void PvalueVectors::calculatePvaluesOverlap(PvalueVectorsDbRow& tailPvecRow,
+    std::vector<PvalueVectorsDbRow>& pvalVecCollectionHead,
+    std::vector<PvalueTriplet>& pvalBuffer) {
+  double precLimit = getUpperBound(tailPvecRow.precMz);
+  size_t lo = 0u, hi = pvalVecCollectionHead.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (pvalVecCollectionHead[mid].precMz < precLimit) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (size_t j = 0; j < lo; ++j) {
+    calculatePvalues(tailPvecRow, pvalVecCollectionHead[j], pvalBuffer);
+  }
+}
+
+/* Scores the p-value vectors in memory, e.g. of newly added spectra, against
+   the p-value vectors of a previous run stored in storedPvalueVectorsFN by
+   writePvalueVectors() with writeAll. Both are sorted by precursor m/z, so 
+   only the stored vectors within the precursor tolerance of the vectors in 
+   memory are read. A pair is scored under the same condition as in 
+   batchCalculatePvalues(), i.e. if the larger precursor m/z lies below the 
+   upper bound of the smaller one. */
+void PvalueVectors::batchCalculatePvaluesUpdate(
+    const std::string& storedPvalueVectorsFN) {
+  if (pvalVecCollection_.empty() || 
+      Globals::fileIsEmpty(storedPvalueVectorsFN)) return;
+  
+  if (Globals::VERB > 2) {
+    std::cerr << "Calculating pvalues against " << storedPvalueVectorsFN 
+              << std::endl;
   }
   
-  size_t n1 = pvalVecCollectionTail.size();
-  size_t n2 = pvalVecCollectionHead.size();
-  for (size_t i = 0; i < n1; ++i) {
-    if (i % 10000 == 0 && Globals::VERB > 2) {
-      std::cerr << "Processing pvalue vector " << i+1 << "/" << n1 << std::endl;
+  PvalueVectorFile stored;
+  if (!stored.open(storedPvalueVectorsFN)) {
+    std::stringstream ss;
+    ss << "(PvalueVectors.cpp) error in reading p-value vectors file " 
+       << storedPvalueVectorsFN << std::endl;
+    throw MyException(ss);
+  }
+  size_t numStored = stored.size();
+  
+  double lowerPrecMz = getLowerBound(pvalVecCollection_.front().precMz);
+  double upperPrecMz = getUpperBound(pvalVecCollection_.back().precMz);
+  
+  // binary search, so that only the pages within the window are touched
+  size_t lo = 0u, hi = numStored;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (stored[mid].precMz <= lowerPrecMz) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
-    double precLimit = getUpperBound(pvalVecCollectionTail[i].precMz);
-    std::vector<PvalueTriplet> pvalBuffer;
-    for (size_t j = 0; j < n2; ++j) {
-      if (pvalVecCollectionHead[j].precMz < precLimit) { 
-        calculatePvalues(pvalVecCollectionTail[i], pvalVecCollectionHead[j], pvalBuffer);
+  }
+  
+  std::vector<PvalueVectorsDbRow> storedRows;
+  for (size_t i = lo; i < numStored && stored[i].precMz < upperPrecMz; ++i) {
+    PvalueVectorsDbRow pvecRow;
+    initPvecRow(stored[i], pvecRow);
+    pvecRow.pvalCalc.initEarlyExit(dbPvalThreshold_);
+    storedRows.push_back(pvecRow);
+  }
+  StageProfiler::addBytesRead(storedRows.size() * sizeof(PvalueVectorRecord));
+  
+  size_t n = pvalVecCollection_.size();
+  size_t numStoredRows = storedRows.size();
+#pragma omp parallel for schedule(dynamic, 1000)
+  for (int i = 0; i < static_cast<int>(numStoredRows); ++i) {
+    PvalueVectorsDbRow& storedRow = storedRows[i];
+    
+    // the first vector in memory that can still form a pair with storedRow
+    size_t lo = 0u, hi = n;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (getUpperBound(pvalVecCollection_[mid].precMz) <= storedRow.precMz) {
+        lo = mid + 1;
       } else {
-        break;
+        hi = mid;
       }
     }
     
+    double precLimit = getUpperBound(storedRow.precMz);
+    std::vector<PvalueTriplet> pvalBuffer;
+    for (size_t j = lo; j < n && pvalVecCollection_[j].precMz < precLimit; ++j) {
+      calculatePvalues(storedRow, pvalVecCollection_[j], pvalBuffer);
+    }
     pvalues_.batchWrite(pvalBuffer);
   }
   
-  if (Globals::VERB > 1) {
-    std::cerr << "Finished calculating pvalues of overlap" << std::endl;
+  if (Globals::VERB > 2) {
+    std::cerr << "Scored " << numStoredRows << "/" << numStored 
+              << " stored pvalue vectors." << std::endl;
   }
 }
 
@@ -981,50 +1625,79 @@ void PvalueVectors::calculatePvalues(PvalueVectorsDbRow& pvecRow,
                                        cosDist));
   }
 #else  
-  double queryPval = queryPvecRow.pvalCalc.computePvalPolyfit(pvecRow.pvalCalc.getPeakBinsRef());
-  if (queryPval <= dbPvalThreshold_) {
-    double targetPval = pvecRow.pvalCalc.computePvalPolyfit(queryPvecRow.pvalCalc.getPeakBinsRef());
-    if (targetPval <= dbPvalThreshold_) {
-      pvalBuffer.push_back(PvalueTriplet(std::min(pvecRow.scannr, queryPvecRow.scannr),
-                                         std::max(pvecRow.scannr, queryPvecRow.scannr),
-                                         std::max(targetPval, queryPval)));
+  double targetPval, queryPval;
+  if (PvalueCalculator::computePvalPolyfitPair(pvecRow.pvalCalc, 
+          queryPvecRow.pvalCalc, dbPvalThreshold_, targetPval, queryPval)) {
+    pvalBuffer.push_back(PvalueTriplet(std::min(pvecRow.scannr, queryPvecRow.scannr),
+                                       std::max(pvecRow.scannr, queryPvecRow.scannr),
+                                       std::max(targetPval, queryPval)));
+  }
+#endif
+}
+
+/* Same as calling calculatePvalues(pvecRow, pvalVecCollection_[j], 
+   pvalBuffer) for j in [startIdx, endIdx), but both directions of all 
+   candidates are scored in one batch against a bin mask of pvecRow. */
+void PvalueVectors::calculatePvaluesBatch(PvalueVectorsDbRow& pvecRow, 
+    size_t startIdx, size_t endIdx, CandidateScoreBuffers& scoreBuffers,
+    std::vector<PvalueTriplet>& pvalBuffer) {
+#ifdef DOT_PRODUCT
+  for (size_t j = startIdx; j < endIdx; ++j) {
+    calculatePvalues(pvecRow, pvalVecCollection_[j], pvalBuffer);
+  }
+#else
+  scoreBuffers.pvalCalcs.clear();
+  scoreBuffers.pvecIdxs.clear();
+  for (size_t j = startIdx; j < endIdx; ++j) {
+    PvalueVectorsDbRow& queryPvecRow = pvalVecCollection_[j];
+    if (queryPvecRow.scannr == pvecRow.scannr || 
+        !isPvecMatch(pvecRow, queryPvecRow)) {
+      continue;
     }
+    scoreBuffers.pvalCalcs.push_back(&queryPvecRow.pvalCalc);
+    scoreBuffers.pvecIdxs.push_back(j);
+  }
+  
+  PvalueCalculator::computePvalPolyfitPairBatch(pvecRow.pvalCalc,
+      scoreBuffers.pvalCalcs, dbPvalThreshold_, scoreBuffers.passedIdxs, 
+      scoreBuffers.logPvals, scoreBuffers.targetBinMask);
+  
+  for (size_t k = 0; k < scoreBuffers.passedIdxs.size(); ++k) {
+    PvalueVectorsDbRow& queryPvecRow = 
+        pvalVecCollection_[scoreBuffers.pvecIdxs[scoreBuffers.passedIdxs[k]]];
+    pvalBuffer.push_back(PvalueTriplet(std::min(pvecRow.scannr, queryPvecRow.scannr),
+                                       std::max(pvecRow.scannr, queryPvecRow.scannr),
+                                       scoreBuffers.logPvals[k]));
   }
 #endif
 }
 
-void PvalueVectors::calculatePvalue(PvalueVectorsDbRow& pvecRow, 
-                                         Spectrum& querySpectrum,
-                                         std::vector<PvalueTriplet>& pvalBuffer) {  
+void PvalueVectors::calculatePvalue(const PvalueVector& pvec, 
+    const ScanId& libraryScanId, const Spectrum& querySpectrum,
+    const std::vector<unsigned int>& peakBins,
+    std::vector<PvalueTriplet>& pvalBuffer) {  
   // skip if the charges do not match
-  if (pvecRow.queryCharge != querySpectrum.charge) {
+  if (static_cast<unsigned int>(pvec.queryCharge) != querySpectrum.charge) {
     return;
   }
   
-  float precMass = SpectrumHandler::calcMass(querySpectrum.precMz, 
-                                             querySpectrum.charge);
-  unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(precMass);
-  std::vector<unsigned int> peakBins;
-  peakBins.reserve(numScoringPeaks);
-  for (unsigned int j = 0; j < numScoringPeaks; ++j) {
-    if (querySpectrum.fragBins[j] != 0) {
-      peakBins.push_back(querySpectrum.fragBins[j]);
-    } else {
-      break;
-    }
-  }
-  
 #ifdef DOT_PRODUCT
-  double cosDist = calculateCosineDistance(pvecRow.pvalCalc.getPeakBinsRef(), 
-                                           peakBins);  
+  std::vector<unsigned int> libraryPeakBins;
+  for (unsigned int j = 0; j < PvalueCalculator::kMaxScoringPeaks && 
+                           pvec.peakBins[j] != 0; ++j) {
+    libraryPeakBins.push_back(pvec.peakBins[j]);
+  }
+  std::vector<unsigned int> queryPeakBins(peakBins);
+  double cosDist = calculateCosineDistance(libraryPeakBins, queryPeakBins);  
   if (cosDist <= dbPvalThreshold_) {
-    pvalBuffer.push_back(PvalueTriplet(pvecRow.scannr, querySpectrum.scannr,
+    pvalBuffer.push_back(PvalueTriplet(libraryScanId, querySpectrum.scannr,
                                        cosDist));
   }
 #else
-  double targetPval = pvecRow.pvalCalc.computePvalPolyfit(peakBins);
+  double targetPval = PvalueCalculator::computePvalPolyfit(pvec.peakBins,
+      pvec.peakScores, pvec.polyfit, peakBins);
   if (targetPval <= dbPvalThreshold_) {
-    pvalBuffer.push_back(PvalueTriplet(pvecRow.scannr, querySpectrum.scannr, 
+    pvalBuffer.push_back(PvalueTriplet(libraryScanId, querySpectrum.scannr, 
                                        targetPval));
   }
 #endif
@@ -21,17 +21,30 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <map>
+#include <deque>
 #include <queue>
 #include <string>
+#include <limits>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "Globals.h"
+#include "ProgressReporter.h"
+#include "ThreadPlacement.h"
 #include "PvalueVector.h"
+#include "PvalueVectorIndex.h"
+#include "PvalueVectorFile.h"
 #include "Pvalues.h"
 #include "Spectrum.h"
 #include "SpectrumFiles.h"
+#include "PrecMzLimits.h"
 
 #include "SpectrumHandler.h"
 #include "SpectrumFileList.h"
@@ -44,9 +57,7 @@
 
 #include "SparsePoisonedClustering.h"
 
-#ifdef FINGERPRINT_FILTER
-  #include "BinaryFingerprintMethods.h"
-#endif
+#include "BinaryFingerprintMethods.h"
 
 namespace maracluster {
 
@@ -75,18 +86,118 @@ struct PvalueVectorsDbRow {
 
 struct ClusterJob {
   size_t startBatch, endBatch;
-  size_t endIdx;
   double lowerPrecMz, upperPrecMz;
   bool finished;
   std::vector<PvalueTriplet> poisonedPvals;
 };
 
+/* P-values of the p-value vector batches that were not yet assigned to a
+   cluster job. Finished batches are spilled to disk if keeping them in 
+   memory would exceed maxBufferedPvals. The precursor m/z range of a batch
+   has to be set before it is finished, a cluster job spans the range from
+   its first to its last batch. */
+struct PvalBatchBuffers {
+  PvalBatchBuffers(size_t numPvecBatches, size_t maxBuffered, 
+                   const std::string& spillBase) : 
+    pvals(numPvecBatches), numPvals(numPvecBatches, 0u), 
+    lowerPrecMzs(numPvecBatches, 0.0), upperPrecMzs(numPvecBatches, 0.0),
+    isSpilled(numPvecBatches, false), numBufferedPvals(0u), 
+    peakBufferedPvals(0u), numSpilledBatches(0u), 
+    maxBufferedPvals(maxBuffered), spillBaseFN(spillBase) {}
+  
+  std::vector< std::vector<PvalueTriplet> > pvals;
+  std::vector<size_t> numPvals;
+  std::vector<double> lowerPrecMzs, upperPrecMzs;
+  std::vector<bool> isSpilled;
+  size_t numBufferedPvals, peakBufferedPvals, numSpilledBatches;
+  size_t maxBufferedPvals;
+  std::string spillBaseFN;
+  
+  inline std::string getSpillFN(size_t batchIdx) const {
+    return spillBaseFN + ".spill_" + boost::lexical_cast<std::string>(batchIdx) + ".dat";
+  }
+};
+
+/* Hands over the poisoned edges of finished cluster jobs to the poisoned
+   clustering thread, which needs them in the order of the cluster jobs. 
+   The edges are moved into and out of the queue by swapping. */
+class PoisonedEdgeQueue {
+ public:
+  void push(size_t clusterJobIdx, std::vector<PvalueTriplet>& poisonedPvals,
+            double upperPrecMz, bool isLastJob) {
+    boost::mutex::scoped_lock lock(mutex_);
+    PoisonedEdges& edges = pending_[clusterJobIdx];
+    edges.pvals.swap(poisonedPvals);
+    edges.upperPrecMz = upperPrecMz;
+    edges.isLastJob = isLastJob;
+    available_.notify_one();
+  }
+  
+  /* blocks until the edges of the requested cluster job are available, lag
+     returns the number of finished cluster jobs still waiting after it */
+  void pop(size_t clusterJobIdx, std::vector<PvalueTriplet>& poisonedPvals,
+           double& upperPrecMz, bool& isLastJob, size_t& lag) {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<size_t, PoisonedEdges>::iterator it;
+    while ((it = pending_.find(clusterJobIdx)) == pending_.end()) {
+      available_.wait(lock);
+    }
+    poisonedPvals.swap(it->second.pvals);
+    upperPrecMz = it->second.upperPrecMz;
+    isLastJob = it->second.isLastJob;
+    pending_.erase(it);
+    lag = pending_.size();
+  }
+  
+ protected:
+  struct PoisonedEdges {
+    std::vector<PvalueTriplet> pvals;
+    double upperPrecMz;
+    bool isLastJob;
+  };
+  std::map<size_t, PoisonedEdges> pending_;
+  boost::mutex mutex_;
+  boost::condition_variable available_;
+};
+
+/* Pair counts of the fingerprint prefilter. The exhaustive p-values are 
+   only calculated for a sample of the blocks to estimate the recall. */
+struct FingerprintFilterStats {
+  FingerprintFilterStats() : windowPairs(0u), candidatePairs(0u), 
+    sampledBlocks(0u), sampledExhaustivePvals(0u), sampledFilteredPvals(0u) {}
+  
+  unsigned long long windowPairs, candidatePairs;
+  unsigned long long sampledBlocks, sampledExhaustivePvals, sampledFilteredPvals;
+};
+
+/* Scratch space of calculatePvaluesBatch(), reused for all rows of a batch
+   to avoid allocations in the all-pairs loop */
+struct CandidateScoreBuffers {
+  std::vector<const PvalueCalculator*> pvalCalcs;
+  std::vector<size_t> pvecIdxs, passedIdxs;
+  std::vector<double> logPvals;
+  std::vector<unsigned char> targetBinMask;
+};
+
 class PvalueVectors {
  public:
   PvalueVectors(const std::string& pvaluesFN, double precursorTolerance, 
     bool precursorToleranceDa, double dbPvalThreshold) : 
       pvalues_(pvaluesFN), precursorTolerance_(precursorTolerance), 
-      precursorToleranceDa_(precursorToleranceDa), dbPvalThreshold_(dbPvalThreshold) {}
+      precursorToleranceDa_(precursorToleranceDa), dbPvalThreshold_(dbPvalThreshold),
+      pvalMemoryBudget_(0.0), fingerprintFilterCutoff_(-1.0) {}
+  
+  /* memory budget in MB for the p-values in batchCalculateAndClusterPvalues,
+     0 uses fixed job sizes */
+  inline void setPvalMemoryBudget(double megaBytes) { 
+    pvalMemoryBudget_ = megaBytes*1024.0*1024.0;
+  }
+  
+  /* only calculate p-values for pairs with a Tanimoto similarity of their
+     peak bins of at least minSimilarity, a negative value disables this */
+  inline void setFingerprintFilter(double minSimilarity) {
+    fingerprintFilterCutoff_ = minSimilarity;
+  }
   
   void calculatePvalueVectors(std::vector<Spectrum>& spectra, 
       PeakCounts& peakCounts);
@@ -100,6 +211,7 @@ class PvalueVectors {
   void sortPvalueVectors();
   void writePvalueVectors(const std::string& pvalueVectorsBaseFN, 
                           bool writeAll);
+  bool writePvalueVectorIndex(const std::string& indexFN);
   void reloadPvalueVectors();
   inline std::vector<PvalueVectorsDbRow>& getPvalueVectors() { return pvalVecCollection_; }
   
@@ -109,6 +221,10 @@ class PvalueVectors {
       std::vector< std::pair<std::string, std::string> >& overlapFNs);
   
   void processOverlapFiles(std::vector< std::pair<std::string, std::string> >& overlapFNs);
+  void processAndClusterOverlapFiles(
+      const std::vector< std::pair<std::string, std::string> >& overlapFNs,
+      const std::vector<std::string>& binPvalFNs,
+      const std::string& resultTreeFN, const std::string& scanInfoFN);
   
   void batchCalculatePvalues();
   void batchCalculateAndClusterPvalues(const std::string& resultTreeFN, 
@@ -117,13 +233,26 @@ class PvalueVectors {
     std::vector<std::vector<unsigned short> >& mol_features, 
     std::vector<ScanId>& mol_identifiers, 
     std::vector<float>& prec_masses);
-  void batchCalculatePvaluesJaccardFilter();
   void batchCalculatePvaluesLibrarySearch(
     std::vector<Spectrum>& querySpectra);
+  void batchCalculatePvaluesLibrarySearch(const PvalueVectorIndex& library,
+    std::vector<Spectrum>& querySpectra, unsigned int libraryFileIdxOffset);
+  size_t streamPvaluesLibrarySearch(const PvalueVectorIndex& library,
+    std::istream& queryStream, std::ostream& resultStream, size_t topK,
+    size_t queryChunkSize, bool binaryOutput);
+  static size_t readQueryChunk(std::istream& queryStream,
+    std::vector<Spectrum>& querySpectra);
+  void searchLibrary(const PvalueVectorIndex& library,
+    const Spectrum& querySpectrum, size_t topK, 
+    std::vector<PvalueTriplet>& topHits);
   
   void batchCalculatePvaluesOverlap(
       std::vector<PvalueVectorsDbRow>& pvalVecCollectionTail,
       std::vector<PvalueVectorsDbRow>& pvalVecCollectionHead);
+  void calculatePvaluesOverlap(PvalueVectorsDbRow& tailPvecRow,
+      std::vector<PvalueVectorsDbRow>& pvalVecCollectionHead,
+      std::vector<PvalueTriplet>& pvalBuffer);
+  void batchCalculatePvaluesUpdate(const std::string& storedPvalueVectorsFN);
   
   static inline double getLowerBound(double precMass, double precursorTolerance, 
       bool precursorToleranceDa) {
@@ -148,8 +277,15 @@ class PvalueVectors {
   double precursorTolerance_;
   bool precursorToleranceDa_;
   double dbPvalThreshold_;
+  double pvalMemoryBudget_;
+  double fingerprintFilterCutoff_;
   std::vector<PvalueVectorsDbRow> pvalVecBatch_, pvalVecCollection_;
   
+  static const size_t kPvecBatchSize;
+  static const size_t kMinPvalsForClustering;
+  static const unsigned short kFingerprintBlockSize;
+  static const size_t kFingerprintRecallSampling;
+  
   void initPvalCalc(PvalueCalculator& pvalCalc, 
                            PvalueVectorsDbRow& pvecRow, 
                            PeakCounts& peakCounts, 
@@ -158,67 +294,102 @@ class PvalueVectors {
   void initPvecRow(const MassChargeCandidate& mcc, 
                           const Spectrum& spec,
                           PvalueVectorsDbRow& pvecRow);
+  static void initPvecRow(const PvalueVector& pvec, 
+                          PvalueVectorsDbRow& pvecRow);
+  static void initPvecRow(const PvalueVectorRecord& record, 
+                          PvalueVectorsDbRow& pvecRow);
+  static void initPvec(const PvalueVectorsDbRow& pvecRow, 
+                       PvalueVector& pvec);
   
   void calculatePvalueVector(PvalueVectorsDbRow& pvecRow,
       PeakCounts& peakCounts);
+  void initEarlyExits(std::vector<PvalueVectorsDbRow>& pvalVecCollection);
   
   void insert(PvalueVectorsDbRow& pvecRow, 
               std::vector<PvalueVector>& pvecList);
   void calculatePvalues(PvalueVectorsDbRow& pvecRow, 
                         PvalueVectorsDbRow& queryPvecRow,
                         std::vector<PvalueTriplet>& pvalBuffer);
-  void calculatePvalue(PvalueVectorsDbRow& pvecRow, 
-                       Spectrum& querySpectrum,
+  void calculatePvaluesBatch(PvalueVectorsDbRow& pvecRow, 
+                             size_t startIdx, size_t endIdx,
+                             CandidateScoreBuffers& scoreBuffers,
+                             std::vector<PvalueTriplet>& pvalBuffer);
+  void batchCalculatePvaluesLibrarySearch(const PvalueVector* library,
+    size_t numLibraryPvecs, std::vector<Spectrum>& querySpectra, 
+    unsigned int libraryFileIdxOffset);
+  void calculatePvaluesLibraryWindow(const PvalueVector* library, 
+    size_t numLibraryPvecs, unsigned int libraryFileIdxOffset, 
+    const Spectrum& querySpectrum, 
+    const std::vector<unsigned int>& queryPeakBins,
+    std::vector<PvalueTriplet>& pvalBuffer);
+  static void getQueryPeakBins(const Spectrum& querySpectrum,
+    std::vector<unsigned int>& peakBins);
+  static void keepTopHits(const std::vector<PvalueTriplet>& pvals, 
+    size_t topK, std::vector<PvalueTriplet>& topHits);
+  static void writeTopHits(const Spectrum& querySpectrum,
+    std::vector<PvalueTriplet>& topHits, std::ostream& resultStream, 
+    bool binaryOutput);
+  void calculatePvalue(const PvalueVector& pvec, const ScanId& libraryScanId,
+                       const Spectrum& querySpectrum,
+                       const std::vector<unsigned int>& queryPeakBins,
                        std::vector<PvalueTriplet>& pvalBuffer);
   
   double calculateCosineDistance(std::vector<unsigned int>& peakBins,
     std::vector<unsigned int>& queryPeakBins);
   
-  void attemptClustering(size_t& newStartBatch, size_t& newPoisonedStartBatch,
-    size_t pvecBatchSize, size_t numPvecBatches, size_t minPvalsForClustering,
+  void calculatePvaluesExhaustive(size_t startIdx, size_t endIdx,
+    std::vector<PvalueTriplet>& pvalBuffer);
+  bool initFingerprintFilter(BALL::BinaryFingerprintMethods& bfm,
+    std::vector<std::vector<unsigned short> >& features);
+  void calculatePvaluesFingerprintFiltered(BALL::BinaryFingerprintMethods& bfm,
+    size_t startIdx, size_t endIdx, std::vector<PvalueTriplet>& pvalBuffer,
+    FingerprintFilterStats& stats);
+  void reportFingerprintFilterStats(const FingerprintFilterStats& stats);
+  
+  void getPvalBufferLimits(size_t& minPvalsForClustering, 
+    size_t& maxBufferedPvals);
+  void finishPvalBatch(size_t batchIdx, PvalBatchBuffers& pvalBuffers,
+    std::vector<bool>& finishedPvalCalc);
+  void attemptClustering(size_t& newStartBatch,
+    size_t numPvecBatches, size_t minPvalsForClustering,
     const std::vector<bool>& finishedPvalCalc,
-    std::vector< std::vector<PvalueTriplet> >& pvalBuffers, 
-    std::deque<ClusterJob>& clusterJobs, ClusterJob& poisonedClusterJob,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits,
+    PvalBatchBuffers& pvalBuffers, 
+    std::deque<ClusterJob>& clusterJobs, PoisonedEdgeQueue& poisonedEdgeQueue,
+    const PrecMzLimits& precMzLimits,
     const std::string& resultTreeFN, time_t& startTime, clock_t& startClock);
     
   bool createClusterJob(size_t& newStartBatch, 
-    size_t pvecBatchSize, size_t numPvecBatches, size_t minPvalsForClustering,
+    size_t numPvecBatches, size_t minPvalsForClustering,
     const std::vector<bool>& finishedPvalCalc,
-    const std::vector< std::vector<PvalueTriplet> >& pvalBuffers, 
+    const PvalBatchBuffers& pvalBuffers, 
     std::deque<ClusterJob>& clusterJobs, size_t& clusterJobIdx);
-  bool createPoisonedClusterJob(size_t& newPoisonedStartBatch, 
-    const size_t numPvecBatches, const size_t minPvalsForClustering, 
-    std::deque<ClusterJob>& clusterJobs, ClusterJob& poisonedClusterJob);
     
   void runClusterJob(ClusterJob& clusterJob,
-    std::vector< std::vector<PvalueTriplet> >& pvalBuffers,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits,
+    PvalBatchBuffers& pvalBuffers,
+    const PrecMzLimits& precMzLimits,
     const std::string& resultTreeFN,
     time_t& startTime, clock_t& startClock);
-  void runPoisonedClusterJob(ClusterJob& clusterJob,
-    std::deque<ClusterJob>& clusterJobs,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits,
-    const std::string& resultTreeFN,
-    const size_t numPvecBatches);
+  void runPoisonedClusteringChain(PoisonedEdgeQueue& poisonedEdgeQueue,
+    const PrecMzLimits& precMzLimits, const float lowerPrecMz,
+    const bool isFinalClustering, const std::string& resultTreeFN, 
+    const size_t minPvalsForClustering);
     
   void clusterPvals(std::vector<PvalueTriplet>& pvalBuffer,
     std::vector<PvalueTriplet>& pvalPoisonedBuffer,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits, 
+    const PrecMzLimits& precMzLimits, 
     float lowerPrecMz, float upperPrecMz, const std::string& resultTreeFN);
     
-  void getPrecMzLimits(
-    std::map<ScanId, std::pair<float, float> >& precMzLimits);
+  void getPrecMzLimits(PrecMzLimits& precMzLimits);
   
   void markPoisoned(SparsePoisonedClustering& matrix, 
     std::vector<PvalueTriplet>& pvalBuffer, 
-    std::map<ScanId, std::pair<float, float> >& precMzLimits, 
+    const PrecMzLimits& precMzLimits, 
     float lowerPrecMz, float upperPrecMz);
   bool isPoisoned(const ScanId& si,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits, 
+    const PrecMzLimits& precMzLimits, 
     float lowerPrecMz, float upperPrecMz);
   bool isSafeToWrite(const ScanId& si,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits, 
+    const PrecMzLimits& precMzLimits, 
     float upperPrecMz);
     
   inline double getLowerBound(double mass) { 
@@ -0,0 +1,40 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "ScanIdBitmap.h"
+
+namespace maracluster {
+
+const unsigned int ScanIdBitmap::kMaxDenseFileIdx = 1u << 20;
+
+void ScanIdBitmap::set(const ScanId& si) {
+  std::vector<bool>* bits;
+  if (si.fileIdx < kMaxDenseFileIdx) {
+    if (si.fileIdx >= denseBits_.size()) denseBits_.resize(si.fileIdx + 1u);
+    bits = &denseBits_[si.fileIdx];
+  } else {
+    bits = &sparseBits_[si.fileIdx];
+  }
+  
+  if (si.scannr >= bits->size()) {
+    // grow geometrically to keep the number of reallocations logarithmic
+    bits->resize((std::max)(static_cast<size_t>(si.scannr) + 1u, 
+                            2u * bits->size()), false);
+  }
+  (*bits)[si.scannr] = true;
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,64 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_SCANIDBITMAP_H_
+#define MARACLUSTER_SCANIDBITMAP_H_
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "ScanId.h"
+
+namespace maracluster {
+
+/* Set of ScanIds stored as one bit vector per file, indexed by scannr. File
+   indices of kMaxDenseFileIdx and above, e.g. the merged cluster ids starting
+   at SparseClustering::mergeOffset_, are kept in a small map instead. Testing
+   a ScanId never inserts elements, unlike operator[] of a hash map. */
+class ScanIdBitmap {
+ public:
+  ScanIdBitmap() {}
+  
+  inline bool test(const ScanId& si) const {
+    const std::vector<bool>* bits = findBits(si.fileIdx);
+    return (bits != NULL && si.scannr < bits->size() && (*bits)[si.scannr]);
+  }
+  
+  void set(const ScanId& si);
+  
+  static const unsigned int kMaxDenseFileIdx;
+  
+ protected:
+  std::vector< std::vector<bool> > denseBits_;
+  std::map<unsigned int, std::vector<bool> > sparseBits_;
+  
+  inline const std::vector<bool>* findBits(unsigned int fileIdx) const {
+    if (fileIdx < denseBits_.size()) {
+      return &denseBits_[fileIdx];
+    } else if (fileIdx < kMaxDenseFileIdx) {
+      return NULL;
+    } else {
+      std::map<unsigned int, std::vector<bool> >::const_iterator it = 
+          sparseBits_.find(fileIdx);
+      return (it != sparseBits_.end()) ? &it->second : NULL;
+    }
+  }
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_SCANIDBITMAP_H_ */
@@ -0,0 +1,415 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "SearchServer.h"
+#include "ThreadPlacement.h"
+
+#ifndef _WIN32
+  #include <cerrno>
+  #include <csignal>
+  #include <cstring>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <unistd.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+#endif
+
+namespace maracluster {
+
+const unsigned int SearchServer::kRequestMagic = 0x5143524du; // "MRCQ"
+const unsigned int SearchServer::kReplyMagic = 0x5243524du; // "MRCR"
+const unsigned int SearchServer::kStopMagic = 0x5343524du; // "MRCS"
+const unsigned int SearchServer::kMaxQueriesPerRequest = 1000000u;
+const unsigned int SearchServer::kMaxTopK = 100000u;
+
+volatile int SearchServer::signalStopFd_ = -1;
+
+#ifdef _WIN32
+
+bool SearchServer::run(const std::string& socketFN, unsigned int numWorkers) {
+  std::cerr << "Error: the serve mode is not available on Windows" << std::endl;
+  return false;
+}
+
+void SearchServer::requestStop() {}
+void SearchServer::handleStopSignal(int signum) {}
+void SearchServer::runWorker(int listenFd) {}
+bool SearchServer::waitReadable(int fd) { return false; }
+bool SearchServer::handleRequest(int connFd) { return false; }
+bool SearchServer::readFully(int fd, char* buffer, size_t numBytes) { return false; }
+bool SearchServer::writeFully(int fd, const char* buffer, size_t numBytes) { return false; }
+void SearchServer::runServer(SearchServer* server, const std::string& socketFN, bool* success) {}
+int SearchServer::connectClient(const std::string& socketFN) { return -1; }
+
+bool SearchServer::searchServerUnitTest() { return true; }
+
+#else
+
+bool SearchServer::run(const std::string& socketFN, unsigned int numWorkers) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketFN.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Error: socket path " << socketFN << " is too long, use at most " 
+              << sizeof(address.sun_path) - 1 << " characters" << std::endl;
+    return false;
+  }
+  strncpy(address.sun_path, socketFN.c_str(), sizeof(address.sun_path) - 1);
+  
+  // a client disconnecting mid-reply should not terminate the server
+  signal(SIGPIPE, SIG_IGN);
+  
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0) {
+    std::cerr << "Error: could not create socket: " << strerror(errno) << std::endl;
+    return false;
+  }
+  
+  unlink(socketFN.c_str()); // remove the socket of a previous run
+  if (bind(listenFd, reinterpret_cast<struct sockaddr*>(&address), 
+           sizeof(address)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+    std::cerr << "Error: could not listen on socket " << socketFN << ": " 
+              << strerror(errno) << std::endl;
+    close(listenFd);
+    return false;
+  }
+  
+  // several workers are woken up for each connection, the ones that lose 
+  // the race should not block in accept()
+  fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+  
+  if (pipe(stopPipe_) < 0 || pipe(wakePipe_) < 0) {
+    std::cerr << "Error: could not create pipe: " << strerror(errno) << std::endl;
+    close(listenFd);
+    return false;
+  }
+  
+  signalStopFd_ = stopPipe_[1];
+  struct sigaction stopAction, oldIntAction, oldTermAction;
+  memset(&stopAction, 0, sizeof(stopAction));
+  stopAction.sa_handler = &SearchServer::handleStopSignal;
+  sigemptyset(&stopAction.sa_mask);
+  sigaction(SIGINT, &stopAction, &oldIntAction);
+  sigaction(SIGTERM, &stopAction, &oldTermAction);
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Serving " << library_.size() << " library p-value vectors on "
+              << socketFN << " with " << numWorkers << " workers" << std::endl;
+  }
+  
+  boost::thread_group workers;
+  for (unsigned int i = 0; i < numWorkers; ++i) {
+    workers.create_thread(boost::bind(&SearchServer::runWorker, this, listenFd));
+  }
+  
+  char stopByte;
+  while (read(stopPipe_[0], &stopByte, 1) < 0 && errno == EINTR) {}
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Stopping the server" << std::endl;
+  }
+  close(wakePipe_[1]);
+  workers.join_all();
+  
+  sigaction(SIGINT, &oldIntAction, NULL);
+  sigaction(SIGTERM, &oldTermAction, NULL);
+  signalStopFd_ = -1;
+  
+  close(stopPipe_[0]);
+  close(stopPipe_[1]);
+  close(wakePipe_[0]);
+  stopPipe_[0] = stopPipe_[1] = -1;
+  wakePipe_[0] = wakePipe_[1] = -1;
+  
+  close(listenFd);
+  unlink(socketFN.c_str());
+  return true;
+}
+
+void SearchServer::requestStop() {
+  char stopByte = 's';
+  if (write(stopPipe_[1], &stopByte, 1) < 0 && Globals::VERB > 1) {
+    std::cerr << "Warning: could not request the server to stop" << std::endl;
+  }
+}
+
+/* Only calls write(), which is async-signal-safe */
+void SearchServer::handleStopSignal(int signum) {
+  char stopByte = 's';
+  if (signalStopFd_ >= 0 && write(signalStopFd_, &stopByte, 1) < 0) {}
+}
+
+/* Concurrent accept() calls on the same listening socket are safe, each 
+   connection is handed to exactly one worker. */
+void SearchServer::runWorker(int listenFd) {
+  ThreadPlacement::resetThreadAffinity();
+  while (waitReadable(listenFd)) {
+    int connFd = accept(listenFd, NULL, NULL);
+    if (connFd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || 
+          errno == EAGAIN || errno == EWOULDBLOCK) continue;
+      std::cerr << "Error: could not accept connection: " << strerror(errno) << std::endl;
+      return;
+    }
+    
+    // on some platforms, accepted sockets inherit O_NONBLOCK
+    fcntl(connFd, F_SETFL, fcntl(connFd, F_GETFL) & ~O_NONBLOCK);
+    while (waitReadable(connFd) && handleRequest(connFd)) {}
+    close(connFd);
+  }
+}
+
+/* Returns false if the server is stopping, which is signalled by the end of 
+   file on wakePipe_ that all workers poll in addition to fd */
+bool SearchServer::waitReadable(int fd) {
+  struct pollfd pollFds[2];
+  pollFds[0].fd = fd;
+  pollFds[0].events = POLLIN;
+  pollFds[1].fd = wakePipe_[0];
+  pollFds[1].events = POLLIN;
+  while (true) {
+    pollFds[0].revents = pollFds[1].revents = 0;
+    int numReady = poll(pollFds, 2, -1);
+    if (numReady < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (pollFds[1].revents != 0) return false;
+    if (pollFds[0].revents != 0) return true;
+  }
+}
+
+/* Returns false if the connection was closed or the request was invalid */
+bool SearchServer::handleRequest(int connFd) {
+  SearchRequestHeader request;
+  if (!readFully(connFd, reinterpret_cast<char*>(&request), sizeof(request))) {
+    return false;
+  }
+  
+  SearchReplyHeader reply;
+  reply.magic = kReplyMagic;
+  reply.numQueries = 0u;
+  
+  if (request.magic == kStopMagic) {
+    writeFully(connFd, reinterpret_cast<const char*>(&reply), sizeof(reply));
+    requestStop();
+    return false;
+  }
+  
+  if (request.magic != kRequestMagic || 
+      request.numQueries > kMaxQueriesPerRequest || request.topK > kMaxTopK) {
+    if (Globals::VERB > 1) {
+      std::cerr << "Warning: closing connection after invalid request" << std::endl;
+    }
+    return false;
+  }
+  
+  std::vector<Spectrum> querySpectra(request.numQueries);
+  if (request.numQueries > 0 && !readFully(connFd, 
+        reinterpret_cast<char*>(&querySpectra[0]), 
+        request.numQueries * sizeof(Spectrum))) {
+    return false;
+  }
+  
+  int numQueries = static_cast<int>(request.numQueries);
+  std::vector< std::vector<PvalueTriplet> > topHits(numQueries);
+#pragma omp parallel for schedule(dynamic, 10)
+  for (int j = 0; j < numQueries; ++j) {
+    pvecs_.searchLibrary(library_, querySpectra[j], request.topK, topHits[j]);
+  }
+  
+  reply.numQueries = request.numQueries;
+  std::vector<char> replyBuffer(reinterpret_cast<const char*>(&reply), 
+      reinterpret_cast<const char*>(&reply) + sizeof(reply));
+  BOOST_FOREACH (const std::vector<PvalueTriplet>& queryHits, topHits) {
+    unsigned int numHits = queryHits.size();
+    const char* numHitsPtr = reinterpret_cast<const char*>(&numHits);
+    replyBuffer.insert(replyBuffer.end(), numHitsPtr, numHitsPtr + sizeof(numHits));
+    if (numHits > 0) {
+      const char* hitsPtr = reinterpret_cast<const char*>(&queryHits[0]);
+      replyBuffer.insert(replyBuffer.end(), hitsPtr, 
+                         hitsPtr + numHits * sizeof(PvalueTriplet));
+    }
+  }
+  
+  if (Globals::VERB > 2) {
+    std::cerr << "Answered request with " << request.numQueries 
+              << " query spectra" << std::endl;
+  }
+  return writeFully(connFd, &replyBuffer[0], replyBuffer.size());
+}
+
+bool SearchServer::readFully(int fd, char* buffer, size_t numBytes) {
+  while (numBytes > 0) {
+    ssize_t numRead = read(fd, buffer, numBytes);
+    if (numRead < 0 && errno == EINTR) continue;
+    if (numRead <= 0) return false;
+    buffer += numRead;
+    numBytes -= numRead;
+  }
+  return true;
+}
+
+bool SearchServer::writeFully(int fd, const char* buffer, size_t numBytes) {
+  while (numBytes > 0) {
+    ssize_t numWritten = write(fd, buffer, numBytes);
+    if (numWritten < 0 && errno == EINTR) continue;
+    if (numWritten <= 0) return false;
+    buffer += numWritten;
+    numBytes -= numWritten;
+  }
+  return true;
+}
+
+void SearchServer::runServer(SearchServer* server, const std::string& socketFN, 
+    bool* success) {
+  *success = server->run(socketFN, 2u);
+}
+
+/* Retries for up to a second, as the server might not be listening yet */
+int SearchServer::connectClient(const std::string& socketFN) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socketFN.c_str(), sizeof(address.sun_path) - 1);
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), 
+                sizeof(address)) == 0) {
+      return fd;
+    }
+    close(fd);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  return -1;
+}
+
+/* Sends a request with a matching and a non-matching query to a server on a 
+   library of two p-value vectors with constant p-values, and stops it. */
+bool SearchServer::searchServerUnitTest() {
+  bool isSuccess = true;
+  
+  boost::filesystem::path tmpDir = 
+      boost::filesystem::temp_directory_path() / 
+      boost::filesystem::unique_path("maracluster_serve_%%%%%%%%");
+  boost::filesystem::create_directories(tmpDir);
+  std::string indexFN = (tmpDir / "library_index.dat").string();
+  std::string socketFN = (tmpDir / "serve.sock").string();
+  
+  std::vector<PvalueVector> libraryPvecs(2);
+  for (size_t i = 0; i < libraryPvecs.size(); ++i) {
+    PvalueVector& pvec = libraryPvecs[i];
+    pvec.precMz = 500.0;
+    pvec.precMass = SpectrumHandler::calcMass(500.0, 2u);
+    pvec.charge = pvec.queryCharge = 2;
+    pvec.polyfit[0] = -5.0 - static_cast<double>(i);
+    pvec.peakBins[0] = 10;
+    pvec.peakBins[1] = 20;
+    pvec.peakScores[0] = pvec.peakScores[1] = 1;
+    pvec.scannr = ScanId(0u, static_cast<unsigned int>(i + 1));
+  }
+  
+  PvalueVectorIndex library;
+  if (!PvalueVectorIndex::write(indexFN, libraryPvecs) || !library.open(indexFN)) {
+    boost::filesystem::remove_all(tmpDir);
+    return false;
+  }
+  
+  PvalueVectors pvecs("", 20.0, false, -1.0);
+  SearchServer server(pvecs, library);
+  bool serverSuccess = false;
+  boost::thread serverThread(boost::bind(&SearchServer::runServer, &server, 
+                                         socketFN, &serverSuccess));
+  
+  int fd = connectClient(socketFN);
+  if (fd < 0) {
+    std::cerr << "Could not connect to the search server" << std::endl;
+    server.requestStop(); // the pipes exist once the socket is bound
+    serverThread.join();
+    library.close();
+    boost::filesystem::remove_all(tmpDir);
+    return false;
+  }
+  
+  SearchRequestHeader request;
+  request.magic = kRequestMagic;
+  request.numQueries = 2u;
+  request.topK = 10u;
+  std::vector<Spectrum> querySpectra(2);
+  for (size_t j = 0; j < querySpectra.size(); ++j) {
+    querySpectra[j].scannr = ScanId(1u, static_cast<unsigned int>(j + 1));
+    querySpectra[j].precMz = 500.0f;
+    querySpectra[j].fragBins[0] = 10;
+    querySpectra[j].fragBins[1] = 20;
+  }
+  querySpectra[0].charge = 2u;
+  querySpectra[1].charge = 3u; // does not match the library charge
+  
+  SearchReplyHeader reply;
+  unsigned int numHits[2] = {0u, 0u};
+  std::vector<PvalueTriplet> hits(2);
+  isSuccess &= writeFully(fd, reinterpret_cast<const char*>(&request), sizeof(request));
+  isSuccess &= writeFully(fd, reinterpret_cast<const char*>(&querySpectra[0]), 
+                          2 * sizeof(Spectrum));
+  isSuccess &= readFully(fd, reinterpret_cast<char*>(&reply), sizeof(reply));
+  isSuccess &= readFully(fd, reinterpret_cast<char*>(&numHits[0]), sizeof(unsigned int));
+  if (isSuccess && numHits[0] == 2u) {
+    isSuccess &= readFully(fd, reinterpret_cast<char*>(&hits[0]), 
+                           2 * sizeof(PvalueTriplet));
+  }
+  isSuccess &= readFully(fd, reinterpret_cast<char*>(&numHits[1]), sizeof(unsigned int));
+  
+  if (!isSuccess || reply.magic != kReplyMagic || reply.numQueries != 2u) {
+    std::cerr << "Invalid reply header" << std::endl;
+    isSuccess = false;
+  } else if (numHits[0] != 2u || numHits[1] != 0u) {
+    std::cerr << "Expected 2 and 0 hits, got " << numHits[0] << " and " 
+              << numHits[1] << std::endl;
+    isSuccess = false;
+  } else if (hits[0].scannr1.scannr != 2u || hits[0].pval != -6.0 || 
+             hits[1].scannr1.scannr != 1u || hits[1].pval != -5.0 ||
+             hits[0].scannr2.scannr != 1u) {
+    std::cerr << "Hits not sorted by p-value" << std::endl;
+    isSuccess = false;
+  }
+  
+  SearchRequestHeader stopRequest;
+  stopRequest.magic = kStopMagic;
+  stopRequest.numQueries = stopRequest.topK = 0u;
+  writeFully(fd, reinterpret_cast<const char*>(&stopRequest), sizeof(stopRequest));
+  if (!readFully(fd, reinterpret_cast<char*>(&reply), sizeof(reply)) || 
+      reply.magic != kReplyMagic || reply.numQueries != 0u) {
+    std::cerr << "Invalid reply to the stop request" << std::endl;
+    isSuccess = false;
+  }
+  close(fd);
+  
+  serverThread.join();
+  if (!serverSuccess || boost::filesystem::exists(socketFN)) {
+    std::cerr << "Server did not stop cleanly" << std::endl;
+    isSuccess = false;
+  }
+  
+  library.close();
+  boost::filesystem::remove_all(tmpDir);
+  return isSuccess;
+}
+
+#endif /* _WIN32 */
+
+} /* namespace maracluster */
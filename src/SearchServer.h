@@ -0,0 +1,99 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_SEARCHSERVER_H_
+#define MARACLUSTER_SEARCHSERVER_H_
+
+#include <iostream>
+#include <vector>
+#include <string>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "Globals.h"
+#include "Spectrum.h"
+#include "PvalueTriplet.h"
+#include "PvalueVectors.h"
+#include "PvalueVectorIndex.h"
+
+namespace maracluster {
+
+/* Binary protocol, in native byte order: a request consists of a 
+   SearchRequestHeader followed by numQueries Spectrum records. The reply 
+   consists of a SearchReplyHeader followed, for each query in the order of 
+   the request, by an unsigned int with the number of hits and that many 
+   PvalueTriplet records (library scan, query scan, log p-value) sorted by
+   p-value. A connection can send any number of requests. A request with 
+   magic kStopMagic is answered by a reply header with numQueries = 0, after 
+   which the server stops. */
+struct SearchRequestHeader {
+  unsigned int magic, numQueries, topK;
+};
+
+struct SearchReplyHeader {
+  unsigned int magic, numQueries;
+};
+
+/* Answers search requests against a library index on a Unix domain socket.
+   Each worker thread accepts and serves one connection at a time, the 
+   queries of a request are scored by all OpenMP threads. run() returns 
+   after a stop request or a SIGINT/SIGTERM, once the requests that are 
+   being answered have been completed. */
+class SearchServer {
+ public:
+  SearchServer(PvalueVectors& pvecs, const PvalueVectorIndex& library) :
+    pvecs_(pvecs), library_(library) {
+    stopPipe_[0] = stopPipe_[1] = -1;
+    wakePipe_[0] = wakePipe_[1] = -1;
+  }
+  
+  bool run(const std::string& socketFN, unsigned int numWorkers);
+  void requestStop();
+  
+  static bool searchServerUnitTest();
+  
+  static const unsigned int kRequestMagic, kReplyMagic, kStopMagic;
+  static const unsigned int kMaxQueriesPerRequest, kMaxTopK;
+  
+ protected:
+  PvalueVectors& pvecs_;
+  const PvalueVectorIndex& library_;
+  
+  // stopPipe_ receives a byte to stop the server, the write end of 
+  // wakePipe_ is closed to wake up all workers
+  int stopPipe_[2], wakePipe_[2];
+  
+  static volatile int signalStopFd_;
+  static void handleStopSignal(int signum);
+  
+  void runWorker(int listenFd);
+  bool waitReadable(int fd);
+  bool handleRequest(int connFd);
+  
+  static bool readFully(int fd, char* buffer, size_t numBytes);
+  static bool writeFully(int fd, const char* buffer, size_t numBytes);
+  
+  static void runServer(SearchServer* server, const std::string& socketFN, 
+                        bool* success);
+  static int connectClient(const std::string& socketFN);
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_SEARCHSERVER_H_ */
@@ -16,12 +16,27 @@
  
 #include "SparseClustering.h"
 
+#include <boost/filesystem.hpp>
+
 namespace maracluster {
 
 void SparseClustering::initMatrix(const std::string& matrixFN) {
   matrixLoader_.initStream(matrixFN);
 }
 
+/* Replays the merges of a previous clustering tree in p-value order together 
+   with the new edges, such that new spectra can join previous clusters at 
+   any point in their formation. The merges of the previous tree are not 
+   repeated in the new clustering tree. */
+void SparseClustering::setPreviousMerges(std::vector<PvalueTriplet>& pvalTree) {
+  std::sort(pvalTree.begin(), pvalTree.end());
+  previousMerges_.swap(pvalTree);
+  nextPreviousMerge_ = 0u;
+  
+  std::cerr << "Replaying " << previousMerges_.size() 
+            << " merges from previous clustering tree." << std::endl;
+}
+
 void SparseClustering::clusterInit(const ScanId& row) {
 #pragma omp critical (new_cluster)
   {
@@ -228,6 +243,54 @@ void SparseClustering::updateMatrix(const ScanId& minRow, const ScanId& minCol,
   matrix_.merge(minRow, minCol, mergeScanId, edgeList_);
 }
 
+// returns the current cluster of a spectrum from a previous clustering tree
+ScanId SparseClustering::getCluster(const ScanId& si) {
+  ScanId cluster = si;
+  boost::unordered_map<ScanId, ScanId>::iterator it;
+  while ((it = clusterParents_.find(cluster)) != clusterParents_.end()) {
+    cluster = it->second;
+  }
+  
+  // path compression
+  ScanId child = si;
+  while ((it = clusterParents_.find(child)) != clusterParents_.end() && 
+          it->second != cluster) {
+    child = it->second;
+    it->second = cluster;
+  }
+  return cluster;
+}
+
+// merges the clusters of the next previous merge if it comes before an edge
+// with the given p-value. Only the matrix rows of clusters with edges are 
+// merged, as complete linkage drops all other edges anyway.
+bool SparseClustering::replayPreviousMerge(const double value, 
+                                           unsigned int& mergeCnt) {
+  if (nextPreviousMerge_ >= previousMerges_.size() || 
+      previousMerges_[nextPreviousMerge_].pval > value) {
+    return false;
+  }
+  
+  const PvalueTriplet& previousMerge = previousMerges_[nextPreviousMerge_++];
+  ScanId row = getCluster(previousMerge.scannr1);
+  ScanId col = getCluster(previousMerge.scannr2);
+  if (row == col) return true;
+  
+  clusterInit(row);
+  clusterInit(col);
+  
+  ScanId mergeScanId(mergeOffset_, mergeCnt++);
+  setRoot(mergeScanId, getRoot(row));
+  clusterParents_[row] = mergeScanId;
+  clusterParents_[col] = mergeScanId;
+  
+  joinClusters(row, col, mergeScanId);
+  if (matrix_.isAlive(row) || matrix_.isAlive(col)) {
+    updateMatrix(row, col, mergeScanId);
+  }
+  return true;
+}
+
 // Based on http://www.ncbi.nlm.nih.gov/pmc/articles/PMC2718652/
 void SparseClustering::doClustering(double cutoff) {  
   std::cerr << "Starting MinHeap clustering" << std::endl;
@@ -252,15 +315,17 @@ void SparseClustering::doClustering(double cutoff) {
   }
   
   unsigned int mergeCnt = 0u;
+  ProgressReporter::startTask("Merging cluster", 0u);
+  bool replayMerges = !previousMerges_.empty();
   while (!edgeList_.empty() && edgeList_.top().value < cutoff) {
+    if (replayMerges && replayPreviousMerge(edgeList_.top().value, mergeCnt)) {
+      continue;
+    }
+    
     SparseEdge minEdge = edgeList_.top();
     popEdge();
     if (matrix_.isAlive(minEdge.row) && matrix_.isAlive(minEdge.col)) {
-      if (mergeCnt % 10000 == 0) {
-        std::cerr << "It. " << mergeCnt << ": minRow = " << minEdge.row 
-                  << ", minCol = " << minEdge.col 
-                  << ", minEl = " << minEdge.value << std::endl;
-      }
+      ProgressReporter::addProgress(1u);
       
       ScanId minRowRoot = getRoot(minEdge.row);
       ScanId mergeScanId(mergeOffset_, mergeCnt++);
@@ -272,6 +337,11 @@ void SparseClustering::doClustering(double cutoff) {
         resultFNStream << tmp << "\n";
       }
       
+      if (replayMerges) {
+        clusterParents_[minEdge.row] = mergeScanId;
+        clusterParents_[minEdge.col] = mergeScanId;
+      }
+      
       joinClusters(minEdge.row, minEdge.col, mergeScanId);
       updateMatrix(minEdge.row, minEdge.col, mergeScanId);
     }
@@ -387,6 +457,142 @@ bool SparseClustering::clusteringUnitTest() {
   }
 }
 
+static void writeUnitTestMatrix(std::vector<PvalueTriplet> edges,
+                                const std::string& matrixFN) {
+  std::sort(edges.begin(), edges.end());
+  std::ofstream matrixStream(matrixFN.c_str(), std::ios::out | std::ios::binary);
+  BOOST_FOREACH (const PvalueTriplet& edge, edges) {
+    matrixStream.write(reinterpret_cast<const char*>(&edge), sizeof(edge));
+  }
+}
 
+static void readUnitTestTree(const std::string& treeFN,
+                             std::vector<PvalueTriplet>& pvalTree) {
+  std::ifstream treeStream(treeFN.c_str());
+  std::string line;
+  while (std::getline(treeStream, line)) {
+    char* next = NULL;
+    PvalueTriplet tmp;
+    tmp.readFromString(line.c_str(), &next);
+    pvalTree.push_back(tmp);
+  }
+}
+
+// assigns each spectrum to the root of its cluster at the given threshold
+static void getUnitTestClusters(std::vector<PvalueTriplet> pvalTree,
+    double threshold, std::map<ScanId, ScanId>& roots) {
+  std::sort(pvalTree.begin(), pvalTree.end());
+  BOOST_FOREACH (const PvalueTriplet& pvalTriplet, pvalTree) {
+    if (pvalTriplet.pval >= threshold) break;
+    ScanId r1 = pvalTriplet.scannr1, r2 = pvalTriplet.scannr2;
+    while (roots.find(r1) != roots.end() && roots[r1] != r1) r1 = roots[r1];
+    while (roots.find(r2) != roots.end() && roots[r2] != r2) r2 = roots[r2];
+    roots[r1] = r1;
+    roots[r2] = r1;
+  }
+  std::map<ScanId, ScanId>::iterator it;
+  for (it = roots.begin(); it != roots.end(); ++it) {
+    ScanId r = it->second;
+    while (roots[r] != r) r = roots[r];
+    it->second = r;
+  }
+}
+
+// Checks that replaying the tree of the old edges together with the new 
+// edges gives the same clusters as clustering all edges at once.
+bool SparseClustering::updateClusteringUnitTest() {
+  boost::filesystem::path testFolder = 
+      boost::filesystem::temp_directory_path() / 
+      boost::filesystem::unique_path("maracluster_update_%%%%%%%%");
+  boost::filesystem::create_directories(testFolder);
+  std::string matrixFN = (testFolder / "matrix.dat").string();
+  std::string fullTreeFN = (testFolder / "full.pvaltree.tsv").string();
+  std::string oldTreeFN = (testFolder / "old.pvaltree.tsv").string();
+  std::string updateTreeFN = (testFolder / "update.pvaltree.tsv").string();
+  
+  double cutoff = -1.0;
+  ScanId a(0,1), b(0,2), c(0,3), d(0,4), x(1,1), y(1,2), z(1,3);
+  std::vector<PvalueTriplet> oldEdges, newEdges;
+  oldEdges.push_back(PvalueTriplet(a, b, -6.0f));
+  oldEdges.push_back(PvalueTriplet(c, d, -10.0f));
+  
+  // x is much closer to a than to b, and should join a before {a,b} forms
+  newEdges.push_back(PvalueTriplet(a, x, -40.0f));
+  newEdges.push_back(PvalueTriplet(b, x, -6.0f));
+  newEdges.push_back(PvalueTriplet(c, y, -12.0f));
+  newEdges.push_back(PvalueTriplet(d, y, -11.0f));
+  newEdges.push_back(PvalueTriplet(y, z, -5.0f));
+  newEdges.push_back(PvalueTriplet(c, z, -4.5f));
+  newEdges.push_back(PvalueTriplet(d, z, -4.0f));
+  newEdges.push_back(PvalueTriplet(a, z, -3.0f));
+  
+  std::vector<PvalueTriplet> allEdges(oldEdges);
+  allEdges.insert(allEdges.end(), newEdges.begin(), newEdges.end());
+  
+  {
+    writeUnitTestMatrix(allEdges, matrixFN);
+    SparseClustering matrix;
+    matrix.initMatrix(matrixFN);
+    matrix.setClusterPairFN(fullTreeFN);
+    matrix.doClustering(cutoff);
+  }
+  
+  {
+    writeUnitTestMatrix(oldEdges, matrixFN);
+    SparseClustering matrix;
+    matrix.initMatrix(matrixFN);
+    matrix.setClusterPairFN(oldTreeFN);
+    matrix.doClustering(cutoff);
+  }
+  
+  std::vector<PvalueTriplet> oldTree;
+  readUnitTestTree(oldTreeFN, oldTree);
+  {
+    writeUnitTestMatrix(newEdges, matrixFN);
+    SparseClustering matrix;
+    matrix.setPreviousMerges(oldTree);
+    matrix.initMatrix(matrixFN);
+    matrix.setClusterPairFN(updateTreeFN);
+    matrix.doClustering(cutoff);
+  }
+  
+  std::vector<PvalueTriplet> fullTree, updateTree;
+  readUnitTestTree(fullTreeFN, fullTree);
+  readUnitTestTree(oldTreeFN, updateTree);
+  readUnitTestTree(updateTreeFN, updateTree);
+  
+  boost::filesystem::remove_all(testFolder);
+  
+  bool success = true;
+  double thresholds[] = { -30.0, -11.5, -10.5, -8.0, -5.5, -4.2, -2.0 };
+  BOOST_FOREACH (double threshold, thresholds) {
+    std::map<ScanId, ScanId> fullRoots, updateRoots;
+    getUnitTestClusters(fullTree, threshold, fullRoots);
+    getUnitTestClusters(updateTree, threshold, updateRoots);
+    
+    std::map<ScanId, ScanId>::const_iterator it1, it2;
+    for (it1 = fullRoots.begin(); it1 != fullRoots.end(); ++it1) {
+      for (it2 = fullRoots.begin(); it2 != fullRoots.end(); ++it2) {
+        bool sameFull = (it1->second == it2->second);
+        bool sameUpdate = updateRoots.find(it1->first) != updateRoots.end() &&
+            updateRoots.find(it2->first) != updateRoots.end() &&
+            updateRoots[it1->first] == updateRoots[it2->first];
+        if (sameFull != sameUpdate) {
+          std::cerr << "Update clustering differs from full clustering for " 
+                    << it1->first << " and " << it2->first 
+                    << " at threshold " << threshold << std::endl;
+          success = false;
+        }
+      }
+    }
+    if (fullRoots.size() != updateRoots.size()) {
+      std::cerr << "Update clustering has " << updateRoots.size() 
+                << " clustered spectra instead of " << fullRoots.size() 
+                << " at threshold " << threshold << std::endl;
+      success = false;
+    }
+  }
+  return success;
+}
 
 } /* namespace maracluster */
@@ -31,6 +31,7 @@
 #include <boost/foreach.hpp>
 #include <boost/unordered/unordered_map.hpp>
 
+#include "ProgressReporter.h"
 #include "MatrixLoader.h"
 #include "PvalueTriplet.h"
 #include "SparseEdge.h"
@@ -43,7 +44,7 @@ class SparseClustering {
   SparseClustering() : numTotalEdges_(0), clusterPairFN_(""), 
     edgeLoadingBatchSize_(20000000) /* 20M */, 
     mergeOffset_(3000000000) /* 3G */,
-    writeMissingEdges_(false) { }
+    writeMissingEdges_(false), nextPreviousMerge_(0u) { }
   
   inline void setClusterPairFN(const std::string& clusterPairFN) { 
     clusterPairFN_ = clusterPairFN;
@@ -53,6 +54,7 @@ class SparseClustering {
     return clusters_; 
   }
   void initMatrix(const std::string& matrixFN);
+  void setPreviousMerges(std::vector<PvalueTriplet>& pvalTree);
   
   virtual void doClustering(double cutoff);
   
@@ -65,6 +67,7 @@ class SparseClustering {
   }
   
   static bool clusteringUnitTest();
+  static bool updateClusteringUnitTest();
  protected:
   long long numTotalEdges_;
   std::string clusterPairFN_;
@@ -81,6 +84,10 @@ class SparseClustering {
   boost::unordered_map<ScanId, ScanId> mergeRoots_;
   std::vector<SparseMissingEdge> missingEdges_;
   
+  std::vector<PvalueTriplet> previousMerges_;
+  size_t nextPreviousMerge_;
+  boost::unordered_map<ScanId, ScanId> clusterParents_;
+  
   virtual void loadNextEdges();
   void loadEdges(std::vector<PvalueTriplet>& pvec);
   virtual bool edgesLeft();
@@ -113,6 +120,9 @@ class SparseClustering {
   void updateMatrix(const ScanId& minRow, const ScanId& minCol,
     const ScanId& mergeScanId);
   
+  bool replayPreviousMerge(const double value, unsigned int& mergeCnt);
+  ScanId getCluster(const ScanId& si);
+  
   void writeMissingEdges(double cutoff);
   
   inline static bool lowerEdge(const SparseMissingEdge& a, 
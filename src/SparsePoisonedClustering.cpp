@@ -27,7 +27,7 @@ void SparsePoisonedClustering::loadNextEdges() {
     ScanId s1 = (std::min)(pvals_[i].scannr1, pvals_[i].scannr2);
     ScanId s2 = (std::max)(pvals_[i].scannr1, pvals_[i].scannr2);
     
-    if (isPoisoned_[s1] && isPoisoned_[s2]) {
+    if (isPoisoned(s1) && isPoisoned(s2)) {
       poisonedEdges_.push_back(pvals_[i]);
     } else {
 #ifdef SINGLE_LINKAGE
@@ -60,9 +60,9 @@ void SparsePoisonedClustering::doClustering(double cutoff) {
     SparseEdge minEdge = edgeList_.top();
     popEdge();
     if (matrix_.isAlive(minEdge.row) && matrix_.isAlive(minEdge.col)) {
-      if (isPoisoned_[minEdge.row] || isPoisoned_[minEdge.col]) {
-        isPoisoned_[minEdge.row] = true;
-        isPoisoned_[minEdge.col] = true;
+      if (isPoisoned(minEdge.row) || isPoisoned(minEdge.col)) {
+        markPoisoned(minEdge.row);
+        markPoisoned(minEdge.col);
         
         ScanId minRowRoot = getRoot(minEdge.row);
         ScanId minColRoot = getRoot(minEdge.col);
@@ -70,7 +70,7 @@ void SparsePoisonedClustering::doClustering(double cutoff) {
                                                std::max(minRowRoot, minColRoot), 
                                                minEdge.value));
       } else {
-        if (mergeCnt_ % 10000 == 0) {
+        if (mergeCnt_ % 10000 == 0 && Globals::VERB > 4) {
           std::cerr << "It. " << mergeCnt_ << ": minRow = " << minEdge.row 
                     << ", minCol = " << minEdge.col 
                     << ", minEl = " << minEdge.value 
@@ -32,6 +32,7 @@
 #include <boost/unordered/unordered_map.hpp>
 
 #include "SparseClustering.h"
+#include "ScanIdBitmap.h"
 
 namespace maracluster {
 
@@ -40,11 +41,11 @@ class SparsePoisonedClustering : public SparseClustering {
   SparsePoisonedClustering() : SparseClustering(), edgesLeft_(false), mergeCnt_(0u) { }
   
   inline void markPoisoned(const ScanId& scanId) {
-    isPoisoned_[scanId] = true;
+    isPoisoned_.set(scanId);
   }
   
-  inline bool isPoisoned(const ScanId& scanId) {
-    return isPoisoned_[scanId];
+  inline bool isPoisoned(const ScanId& scanId) const {
+    return isPoisoned_.test(scanId);
   }
   
   void initPvals(std::vector<PvalueTriplet>& pvec) {
@@ -61,7 +62,7 @@ class SparsePoisonedClustering : public SparseClustering {
   void doClustering(double cutoff);
   
  protected:  
-  boost::unordered_map<ScanId, bool> isPoisoned_;
+  ScanIdBitmap isPoisoned_;
   std::vector<PvalueTriplet> pvals_, poisonedEdges_;
   bool edgesLeft_;
   unsigned int mergeCnt_;
@@ -43,7 +43,7 @@ class Spectra {
   void convertToBatchSpectra(std::string& spectrumFN, 
     SpectrumFileList& fileList);
   void convertToBatchSpectra(SpectrumFileList& fileList);
-  void readBatchSpectra(std::string& batchSpectraFN);
+  void readBatchSpectra(const std::string& batchSpectraFN);
   
   void sortSpectraByPrecMass();
   void sortSpectraByPrecMz();
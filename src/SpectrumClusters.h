@@ -45,12 +45,12 @@ class SpectrumClusters {
     const std::string& scanInfoFN, const std::string& resultBaseFN);
   
   static std::string getClusterFN(const std::string resultBaseFN, double threshold);
+  static void readPvalTree(const std::string& pvalTreeFN,
+    std::vector<PvalueTriplet>& pvals);
   
  private:
   std::vector<ScanInfo> scanInfos_;
   
-  void readPvalTree(const std::string& pvalTreeFN,
-    std::vector<PvalueTriplet>& pvals);
   void readScanNrs(const std::string& scanInfoFN);
   
   void createClusterings(std::vector<PvalueTriplet>& pvals, 
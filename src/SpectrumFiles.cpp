@@ -31,11 +31,22 @@ void SpectrumFiles::splitByPrecursorMz(
   }
   
   std::vector<double> precMzsAccumulated;
-  getPeakCountsAndPrecursorMzs(fileList, precMzsAccumulated, peakCountFN);
+  std::vector<size_t> chargeCounts;
+  getPeakCountsAndPrecursorMzs(fileList, precMzsAccumulated, chargeCounts, 
+                               peakCountFN);
   
   //writePrecMzs(precMzsAccumulated);
   //readPrecMzs(peakCountFN_, precMzsAccumulated);
   
+  if (binCostModel_.doCalibrate()) {
+    PeakCounts peakCounts;
+    peakCounts.readFromFile(peakCountFN);
+    binCostModel_.calibrate(peakCounts, precMzsAccumulated, chargeCounts);
+  }
+  if (Globals::VERB > 1) {
+    binCostModel_.print();
+  }
+  
   std::vector<double> limits;
   getPrecMzLimits(precMzsAccumulated, limits, precursorTolerance, 
                     precursorToleranceDa);
@@ -58,21 +69,37 @@ void SpectrumFiles::getPeakCountsAndPrecursorMzs(
     SpectrumFileList& fileList, 
     std::vector<double>& precMzsAccumulated,
     const std::string& peakCountFN) {
+  std::vector<size_t> chargeCounts;
+  getPeakCountsAndPrecursorMzs(fileList, precMzsAccumulated, chargeCounts,
+                               peakCountFN);
+}
+
+void SpectrumFiles::getPeakCountsAndPrecursorMzs(
+    SpectrumFileList& fileList, 
+    std::vector<double>& precMzsAccumulated,
+    std::vector<size_t>& chargeCounts,
+    const std::string& peakCountFN) {
   if (Globals::VERB > 1) {
     std::cerr << "Accumulating peak counts and precursor Mzs" << std::endl;
   }
+  ScopedStageTimer timer("index/peak_counts");
   
   PeakCounts peakCountsAccumulated;
   
   std::vector<std::string> spectrumFNs = fileList.getFilePaths();
+  ProgressReporter::startTask("Processing spectrum file", 
+                              spectrumFNs.size() - firstFileIdx_);
 #pragma omp parallel for schedule(dynamic, 1)  
-  for (int fileIdx = 0; fileIdx < static_cast<int>(spectrumFNs.size()); ++fileIdx) {
+  for (int fileIdx = static_cast<int>(firstFileIdx_); fileIdx < static_cast<int>(spectrumFNs.size()); ++fileIdx) {
     std::string spectrumFN = spectrumFNs[fileIdx];
     if (Globals::VERB > 1) {
       std::cerr << "  Processing " << spectrumFN << 
           " (" << (fileIdx+1)*100/spectrumFNs.size() << "%)." << std::endl;
     }
     
+    boost::system::error_code returnedError;
+    StageProfiler::addBytesRead(boost::filesystem::file_size(spectrumFN, returnedError));
+    
     SpectrumListPtr specList;    
     MSReaderList readerList;
     MSDataFile msd(spectrumFN, &readerList);
@@ -80,11 +107,16 @@ void SpectrumFiles::getPeakCountsAndPrecursorMzs(
     
     PeakCounts peakCounts;
     std::vector<double> precMzs;
+    std::vector<size_t> fileChargeCounts;
     
     size_t numSpectra = specList->size();
     //size_t numSpectra = 2;
+    boost::posix_time::time_duration decodeTime;
     for (size_t i = 0; i < numSpectra; ++i) {
+      boost::posix_time::ptime decodeStart = 
+          boost::posix_time::microsec_clock::universal_time();
       SpectrumPtr s = specList->spectrum(i, true);
+      decodeTime += boost::posix_time::microsec_clock::universal_time() - decodeStart;
       if (!SpectrumHandler::isMs2Scan(s)) continue;
       
       std::vector<MZIntensityPair> mziPairs;
@@ -98,6 +130,10 @@ void SpectrumFiles::getPeakCountsAndPrecursorMzs(
       unsigned int lastCharge = 0;
       BOOST_FOREACH (MassChargeCandidate& mcc, mccs) {
         precMzs.push_back(mcc.precMz);
+        if (mcc.charge >= fileChargeCounts.size()) {
+          fileChargeCounts.resize(mcc.charge + 1, 0u);
+        }
+        ++fileChargeCounts[mcc.charge];
         unsigned int charge = (std::min)(mcc.charge, peakCounts.getMaxCharge());
         if (charge != lastCharge) {
           // in the last bin we do not truncate the spectrum
@@ -108,11 +144,21 @@ void SpectrumFiles::getPeakCountsAndPrecursorMzs(
         }
       }
     }
+    StageProfiler::addThreadTime("index/decode", 
+        decodeTime.total_microseconds() / 1e6, numSpectra);
   #pragma omp critical (add_to_peakcount)  
     {
+      timer.addItems(numSpectra);
       peakCountsAccumulated.add(peakCounts);
       precMzsAccumulated.insert( precMzsAccumulated.end(), precMzs.begin(), precMzs.end() );
+      if (fileChargeCounts.size() > chargeCounts.size()) {
+        chargeCounts.resize(fileChargeCounts.size(), 0u);
+      }
+      for (size_t charge = 0; charge < fileChargeCounts.size(); ++charge) {
+        chargeCounts[charge] += fileChargeCounts[charge];
+      }
     }
+    ProgressReporter::addProgress(1u);
   }
   writePeakCounts(peakCountsAccumulated, peakCountFN);
   
@@ -128,10 +174,13 @@ void SpectrumFiles::writeSplittedPrecursorMzFiles(
     std::cerr << "Dividing spectra in " << limits.size() << 
                  " bins of ~2 CPU hours each." << std::endl;
   }
+  ScopedStageTimer timer("index/binning");
   
   std::vector<std::string> spectrumFNs = fileList.getFilePaths();
+  ProgressReporter::startTask("Processing spectrum file", 
+                              spectrumFNs.size() - firstFileIdx_);
 #pragma omp parallel for schedule(dynamic, 1)                
-  for (int fileIdx = 0; fileIdx < static_cast<int>(spectrumFNs.size()); ++fileIdx) {
+  for (int fileIdx = static_cast<int>(firstFileIdx_); fileIdx < static_cast<int>(spectrumFNs.size()); ++fileIdx) {
     std::string spectrumFN = spectrumFNs[fileIdx];
     if (Globals::VERB > 1) {
       std::cerr << "  Processing " << spectrumFN << 
@@ -150,6 +199,7 @@ void SpectrumFiles::writeSplittedPrecursorMzFiles(
     
   #pragma omp critical (add_to_datfiles)
     {
+      timer.addItems(scanInfos.size());
       appendBatchSpectra(batchSpectra, datFNs);
     }
   #pragma omp critical (write_scannrs)
@@ -157,6 +207,7 @@ void SpectrumFiles::writeSplittedPrecursorMzFiles(
       bool append = true;
       BinaryInterface::write<ScanInfo>(scanInfos, scanInfoFN, append);
     }
+    ProgressReporter::addProgress(1u);
   }
 }
 
@@ -170,14 +221,21 @@ void SpectrumFiles::getBatchSpectra(
     return;
   }
    
+  boost::system::error_code returnedError;
+  StageProfiler::addBytesRead(boost::filesystem::file_size(spectrumFN, returnedError));
+  
   SpectrumListPtr specList;
   MSReaderList readerList;
   MSDataFile msd(spectrumFN, &readerList);
   specList = msd.run.spectrumListPtr;
   
   size_t numSpectra = specList->size();
+  boost::posix_time::time_duration decodeTime;
   for (size_t i = 0; i < numSpectra; ++i) {
+    boost::posix_time::ptime decodeStart = 
+        boost::posix_time::microsec_clock::universal_time();
     SpectrumPtr s = specList->spectrum(i, true);
+    decodeTime += boost::posix_time::microsec_clock::universal_time() - decodeStart;
     if (!SpectrumHandler::isMs2Scan(s)) continue;
     
     std::vector<MZIntensityPair> mziPairs;
@@ -219,6 +277,8 @@ void SpectrumFiles::getBatchSpectra(
     }
     scanInfos.push_back(scanInfo);
   }
+  StageProfiler::addThreadTime("index/decode", 
+      decodeTime.total_microseconds() / 1e6, numSpectra);
 }
 
 void SpectrumFiles::appendBatchSpectra(
@@ -295,7 +355,7 @@ void SpectrumFiles::readPrecMzs(const std::string& precMzFN,
 }
 
 void SpectrumFiles::readPrecMzLimits(const std::string& scanInfoFN,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits) {
+    PrecMzLimits& precMzLimits) {
   if (Globals::VERB > 2) {
     std::cerr << "Reading precursor m/z limits." << std::endl;
   }
@@ -303,33 +363,32 @@ void SpectrumFiles::readPrecMzLimits(const std::string& scanInfoFN,
   BinaryInterface::read<ScanInfo>(scanInfoFN, scanInfos);
   
   BOOST_FOREACH (const ScanInfo& si, scanInfos) {
-    precMzLimits[si.scanId] = std::make_pair(si.minPrecMz, si.maxPrecMz);
+    precMzLimits.add(si.scanId, si.minPrecMz, si.maxPrecMz);
   }
+  precMzLimits.finalize();
 }
 
 void SpectrumFiles::getPrecMzLimits(std::vector<double>& precMzs, 
     std::vector<double>& limits, double precursorTolerance, 
     bool precursorToleranceDa) {
-  float pvecCost = 0.7f; // computation time for 1 p-value vector in ms on 1 core
-  float pvalCost = 0.001f; // computation time for 1 p-value pair in ms on 1 core
-  float maxCost = 120.0f*60.0f*1000.0f; // max computation time = 120 CPU minutes
-  
   unsigned long long numComparisons = 0uL;
   if (precMzs.size() > 0) {
     size_t lowerBoundIdx = 0;
     limits.push_back(precMzs[0]);
-    float curCost = 0.0f;
+    double numBinPvecs = 0.0, numBinComparisons = 0.0;
     for (size_t idx = 0; idx < precMzs.size(); ++idx) {
-      curCost += pvecCost;
+      numBinPvecs += 1.0;
       double lowerBound = PvalueVectors::getLowerBound(precMzs[idx], 
           precursorTolerance, precursorToleranceDa);
       while (precMzs[lowerBoundIdx] < lowerBound) {
         ++lowerBoundIdx;
       }
       numComparisons += (idx - lowerBoundIdx);
-      curCost += (idx - lowerBoundIdx)*pvalCost;
-      if (curCost > maxCost && lowerBound > limits.back()) {
-        curCost = 0.0f;
+      numBinComparisons += (idx - lowerBoundIdx);
+      if (binCostModel_.isFull(numBinPvecs, numBinComparisons) && 
+          lowerBound > limits.back()) {
+        numBinPvecs = 0.0;
+        numBinComparisons = 0.0;
         limits.push_back(precMzs[idx]);
       }
     } 
@@ -338,6 +397,8 @@ void SpectrumFiles::getPrecMzLimits(std::vector<double>& precMzs,
   if (Globals::VERB > 1) {
     std::cerr << "Estimated number of pair comparisons: " 
               << numComparisons << std::endl;
+    std::cerr << "Split precursor m/z range into " << limits.size() 
+              << " bins" << std::endl;
   }
 }
 
@@ -346,6 +407,15 @@ int SpectrumFiles::getPrecMzBin(double precMz, std::vector<double>& limits) {
   return std::min(std::max(bin, 0), static_cast<int>(limits.size()) - 1);
 }
 
+void SpectrumFiles::mergePeakCounts(const std::string& peakCountFN,
+    const std::string& addedPeakCountFN, const std::string& mergedPeakCountFN) {
+  PeakCounts peakCounts, addedPeakCounts;
+  peakCounts.readFromFile(peakCountFN);
+  addedPeakCounts.readFromFile(addedPeakCountFN);
+  peakCounts.add(addedPeakCounts);
+  writePeakCounts(peakCounts, mergedPeakCountFN);
+}
+
 void SpectrumFiles::writePeakCounts(PeakCounts& peakCountsAccumulated, 
                                          const std::string& peakCountFN) {
   if (Globals::VERB > 2) {
@@ -31,12 +31,15 @@
 #include "Spectrum.h"
 
 #include "ScanId.h"
+#include "PrecMzLimits.h"
 #include "PeakCounts.h"
 #include "SpectrumFileList.h"
 #include "SpectrumHandler.h"
 #include "MSFileHandler.h"
 #include "BinSpectra.h"
 #include "BinaryInterface.h"
+#include "BinCostModel.h"
+#include "StageProfiler.h"
 
 namespace maracluster {
 
@@ -63,13 +66,15 @@ struct ScanInfo {
 
 class SpectrumFiles {
  public:
-  SpectrumFiles() : precMzFileFolder_(""), chargeUncertainty_(0) {}
+  SpectrumFiles() : precMzFileFolder_(""), chargeUncertainty_(0), 
+      firstFileIdx_(0u) {}
   SpectrumFiles(const std::string& precMzFileFolder) : 
-      precMzFileFolder_(precMzFileFolder), chargeUncertainty_(0) {}
+      precMzFileFolder_(precMzFileFolder), chargeUncertainty_(0), 
+      firstFileIdx_(0u) {}
   SpectrumFiles(const std::string& precMzFileFolder, 
                      const int chargeUncertainty) : 
       precMzFileFolder_(precMzFileFolder), 
-      chargeUncertainty_(chargeUncertainty) {}
+      chargeUncertainty_(chargeUncertainty), firstFileIdx_(0u) {}
   
   void splitByPrecursorMz(SpectrumFileList& fileList,
       std::vector<std::string>& datFNs, const std::string& peakCountFN,
@@ -82,6 +87,10 @@ class SpectrumFiles {
   
   void getPeakCountsAndPrecursorMzs(SpectrumFileList& fileList,
     std::vector<double>& precMzsAccumulated, const std::string& peakCountFN);
+  // chargeCounts[z] = number of precursors with charge z
+  void getPeakCountsAndPrecursorMzs(SpectrumFileList& fileList,
+    std::vector<double>& precMzsAccumulated, 
+    std::vector<size_t>& chargeCounts, const std::string& peakCountFN);
     
   void writeDatFNsToFile(std::vector<std::string>& datFNs,
     const std::string& datFNFile);
@@ -89,17 +98,32 @@ class SpectrumFiles {
   void readDatFNsFromFile(const std::string& datFNFile,
     std::vector<std::string>& datFNs);
   void readPrecMzLimits(const std::string& scanInfoFN,
-    std::map<ScanId, std::pair<float, float> >& precMzLimits);
+    PrecMzLimits& precMzLimits);
+  void mergePeakCounts(const std::string& peakCountFN, 
+    const std::string& addedPeakCountFN, const std::string& mergedPeakCountFN);
   
   void getBatchSpectra(const std::string& spectrumFN, 
     SpectrumFileList& fileList, std::vector<Spectrum>& localSpectra,
     std::vector<ScanInfo>& localScanInfos);
   
+  inline void setBinCostModel(const BinCostModel& binCostModel) {
+    binCostModel_ = binCostModel;
+  }
+  inline const BinCostModel& getBinCostModel() const { return binCostModel_; }
+  
+  /* only read the files of the file list from this index onwards, the 
+     earlier files were already indexed by a previous run */
+  inline void setFirstFileIdx(size_t firstFileIdx) { 
+    firstFileIdx_ = firstFileIdx;
+  }
+  
   static bool limitsUnitTest();
   
  protected:
   std::string precMzFileFolder_;
   int chargeUncertainty_;
+  size_t firstFileIdx_;
+  BinCostModel binCostModel_;
   
   virtual void getMassChargeCandidates(pwiz::msdata::SpectrumPtr s, 
     std::vector<MassChargeCandidate>& mccs, ScanId scanId);
@@ -0,0 +1,142 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "SpectrumSpool.h"
+
+namespace maracluster {
+
+const size_t SpectrumSpoolWriter::kBufferSize = 4u*1024u*1024u; /* = 4MB */
+
+bool SpectrumSpoolWriter::open(const std::string& spoolFN) {
+  spoolFN_ = spoolFN;
+  outfile_.open(spoolFN.c_str(), std::ios_base::out | std::ios_base::binary);
+  if (!outfile_.is_open()) {
+    std::cerr << "Error: could not write spectrum spool to " << spoolFN << std::endl;
+    return false;
+  }
+  buffer_.reserve(kBufferSize);
+  return true;
+}
+
+void SpectrumSpoolWriter::write(unsigned int scannr, double retentionTime,
+    const std::vector<MassChargeCandidate>& mccs,
+    const std::vector<double>& mzs, const std::vector<double>& intensities) {
+  SpectrumSpoolRecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.scannr = scannr;
+  header.numMccs = mccs.size();
+  header.numPeaks = (std::min)(mzs.size(), intensities.size());
+  header.retentionTime = retentionTime;
+  append(&header, sizeof(header));
+  
+  std::vector<MassChargeCandidate>::const_iterator it = mccs.begin();
+  for ( ; it != mccs.end(); ++it) {
+    SpectrumSpoolMcc mcc;
+    memset(&mcc, 0, sizeof(mcc));
+    mcc.precMz = it->precMz;
+    mcc.mass = it->mass;
+    mcc.charge = it->charge;
+    append(&mcc, sizeof(mcc));
+  }
+  
+  if (header.numPeaks > 0u) {
+    append(&mzs[0], header.numPeaks * sizeof(double));
+    append(&intensities[0], header.numPeaks * sizeof(double));
+  }
+  
+  if (buffer_.size() >= kBufferSize) flush();
+}
+
+void SpectrumSpoolWriter::flush() {
+  if (!buffer_.empty()) {
+    outfile_.write(&buffer_[0], buffer_.size());
+    buffer_.clear();
+  }
+}
+
+bool SpectrumSpoolWriter::close() {
+  flush();
+  outfile_.close();
+  if (outfile_.fail()) {
+    std::cerr << "Error: failed writing spectrum spool to " << spoolFN_ << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool SpectrumSpoolReader::open(const std::string& spoolFN) {
+  close();
+  if (!Globals::fileExists(spoolFN)) {
+    std::cerr << "Error: missing spectrum spool " << spoolFN << std::endl;
+    return false;
+  } else if (Globals::fileIsEmpty(spoolFN)) {
+    return true; // files of empty cluster bins cannot be mapped
+  }
+  
+  mmap_.open(spoolFN);
+  if (!mmap_.is_open()) {
+    std::cerr << "Error: could not read spectrum spool " << spoolFN << std::endl;
+    return false;
+  }
+  
+  size_t offset = 0u;
+  while (offset + sizeof(SpectrumSpoolRecordHeader) <= mmap_.size()) {
+    const SpectrumSpoolRecordHeader* header = 
+        reinterpret_cast<const SpectrumSpoolRecordHeader*>(mmap_.data() + offset);
+    scannrToIdx_.push_back(std::make_pair(header->scannr, offsets_.size()));
+    offsets_.push_back(offset);
+    offset += getRecordSize(*header);
+  }
+  if (offset != mmap_.size()) {
+    std::cerr << "Error: spectrum spool " << spoolFN << " is truncated" << std::endl;
+    close();
+    return false;
+  }
+  
+  std::sort(scannrToIdx_.begin(), scannrToIdx_.end());
+  return true;
+}
+
+void SpectrumSpoolReader::close() {
+  if (mmap_.is_open()) mmap_.close();
+  offsets_.clear();
+  scannrToIdx_.clear();
+}
+
+size_t SpectrumSpoolReader::find(unsigned int scannr) const {
+  std::vector<std::pair<unsigned int, size_t> >::const_iterator it = 
+      std::lower_bound(scannrToIdx_.begin(), scannrToIdx_.end(), 
+                       std::make_pair(scannr, static_cast<size_t>(0u)));
+  if (it != scannrToIdx_.end() && it->first == scannr) {
+    return it->second;
+  } else {
+    return size();
+  }
+}
+
+SpectrumSpoolEntry SpectrumSpoolReader::getEntry(size_t idx) const {
+  const char* record = mmap_.data() + offsets_[idx];
+  SpectrumSpoolEntry entry;
+  entry.header = reinterpret_cast<const SpectrumSpoolRecordHeader*>(record);
+  record += sizeof(SpectrumSpoolRecordHeader);
+  entry.mccs = reinterpret_cast<const SpectrumSpoolMcc*>(record);
+  record += entry.header->numMccs * sizeof(SpectrumSpoolMcc);
+  entry.mzs = reinterpret_cast<const double*>(record);
+  entry.intensities = entry.mzs + entry.header->numPeaks;
+  return entry;
+}
+
+} /* namespace maracluster */
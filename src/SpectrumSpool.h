@@ -0,0 +1,111 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_SPECTRUMSPOOL_H_
+#define MARACLUSTER_SPECTRUMSPOOL_H_
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "Globals.h"
+#include "MassChargeCandidate.h"
+
+namespace maracluster {
+
+struct SpectrumSpoolRecordHeader {
+  unsigned int scannr, numMccs, numPeaks, reserved;
+  double retentionTime; // in seconds, negative if unknown
+};
+
+struct SpectrumSpoolMcc {
+  double precMz, mass;
+  unsigned int charge, reserved;
+};
+
+/* Pointers into the mapped spool file, valid as long as the reader is open */
+struct SpectrumSpoolEntry {
+  const SpectrumSpoolRecordHeader* header;
+  const SpectrumSpoolMcc* mccs;
+  const double* mzs;
+  const double* intensities;
+};
+
+/* Intermediate peak list store of the consensus spectrum merging. Each 
+   record consists of a SpectrumSpoolRecordHeader, followed by its mass 
+   charge candidates and its m/z and intensity arrays, in native byte order
+   and 8-byte aligned. The writer buffers records to issue large sequential 
+   writes. */
+class SpectrumSpoolWriter {
+ public:
+  SpectrumSpoolWriter() {}
+  
+  bool open(const std::string& spoolFN);
+  void write(unsigned int scannr, double retentionTime,
+             const std::vector<MassChargeCandidate>& mccs,
+             const std::vector<double>& mzs, 
+             const std::vector<double>& intensities);
+  bool close();
+  
+  static const size_t kBufferSize;
+  
+ protected:
+  std::string spoolFN_;
+  std::ofstream outfile_;
+  std::vector<char> buffer_;
+  
+  inline void append(const void* data, size_t numBytes) {
+    const char* bytes = static_cast<const char*>(data);
+    buffer_.insert(buffer_.end(), bytes, bytes + numBytes);
+  }
+  void flush();
+};
+
+/* Memory mapped reader for the files of SpectrumSpoolWriter, with a lookup
+   of records by scan number. Concurrent reads are safe. */
+class SpectrumSpoolReader {
+ public:
+  SpectrumSpoolReader() {}
+  
+  bool open(const std::string& spoolFN);
+  void close();
+  
+  inline size_t size() const { return offsets_.size(); }
+  
+  // index of the record with the scan number, size() if not present
+  size_t find(unsigned int scannr) const;
+  SpectrumSpoolEntry getEntry(size_t idx) const;
+  
+ protected:
+  boost::iostreams::mapped_file_source mmap_;
+  std::vector<size_t> offsets_;
+  std::vector<std::pair<unsigned int, size_t> > scannrToIdx_;
+  
+  inline static size_t getRecordSize(const SpectrumSpoolRecordHeader& header) {
+    return sizeof(SpectrumSpoolRecordHeader) + 
+           header.numMccs * sizeof(SpectrumSpoolMcc) + 
+           header.numPeaks * 2u * sizeof(double);
+  }
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_SPECTRUMSPOOL_H_ */
@@ -0,0 +1,136 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "StageProfiler.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+namespace maracluster {
+
+boost::mutex StageProfiler::mutex_;
+std::vector<std::string> StageProfiler::stageOrder_;
+std::map<std::string, StageStats> StageProfiler::stages_;
+unsigned long long StageProfiler::bytesRead_ = 0ull;
+unsigned long long StageProfiler::bytesWritten_ = 0ull;
+
+StageStats& StageProfiler::getStage(const std::string& stage) {
+  std::map<std::string, StageStats>::iterator it = stages_.find(stage);
+  if (it == stages_.end()) {
+    stageOrder_.push_back(stage);
+    it = stages_.insert(std::make_pair(stage, StageStats())).first;
+  }
+  return it->second;
+}
+
+void StageProfiler::addStage(const std::string& stage, double wallSeconds, 
+    double cpuSeconds, unsigned long long items, 
+    unsigned long long bytesRead, unsigned long long bytesWritten) {
+  double peakMemoryMB = Globals::getPeakMemoryMB();
+  boost::mutex::scoped_lock lock(mutex_);
+  StageStats& stats = getStage(stage);
+  ++stats.calls;
+  stats.wallSeconds += wallSeconds;
+  stats.cpuSeconds += cpuSeconds;
+  stats.items += items;
+  stats.bytesRead += bytesRead;
+  stats.bytesWritten += bytesWritten;
+  stats.peakMemoryMB = (std::max)(stats.peakMemoryMB, peakMemoryMB);
+}
+
+void StageProfiler::addThreadTime(const std::string& stage, 
+    double threadSeconds, unsigned long long items) {
+  boost::mutex::scoped_lock lock(mutex_);
+  StageStats& stats = getStage(stage);
+  ++stats.calls;
+  stats.threadSeconds += threadSeconds;
+  stats.items += items;
+}
+
+std::string StageProfiler::escapeJson(const std::string& s) {
+  std::ostringstream oss;
+  BOOST_FOREACH (const char c, s) {
+    switch (c) {
+      case '"': oss << "\\\""; break;
+      case '\\': oss << "\\\\"; break;
+      case '\n': oss << "\\n"; break;
+      case '\r': oss << "\\r"; break;
+      case '\t': oss << "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          oss << "\\u00" << "0123456789abcdef"[(c >> 4) & 0xf] 
+              << "0123456789abcdef"[c & 0xf];
+        } else {
+          oss << c;
+        }
+    }
+  }
+  return oss.str();
+}
+
+/* Format:
+   { "version": ..., "command": ..., "exit_code": ..., "threads": ..., 
+     "peak_rss_mb": ..., "bytes_read": ..., "bytes_written": ...,
+     "stages": [ { "name": ..., "calls": ..., "wall_seconds": ..., 
+                   "cpu_seconds": ..., "thread_seconds": ..., "items": ..., 
+                   "bytes_read": ..., "bytes_written": ..., 
+                   "peak_rss_mb": ... }, ... ] } */
+bool StageProfiler::writeReport(const std::string& reportFN, 
+    const std::string& version, const std::string& command, int exitCode) {
+  std::ofstream reportStream(reportFN.c_str(), std::ios_base::out);
+  if (!reportStream.is_open()) {
+    std::cerr << "Error: could not write run report to " << reportFN << std::endl;
+    return false;
+  }
+  
+  int numThreads = 1;
+#ifdef _OPENMP
+  numThreads = omp_get_max_threads();
+#endif
+  
+  boost::mutex::scoped_lock lock(mutex_);
+  reportStream << "{\n"
+      << "  \"version\": \"" << escapeJson(version) << "\",\n"
+      << "  \"command\": \"" << escapeJson(command) << "\",\n"
+      << "  \"exit_code\": " << exitCode << ",\n"
+      << "  \"threads\": " << numThreads << ",\n"
+      << "  \"peak_rss_mb\": " << Globals::getPeakMemoryMB() << ",\n"
+      << "  \"bytes_read\": " << bytesRead_ << ",\n"
+      << "  \"bytes_written\": " << bytesWritten_ << ",\n"
+      << "  \"stages\": [";
+  for (size_t i = 0; i < stageOrder_.size(); ++i) {
+    const StageStats& stats = stages_[stageOrder_[i]];
+    reportStream << (i > 0 ? "," : "") << "\n    {"
+        << "\"name\": \"" << escapeJson(stageOrder_[i]) << "\", "
+        << "\"calls\": " << stats.calls << ", "
+        << "\"wall_seconds\": " << stats.wallSeconds << ", "
+        << "\"cpu_seconds\": " << stats.cpuSeconds << ", "
+        << "\"thread_seconds\": " << stats.threadSeconds << ", "
+        << "\"items\": " << stats.items << ", "
+        << "\"bytes_read\": " << stats.bytesRead << ", "
+        << "\"bytes_written\": " << stats.bytesWritten << ", "
+        << "\"peak_rss_mb\": " << stats.peakMemoryMB << "}";
+  }
+  reportStream << "\n  ]\n}\n";
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Wrote run report to " << reportFN << std::endl;
+  }
+  return true;
+}
+
+} /* namespace maracluster */
@@ -0,0 +1,127 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_STAGEPROFILER_H_
+#define MARACLUSTER_STAGEPROFILER_H_
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <ctime>
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "Globals.h"
+#include "ProgressReporter.h"
+
+namespace maracluster {
+
+/* Totals of all calls of a stage. Bytes are counted by BinaryInterface and 
+   by the readers of the input files. The peak resident set size is the 
+   maximum of the process at the end of any of the calls. */
+struct StageStats {
+  StageStats() : calls(0u), wallSeconds(0.0), cpuSeconds(0.0), 
+    threadSeconds(0.0), items(0ull), bytesRead(0ull), bytesWritten(0ull), 
+    peakMemoryMB(0.0) {}
+  
+  size_t calls;
+  double wallSeconds, cpuSeconds, threadSeconds;
+  unsigned long long items, bytesRead, bytesWritten;
+  double peakMemoryMB;
+};
+
+/* Collects the statistics of the stages of a run and writes them as a JSON
+   run report. Stages are named by their path, e.g. "index/peak_counts", and
+   reported in the order in which they were first finished. */
+class StageProfiler {
+ public:
+  static void addStage(const std::string& stage, double wallSeconds, 
+    double cpuSeconds, unsigned long long items, 
+    unsigned long long bytesRead, unsigned long long bytesWritten);
+  
+  /* for sub-stages that run on many threads at the same time, e.g. decoding
+     of the input files, the time is summed over the threads */
+  static void addThreadTime(const std::string& stage, double threadSeconds,
+    unsigned long long items);
+  
+  static inline void addBytesRead(unsigned long long bytes) {
+#pragma omp atomic
+    bytesRead_ += bytes;
+  }
+  static inline void addBytesWritten(unsigned long long bytes) {
+#pragma omp atomic
+    bytesWritten_ += bytes;
+  }
+  static inline unsigned long long getBytesRead() { return bytesRead_; }
+  static inline unsigned long long getBytesWritten() { return bytesWritten_; }
+  
+  static bool writeReport(const std::string& reportFN, 
+    const std::string& version, const std::string& command, int exitCode);
+  
+  static std::string escapeJson(const std::string& s);
+  
+ protected:
+  static boost::mutex mutex_;
+  static std::vector<std::string> stageOrder_;
+  static std::map<std::string, StageStats> stages_;
+  static unsigned long long bytesRead_, bytesWritten_;
+  
+  static StageStats& getStage(const std::string& stage);
+};
+
+/* Adds the wall and CPU time, items and bytes between its construction and
+   destruction to the statistics of a stage. The CPU time is that of the 
+   whole process, so it includes the threads started within the stage. The
+   start and end of the stage are also sent to the ProgressReporter. */
+class ScopedStageTimer {
+ public:
+  explicit ScopedStageTimer(const std::string& stage) : stage_(stage), 
+      startTime_(boost::posix_time::microsec_clock::universal_time()),
+      startClock_(clock()), items_(0ull), 
+      startBytesRead_(StageProfiler::getBytesRead()),
+      startBytesWritten_(StageProfiler::getBytesWritten()) {
+    ProgressReporter::beginStage(stage_);
+  }
+  
+  ~ScopedStageTimer() {
+    boost::posix_time::time_duration elapsed = 
+        boost::posix_time::microsec_clock::universal_time() - startTime_;
+    StageProfiler::addStage(stage_, 
+        elapsed.total_microseconds() / 1e6, 
+        (clock() - startClock_) / (double)CLOCKS_PER_SEC, items_, 
+        StageProfiler::getBytesRead() - startBytesRead_, 
+        StageProfiler::getBytesWritten() - startBytesWritten_);
+    ProgressReporter::endStage(stage_, elapsed.total_microseconds() / 1e6);
+  }
+  
+  inline void addItems(unsigned long long items) { items_ += items; }
+  
+ protected:
+  std::string stage_;
+  boost::posix_time::ptime startTime_;
+  clock_t startClock_;
+  unsigned long long items_, startBytesRead_, startBytesWritten_;
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_STAGEPROFILER_H_ */
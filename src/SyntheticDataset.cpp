@@ -0,0 +1,612 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "SyntheticDataset.h"
+
+namespace maracluster {
+
+using pwiz::msdata::SpectrumPtr;
+using pwiz::msdata::SpectrumListSimple;
+using pwiz::msdata::SpectrumListSimplePtr;
+using pwiz::msdata::DataProcessing;
+using pwiz::msdata::DataProcessingPtr;
+
+const unsigned int SyntheticDataset::kFragmentBinBucketSize = 50u;
+const double SyntheticDataset::kMinFragmentMz = 100.0;
+
+SyntheticDataset::SyntheticDataset() : mode_(NONE),
+    outputFolder_("synthetic_data"), fnPrefix_("synthetic"),
+    outputFormat_("ms2"), numSpectra_(100000u), spectraPerFile_(50000u),
+    precMzMean_(700.0), precMzStd_(200.0), minPrecMz_(350.0),
+    maxPrecMz_(1500.0), clusterSizeExponent_(2.0), maxClusterSize_(100u),
+    numTemplatePeaks_(80u), numNoisePeaks_(20u), peakRetention_(0.8),
+    precursorTolerancePpm_(5.0), seed_(1u) {
+  chargeFractions_.push_back(std::make_pair(2u, 0.6));
+  chargeFractions_.push_back(std::make_pair(3u, 0.3));
+  chargeFractions_.push_back(std::make_pair(4u, 0.1));
+}
+
+bool SyntheticDataset::parseOptions(int argc, char **argv) {
+  std::ostringstream intro;
+  intro << "MaRaCluster synthetic dataset generator version " << VERSION << "\n";
+  intro << "Usage:" << std::endl;
+  intro << "  maracluster-simulate generate -n <num_spectra> [-f <output_folder>]\n";
+  intro << "  maracluster-simulate evaluate -l <cluster_file> [-f <output_folder>]\n";
+  intro << std::endl;
+  intro << "  The generate mode writes spectrum files with noisy replicates of random\n";
+  intro << "  template spectra, a file list <prefix>.files.txt that can be passed to\n";
+  intro << "  maracluster batch -b, and the ground truth <prefix>.ground_truth.tsv\n";
+  intro << "  with the template index of each spectrum. The evaluate mode computes\n";
+  intro << "  the purity and completeness of a MaRaCluster cluster file with respect\n";
+  intro << "  to this ground truth.\n";
+  intro << std::endl;
+
+  CommandLineParser cmd(intro.str());
+  cmd.defineOption("f",
+      "output-folder",
+      "Folder for the spectrum files and ground truth (default: ./synthetic_data).",
+      "path");
+  cmd.defineOption("a",
+      "prefix",
+      "Output files will be prefixed as e.g. <prefix>.files.txt (default: 'synthetic').",
+      "name");
+  cmd.defineOption("n",
+      "numSpectra",
+      "Total number of spectra (default: 100000).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "spectraPerFile",
+      "Number of spectra per spectrum file (default: 50000).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "format",
+      "Format of the spectrum files, mgf or ms2 (default: ms2).",
+      "string");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "charges",
+      "Charge state mix as a comma separated list of <charge>:<fraction> (default: 2:0.6,3:0.3,4:0.1).",
+      "string");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "precMzMean",
+      "Mean of the normal distribution of template precursor m/z (default: 700.0).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "precMzStd",
+      "Standard deviation of the normal distribution of template precursor m/z (default: 200.0).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "precMzRange",
+      "Range to which the template precursor m/z are truncated, as <min>,<max> (default: 350,1500).",
+      "string");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "clusterSizeExponent",
+      "Exponent a of the cluster size distribution P(size = k) ~ k^-a (default: 2.0).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "maxClusterSize",
+      "Maximum number of replicates of a template (default: 100).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "templatePeaks",
+      "Number of fragment peaks of a template (default: 80).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "noisePeaks",
+      "Number of random noise peaks added to each replicate (default: 20).",
+      "int");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "peakRetention",
+      "Probability that a replicate contains a fragment peak of its template (default: 0.8).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "precursorTolerance",
+      "Maximum deviation in ppm of the precursor m/z of a replicate from its template (default: 5.0).",
+      "double");
+  cmd.defineOption(Option::NO_SHORT_OPT,
+      "seed",
+      "Seed of the random number generator (default: 1).",
+      "int");
+  cmd.defineOption("l",
+      "clusterFile",
+      "Cluster file to evaluate, e.g. maracluster_output/MaRaCluster.clusters_p30.tsv.",
+      "filename");
+  cmd.defineOption("g",
+      "groundTruth",
+      "Ground truth written by the generate mode (default: <output_folder>/<prefix>.ground_truth.tsv).",
+      "filename");
+  cmd.defineOption("o",
+      "output",
+      "Write the evaluation as JSON to this file instead of stdout.",
+      "filename");
+  cmd.defineOption("v",
+      "verbatim",
+      "Set the verbatim level (lowest: 0, highest: 5, default: 3).",
+      "int");
+
+  cmd.parseArgs(argc, argv);
+
+  if (cmd.arguments.size() == 1) {
+    std::string mode = cmd.arguments[0];
+    if (mode == "generate") mode_ = GENERATE;
+    else if (mode == "evaluate") mode_ = EVALUATE;
+    else {
+      std::cerr << "Error: unknown mode: " << mode << std::endl;
+      std::cerr << "Invoke with -h option for help" << std::endl;
+      return false;
+    }
+  } else {
+    std::cerr << "Error: specify exactly one mode, generate or evaluate" << std::endl;
+    std::cerr << "Invoke with -h option for help" << std::endl;
+    return false;
+  }
+
+  if (cmd.optionSet("output-folder")) outputFolder_ = cmd.options["output-folder"];
+  if (cmd.optionSet("prefix")) fnPrefix_ = cmd.options["prefix"];
+  if (cmd.optionSet("numSpectra")) numSpectra_ = cmd.getInt("numSpectra", 1, INT_MAX);
+  if (cmd.optionSet("spectraPerFile")) spectraPerFile_ = cmd.getInt("spectraPerFile", 1, INT_MAX);
+  if (cmd.optionSet("format")) {
+    outputFormat_ = cmd.options["format"];
+    if (outputFormat_ != "mgf" && outputFormat_ != "ms2") {
+      std::cerr << "Error: unknown output format: " << outputFormat_
+                << "; valid formats are mgf and ms2." << std::endl;
+      return false;
+    }
+  }
+  if (cmd.optionSet("charges") && !parseChargeFractions(cmd.options["charges"])) {
+    return false;
+  }
+  if (cmd.optionSet("precMzMean")) precMzMean_ = cmd.getDouble("precMzMean", 100.0, 5000.0);
+  if (cmd.optionSet("precMzStd")) precMzStd_ = cmd.getDouble("precMzStd", 0.0, 5000.0);
+  if (cmd.optionSet("precMzRange")) {
+    std::string range = cmd.options["precMzRange"];
+    size_t commaPos = range.find(',');
+    if (commaPos != std::string::npos) {
+      minPrecMz_ = atof(range.substr(0, commaPos).c_str());
+      maxPrecMz_ = atof(range.substr(commaPos + 1).c_str());
+    }
+    if (commaPos == std::string::npos || minPrecMz_ < 2 * kMinFragmentMz ||
+        maxPrecMz_ <= minPrecMz_) {
+      std::cerr << "Error: invalid input for precMzRange parameter: " << range << std::endl;
+      return false;
+    }
+  }
+  if (cmd.optionSet("clusterSizeExponent")) clusterSizeExponent_ = cmd.getDouble("clusterSizeExponent", 0.0, 100.0);
+  if (cmd.optionSet("maxClusterSize")) maxClusterSize_ = cmd.getInt("maxClusterSize", 1, 1000000);
+  if (cmd.optionSet("templatePeaks")) numTemplatePeaks_ = cmd.getInt("templatePeaks", 1, 1000);
+  if (cmd.optionSet("noisePeaks")) numNoisePeaks_ = cmd.getInt("noisePeaks", 0, 10000);
+  if (cmd.optionSet("peakRetention")) peakRetention_ = cmd.getDouble("peakRetention", 0.0, 1.0);
+  if (cmd.optionSet("precursorTolerance")) precursorTolerancePpm_ = cmd.getDouble("precursorTolerance", 0.0, 1000.0);
+  if (cmd.optionSet("seed")) seed_ = cmd.getInt("seed", 1, INT_MAX);
+  if (cmd.optionSet("clusterFile")) clusterFileFN_ = cmd.options["clusterFile"];
+  if (cmd.optionSet("groundTruth")) groundTruthFN_ = cmd.options["groundTruth"];
+  if (cmd.optionSet("output")) evaluationFN_ = cmd.options["output"];
+  if (cmd.optionSet("verbatim")) Globals::VERB = cmd.getInt("verbatim", 0, 5);
+
+  if (groundTruthFN_.empty()) {
+    groundTruthFN_ = outputFolder_ + "/" + fnPrefix_ + ".ground_truth.tsv";
+  }
+
+  return true;
+}
+
+bool SyntheticDataset::parseChargeFractions(const std::string& chargeString) {
+  chargeFractions_.clear();
+  std::istringstream ss(chargeString);
+  std::string token;
+  while (std::getline(ss, token, ',')) {
+    size_t colonPos = token.find(':');
+    if (colonPos == std::string::npos) break;
+    int charge = atoi(token.substr(0, colonPos).c_str());
+    double fraction = atof(token.substr(colonPos + 1).c_str());
+    if (charge < 1 || fraction <= 0.0) break;
+    chargeFractions_.push_back(std::make_pair(static_cast<unsigned int>(charge), fraction));
+  }
+  if (chargeFractions_.empty() || !ss.eof()) {
+    std::cerr << "Error: invalid input for charges parameter: " << chargeString << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int SyntheticDataset::run() {
+  switch (mode_) {
+    case GENERATE:
+      return generate();
+    case EVALUATE:
+      return evaluate();
+    default:
+      return EXIT_FAILURE;
+  }
+}
+
+int SyntheticDataset::generate() {
+  boost::system::error_code returnedError;
+  boost::filesystem::create_directories(outputFolder_, returnedError);
+  if (!boost::filesystem::exists(outputFolder_)) {
+    std::cerr << "Error: could not create output directory at " << outputFolder_ << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::string fileListFN = outputFolder_ + "/" + fnPrefix_ + ".files.txt";
+  std::ofstream fileListStream(fileListFN.c_str(), std::ios_base::out);
+  std::ofstream groundTruthStream(groundTruthFN_.c_str(), std::ios_base::out);
+  if (!fileListStream.is_open() || !groundTruthStream.is_open()) {
+    std::cerr << "Error: could not write to " << fileListFN << " or "
+              << groundTruthFN_ << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  double sumProb = 0.0;
+  cumClusterSizeProbs_.clear();
+  for (unsigned int k = 1; k <= maxClusterSize_; ++k) {
+    sumProb += std::pow(static_cast<double>(k), -clusterSizeExponent_);
+    cumClusterSizeProbs_.push_back(sumProb);
+  }
+  BOOST_FOREACH (double& cumProb, cumClusterSizeProbs_) {
+    cumProb /= sumProb;
+  }
+
+  double sumFractions = 0.0;
+  unsigned int maxCharge = 1u;
+  typedef std::pair<unsigned int, double> ChargeFraction;
+  BOOST_FOREACH (const ChargeFraction& chargeFraction, chargeFractions_) {
+    sumFractions += chargeFraction.second;
+    maxCharge = (std::max)(maxCharge, chargeFraction.first);
+  }
+  BOOST_FOREACH (ChargeFraction& chargeFraction, chargeFractions_) {
+    chargeFraction.second /= sumFractions;
+  }
+
+  unsigned int maxNumBins = BinSpectra::getBin(
+      SpectrumHandler::calcMass(maxPrecMz_, maxCharge)) + 1u;
+  retentionDistribution_.init(maxNumBins);
+  retentionDistribution_.setUniform(peakRetention_);
+
+  PeakDistribution::setSeed(seed_);
+
+  if (Globals::VERB > 2) {
+    std::cerr << "Generating " << numSpectra_ << " spectra in "
+              << (numSpectra_ + spectraPerFile_ - 1) / spectraPerFile_
+              << " spectrum files" << std::endl;
+  }
+
+  SpectrumListSimplePtr spectra(new SpectrumListSimple);
+  spectra->dp = DataProcessingPtr(new DataProcessing("synthetic_spectra"));
+
+  size_t spectrumIdx = 0u, fileIdx = 0u;
+  unsigned int templateIdx = 0u;
+  while (spectrumIdx < numSpectra_) {
+    SyntheticTemplate spectrumTemplate;
+    generateTemplate(spectrumTemplate);
+
+    size_t clusterSize = (std::min)(static_cast<size_t>(drawClusterSize()),
+                                    numSpectra_ - spectrumIdx);
+    for (size_t i = 0; i < clusterSize; ++i) {
+      std::string spectrumFN = getSpectrumFN(fileIdx);
+      unsigned int scannr = spectra->size() + 1u;
+      spectra->spectra.push_back(generateReplicate(spectrumTemplate, scannr));
+      groundTruthStream << spectrumFN << '\t' << scannr << '\t'
+                        << templateIdx << '\n';
+
+      ++spectrumIdx;
+      if (spectra->size() >= spectraPerFile_ || spectrumIdx == numSpectra_) {
+        writeSpectrumFile(spectra, spectrumFN);
+        fileListStream << spectrumFN << '\n';
+        spectra->spectra.clear();
+        ++fileIdx;
+      }
+    }
+    ++templateIdx;
+  }
+
+  if (Globals::VERB > 2) {
+    std::cerr << "Generated " << spectrumIdx << " replicates of "
+              << templateIdx << " templates" << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+unsigned int SyntheticDataset::drawClusterSize() {
+  double uniRand = PeakDistribution::lcg_rand_unif();
+  return static_cast<unsigned int>(std::upper_bound(cumClusterSizeProbs_.begin(),
+      cumClusterSizeProbs_.end() - 1, uniRand) - cumClusterSizeProbs_.begin()) + 1u;
+}
+
+unsigned int SyntheticDataset::drawCharge() {
+  double uniRand = PeakDistribution::lcg_rand_unif();
+  typedef std::pair<unsigned int, double> ChargeFraction;
+  BOOST_FOREACH (const ChargeFraction& chargeFraction, chargeFractions_) {
+    if (uniRand < chargeFraction.second) return chargeFraction.first;
+    uniRand -= chargeFraction.second;
+  }
+  return chargeFractions_.back().first;
+}
+
+/* Box-Muller transform, redrawn until it falls within the precursor range */
+double SyntheticDataset::drawPrecMz() {
+  const double kPi = 3.14159265358979323846;
+  double precMz;
+  do {
+    double u1 = 1.0 - PeakDistribution::lcg_rand_unif();
+    double u2 = PeakDistribution::lcg_rand_unif();
+    precMz = precMzMean_ + precMzStd_ *
+        std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * kPi * u2);
+  } while (precMz < minPrecMz_ || precMz > maxPrecMz_);
+  return precMz;
+}
+
+/* Fragment peak distribution with a higher peak density at low m/z, cached
+   per bucket of kFragmentBinBucketSize bins, as generateRandSpec caches the
+   cumulative distribution in the PeakDistribution object. */
+PeakDistribution& SyntheticDataset::getFragmentDistribution(unsigned int numBins) {
+  unsigned int numBucketBins = (numBins / kFragmentBinBucketSize) * kFragmentBinBucketSize;
+  std::map<unsigned int, PeakDistribution>::iterator it =
+      fragmentDistributions_.find(numBucketBins);
+  if (it != fragmentDistributions_.end()) return it->second;
+
+  PeakDistribution& distribution = fragmentDistributions_[numBucketBins];
+  distribution.init(numBucketBins);
+  unsigned int minBin = BinSpectra::getBin(kMinFragmentMz);
+  double sumWeights = 0.0;
+  for (unsigned int bin = minBin; bin < numBucketBins; ++bin) {
+    sumWeights += 1.0 / (1.0 + 4.0 * bin / numBucketBins);
+  }
+  for (unsigned int bin = minBin; bin < numBucketBins; ++bin) {
+    distribution.insert(bin, 1.0 / (1.0 + 4.0 * bin / numBucketBins) / sumWeights);
+  }
+  return distribution;
+}
+
+void SyntheticDataset::generateTemplate(SyntheticTemplate& spectrumTemplate) {
+  spectrumTemplate.charge = drawCharge();
+  spectrumTemplate.precMz = drawPrecMz();
+
+  double mass = SpectrumHandler::calcMass(spectrumTemplate.precMz,
+                                          spectrumTemplate.charge);
+  unsigned int numBins = BinSpectra::getBin(mass);
+  unsigned int numAvailableBins = (numBins - BinSpectra::getBin(kMinFragmentMz)) / 2;
+  getFragmentDistribution(numBins).generateRandSpec(spectrumTemplate.peakBins,
+      (std::min)(numTemplatePeaks_, numAvailableBins));
+
+  spectrumTemplate.peaks.clear();
+  BOOST_FOREACH (const unsigned int bin, spectrumTemplate.peakBins) {
+    double mz = BinSpectra::getMZ(bin) + 0.4 * (PeakDistribution::lcg_rand_unif() - 0.5);
+    double intensity = std::pow(10.0, 3.0 * PeakDistribution::lcg_rand_unif());
+    spectrumTemplate.peaks.push_back(MZIntensityPair(mz, intensity));
+  }
+}
+
+SpectrumPtr SyntheticDataset::generateReplicate(
+    SyntheticTemplate& spectrumTemplate, unsigned int scannr) {
+  std::vector<unsigned int> retainedPeakBins;
+  retentionDistribution_.generateRandSpecBernoulli(retainedPeakBins,
+      numTemplatePeaks_, spectrumTemplate.peakBins);
+
+  std::vector<MZIntensityPair> mziPairs;
+  BOOST_FOREACH (const unsigned int bin, retainedPeakBins) {
+    size_t peakIdx = std::lower_bound(spectrumTemplate.peakBins.begin(),
+        spectrumTemplate.peakBins.end(), bin) - spectrumTemplate.peakBins.begin();
+    const MZIntensityPair& peak = spectrumTemplate.peaks[peakIdx];
+    mziPairs.push_back(MZIntensityPair(
+        peak.mz + 0.02 * (PeakDistribution::lcg_rand_unif() - 0.5),
+        peak.intensity * (0.5 + PeakDistribution::lcg_rand_unif())));
+  }
+
+  double mass = SpectrumHandler::calcMass(spectrumTemplate.precMz,
+                                          spectrumTemplate.charge);
+  for (unsigned int i = 0; i < numNoisePeaks_; ++i) {
+    double mz = kMinFragmentMz + (mass - kMinFragmentMz) * PeakDistribution::lcg_rand_unif();
+    double intensity = std::pow(10.0, 1.5 * PeakDistribution::lcg_rand_unif());
+    mziPairs.push_back(MZIntensityPair(mz, intensity));
+  }
+  std::sort(mziPairs.begin(), mziPairs.end(), SpectrumHandler::lessMZ);
+
+  double precMz = spectrumTemplate.precMz * (1.0 + precursorTolerancePpm_ * 1e-6 *
+      2.0 * (PeakDistribution::lcg_rand_unif() - 0.5));
+
+  SpectrumPtr s(new pwiz::msdata::Spectrum);
+  SpectrumHandler::setScannr(s, scannr);
+  s->set(pwiz::cv::MS_ms_level, 2);
+  s->set(pwiz::cv::MS_MSn_spectrum);
+  s->set(pwiz::cv::MS_centroid_spectrum);
+
+  std::vector<MassChargeCandidate> mccs;
+  mccs.push_back(MassChargeCandidate(spectrumTemplate.charge, precMz,
+      SpectrumHandler::calcMass(precMz, spectrumTemplate.charge)));
+  s->precursors.push_back(pwiz::msdata::Precursor());
+  SpectrumHandler::setMassChargeCandidates(s, mccs);
+  SpectrumHandler::setMZIntensityPairs(s, mziPairs);
+  return s;
+}
+
+void SyntheticDataset::writeSpectrumFile(SpectrumListSimplePtr spectra,
+    const std::string& spectrumFN) {
+  size_t idx = 0;
+  BOOST_FOREACH (SpectrumPtr& s, spectra->spectra) {
+    s->index = idx++;
+  }
+
+  pwiz::msdata::MSData msd;
+  msd.id = msd.run.id = fnPrefix_;
+  msd.run.spectrumListPtr = spectra;
+  MSFileHandler::writeMSData(msd, spectrumFN);
+}
+
+std::string SyntheticDataset::getSpectrumFN(size_t fileIdx) {
+  boost::filesystem::path spectrumPath(outputFolder_ + "/" + fnPrefix_ + "." +
+      boost::lexical_cast<std::string>(fileIdx + 1) + "." + outputFormat_);
+  return boost::filesystem::absolute(spectrumPath).string();
+}
+
+std::string SyntheticDataset::getFileName(const std::string& filePath) {
+  return boost::filesystem::path(filePath).filename().string();
+}
+
+/* The spectrum files are identified by their file name only, such that the
+   dataset can be moved after it was generated. */
+bool SyntheticDataset::readGroundTruth(std::map<std::string, size_t>& fileIdxs,
+    std::vector< std::vector<unsigned int> >& templateIdxs,
+    size_t& numTemplates) {
+  std::ifstream groundTruthStream(groundTruthFN_.c_str(), std::ios_base::in);
+  if (!groundTruthStream.is_open()) {
+    std::cerr << "Error: could not read ground truth from " << groundTruthFN_ << std::endl;
+    return false;
+  }
+
+  numTemplates = 0u;
+  std::string line;
+  while (getline(groundTruthStream, line)) {
+    std::istringstream lineStream(line);
+    std::string filePath;
+    unsigned int scannr, templateIdx;
+    if (!getline(lineStream, filePath, '\t') || !(lineStream >> scannr >> templateIdx)) {
+      std::cerr << "Error: could not parse line in ground truth: " << line << std::endl;
+      return false;
+    }
+
+    std::string fileName = getFileName(filePath);
+    if (fileIdxs.find(fileName) == fileIdxs.end()) {
+      fileIdxs[fileName] = templateIdxs.size();
+      templateIdxs.push_back(std::vector<unsigned int>());
+    }
+    std::vector<unsigned int>& fileTemplateIdxs = templateIdxs[fileIdxs[fileName]];
+    if (fileTemplateIdxs.size() <= scannr) fileTemplateIdxs.resize(scannr + 1u, UINT_MAX);
+    fileTemplateIdxs[scannr] = templateIdx;
+    numTemplates = (std::max)(numTemplates, static_cast<size_t>(templateIdx) + 1u);
+  }
+  return true;
+}
+
+/* Purity is the fraction of the spectra in non-singleton clusters that
+   belong to the most frequent template of their cluster. Completeness is
+   the fraction of the spectra of templates with multiple replicates that
+   are in the cluster with most replicates of their template. */
+int SyntheticDataset::evaluate() {
+  if (clusterFileFN_.empty()) {
+    std::cerr << "Error: no cluster file specified with -l flag" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::map<std::string, size_t> fileIdxs;
+  std::vector< std::vector<unsigned int> > templateIdxs;
+  size_t numTemplates = 0u;
+  if (!readGroundTruth(fileIdxs, templateIdxs, numTemplates)) {
+    return EXIT_FAILURE;
+  }
+
+  std::ifstream clusterStream(clusterFileFN_.c_str(), std::ios_base::in);
+  if (!clusterStream.is_open()) {
+    std::cerr << "Error: could not read cluster file " << clusterFileFN_ << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<unsigned int> templateSizes(numTemplates),
+                            maxTemplateCounts(numTemplates);
+  size_t numSpectra = 0u, numUnknownSpectra = 0u, numClusters = 0u,
+         numClusteredSpectra = 0u, numCorrectlyClustered = 0u;
+  std::map<unsigned int, unsigned int> clusterTemplateCounts;
+  size_t clusterSize = 0u;
+
+  std::string line;
+  bool endOfFile = false;
+  while (!endOfFile) {
+    endOfFile = !getline(clusterStream, line);
+    if (!endOfFile && !line.empty()) {
+      std::istringstream lineStream(line);
+      std::string filePath;
+      unsigned int scannr;
+      if (!getline(lineStream, filePath, '\t') || !(lineStream >> scannr)) {
+        std::cerr << "Error: could not parse line in cluster file: " << line << std::endl;
+        return EXIT_FAILURE;
+      }
+      ++numSpectra;
+
+      std::map<std::string, size_t>::const_iterator it =
+          fileIdxs.find(getFileName(filePath));
+      if (it == fileIdxs.end() || templateIdxs[it->second].size() <= scannr ||
+          templateIdxs[it->second][scannr] == UINT_MAX) {
+        ++numUnknownSpectra;
+        continue;
+      }
+      unsigned int templateIdx = templateIdxs[it->second][scannr];
+      ++clusterTemplateCounts[templateIdx];
+      ++templateSizes[templateIdx];
+      ++clusterSize;
+    } else if (clusterSize > 0u) {
+      unsigned int maxCount = 0u;
+      typedef std::pair<unsigned int, unsigned int> TemplateCount;
+      BOOST_FOREACH (const TemplateCount& templateCount, clusterTemplateCounts) {
+        maxCount = (std::max)(maxCount, templateCount.second);
+        maxTemplateCounts[templateCount.first] = (std::max)(
+            maxTemplateCounts[templateCount.first], templateCount.second);
+      }
+      if (clusterSize > 1u) {
+        ++numClusters;
+        numClusteredSpectra += clusterSize;
+        numCorrectlyClustered += maxCount;
+      }
+      clusterTemplateCounts.clear();
+      clusterSize = 0u;
+    }
+  }
+
+  size_t numReplicatedSpectra = 0u, numCompleteSpectra = 0u;
+  for (size_t i = 0; i < numTemplates; ++i) {
+    if (templateSizes[i] > 1u) {
+      numReplicatedSpectra += templateSizes[i];
+      numCompleteSpectra += maxTemplateCounts[i];
+    }
+  }
+
+  if (numUnknownSpectra > 0u) {
+    std::cerr << "Warning: " << numUnknownSpectra << " spectra of the cluster "
+              << "file are not in the ground truth" << std::endl;
+  }
+
+  double purity = (numClusteredSpectra > 0u) ?
+      static_cast<double>(numCorrectlyClustered) / numClusteredSpectra : 1.0;
+  double completeness = (numReplicatedSpectra > 0u) ?
+      static_cast<double>(numCompleteSpectra) / numReplicatedSpectra : 1.0;
+
+  std::ostringstream evaluation;
+  evaluation << "{\n"
+      << "  \"cluster_file\": \"" << clusterFileFN_ << "\",\n"
+      << "  \"spectra\": " << numSpectra << ",\n"
+      << "  \"unknown_spectra\": " << numUnknownSpectra << ",\n"
+      << "  \"templates\": " << numTemplates << ",\n"
+      << "  \"clusters\": " << numClusters << ",\n"
+      << "  \"clustered_spectra\": " << numClusteredSpectra << ",\n"
+      << "  \"clustered_fraction\": " << static_cast<double>(numClusteredSpectra) /
+                                         (std::max)(numSpectra, static_cast<size_t>(1u)) << ",\n"
+      << "  \"purity\": " << purity << ",\n"
+      << "  \"incorrectly_clustered_fraction\": " << 1.0 - purity << ",\n"
+      << "  \"completeness\": " << completeness << "\n"
+      << "}\n";
+
+  if (evaluationFN_.empty()) {
+    std::cout << evaluation.str();
+  } else {
+    std::ofstream evaluationStream(evaluationFN_.c_str(), std::ios_base::out);
+    if (!evaluationStream.is_open()) {
+      std::cerr << "Error: could not write evaluation to " << evaluationFN_ << std::endl;
+      return EXIT_FAILURE;
+    }
+    evaluationStream << evaluation.str();
+  }
+  return EXIT_SUCCESS;
+}
+
+} /* namespace maracluster */
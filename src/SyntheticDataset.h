@@ -0,0 +1,119 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_SYNTHETICDATASET_H_
+#define MARACLUSTER_SYNTHETICDATASET_H_
+
+#include <cstdlib>
+#include <climits>
+#include <cmath>
+#include <vector>
+#include <map>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+
+#include "pwiz/data/msdata/MSDataFile.hpp"
+
+#include "Option.h"
+#include "Globals.h"
+#include "Version.h"
+#include "PeakDistribution.h"
+#include "MSFileHandler.h"
+#include "SpectrumHandler.h"
+#include "MassChargeCandidate.h"
+
+namespace maracluster {
+
+/* Noise free spectrum of which the spectra of a ground truth cluster are
+   noisy replicates */
+struct SyntheticTemplate {
+  unsigned int charge;
+  double precMz;
+  std::vector<unsigned int> peakBins; // sorted
+  std::vector<MZIntensityPair> peaks; // same order as peakBins
+};
+
+/* Driver of the maracluster-simulate executable. The generate mode writes
+   spectrum files with noisy replicates of random template spectra, together
+   with a batch file list and the ground truth clustering. The evaluate mode
+   compares a clusters_p<x>.tsv file to this ground truth.
+
+   Cluster sizes follow a truncated power law, replicates of a template are
+   written consecutively, such that only one spectrum file has to be held in
+   memory and a cluster spans at most a few neighboring files. */
+class SyntheticDataset {
+ public:
+  enum Mode { NONE, GENERATE, EVALUATE };
+
+  SyntheticDataset();
+
+  bool parseOptions(int argc, char **argv);
+  int run();
+
+ protected:
+  Mode mode_;
+  std::string outputFolder_, fnPrefix_, outputFormat_;
+  std::string clusterFileFN_, groundTruthFN_, evaluationFN_;
+
+  // parameters of the generated dataset
+  size_t numSpectra_, spectraPerFile_;
+  std::vector<std::pair<unsigned int, double> > chargeFractions_;
+  double precMzMean_, precMzStd_, minPrecMz_, maxPrecMz_;
+  double clusterSizeExponent_;
+  unsigned int maxClusterSize_;
+  unsigned int numTemplatePeaks_, numNoisePeaks_;
+  double peakRetention_, precursorTolerancePpm_;
+  unsigned long seed_;
+
+  std::vector<double> cumClusterSizeProbs_;
+  std::map<unsigned int, PeakDistribution> fragmentDistributions_;
+  PeakDistribution retentionDistribution_;
+
+  static const unsigned int kFragmentBinBucketSize;
+  static const double kMinFragmentMz;
+
+  bool parseChargeFractions(const std::string& chargeString);
+
+  int generate();
+  int evaluate();
+
+  unsigned int drawClusterSize();
+  unsigned int drawCharge();
+  double drawPrecMz();
+  PeakDistribution& getFragmentDistribution(unsigned int numBins);
+  void generateTemplate(SyntheticTemplate& spectrumTemplate);
+  pwiz::msdata::SpectrumPtr generateReplicate(
+      SyntheticTemplate& spectrumTemplate, unsigned int scannr);
+  void writeSpectrumFile(pwiz::msdata::SpectrumListSimplePtr spectra,
+      const std::string& spectrumFN);
+  std::string getSpectrumFN(size_t fileIdx);
+
+  bool readGroundTruth(std::map<std::string, size_t>& fileIdxs,
+      std::vector< std::vector<unsigned int> >& templateIdxs,
+      size_t& numTemplates);
+  static std::string getFileName(const std::string& filePath);
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_SYNTHETICDATASET_H_ */
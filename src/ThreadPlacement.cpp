@@ -0,0 +1,252 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#include "ThreadPlacement.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+#ifdef __linux__
+  #include <sched.h>
+  #include <unistd.h>
+  #include <boost/filesystem.hpp>
+#endif
+
+namespace maracluster {
+
+int ThreadPlacement::numNodes_ = 1;
+std::vector< std::vector<int> > ThreadPlacement::nodeCpus_;
+bool ThreadPlacement::isPlaced_ = false;
+std::vector<int> ThreadPlacement::processCpus_;
+
+bool ThreadPlacement::init(int numThreads, int numNodes, bool pinThreads) {
+  if (numThreads > 0) {
+#ifdef _OPENMP
+    omp_set_num_threads(numThreads);
+#else
+    if (numThreads > 1) {
+      std::cerr << "Warning: compiled without OpenMP, running single threaded" 
+                << std::endl;
+    }
+#endif
+  }
+  
+  detectNodes();
+  if (numNodes == 0) {
+    numNodes = static_cast<int>(nodeCpus_.size());
+  } else if (numNodes > static_cast<int>(nodeCpus_.size())) {
+    std::cerr << "Warning: " << numNodes << " NUMA nodes requested, but only " 
+              << nodeCpus_.size() << " available, using " << nodeCpus_.size() 
+              << std::endl;
+    numNodes = static_cast<int>(nodeCpus_.size());
+  }
+  int maxThreads = 1;
+#ifdef _OPENMP
+  maxThreads = omp_get_max_threads();
+#endif
+  // every node needs at least one thread to touch its memory first
+  numNodes_ = (std::max)((std::min)(numNodes, maxThreads), 1);
+  
+  if (Globals::VERB > 1) {
+    std::cerr << "Running " << maxThreads << " threads on " << numNodes_ 
+              << " of " << nodeCpus_.size() << " NUMA nodes" 
+              << (pinThreads ? ", pinned to single CPUs" : "") << std::endl;
+  }
+  
+  if (numNodes_ == 1 && !pinThreads) return true;
+  
+#ifndef __linux__
+  std::cerr << "Warning: setting the CPU affinity of the threads is not "
+            << "available on this platform" << std::endl;
+  return true;
+#endif
+  
+  if (!getAffinity(processCpus_)) {
+    std::cerr << "Error: could not get the CPU affinity of the process" 
+              << std::endl;
+    return false;
+  }
+  
+  bool success = true;
+#pragma omp parallel reduction(&& : success)
+  {
+    int threadIdx = 0, numThreads = 1;
+#ifdef _OPENMP
+    threadIdx = omp_get_thread_num();
+    numThreads = omp_get_num_threads();
+#endif
+    int node = getNode(threadIdx, numThreads);
+    const std::vector<int>& cpus = nodeCpus_[node];
+    if (pinThreads) {
+      int firstThreadIdx = (node * numThreads + numNodes_ - 1) / numNodes_;
+      std::vector<int> cpu(1, cpus[(threadIdx - firstThreadIdx) % cpus.size()]);
+      success = setAffinity(cpu);
+    } else {
+      success = setAffinity(cpus);
+    }
+  }
+  if (!success) {
+    std::cerr << "Error: could not set the CPU affinity of the threads" 
+              << std::endl;
+  }
+  isPlaced_ = true;
+  return success;
+}
+
+void ThreadPlacement::resetThreadAffinity() {
+  if (isPlaced_ && !setAffinity(processCpus_) && Globals::VERB > 1) {
+    std::cerr << "Warning: could not reset the CPU affinity of a thread" 
+              << std::endl;
+  }
+}
+
+int ThreadPlacement::getNode(int threadIdx, int numThreads) {
+  return (numThreads > 0) ? threadIdx * numNodes_ / numThreads : 0;
+}
+
+int ThreadPlacement::getThreadNode() {
+#ifdef _OPENMP
+  return getNode(omp_get_thread_num(), omp_get_num_threads());
+#else
+  return 0;
+#endif
+}
+
+size_t ThreadPlacement::getNumDetectedNodes() {
+  if (nodeCpus_.empty()) detectNodes();
+  return nodeCpus_.size();
+}
+
+/* Reads the CPUs of each NUMA node from sysfs, restricted to the CPUs this 
+   process may run on, e.g. the ones assigned by a job scheduler. Without 
+   this information, all CPUs form a single node. */
+void ThreadPlacement::detectNodes() {
+  nodeCpus_.clear();
+#ifdef __linux__
+  cpu_set_t allowedCpus;
+  CPU_ZERO(&allowedCpus);
+  bool hasAllowedCpus = (sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) == 0);
+  
+  std::vector<std::pair<int, std::string> > nodeCpuLists;
+  boost::system::error_code returnedError;
+  boost::filesystem::directory_iterator it("/sys/devices/system/node", returnedError), end;
+  for (; !returnedError && it != end; it.increment(returnedError)) {
+    std::string name = it->path().filename().string();
+    if (name.size() <= 4 || name.substr(0, 4) != "node" || 
+        name.find_first_not_of("0123456789", 4) != std::string::npos) continue;
+    std::ifstream cpuListStream((it->path() / "cpulist").string().c_str());
+    std::string cpuList;
+    if (std::getline(cpuListStream, cpuList)) {
+      nodeCpuLists.push_back(std::make_pair(atoi(name.substr(4).c_str()), cpuList));
+    }
+  }
+  std::sort(nodeCpuLists.begin(), nodeCpuLists.end());
+  
+  typedef std::pair<int, std::string> NodeCpuListPair;
+  BOOST_FOREACH (const NodeCpuListPair& nodeCpuList, nodeCpuLists) {
+    std::vector<int> cpus, allowed;
+    parseCpuList(nodeCpuList.second, cpus);
+    BOOST_FOREACH (const int cpu, cpus) {
+      if (!hasAllowedCpus || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowedCpus))) {
+        allowed.push_back(cpu);
+      }
+    }
+    // memory-only nodes and nodes outside our CPU set cannot run threads
+    if (!allowed.empty()) nodeCpus_.push_back(allowed);
+  }
+  
+  if (nodeCpus_.empty()) {
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (hasAllowedCpus ? CPU_ISSET(cpu, &allowedCpus) : 
+                           cpu < sysconf(_SC_NPROCESSORS_ONLN)) {
+        cpus.push_back(cpu);
+      }
+    }
+    nodeCpus_.push_back(cpus);
+  }
+#else
+  nodeCpus_.push_back(std::vector<int>(1, 0));
+#endif
+}
+
+/* Parses lists such as "0-15,32-47" */
+void ThreadPlacement::parseCpuList(const std::string& cpuList, 
+    std::vector<int>& cpus) {
+  std::istringstream ss(cpuList);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    size_t dashIdx = range.find('-');
+    int first = atoi(range.substr(0, dashIdx).c_str());
+    int last = (dashIdx == std::string::npos) ? first : 
+                   atoi(range.substr(dashIdx + 1).c_str());
+    for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+  }
+}
+
+bool ThreadPlacement::getAffinity(std::vector<int>& cpus) {
+  cpus.clear();
+#ifdef __linux__
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) != 0) return false;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpuSet)) cpus.push_back(cpu);
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool ThreadPlacement::setAffinity(const std::vector<int>& cpus) {
+#ifdef __linux__
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  BOOST_FOREACH (const int cpu, cpus) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpuSet);
+  }
+  // pid 0 sets the affinity of the calling thread only
+  return sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == 0;
+#else
+  return false;
+#endif
+}
+
+NodeBatchScheduler::NodeBatchScheduler(size_t numBatches) : 
+    numBatches_(numBatches) {
+  int numNodes = ThreadPlacement::getNumNodes();
+  for (int node = 0; node < numNodes; ++node) {
+    nextBatches_.push_back(static_cast<size_t>(node));
+  }
+}
+
+bool NodeBatchScheduler::next(int node, size_t& batchIdx) {
+  boost::mutex::scoped_lock lock(mutex_);
+  size_t numNodes = nextBatches_.size();
+  for (size_t i = 0; i < numNodes; ++i) {
+    size_t& nextBatch = nextBatches_[(node + i) % numNodes];
+    if (nextBatch < numBatches_) {
+      batchIdx = nextBatch;
+      nextBatch += numNodes;
+      return true;
+    }
+  }
+  return false;
+}
+
+} /* namespace maracluster */
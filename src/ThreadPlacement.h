@@ -0,0 +1,94 @@
+/******************************************************************************  
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+  
+ ******************************************************************************/
+ 
+#ifndef MARACLUSTER_THREADPLACEMENT_H_
+#define MARACLUSTER_THREADPLACEMENT_H_
+
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Globals.h"
+
+namespace maracluster {
+
+/* Number of OpenMP threads and their placement on the NUMA nodes (sockets) 
+   of the machine. The threads of a parallel region are assigned to the 
+   nodes in contiguous blocks, i.e. thread t of T threads runs on node 
+   t * numNodes / T, and are restricted to the CPUs of their node, or with 
+   pinning to a single CPU. The affinity is set once by init(); the OpenMP 
+   runtimes of GCC and LLVM keep their threads between parallel regions of 
+   the same size. Threads that are started outside of OpenMP inherit the 
+   affinity of the main thread, i.e. OpenMP thread 0, and should call 
+   resetThreadAffinity() first. */
+class ThreadPlacement {
+ public:
+  /* numThreads = 0 keeps the OpenMP default, numNodes = 0 uses all NUMA 
+     nodes of the machine; with numNodes = 1 and without pinning the threads
+     are not restricted at all */
+  static bool init(int numThreads, int numNodes, bool pinThreads);
+  
+  static inline int getNumNodes() { return numNodes_; }
+  static int getNode(int threadIdx, int numThreads);
+  /* node of the calling thread within a parallel region */
+  static int getThreadNode();
+  
+  static size_t getNumDetectedNodes();
+  
+  /* restores the affinity the process had before init() for the calling 
+     thread */
+  static void resetThreadAffinity();
+  
+ protected:
+  static int numNodes_;
+  static std::vector< std::vector<int> > nodeCpus_;
+  static bool isPlaced_;
+  static std::vector<int> processCpus_;
+  
+  static void detectNodes();
+  static void parseCpuList(const std::string& cpuList, std::vector<int>& cpus);
+  static bool getAffinity(std::vector<int>& cpus);
+  static bool setAffinity(const std::vector<int>& cpus);
+};
+
+/* Hands out the batches of a parallel loop, batch b belongs to node 
+   b % numNodes. Threads take the batches of their own node in ascending 
+   order and help the other nodes once these are done. Interleaving the 
+   batches, rather than giving each node a contiguous range, keeps the 
+   batches roughly in order, which the clustering of finished batches 
+   relies on to bound the number of buffered p-values. */
+class NodeBatchScheduler {
+ public:
+  explicit NodeBatchScheduler(size_t numBatches);
+  
+  bool next(int node, size_t& batchIdx);
+  
+ protected:
+  boost::mutex mutex_;
+  size_t numBatches_;
+  std::vector<size_t> nextBatches_;
+};
+
+} /* namespace maracluster */
+
+#endif /* MARACLUSTER_THREADPLACEMENT_H_ */
@@ -33,6 +33,8 @@ int main(int argc, char** argv) {
     std::cerr << "Unknown exception, contact the developer.." << std::endl;
     retVal = EXIT_FAILURE;
   }
+  maracluster.writeRunReport(retVal);
+  maracluster::ProgressReporter::close(retVal);
   
   return retVal;
 }